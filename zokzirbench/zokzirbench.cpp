@@ -0,0 +1,2211 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Headless OFX host for benchmarking the Zokzir effects.
+
+It loads an .ofx binary and runs one of its effects through the actions a
+host would use: load, describe, create instance, the region actions and
+render. Every action is timed. Frames are synthetic or read from PPM or PFM
+files, at any size, depth and component count the effect supports.
+
+It only implements enough of the property, image effect, parameter,
+multithread, memory and message suites for an effect to render. There is no
+interface, no animation and no image cache. The render is repeated at each
+of the requested thread counts to show how the effect scales.
+
+It is also the runner of the regression tests. The last render can be
+checked against a stored reference within an error budget, and the best time
+against a stored baseline, see zokzirregress.cmake.
+
+With --counters it also reads the hardware performance counters of every
+action and of each thread's share of the renders, see zokzirperf.h, and
+turns them on in the effect, which puts them on its trace spans.
+*/
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include "ofxCore.h"
+#include "ofxImageEffect.h"
+#include "ofxMemory.h"
+#include "ofxMessage.h"
+#include "ofxMultiThread.h"
+#include "ofxParam.h"
+#include "ofxProperty.h"
+
+#include "zokzirhalf.h"
+#include "zokzirperf.h"
+
+namespace {
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Properties, every value of a property is kept as all of its possible types,
+  // ints live in the double so a plugin can read an int property as a double.
+
+  enum PropertyType {
+    ePropPointer,
+    ePropString,
+    ePropDouble,
+    ePropInt
+  };
+
+  struct PropertyValue {
+    void *pointer = NULL;
+    std::string string;
+    double number = 0.;
+  };
+
+  struct Property {
+    PropertyType type = ePropInt;
+    std::vector<PropertyValue> values;
+  };
+
+  class PropertySet {
+  public :
+    OfxPropertySetHandle handle() {return (OfxPropertySetHandle) this;}
+    static PropertySet *from(OfxPropertySetHandle handle) {return (PropertySet *) handle;}
+
+    // the value at index, growing the property if need be
+    PropertyValue *set(const char *name, int index, PropertyType type)
+    {
+      if(index < 0)
+        return NULL;
+      Property &prop = _props[name];
+      prop.type = type;
+      if((int) prop.values.size() <= index)
+        prop.values.resize(index + 1);
+      return &prop.values[index];
+    }
+
+    // the value at index, or why there isn't one
+    const PropertyValue *get(const char *name, int index, PropertyType type, OfxStatus &status) const
+    {
+      std::map<std::string, Property>::const_iterator found = _props.find(name);
+      if(found == _props.end()) {
+        status = kOfxStatErrUnknown;
+        return NULL;
+      }
+      const Property &prop = found->second;
+      bool numeric = (type == ePropDouble || type == ePropInt) && (prop.type == ePropDouble || prop.type == ePropInt);
+      if(prop.type != type && !numeric) {
+        status = kOfxStatErrValue;
+        return NULL;
+      }
+      if(index < 0 || index >= (int) prop.values.size()) {
+        status = kOfxStatErrBadIndex;
+        return NULL;
+      }
+      status = kOfxStatOK;
+      return &prop.values[index];
+    }
+
+    // replace every value of a property
+    void resize(const char *name, int count, PropertyType type)
+    {
+      Property &prop = _props[name];
+      prop.type = type;
+      prop.values.assign(std::max(count, 0), PropertyValue());
+    }
+
+    int dimension(const char *name) const
+    {
+      std::map<std::string, Property>::const_iterator found = _props.find(name);
+      return found == _props.end() ? -1 : (int) found->second.values.size();
+    }
+
+    bool reset(const char *name)
+    {
+      return _props.erase(name) != 0;
+    }
+
+    // host side helpers
+    void setString(const char *name, const std::string &v, int index = 0) {set(name, index, ePropString)->string = v;}
+    void setPointer(const char *name, void *v) {set(name, 0, ePropPointer)->pointer = v;}
+
+    void setInts(const char *name, std::initializer_list<int> v)
+    {
+      resize(name, (int) v.size(), ePropInt);
+      int i = 0;
+      for(int x : v) _props[name].values[i++].number = x;
+    }
+
+    void setDoubles(const char *name, std::initializer_list<double> v)
+    {
+      resize(name, (int) v.size(), ePropDouble);
+      int i = 0;
+      for(double x : v) _props[name].values[i++].number = x;
+    }
+
+    void setStrings(const char *name, std::initializer_list<const char *> v)
+    {
+      resize(name, (int) v.size(), ePropString);
+      int i = 0;
+      for(const char *x : v) _props[name].values[i++].string = x;
+    }
+
+    std::string getString(const char *name, int index = 0) const
+    {
+      OfxStatus status;
+      const PropertyValue *v = get(name, index, ePropString, status);
+      return v ? v->string : std::string();
+    }
+
+    double getDouble(const char *name, int index = 0, double otherwise = 0.) const
+    {
+      OfxStatus status;
+      const PropertyValue *v = get(name, index, ePropDouble, status);
+      return v ? v->number : otherwise;
+    }
+
+  private :
+    std::map<std::string, Property> _props;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the property suite
+
+  OfxStatus PropSetPointer(OfxPropertySetHandle h, const char *name, int index, void *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertyValue *v = PropertySet::from(h)->set(name, index, ePropPointer);
+    if(!v) return kOfxStatErrBadIndex;
+    v->pointer = value;
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetString(OfxPropertySetHandle h, const char *name, int index, const char *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertyValue *v = PropertySet::from(h)->set(name, index, ePropString);
+    if(!v) return kOfxStatErrBadIndex;
+    v->string = value ? value : "";
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetDouble(OfxPropertySetHandle h, const char *name, int index, double value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertyValue *v = PropertySet::from(h)->set(name, index, ePropDouble);
+    if(!v) return kOfxStatErrBadIndex;
+    v->number = value;
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetInt(OfxPropertySetHandle h, const char *name, int index, int value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertyValue *v = PropertySet::from(h)->set(name, index, ePropInt);
+    if(!v) return kOfxStatErrBadIndex;
+    v->number = value;
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetPointerN(OfxPropertySetHandle h, const char *name, int count, void *const *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertySet::from(h)->resize(name, count, ePropPointer);
+    for(int i = 0; i < count; i++) PropSetPointer(h, name, i, value[i]);
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetStringN(OfxPropertySetHandle h, const char *name, int count, const char *const *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertySet::from(h)->resize(name, count, ePropString);
+    for(int i = 0; i < count; i++) PropSetString(h, name, i, value[i]);
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetDoubleN(OfxPropertySetHandle h, const char *name, int count, const double *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertySet::from(h)->resize(name, count, ePropDouble);
+    for(int i = 0; i < count; i++) PropSetDouble(h, name, i, value[i]);
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropSetIntN(OfxPropertySetHandle h, const char *name, int count, const int *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    PropertySet::from(h)->resize(name, count, ePropInt);
+    for(int i = 0; i < count; i++) PropSetInt(h, name, i, value[i]);
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropGetPointer(OfxPropertySetHandle h, const char *name, int index, void **value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    OfxStatus status;
+    const PropertyValue *v = PropertySet::from(h)->get(name, index, ePropPointer, status);
+    if(v) *value = v->pointer;
+    return status;
+  }
+
+  OfxStatus PropGetString(OfxPropertySetHandle h, const char *name, int index, char **value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    OfxStatus status;
+    const PropertyValue *v = PropertySet::from(h)->get(name, index, ePropString, status);
+    if(v) *value = (char *) v->string.c_str();
+    return status;
+  }
+
+  OfxStatus PropGetDouble(OfxPropertySetHandle h, const char *name, int index, double *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    OfxStatus status;
+    const PropertyValue *v = PropertySet::from(h)->get(name, index, ePropDouble, status);
+    if(v) *value = v->number;
+    return status;
+  }
+
+  OfxStatus PropGetInt(OfxPropertySetHandle h, const char *name, int index, int *value)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    OfxStatus status;
+    const PropertyValue *v = PropertySet::from(h)->get(name, index, ePropInt, status);
+    if(v) *value = (int) v->number;
+    return status;
+  }
+
+  OfxStatus PropGetPointerN(OfxPropertySetHandle h, const char *name, int count, void **value)
+  {
+    for(int i = 0; i < count; i++) {
+      OfxStatus status = PropGetPointer(h, name, i, value + i);
+      if(status != kOfxStatOK) return status;
+    }
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropGetStringN(OfxPropertySetHandle h, const char *name, int count, char **value)
+  {
+    for(int i = 0; i < count; i++) {
+      OfxStatus status = PropGetString(h, name, i, value + i);
+      if(status != kOfxStatOK) return status;
+    }
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropGetDoubleN(OfxPropertySetHandle h, const char *name, int count, double *value)
+  {
+    for(int i = 0; i < count; i++) {
+      OfxStatus status = PropGetDouble(h, name, i, value + i);
+      if(status != kOfxStatOK) return status;
+    }
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropGetIntN(OfxPropertySetHandle h, const char *name, int count, int *value)
+  {
+    for(int i = 0; i < count; i++) {
+      OfxStatus status = PropGetInt(h, name, i, value + i);
+      if(status != kOfxStatOK) return status;
+    }
+    return kOfxStatOK;
+  }
+
+  OfxStatus PropReset(OfxPropertySetHandle h, const char *name)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    return PropertySet::from(h)->reset(name) ? kOfxStatOK : kOfxStatErrUnknown;
+  }
+
+  OfxStatus PropGetDimension(OfxPropertySetHandle h, const char *name, int *count)
+  {
+    if(!h) return kOfxStatErrBadHandle;
+    *count = PropertySet::from(h)->dimension(name);
+    if(*count < 0) {
+      *count = 0;
+      return kOfxStatErrUnknown;
+    }
+    return kOfxStatOK;
+  }
+
+  OfxPropertySuiteV1 gPropertySuite = {
+    PropSetPointer, PropSetString, PropSetDouble, PropSetInt,
+    PropSetPointerN, PropSetStringN, PropSetDoubleN, PropSetIntN,
+    PropGetPointer, PropGetString, PropGetDouble, PropGetInt,
+    PropGetPointerN, PropGetStringN, PropGetDoubleN, PropGetIntN,
+    PropReset, PropGetDimension
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Parameters, the value does not change over time so animation is ignored
+
+  struct Param {
+    std::string type;
+    PropertySet props;
+    std::vector<double> value;
+    std::string string;
+
+    bool isString() const {return type == kOfxParamTypeString || type == kOfxParamTypeCustom;}
+    bool isInt() const
+    {
+      return type == kOfxParamTypeInteger || type == kOfxParamTypeInteger2D || type == kOfxParamTypeInteger3D
+        || type == kOfxParamTypeBoolean || type == kOfxParamTypeChoice;
+    }
+  };
+
+  // how many numbers make up a value of the type, 0 for strings and the rest
+  int ParamDimension(const std::string &type)
+  {
+    if(type == kOfxParamTypeDouble || type == kOfxParamTypeInteger || type == kOfxParamTypeBoolean || type == kOfxParamTypeChoice)
+      return 1;
+    if(type == kOfxParamTypeDouble2D || type == kOfxParamTypeInteger2D)
+      return 2;
+    if(type == kOfxParamTypeDouble3D || type == kOfxParamTypeInteger3D || type == kOfxParamTypeRGB)
+      return 3;
+    if(type == kOfxParamTypeRGBA)
+      return 4;
+    return 0;
+  }
+
+  struct ParamSet {
+    PropertySet props;
+    std::vector<std::string> order;
+    std::map<std::string, std::unique_ptr<Param>> params;
+
+    Param *find(const char *name)
+    {
+      std::map<std::string, std::unique_ptr<Param>>::iterator found = params.find(name);
+      return found == params.end() ? NULL : found->second.get();
+    }
+  };
+
+  OfxStatus ParamDefine(OfxParamSetHandle paramSet, const char *paramType, const char *name, OfxPropertySetHandle *propertySet)
+  {
+    ParamSet *set = (ParamSet *) paramSet;
+    if(!set) return kOfxStatErrBadHandle;
+    if(set->find(name)) return kOfxStatErrExists;
+
+    std::unique_ptr<Param> param(new Param);
+    param->type = paramType;
+
+    // the properties a host gives every parameter before the plugin sets any
+    PropertySet &props = param->props;
+    props.setString(kOfxPropType, kOfxTypeParameter);
+    props.setString(kOfxParamPropType, paramType);
+    props.setString(kOfxPropName, name);
+    props.setString(kOfxPropLabel, name);
+    props.setString(kOfxParamPropScriptName, name);
+    props.setString(kOfxParamPropHint, "");
+    props.setString(kOfxParamPropParent, "");
+    props.setInts(kOfxParamPropSecret, {0});
+    props.setInts(kOfxParamPropEnabled, {1});
+    props.setInts(kOfxParamPropCanUndo, {1});
+    props.setInts(kOfxParamPropPersistant, {1});
+    props.setInts(kOfxParamPropEvaluateOnChange, {1});
+    props.setInts(kOfxParamPropAnimates, {1});
+    props.setInts(kOfxParamPropIsAnimating, {0});
+
+    int dimension = ParamDimension(paramType);
+    if(param->isString()) {
+      props.setString(kOfxParamPropDefault, "");
+      props.setString(kOfxParamPropStringMode, kOfxParamStringIsSingleLine);
+    }
+    else if(dimension > 0) {
+      PropertyType type = param->isInt() ? ePropInt : ePropDouble;
+      props.resize(kOfxParamPropDefault, dimension, type);
+      props.resize(kOfxParamPropMin, dimension, type);
+      props.resize(kOfxParamPropMax, dimension, type);
+      props.resize(kOfxParamPropDisplayMin, dimension, type);
+      props.resize(kOfxParamPropDisplayMax, dimension, type);
+      for(int i = 0; i < dimension; i++) {
+        props.set(kOfxParamPropMin, i, type)->number = param->isInt() ? INT_MIN : -1e30;
+        props.set(kOfxParamPropMax, i, type)->number = param->isInt() ? INT_MAX : 1e30;
+        props.set(kOfxParamPropDisplayMin, i, type)->number = param->isInt() ? INT_MIN : -1e30;
+        props.set(kOfxParamPropDisplayMax, i, type)->number = param->isInt() ? INT_MAX : 1e30;
+      }
+      if(!param->isInt()) {
+        props.setDoubles(kOfxParamPropIncrement, {1.});
+        props.setInts(kOfxParamPropDigits, {2});
+        props.setString(kOfxParamPropDoubleType, kOfxParamDoubleTypePlain);
+      }
+      if(param->type == kOfxParamTypeChoice)
+        props.resize(kOfxParamPropChoiceOption, 0, ePropString);
+    }
+    else if(param->type == kOfxParamTypePage) {
+      props.resize(kOfxParamPropPageChild, 0, ePropString);
+    }
+
+    if(propertySet) *propertySet = props.handle();
+    set->order.push_back(name);
+    set->params[name] = std::move(param);
+    return kOfxStatOK;
+  }
+
+  OfxStatus ParamGetHandle(OfxParamSetHandle paramSet, const char *name, OfxParamHandle *param, OfxPropertySetHandle *propertySet)
+  {
+    ParamSet *set = (ParamSet *) paramSet;
+    if(!set) return kOfxStatErrBadHandle;
+    Param *found = set->find(name);
+    if(!found) return kOfxStatErrUnknown;
+    if(param) *param = (OfxParamHandle) found;
+    if(propertySet) *propertySet = found->props.handle();
+    return kOfxStatOK;
+  }
+
+  OfxStatus ParamSetGetPropertySet(OfxParamSetHandle paramSet, OfxPropertySetHandle *propHandle)
+  {
+    if(!paramSet) return kOfxStatErrBadHandle;
+    *propHandle = ((ParamSet *) paramSet)->props.handle();
+    return kOfxStatOK;
+  }
+
+  OfxStatus ParamGetPropertySet(OfxParamHandle param, OfxPropertySetHandle *propHandle)
+  {
+    if(!param) return kOfxStatErrBadHandle;
+    *propHandle = ((Param *) param)->props.handle();
+    return kOfxStatOK;
+  }
+
+  // write the value through the pointers in args, scaled by factor
+  OfxStatus GetValueV(Param *param, double factor, va_list args)
+  {
+    if(!param) return kOfxStatErrBadHandle;
+    if(param->isString()) {
+      *va_arg(args, const char **) = param->string.c_str();
+      return kOfxStatOK;
+    }
+    if(param->value.empty()) return kOfxStatErrUnsupported;
+    for(double v : param->value) {
+      if(param->isInt())
+        *va_arg(args, int *) = (int) (v * factor);
+      else
+        *va_arg(args, double *) = v * factor;
+    }
+    return kOfxStatOK;
+  }
+
+  OfxStatus SetValueV(Param *param, va_list args)
+  {
+    if(!param) return kOfxStatErrBadHandle;
+    if(param->isString()) {
+      const char *v = va_arg(args, const char *);
+      param->string = v ? v : "";
+      return kOfxStatOK;
+    }
+    if(param->value.empty()) return kOfxStatErrUnsupported;
+    for(double &v : param->value) {
+      if(param->isInt())
+        v = va_arg(args, int);
+      else
+        v = va_arg(args, double);
+    }
+    return kOfxStatOK;
+  }
+
+  OfxStatus ParamGetValue(OfxParamHandle paramHandle, ...)
+  {
+    va_list args;
+    va_start(args, paramHandle);
+    OfxStatus status = GetValueV((Param *) paramHandle, 1., args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ParamGetValueAtTime(OfxParamHandle paramHandle, OfxTime time, ...)
+  {
+    va_list args;
+    va_start(args, time);
+    OfxStatus status = GetValueV((Param *) paramHandle, 1., args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ParamGetDerivative(OfxParamHandle paramHandle, OfxTime time, ...)
+  {
+    va_list args;
+    va_start(args, time);
+    OfxStatus status = GetValueV((Param *) paramHandle, 0., args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ParamGetIntegral(OfxParamHandle paramHandle, OfxTime time1, OfxTime time2, ...)
+  {
+    va_list args;
+    va_start(args, time2);
+    OfxStatus status = GetValueV((Param *) paramHandle, time2 - time1, args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ParamSetValue(OfxParamHandle paramHandle, ...)
+  {
+    va_list args;
+    va_start(args, paramHandle);
+    OfxStatus status = SetValueV((Param *) paramHandle, args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ParamSetValueAtTime(OfxParamHandle paramHandle, OfxTime time, ...)
+  {
+    va_list args;
+    va_start(args, time);
+    OfxStatus status = SetValueV((Param *) paramHandle, args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ParamGetNumKeys(OfxParamHandle, unsigned int *numberOfKeys)
+  {
+    *numberOfKeys = 0;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ParamGetKeyTime(OfxParamHandle, unsigned int, OfxTime *) {return kOfxStatErrBadIndex;}
+  OfxStatus ParamGetKeyIndex(OfxParamHandle, OfxTime, int, int *) {return kOfxStatFailed;}
+  OfxStatus ParamDeleteKey(OfxParamHandle, OfxTime) {return kOfxStatErrBadIndex;}
+  OfxStatus ParamDeleteAllKeys(OfxParamHandle) {return kOfxStatOK;}
+
+  OfxStatus ParamCopy(OfxParamHandle paramTo, OfxParamHandle paramFrom, OfxTime, const OfxRangeD *)
+  {
+    Param *to = (Param *) paramTo, *from = (Param *) paramFrom;
+    if(!to || !from) return kOfxStatErrBadHandle;
+    if(to->type != from->type) return kOfxStatErrValue;
+    to->value = from->value;
+    to->string = from->string;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ParamEditBegin(OfxParamSetHandle, const char *) {return kOfxStatOK;}
+  OfxStatus ParamEditEnd(OfxParamSetHandle) {return kOfxStatOK;}
+
+  OfxParameterSuiteV1 gParameterSuite = {
+    ParamDefine, ParamGetHandle, ParamSetGetPropertySet, ParamGetPropertySet,
+    ParamGetValue, ParamGetValueAtTime, ParamGetDerivative, ParamGetIntegral,
+    ParamSetValue, ParamSetValueAtTime, ParamGetNumKeys, ParamGetKeyTime,
+    ParamGetKeyIndex, ParamDeleteKey, ParamDeleteAllKeys, ParamCopy,
+    ParamEditBegin, ParamEditEnd
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Frames, clips and effects
+
+  // the pixel layout of every image in a run
+  struct PixelFormat {
+    std::string depth = kOfxBitDepthFloat;
+    std::string components = kOfxImageComponentRGBA;
+    int bytesPerComponent = 4;
+    int nComponents = 4;
+  };
+
+  // a packed image, rows bottom up as OFX has them
+  struct Frame {
+    int width = 0;
+    int height = 0;
+    size_t rowBytes = 0;
+    PixelFormat format;
+    std::vector<unsigned char> data;
+  };
+
+  struct Clip {
+    std::string name;
+    PropertySet props;
+    Frame *frame = NULL;      // what the clip hands out, NULL if it isn't connected
+    double renderScale = 1.;
+  };
+
+  struct Effect {
+    PropertySet props;
+    ParamSet params;
+    std::vector<std::string> clipOrder;
+    std::map<std::string, std::unique_ptr<Clip>> clips;
+  };
+
+  PixelFormat gFormat;
+  std::atomic<int> gImagesOut(0);
+
+  OfxStatus GetPropertySet(OfxImageEffectHandle imageEffect, OfxPropertySetHandle *propHandle)
+  {
+    if(!imageEffect) return kOfxStatErrBadHandle;
+    *propHandle = ((Effect *) imageEffect)->props.handle();
+    return kOfxStatOK;
+  }
+
+  OfxStatus GetParamSet(OfxImageEffectHandle imageEffect, OfxParamSetHandle *paramSet)
+  {
+    if(!imageEffect) return kOfxStatErrBadHandle;
+    *paramSet = (OfxParamSetHandle) &((Effect *) imageEffect)->params;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ClipDefine(OfxImageEffectHandle imageEffect, const char *name, OfxPropertySetHandle *propertySet)
+  {
+    Effect *effect = (Effect *) imageEffect;
+    if(!effect) return kOfxStatErrBadHandle;
+    if(!effect->clips.count(name)) {
+      std::unique_ptr<Clip> clip(new Clip);
+      clip->name = name;
+      clip->props.setString(kOfxPropType, kOfxTypeClip);
+      clip->props.setString(kOfxPropName, name);
+      clip->props.setString(kOfxPropLabel, name);
+      clip->props.resize(kOfxImageEffectPropSupportedComponents, 0, ePropString);
+      clip->props.setInts(kOfxImageEffectPropTemporalClipAccess, {0});
+      clip->props.setInts(kOfxImageClipPropOptional, {0});
+      clip->props.setInts(kOfxImageClipPropIsMask, {0});
+      clip->props.setInts(kOfxImageEffectPropSupportsTiles, {1});
+      clip->props.setString(kOfxImageClipPropFieldExtraction, kOfxImageFieldDoubled);
+      effect->clipOrder.push_back(name);
+      effect->clips[name] = std::move(clip);
+    }
+    *propertySet = effect->clips[name]->props.handle();
+    return kOfxStatOK;
+  }
+
+  OfxStatus ClipGetHandle(OfxImageEffectHandle imageEffect, const char *name, OfxImageClipHandle *clip, OfxPropertySetHandle *propertySet)
+  {
+    Effect *effect = (Effect *) imageEffect;
+    if(!effect) return kOfxStatErrBadHandle;
+    std::map<std::string, std::unique_ptr<Clip>>::iterator found = effect->clips.find(name);
+    if(found == effect->clips.end()) return kOfxStatErrUnknown;
+    if(clip) *clip = (OfxImageClipHandle) found->second.get();
+    if(propertySet) *propertySet = found->second->props.handle();
+    return kOfxStatOK;
+  }
+
+  OfxStatus ClipGetPropertySet(OfxImageClipHandle clip, OfxPropertySetHandle *propHandle)
+  {
+    if(!clip) return kOfxStatErrBadHandle;
+    *propHandle = ((Clip *) clip)->props.handle();
+    return kOfxStatOK;
+  }
+
+  // the whole frame is handed out whatever region is asked for, which hosts may do
+  OfxStatus ClipGetImage(OfxImageClipHandle clipHandle, OfxTime time, const OfxRectD * /*region*/, OfxPropertySetHandle *imageHandle)
+  {
+    Clip *clip = (Clip *) clipHandle;
+    if(!clip) return kOfxStatErrBadHandle;
+    if(!clip->frame) return kOfxStatFailed;
+
+    PropertySet *image = new PropertySet;
+    image->setString(kOfxPropType, kOfxTypeImage);
+    image->setPointer(kOfxImagePropData, clip->frame->data.data());
+    image->setInts(kOfxImagePropBounds, {0, 0, clip->frame->width, clip->frame->height});
+    image->setInts(kOfxImagePropRegionOfDefinition, {0, 0, clip->frame->width, clip->frame->height});
+    image->setInts(kOfxImagePropRowBytes, {(int) clip->frame->rowBytes});
+    image->setString(kOfxImageEffectPropPixelDepth, clip->frame->format.depth);
+    image->setString(kOfxImageEffectPropComponents, clip->frame->format.components);
+    image->setString(kOfxImageEffectPropPreMultiplication, clip->props.getString(kOfxImageEffectPropPreMultiplication));
+    image->setDoubles(kOfxImageEffectPropRenderScale, {clip->renderScale, clip->renderScale});
+    image->setDoubles(kOfxImagePropPixelAspectRatio, {1.});
+    image->setString(kOfxImagePropField, kOfxImageFieldNone);
+    image->setString(kOfxImagePropUniqueIdentifier, clip->name + "@" + std::to_string(time));
+    gImagesOut++;
+
+    *imageHandle = image->handle();
+    return kOfxStatOK;
+  }
+
+  OfxStatus ClipReleaseImage(OfxPropertySetHandle imageHandle)
+  {
+    if(!imageHandle) return kOfxStatErrBadHandle;
+    delete PropertySet::from(imageHandle);
+    gImagesOut--;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ClipGetRegionOfDefinition(OfxImageClipHandle clipHandle, OfxTime, OfxRectD *bounds)
+  {
+    Clip *clip = (Clip *) clipHandle;
+    if(!clip) return kOfxStatErrBadHandle;
+    if(!clip->frame) {
+      *bounds = OfxRectD{0., 0., 0., 0.};
+      return kOfxStatOK;
+    }
+    // canonical coordinates, so undo the render scale
+    *bounds = OfxRectD{0., 0., clip->frame->width / clip->renderScale, clip->frame->height / clip->renderScale};
+    return kOfxStatOK;
+  }
+
+  int Abort(OfxImageEffectHandle) {return 0;}
+
+  struct ImageMemory {
+    void *data;
+  };
+
+  OfxStatus ImageMemoryAlloc(OfxImageEffectHandle, size_t nBytes, OfxImageMemoryHandle *memoryHandle)
+  {
+    ImageMemory *memory = new ImageMemory;
+    memory->data = malloc(nBytes);
+    if(!memory->data) {
+      delete memory;
+      return kOfxStatErrMemory;
+    }
+    *memoryHandle = (OfxImageMemoryHandle) memory;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ImageMemoryFree(OfxImageMemoryHandle memoryHandle)
+  {
+    ImageMemory *memory = (ImageMemory *) memoryHandle;
+    if(!memory) return kOfxStatErrBadHandle;
+    free(memory->data);
+    delete memory;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ImageMemoryLock(OfxImageMemoryHandle memoryHandle, void **returnedPtr)
+  {
+    if(!memoryHandle) return kOfxStatErrBadHandle;
+    *returnedPtr = ((ImageMemory *) memoryHandle)->data;
+    return kOfxStatOK;
+  }
+
+  OfxStatus ImageMemoryUnlock(OfxImageMemoryHandle memoryHandle)
+  {
+    return memoryHandle ? kOfxStatOK : kOfxStatErrBadHandle;
+  }
+
+  OfxImageEffectSuiteV1 gImageEffectSuite = {
+    GetPropertySet, GetParamSet, ClipDefine, ClipGetHandle, ClipGetPropertySet,
+    ClipGetImage, ClipReleaseImage, ClipGetRegionOfDefinition, Abort,
+    ImageMemoryAlloc, ImageMemoryFree, ImageMemoryLock, ImageMemoryUnlock
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Multithreading, a pool of workers that share out the indices of each call
+
+  thread_local unsigned int tThreadIndex = 0;
+  thread_local bool tSpawned = false;
+
+  class ThreadPool {
+  public :
+    ~ThreadPool() {resize(1);}
+
+    // total threads, the caller of run being one of them
+    void resize(unsigned int nThreads)
+    {
+      resetPerf(nThreads);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+      }
+      _wake.notify_all();
+      for(std::thread &t : _workers) t.join();
+      _workers.clear();
+      _quit = false;
+
+      for(unsigned int i = 1; i < nThreads; i++)
+        _workers.emplace_back(&ThreadPool::work, this, i);
+    }
+
+    unsigned int size() const {return (unsigned int) _workers.size() + 1;}
+
+    // forget the hardware counts of each worker's share of the calls
+    void resetPerf(unsigned int nThreads)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _perf.assign(nThreads, Zokzir::PerfCounts());
+      _workerPerf = Zokzir::PerfCounts();
+    }
+    void resetPerf() {resetPerf(size());}
+
+    // the counts of each worker's share since the reset, by thread, the caller
+    // of run being thread 0 and left at zero
+    std::vector<Zokzir::PerfCounts> threadCounts()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _perf;
+    }
+
+    // the counts of the workers since the last take, for the action that ran them
+    Zokzir::PerfCounts takeWorkerCounts()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      Zokzir::PerfCounts counts = _workerPerf;
+      _workerPerf = Zokzir::PerfCounts();
+      return counts;
+    }
+
+    void run(OfxThreadFunctionV1 *func, unsigned int nThreads, void *customArg)
+    {
+      // nested calls and single threads run right here
+      if(tSpawned || nThreads <= 1 || _workers.empty()) {
+        unsigned int saved = tThreadIndex;
+        for(unsigned int i = 0; i < nThreads; i++) {
+          tThreadIndex = i;
+          func(i, nThreads, customArg);
+        }
+        tThreadIndex = saved;
+        return;
+      }
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      _func = func;
+      _arg = customArg;
+      _count = nThreads;
+      _next = 0;
+      _busy = (unsigned int) _workers.size();
+      _generation++;
+      lock.unlock();
+      _wake.notify_all();
+
+      tSpawned = true;
+      drain(func, nThreads, customArg);
+      tSpawned = false;
+      tThreadIndex = 0;
+
+      lock.lock();
+      _finished.wait(lock, [this] {return _busy == 0;});
+    }
+
+  private :
+    // returns the hardware counts of this thread's share, which only the
+    // workers keep, the caller's are in its action's
+    Zokzir::PerfCounts drain(OfxThreadFunctionV1 *func, unsigned int nThreads, void *customArg)
+    {
+      Zokzir::PerfScope perf;
+      for(unsigned int i = _next++; i < nThreads; i = _next++) {
+        tThreadIndex = i;
+        func(i, nThreads, customArg);
+      }
+      return perf.counts();
+    }
+
+    void work(unsigned int slot)
+    {
+      tSpawned = true;
+      unsigned int seen = 0;
+      std::unique_lock<std::mutex> lock(_mutex);
+      for(;;) {
+        _wake.wait(lock, [&] {return _quit || _generation != seen;});
+        if(_quit) return;
+        seen = _generation;
+        OfxThreadFunctionV1 *func = _func;
+        void *arg = _arg;
+        unsigned int count = _count;
+        lock.unlock();
+
+        Zokzir::PerfCounts counts = drain(func, count, arg);
+
+        lock.lock();
+        _perf[slot] += counts;
+        _workerPerf += counts;
+        if(--_busy == 0)
+          _finished.notify_all();
+      }
+    }
+
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _wake, _finished;
+    OfxThreadFunctionV1 *_func = NULL;
+    void *_arg = NULL;
+    unsigned int _count = 0;
+    std::atomic<unsigned int> _next{0};
+    unsigned int _busy = 0;
+    unsigned int _generation = 0;
+    bool _quit = false;
+    std::vector<Zokzir::PerfCounts> _perf = std::vector<Zokzir::PerfCounts>(1);
+    Zokzir::PerfCounts _workerPerf;
+  };
+
+  ThreadPool gPool;
+
+  OfxStatus MultiThread(OfxThreadFunctionV1 func, unsigned int nThreads, void *customArg)
+  {
+    if(!func) return kOfxStatFailed;
+    gPool.run(func, std::max(nThreads, 1u), customArg);
+    return kOfxStatOK;
+  }
+
+  OfxStatus MultiThreadNumCPUs(unsigned int *nCPUs)
+  {
+    *nCPUs = gPool.size();
+    return kOfxStatOK;
+  }
+
+  OfxStatus MultiThreadIndex(unsigned int *threadIndex)
+  {
+    *threadIndex = tThreadIndex;
+    return kOfxStatOK;
+  }
+
+  int MultiThreadIsSpawnedThread(void)
+  {
+    return tSpawned ? 1 : 0;
+  }
+
+  OfxStatus MutexCreate(OfxMutexHandle *mutex, int lockCount)
+  {
+    std::recursive_mutex *m = new std::recursive_mutex;
+    for(int i = 0; i < lockCount; i++) m->lock();
+    *mutex = (OfxMutexHandle) m;
+    return kOfxStatOK;
+  }
+
+  OfxStatus MutexDestroy(const OfxMutexHandle mutex)
+  {
+    if(!mutex) return kOfxStatErrBadHandle;
+    delete (std::recursive_mutex *) mutex;
+    return kOfxStatOK;
+  }
+
+  OfxStatus MutexLock(const OfxMutexHandle mutex)
+  {
+    if(!mutex) return kOfxStatErrBadHandle;
+    ((std::recursive_mutex *) mutex)->lock();
+    return kOfxStatOK;
+  }
+
+  OfxStatus MutexUnLock(const OfxMutexHandle mutex)
+  {
+    if(!mutex) return kOfxStatErrBadHandle;
+    ((std::recursive_mutex *) mutex)->unlock();
+    return kOfxStatOK;
+  }
+
+  OfxStatus MutexTryLock(const OfxMutexHandle mutex)
+  {
+    if(!mutex) return kOfxStatErrBadHandle;
+    return ((std::recursive_mutex *) mutex)->try_lock() ? kOfxStatOK : kOfxStatFailed;
+  }
+
+  OfxMultiThreadSuiteV1 gMultiThreadSuite = {
+    MultiThread, MultiThreadNumCPUs, MultiThreadIndex, MultiThreadIsSpawnedThread,
+    MutexCreate, MutexDestroy, MutexLock, MutexUnLock, MutexTryLock
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // memory and messages
+
+  OfxStatus MemoryAlloc(void *, size_t nBytes, void **allocatedData)
+  {
+    *allocatedData = malloc(nBytes);
+    return *allocatedData ? kOfxStatOK : kOfxStatErrMemory;
+  }
+
+  OfxStatus MemoryFree(void *allocatedData)
+  {
+    free(allocatedData);
+    return kOfxStatOK;
+  }
+
+  OfxMemorySuiteV1 gMemorySuite = {MemoryAlloc, MemoryFree};
+
+  OfxStatus MessageV(const char *kind, const char *messageType, const char *format, va_list args)
+  {
+    fprintf(stderr, "%s %s: ", kind, messageType ? messageType : "");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    // nobody is there to answer a question
+    return messageType && strcmp(messageType, kOfxMessageQuestion) == 0 ? kOfxStatReplyNo : kOfxStatOK;
+  }
+
+  OfxStatus Message(void *, const char *messageType, const char *, const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    OfxStatus status = MessageV("message", messageType, format, args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus SetPersistentMessage(void *, const char *messageType, const char *, const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    OfxStatus status = MessageV("persistent message", messageType, format, args);
+    va_end(args);
+    return status;
+  }
+
+  OfxStatus ClearPersistentMessage(void *) {return kOfxStatOK;}
+
+  OfxMessageSuiteV1 gMessageSuiteV1 = {Message};
+  OfxMessageSuiteV2 gMessageSuiteV2 = {Message, SetPersistentMessage, ClearPersistentMessage};
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the host itself
+
+  PropertySet gHostProps;
+
+  const void *FetchSuite(OfxPropertySetHandle, const char *suiteName, int suiteVersion)
+  {
+    std::string name(suiteName);
+    if(name == kOfxPropertySuite && suiteVersion == 1) return &gPropertySuite;
+    if(name == kOfxImageEffectSuite && suiteVersion == 1) return &gImageEffectSuite;
+    if(name == kOfxParameterSuite && suiteVersion == 1) return &gParameterSuite;
+    if(name == kOfxMultiThreadSuite && suiteVersion == 1) return &gMultiThreadSuite;
+    if(name == kOfxMemorySuite && suiteVersion == 1) return &gMemorySuite;
+    if(name == kOfxMessageSuite && suiteVersion == 1) return &gMessageSuiteV1;
+    if(name == kOfxMessageSuite && suiteVersion == 2) return &gMessageSuiteV2;
+    return NULL;
+  }
+
+  OfxHost gHost = {NULL, FetchSuite};
+
+  void DescribeHost()
+  {
+    PropertySet &p = gHostProps;
+    p.setString(kOfxPropType, kOfxTypeImageEffectHost);
+    p.setString(kOfxPropName, "com.salkocsisfx.zokzir.bench");
+    p.setString(kOfxPropLabel, "Zokzir Bench");
+    p.setInts(kOfxPropAPIVersion, {1, 4});
+    p.setInts(kOfxPropVersion, {1, 0, 0});
+    p.setString(kOfxPropVersionLabel, "1.0");
+    p.setInts(kOfxImageEffectHostPropIsBackground, {1});
+    p.setInts(kOfxImageEffectPropSupportsOverlays, {0});
+    p.setInts(kOfxImageEffectPropSupportsMultiResolution, {1});
+    p.setInts(kOfxImageEffectPropSupportsTiles, {1});
+    p.setInts(kOfxImageEffectPropTemporalClipAccess, {0});
+    p.setInts(kOfxImageEffectPropSupportsMultipleClipDepths, {0});
+    p.setInts(kOfxImageEffectPropSupportsMultipleClipPARs, {0});
+    p.setInts(kOfxImageEffectPropSetableFrameRate, {0});
+    p.setInts(kOfxImageEffectPropSetableFielding, {0});
+    p.setInts(kOfxImageEffectInstancePropSequentialRender, {0});
+    p.setInts(kOfxImageEffectPropRenderQualityDraft, {0});
+    p.setString(kOfxImageEffectHostPropNativeOrigin, kOfxImageEffectHostPropNativeOriginBottomLeft);
+    p.setInts(kOfxParamHostPropSupportsCustomInteract, {0});
+    p.setInts(kOfxParamHostPropSupportsStringAnimation, {0});
+    p.setInts(kOfxParamHostPropSupportsChoiceAnimation, {0});
+    p.setInts(kOfxParamHostPropSupportsBooleanAnimation, {0});
+    p.setInts(kOfxParamHostPropSupportsCustomAnimation, {0});
+    p.setInts(kOfxParamHostPropMaxParameters, {-1});
+    p.setInts(kOfxParamHostPropMaxPages, {0});
+    p.setInts(kOfxParamHostPropPageRowColumnCount, {0, 0});
+    p.setStrings(kOfxImageEffectPropSupportedComponents,
+                 {kOfxImageComponentRGBA, kOfxImageComponentRGB, kOfxImageComponentAlpha});
+    p.setStrings(kOfxImageEffectPropSupportedContexts,
+                 {kOfxImageEffectContextFilter, kOfxImageEffectContextGeneral});
+    p.setStrings(kOfxImageEffectPropSupportedPixelDepths,
+                 {kOfxBitDepthByte, kOfxBitDepthShort, kOfxBitDepthHalf, kOfxBitDepthFloat});
+    gHost.host = p.handle();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Timing of every action the plugin is sent
+
+  typedef std::chrono::steady_clock Clock;
+
+  double Seconds(Clock::time_point start)
+  {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  struct ActionStats {
+    int calls = 0;
+    double total = 0.;
+    double min = 1e30;
+    double max = 0.;
+    Zokzir::PerfCounts counts;   // summed over the calls and the threads they ran
+  };
+
+  std::vector<std::string> gActionOrder;
+  std::map<std::string, ActionStats> gActionStats;
+
+  OfxStatus CallAction(OfxPlugin *plugin, const char *action, const void *handle, PropertySet *inArgs, PropertySet *outArgs)
+  {
+    Zokzir::PerfScope perf;
+    Clock::time_point start = Clock::now();
+    OfxStatus status = plugin->mainEntry(action, handle, inArgs ? inArgs->handle() : NULL, outArgs ? outArgs->handle() : NULL);
+    double seconds = Seconds(start);
+    Zokzir::PerfCounts counts = perf.counts();
+    counts += gPool.takeWorkerCounts();
+
+    if(!gActionStats.count(action)) gActionOrder.push_back(action);
+    ActionStats &stats = gActionStats[action];
+    stats.calls++;
+    stats.total += seconds;
+    stats.min = std::min(stats.min, seconds);
+    stats.max = std::max(stats.max, seconds);
+    stats.counts += counts;
+
+    if(status != kOfxStatOK && status != kOfxStatReplyDefault && status != kOfxStatReplyYes && status != kOfxStatReplyNo)
+      fprintf(stderr, "%s failed with status %d\n", action, status);
+    return status;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Frames in and out, kept as float RGBA bottom row first until packed
+
+  struct FloatFrame {
+    int width = 0;
+    int height = 0;
+    std::vector<float> rgba;
+  };
+
+  // a gradient in red and green over a checkerboard in blue, enough structure
+  // for a warp to show what it has done
+  void SyntheticFrame(int width, int height, FloatFrame &frame)
+  {
+    frame.width = width;
+    frame.height = height;
+    frame.rgba.resize(size_t(width) * height * 4);
+    for(int y = 0; y < height; y++) {
+      for(int x = 0; x < width; x++) {
+        float *pix = &frame.rgba[(size_t(y) * width + x) * 4];
+        pix[0] = (x + 0.5f) / width;
+        pix[1] = (y + 0.5f) / height;
+        pix[2] = ((x / 64) + (y / 64)) % 2 ? 0.75f : 0.25f;
+        pix[3] = 1.f;
+      }
+    }
+  }
+
+  // read past whitespace and comments to the next number of a PPM or PFM header
+  bool ReadHeaderToken(FILE *f, std::string &token)
+  {
+    token.clear();
+    int c = fgetc(f);
+    while(c != EOF && (isspace(c) || c == '#')) {
+      if(c == '#')
+        while(c != EOF && c != '\n') c = fgetc(f);
+      c = fgetc(f);
+    }
+    while(c != EOF && !isspace(c)) {
+      token += char(c);
+      c = fgetc(f);
+    }
+    return !token.empty();
+  }
+
+  // binary PPM (P5 and P6, 8 or 16 bits) and PFM (Pf and PF)
+  bool ReadFrame(const char *path, FloatFrame &frame)
+  {
+    FILE *f = fopen(path, "rb");
+    if(!f) return false;
+
+    std::string magic, w, h, scale;
+    bool ok = ReadHeaderToken(f, magic) && ReadHeaderToken(f, w) && ReadHeaderToken(f, h) && ReadHeaderToken(f, scale);
+    bool pfm = magic == "PF" || magic == "Pf";
+    bool ppm = magic == "P6" || magic == "P5";
+    int channels = (magic == "PF" || magic == "P6") ? 3 : 1;
+    if(!ok || (!pfm && !ppm)) {
+      fclose(f);
+      return false;
+    }
+
+    frame.width = atoi(w.c_str());
+    frame.height = atoi(h.c_str());
+    frame.rgba.assign(size_t(frame.width) * frame.height * 4, 1.f);
+    double max = atof(scale.c_str());
+    int sampleBytes = pfm ? 4 : (max > 255 ? 2 : 1);
+    bool littleEndian = pfm && max < 0;
+
+    std::vector<unsigned char> row(size_t(frame.width) * channels * sampleBytes);
+    for(int line = 0; ok && line < frame.height; line++) {
+      ok = fread(row.data(), 1, row.size(), f) == row.size();
+      // PFM is stored bottom up like OFX, PPM top down
+      int y = pfm ? line : frame.height - 1 - line;
+      for(int x = 0; ok && x < frame.width; x++) {
+        for(int c = 0; c < channels; c++) {
+          const unsigned char *s = &row[(size_t(x) * channels + c) * sampleBytes];
+          float v;
+          if(pfm) {
+            uint32_t bits = littleEndian
+              ? uint32_t(s[0]) | uint32_t(s[1]) << 8 | uint32_t(s[2]) << 16 | uint32_t(s[3]) << 24
+              : uint32_t(s[3]) | uint32_t(s[2]) << 8 | uint32_t(s[1]) << 16 | uint32_t(s[0]) << 24;
+            memcpy(&v, &bits, 4);
+          }
+          else {
+            v = float(sampleBytes == 2 ? (s[0] << 8 | s[1]) : s[0]) / float(max);
+          }
+          float *pix = &frame.rgba[(size_t(y) * frame.width + x) * 4];
+          if(channels == 1)
+            pix[0] = pix[1] = pix[2] = v;
+          else
+            pix[c] = v;
+        }
+      }
+    }
+    fclose(f);
+    return ok;
+  }
+
+  // PFM if the name ends in .pfm, an 8 bit PPM otherwise
+  bool WriteFrame(const char *path, const FloatFrame &frame)
+  {
+    FILE *f = fopen(path, "wb");
+    if(!f) return false;
+    size_t len = strlen(path);
+    bool pfm = len > 4 && (strcmp(path + len - 4, ".pfm") == 0 || strcmp(path + len - 4, ".PFM") == 0);
+
+    fprintf(f, pfm ? "PF\n%d %d\n-1.0\n" : "P6\n%d %d\n255\n", frame.width, frame.height);
+    bool ok = true;
+    for(int line = 0; ok && line < frame.height; line++) {
+      int y = pfm ? line : frame.height - 1 - line;
+      const float *pix = &frame.rgba[size_t(y) * frame.width * 4];
+      for(int x = 0; ok && x < frame.width; x++, pix += 4) {
+        if(pfm) {
+          ok = fwrite(pix, sizeof(float), 3, f) == 3;
+        }
+        else {
+          unsigned char rgb[3];
+          for(int c = 0; c < 3; c++)
+            rgb[c] = (unsigned char) (std::min(std::max(pix[c], 0.f), 1.f) * 255.f + 0.5f);
+          ok = fwrite(rgb, 1, 3, f) == 3;
+        }
+      }
+    }
+    fclose(f);
+    return ok;
+  }
+
+  // nearest neighbour resize for render scales other than one
+  void ScaleFrame(const FloatFrame &src, double scale, FloatFrame &dst)
+  {
+    dst.width = std::max(1, (int) ceil(src.width * scale));
+    dst.height = std::max(1, (int) ceil(src.height * scale));
+    dst.rgba.resize(size_t(dst.width) * dst.height * 4);
+    for(int y = 0; y < dst.height; y++) {
+      int sy = std::min(src.height - 1, (int) (y / scale));
+      for(int x = 0; x < dst.width; x++) {
+        int sx = std::min(src.width - 1, (int) (x / scale));
+        memcpy(&dst.rgba[(size_t(y) * dst.width + x) * 4], &src.rgba[(size_t(sy) * src.width + sx) * 4], 4 * sizeof(float));
+      }
+    }
+  }
+
+  // the components of an RGBA pixel that a format keeps
+  int ComponentOffset(const PixelFormat &format, int c)
+  {
+    return format.nComponents == 1 ? 3 : c;
+  }
+
+  void PackFrame(const FloatFrame &src, const PixelFormat &format, Frame &dst)
+  {
+    dst.width = src.width;
+    dst.height = src.height;
+    dst.format = format;
+    dst.rowBytes = size_t(src.width) * format.nComponents * format.bytesPerComponent;
+    dst.data.assign(dst.rowBytes * src.height, 0);
+
+    size_t count = size_t(src.width) * src.height;
+    for(size_t i = 0; i < count; i++) {
+      for(int c = 0; c < format.nComponents; c++) {
+        float v = src.rgba[i * 4 + ComponentOffset(format, c)];
+        unsigned char *d = &dst.data[(i * format.nComponents + c) * format.bytesPerComponent];
+        if(format.depth == kOfxBitDepthByte) {
+          *d = (unsigned char) (std::min(std::max(v, 0.f), 1.f) * 255.f + 0.5f);
+        }
+        else if(format.depth == kOfxBitDepthShort) {
+          unsigned short s = (unsigned short) (std::min(std::max(v, 0.f), 1.f) * 65535.f + 0.5f);
+          memcpy(d, &s, 2);
+        }
+        else if(format.depth == kOfxBitDepthHalf) {
+          uint16_t h = Zokzir::FloatToHalf(v);
+          memcpy(d, &h, 2);
+        }
+        else {
+          memcpy(d, &v, 4);
+        }
+      }
+    }
+  }
+
+  void UnpackFrame(const Frame &src, FloatFrame &dst)
+  {
+    const PixelFormat &format = src.format;
+    dst.width = src.width;
+    dst.height = src.height;
+    dst.rgba.assign(size_t(src.width) * src.height * 4, 1.f);
+
+    size_t count = size_t(src.width) * src.height;
+    for(size_t i = 0; i < count; i++) {
+      for(int c = 0; c < format.nComponents; c++) {
+        const unsigned char *s = &src.data[(i * format.nComponents + c) * format.bytesPerComponent];
+        float v;
+        if(format.depth == kOfxBitDepthByte) {
+          v = *s / 255.f;
+        }
+        else if(format.depth == kOfxBitDepthShort) {
+          unsigned short u;
+          memcpy(&u, s, 2);
+          v = u / 65535.f;
+        }
+        else if(format.depth == kOfxBitDepthHalf) {
+          uint16_t h;
+          memcpy(&h, s, 2);
+          v = Zokzir::HalfToFloat(h);
+        }
+        else {
+          memcpy(&v, s, 4);
+        }
+        dst.rgba[i * 4 + ComponentOffset(format, c)] = v;
+      }
+      // a lone alpha is shown as grey
+      if(format.nComponents == 1)
+        dst.rgba[i * 4] = dst.rgba[i * 4 + 1] = dst.rgba[i * 4 + 2] = dst.rgba[i * 4 + 3];
+    }
+  }
+
+  // a mask that is clear on the left quarter, solid on the right quarter and
+  // ramps in between, so a masked render sees empty, full and mixed areas
+  void MaskFrame(int width, int height, FloatFrame &frame)
+  {
+    frame.width = width;
+    frame.height = height;
+    frame.rgba.resize(size_t(width) * height * 4);
+    for(int y = 0; y < height; y++) {
+      for(int x = 0; x < width; x++) {
+        float a = std::min(std::max(((x + 0.5f) / width - 0.25f) * 2.f, 0.f), 1.f);
+        float *pix = &frame.rgba[(size_t(y) * width + x) * 4];
+        pix[0] = pix[1] = pix[2] = pix[3] = a;
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Reference renders, kept packed exactly as the effect wrote them so that a
+  // comparison sees the pixels of the depth under test. The header is a line
+  // "ZR DEPTH COMPONENTS WIDTH HEIGHT", then the rows bottom up.
+
+  bool ReadReference(const char *path, Frame &frame)
+  {
+    FILE *f = fopen(path, "rb");
+    if(!f) return false;
+
+    char depth[64], components[64];
+    int width, height;
+    bool ok = fscanf(f, "ZR %63s %63s %d %d", depth, components, &width, &height) == 4 && fgetc(f) == '\n';
+    if(ok) {
+      PixelFormat &format = frame.format;
+      format.depth = depth;
+      format.components = components;
+      format.bytesPerComponent = format.depth == kOfxBitDepthByte ? 1 : format.depth == kOfxBitDepthFloat ? 4 : 2;
+      format.nComponents = format.components == kOfxImageComponentAlpha ? 1 : format.components == kOfxImageComponentRGB ? 3 : 4;
+      frame.width = width;
+      frame.height = height;
+      frame.rowBytes = size_t(width) * format.nComponents * format.bytesPerComponent;
+      frame.data.resize(frame.rowBytes * height);
+      ok = fread(frame.data.data(), 1, frame.data.size(), f) == frame.data.size();
+    }
+    fclose(f);
+    return ok;
+  }
+
+  bool WriteReference(const char *path, const Frame &frame)
+  {
+    FILE *f = fopen(path, "wb");
+    if(!f) return false;
+    fprintf(f, "ZR %s %s %d %d\n", frame.format.depth.c_str(), frame.format.components.c_str(), frame.width, frame.height);
+    bool ok = fwrite(frame.data.data(), 1, frame.data.size(), f) == frame.data.size();
+    return fclose(f) == 0 && ok;
+  }
+
+  // how far a render is from its reference, over every component kept
+  struct FrameError {
+    double max = 0.;
+    double mean = 0.;
+    size_t differing = 0;
+  };
+
+  bool CompareFrames(const Frame &rendered, const Frame &reference, FrameError &error)
+  {
+    if(rendered.width != reference.width || rendered.height != reference.height ||
+       rendered.format.depth != reference.format.depth || rendered.format.components != reference.format.components)
+      return false;
+
+    FloatFrame a, b;
+    UnpackFrame(rendered, a);
+    UnpackFrame(reference, b);
+    size_t count = size_t(a.width) * a.height;
+    double total = 0.;
+    for(size_t i = 0; i < count; i++) {
+      for(int c = 0; c < rendered.format.nComponents; c++) {
+        size_t k = i * 4 + ComponentOffset(rendered.format, c);
+        double d = fabs(double(a.rgba[k]) - b.rgba[k]);
+        // NaN in one but not the other is as wrong as it gets
+        if(d != d) d = (a.rgba[k] != a.rgba[k]) == (b.rgba[k] != b.rgba[k]) ? 0. : HUGE_VAL;
+        error.max = std::max(error.max, d);
+        total += d;
+        if(d > 0.) error.differing++;
+      }
+    }
+    error.mean = total / std::max<size_t>(1, count * rendered.format.nComponents);
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // loading the binary
+
+  typedef int (*GetNumberOfPluginsFunc)(void);
+  typedef OfxPlugin *(*GetPluginFunc)(int nth);
+
+  bool LoadBinary(const char *path, std::vector<OfxPlugin *> &plugins)
+  {
+#if defined(_WIN32)
+    HMODULE binary = LoadLibraryA(path);
+    if(!binary) {
+      fprintf(stderr, "could not load %s\n", path);
+      return false;
+    }
+    GetNumberOfPluginsFunc getNumberOfPlugins = (GetNumberOfPluginsFunc) GetProcAddress(binary, "OfxGetNumberOfPlugins");
+    GetPluginFunc getPlugin = (GetPluginFunc) GetProcAddress(binary, "OfxGetPlugin");
+#else
+    // without a slash dlopen would search the library path instead
+    std::string local = strchr(path, '/') ? std::string(path) : "./" + std::string(path);
+    void *binary = dlopen(local.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!binary) {
+      fprintf(stderr, "could not load %s: %s\n", path, dlerror());
+      return false;
+    }
+    GetNumberOfPluginsFunc getNumberOfPlugins = (GetNumberOfPluginsFunc) dlsym(binary, "OfxGetNumberOfPlugins");
+    GetPluginFunc getPlugin = (GetPluginFunc) dlsym(binary, "OfxGetPlugin");
+#endif
+    if(!getNumberOfPlugins || !getPlugin) {
+      fprintf(stderr, "%s is not an OFX binary\n", path);
+      return false;
+    }
+
+    int count = getNumberOfPlugins();
+    for(int i = 0; i < count; i++) {
+      OfxPlugin *plugin = getPlugin(i);
+      if(plugin && strcmp(plugin->pluginApi, kOfxImageEffectPluginApi) == 0)
+        plugins.push_back(plugin);
+    }
+    return true;
+  }
+
+  // the bundle directory, the binary lives in its Contents/<arch>/
+  std::string BundlePath(const std::string &binaryPath)
+  {
+    size_t contents = binaryPath.rfind("/Contents/");
+    if(contents == std::string::npos) contents = binaryPath.rfind("\\Contents\\");
+    if(contents != std::string::npos) return binaryPath.substr(0, contents);
+    size_t slash = binaryPath.find_last_of("/\\");
+    return slash == std::string::npos ? std::string(".") : binaryPath.substr(0, slash);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // command line
+
+  struct Options {
+    std::string binary;
+    std::string plugin;
+    std::string context = kOfxImageEffectContextFilter;
+    int width = 1920;
+    int height = 1080;
+    std::string input;
+    std::string output;
+    double renderScale = 1.;
+    int frames = 10;
+    int warmup = 2;
+    std::vector<unsigned int> threads;
+    std::vector<std::pair<std::string, std::string>> params;
+    bool list = false;
+    bool mask = false;
+    bool counters = false;
+    // regression checks
+    std::string reference;
+    std::string updateReference;
+    double maxError = 0.;
+    double meanError = 0.;
+    std::string baseline;
+    double slack = 10.;
+    bool update = false;
+  };
+
+  void Usage()
+  {
+    fprintf(stderr,
+            "usage: zokzirbench PLUGIN.ofx [options]\n"
+            "  --list                 list the effects in the binary\n"
+            "  --plugin ID|N          effect to run, by identifier or index (default the first)\n"
+            "  --context filter|general\n"
+            "  --size WxH             size of the synthetic frame (default 1920x1080)\n"
+            "  --input FILE           PPM or PFM frame to render instead\n"
+            "  --output FILE          write the last render as PPM or PFM\n"
+            "  --depth byte|short|half|float (default float)\n"
+            "  --components rgba|rgb|alpha (default rgba)\n"
+            "  --scale S              render scale (default 1)\n"
+            "  --param NAME=V[,V...]  set a parameter, may be repeated\n"
+            "  --frames N             timed renders per thread count (default 10)\n"
+            "  --warmup N             untimed renders first (default 2)\n"
+            "  --threads N[,N...]     thread counts to time (default 1, 2, 4 ... up to every core)\n"
+            "  --mask                 connect the Mask clip to a ramp, general context only\n"
+            "  --counters             read the hardware performance counters, Linux only,\n"
+            "                         as does setting ZOKZIR_PERF_COUNTERS\n"
+            "regression checks, failing with exit status 2, or 77 with no reference to check:\n"
+            "  --reference FILE       compare the last render with a stored one\n"
+            "  --update-reference FILE\n"
+            "                         where --update writes the reference, so the stored one\n"
+            "                         can stay read only (default the --reference FILE)\n"
+            "  --tolerance MAX[,MEAN] largest and mean difference allowed from it (default 0)\n"
+            "  --baseline FILE        compare the best time at the last thread count with a stored one,\n"
+            "                         which is written on the first run\n"
+            "  --slack PERCENT        how much slower than the baseline is allowed (default 10)\n"
+            "  --update               write the reference and baseline instead of checking them,\n"
+            "                         as does setting ZOKZIR_REGRESS_UPDATE\n");
+  }
+
+  bool ParseOptions(int argc, char **argv, Options &options)
+  {
+    for(int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+      bool takesValue = arg != "--list" && arg != "--mask" && arg != "--counters" && arg != "--update" && arg.compare(0, 2, "--") == 0;
+      if(takesValue && !value) {
+        fprintf(stderr, "%s needs a value\n", arg.c_str());
+        return false;
+      }
+
+      if(arg == "--list") {
+        options.list = true;
+      }
+      else if(arg == "--mask") {
+        options.mask = true;
+      }
+      else if(arg == "--counters") {
+        options.counters = true;
+      }
+      else if(arg == "--update") {
+        options.update = true;
+      }
+      else if(arg == "--reference") {
+        options.reference = value;
+      }
+      else if(arg == "--update-reference") {
+        options.updateReference = value;
+      }
+      else if(arg == "--tolerance") {
+        if(sscanf(value, "%lf,%lf", &options.maxError, &options.meanError) < 1) {
+          fprintf(stderr, "bad tolerance %s\n", value);
+          return false;
+        }
+        // without a mean budget the largest difference bounds it
+        if(!strchr(value, ','))
+          options.meanError = options.maxError;
+      }
+      else if(arg == "--baseline") {
+        options.baseline = value;
+      }
+      else if(arg == "--slack") {
+        options.slack = atof(value);
+      }
+      else if(arg == "--plugin") {
+        options.plugin = value;
+      }
+      else if(arg == "--context") {
+        options.context = strcmp(value, "general") == 0 ? kOfxImageEffectContextGeneral : kOfxImageEffectContextFilter;
+      }
+      else if(arg == "--size") {
+        if(sscanf(value, "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0) {
+          fprintf(stderr, "bad size %s\n", value);
+          return false;
+        }
+      }
+      else if(arg == "--input") {
+        options.input = value;
+      }
+      else if(arg == "--output") {
+        options.output = value;
+      }
+      else if(arg == "--depth") {
+        std::string depth = value;
+        gFormat.depth = depth == "byte" ? kOfxBitDepthByte : depth == "short" ? kOfxBitDepthShort : depth == "half" ? kOfxBitDepthHalf : kOfxBitDepthFloat;
+        gFormat.bytesPerComponent = depth == "byte" ? 1 : (depth == "short" || depth == "half") ? 2 : 4;
+      }
+      else if(arg == "--components") {
+        std::string components = value;
+        gFormat.components = components == "alpha" ? kOfxImageComponentAlpha : components == "rgb" ? kOfxImageComponentRGB : kOfxImageComponentRGBA;
+        gFormat.nComponents = components == "alpha" ? 1 : components == "rgb" ? 3 : 4;
+      }
+      else if(arg == "--scale") {
+        options.renderScale = atof(value);
+        if(options.renderScale <= 0. || options.renderScale > 1.) {
+          fprintf(stderr, "render scale must be in (0, 1]\n");
+          return false;
+        }
+      }
+      else if(arg == "--param") {
+        const char *equals = strchr(value, '=');
+        if(!equals) {
+          fprintf(stderr, "bad parameter %s, want NAME=VALUE\n", value);
+          return false;
+        }
+        options.params.push_back(std::make_pair(std::string(value, equals), std::string(equals + 1)));
+      }
+      else if(arg == "--frames") {
+        options.frames = std::max(1, atoi(value));
+      }
+      else if(arg == "--warmup") {
+        options.warmup = std::max(0, atoi(value));
+      }
+      else if(arg == "--threads") {
+        for(const char *p = value; *p; ) {
+          int n = atoi(p);
+          if(n > 0) options.threads.push_back(n);
+          p = strchr(p, ',');
+          if(!p) break;
+          p++;
+        }
+      }
+      else if(arg.compare(0, 2, "--") == 0) {
+        fprintf(stderr, "unknown option %s\n", arg.c_str());
+        return false;
+      }
+      else if(options.binary.empty()) {
+        options.binary = arg;
+        continue;
+      }
+      else {
+        fprintf(stderr, "unexpected argument %s\n", arg.c_str());
+        return false;
+      }
+      if(takesValue) i++;
+    }
+
+    if(options.threads.empty()) {
+      unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+      for(unsigned int n = 1; n < cores; n *= 2) options.threads.push_back(n);
+      options.threads.push_back(cores);
+    }
+    const char *update = getenv("ZOKZIR_REGRESS_UPDATE");
+    if(update && *update && strcmp(update, "0") != 0)
+      options.update = true;
+    if(Zokzir::PerfCountersEnabled())
+      options.counters = true;
+    return !options.binary.empty();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // The hardware counters report, a row of counts per call, - for a counter that
+  // couldn't be read
+
+  void PrintCountsHeader(const char *title)
+  {
+    printf("\n%-44s %10s %10s %6s %10s %10s %10s\n", title, "Mcycles", "Minstr", "IPC", "LLC miss", "dTLB miss", "br miss");
+  }
+
+  void PrintCounts(const std::string &label, const Zokzir::PerfCounts &counts, double calls)
+  {
+    printf("%-44s", label.c_str());
+    for(int i = 0; i < Zokzir::ePerfCounterCount; i++) {
+      double scale = i <= Zokzir::ePerfInstructions ? 1e-6 : 1.;
+      if(!counts.has(i))
+        printf(" %10s", "-");
+      else
+        printf(" %10.4g", double(counts.value[i]) * scale / calls);
+      if(i == Zokzir::ePerfInstructions) {
+        if(counts.has(Zokzir::ePerfCycles) && counts.has(Zokzir::ePerfInstructions) && counts.value[Zokzir::ePerfCycles])
+          printf(" %6.2f", double(counts.value[Zokzir::ePerfInstructions]) / double(counts.value[Zokzir::ePerfCycles]));
+        else
+          printf(" %6s", "-");
+      }
+    }
+    printf("\n");
+  }
+
+  // set a parameter from the command line text of its value
+  bool SetParam(Effect &instance, const std::string &name, const std::string &text)
+  {
+    Param *param = instance.params.find(name.c_str());
+    if(!param) {
+      fprintf(stderr, "the effect has no parameter %s\n", name.c_str());
+      return false;
+    }
+    if(param->isString()) {
+      param->string = text;
+      return true;
+    }
+    if(param->value.empty()) {
+      fprintf(stderr, "parameter %s has no value to set\n", name.c_str());
+      return false;
+    }
+
+    // a choice may be given by its label
+    if(param->type == kOfxParamTypeChoice) {
+      int options = param->props.dimension(kOfxParamPropChoiceOption);
+      for(int i = 0; i < options; i++) {
+        if(param->props.getString(kOfxParamPropChoiceOption, i) == text) {
+          param->value[0] = i;
+          return true;
+        }
+      }
+    }
+
+    size_t start = 0;
+    for(double &v : param->value) {
+      std::string part = text.substr(start, text.find(',', start) - start);
+      v = part == "true" ? 1. : part == "false" ? 0. : atof(part.c_str());
+      if(param->isInt()) v = floor(v + 0.5);
+      start = text.find(',', start);
+      if(start == std::string::npos) break;
+      start++;
+    }
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the effect's side of a run
+
+  // copy a descriptor into a fresh effect, as the host does for each context and instance
+  void CopyEffect(const Effect &from, Effect &to, const char *type)
+  {
+    to.props = from.props;
+    to.props.setString(kOfxPropType, type);
+    to.clipOrder = from.clipOrder;
+    for(const std::string &name : from.clipOrder) {
+      to.clips[name].reset(new Clip(*from.clips.at(name)));
+    }
+    to.params.props = from.params.props;
+    to.params.order = from.params.order;
+    for(const std::string &name : from.params.order) {
+      to.params.params[name].reset(new Param(*from.params.params.at(name)));
+    }
+  }
+
+  // what the instance starts with on top of what the plugin described
+  void SetUpInstance(Effect &instance, const Options &options, int width, int height)
+  {
+    PropertySet &p = instance.props;
+    p.setString(kOfxImageEffectPropContext, options.context);
+    p.setInts(kOfxPropIsInteractive, {0});
+    p.setDoubles(kOfxImageEffectPropProjectSize, {double(width), double(height)});
+    p.setDoubles(kOfxImageEffectPropProjectExtent, {double(width), double(height)});
+    p.setDoubles(kOfxImageEffectPropProjectOffset, {0., 0.});
+    p.setDoubles(kOfxImageEffectPropProjectPixelAspectRatio, {1.});
+    p.setDoubles(kOfxImageEffectInstancePropEffectDuration, {1.});
+    p.setDoubles(kOfxImageEffectPropFrameRate, {24.});
+    p.setPointer(kOfxPropInstanceData, NULL);
+
+    for(const std::string &name : instance.params.order) {
+      Param &param = *instance.params.params[name];
+      param.props.setString(kOfxPropType, kOfxTypeParameterInstance);
+      int dimension = ParamDimension(param.type);
+      if(param.isString()) {
+        param.string = param.props.getString(kOfxParamPropDefault);
+      }
+      else if(dimension > 0) {
+        param.value.resize(dimension);
+        for(int i = 0; i < dimension; i++)
+          param.value[i] = param.props.getDouble(kOfxParamPropDefault, i);
+      }
+    }
+
+    const char *premult = gFormat.nComponents == 4 ? kOfxImagePreMultiplied : kOfxImageOpaque;
+    for(const std::string &name : instance.clipOrder) {
+      Clip &clip = *instance.clips[name];
+      PropertySet &c = clip.props;
+      bool mask = c.getDouble(kOfxImageClipPropIsMask) != 0.;
+      bool connected = name == kOfxImageEffectOutputClipName || name == kOfxImageEffectSimpleSourceClipName || (mask && options.mask);
+      std::string components = mask ? kOfxImageComponentAlpha : gFormat.components;
+      c.setInts(kOfxImageClipPropConnected, {connected ? 1 : 0});
+      c.setString(kOfxImageEffectPropPixelDepth, connected ? gFormat.depth : kOfxBitDepthNone);
+      c.setString(kOfxImageEffectPropComponents, connected ? components : kOfxImageComponentNone);
+      c.setString(kOfxImageClipPropUnmappedPixelDepth, connected ? gFormat.depth : kOfxBitDepthNone);
+      c.setString(kOfxImageClipPropUnmappedComponents, connected ? components : kOfxImageComponentNone);
+      c.setString(kOfxImageEffectPropPreMultiplication, mask ? kOfxImageOpaque : premult);
+      c.setDoubles(kOfxImagePropPixelAspectRatio, {1.});
+      c.setDoubles(kOfxImageEffectPropFrameRate, {24.});
+      c.setDoubles(kOfxImageEffectPropFrameRange, {0., 0.});
+      c.setDoubles(kOfxImageEffectPropUnmappedFrameRate, {24.});
+      c.setDoubles(kOfxImageEffectPropUnmappedFrameRange, {0., 0.});
+      c.setString(kOfxImageClipPropFieldOrder, kOfxImageFieldNone);
+      c.setInts(kOfxImageClipPropContinuousSamples, {0});
+    }
+  }
+
+  void SetRenderScale(PropertySet &args, double scale)
+  {
+    args.setDoubles(kOfxImageEffectPropRenderScale, {scale, scale});
+  }
+
+} // end of anonymous namespace
+
+int main(int argc, char **argv)
+{
+  Options options;
+  if(!ParseOptions(argc, argv, options)) {
+    Usage();
+    return 1;
+  }
+
+  // the effect reads the setting when it is loaded
+  if(options.counters) {
+#if defined(_WIN32)
+    _putenv_s("ZOKZIR_PERF_COUNTERS", "1");
+#else
+    setenv("ZOKZIR_PERF_COUNTERS", "1", 1);
+#endif
+    Zokzir::PerfCountersEnable(true);
+  }
+
+  std::vector<OfxPlugin *> plugins;
+  if(!LoadBinary(options.binary.c_str(), plugins))
+    return 1;
+
+  if(options.list) {
+    for(size_t i = 0; i < plugins.size(); i++)
+      printf("%zu %s %u.%u\n", i, plugins[i]->pluginIdentifier, plugins[i]->pluginVersionMajor, plugins[i]->pluginVersionMinor);
+    return 0;
+  }
+
+  // pick the effect by identifier or index
+  OfxPlugin *plugin = NULL;
+  for(size_t i = 0; i < plugins.size() && !plugin; i++) {
+    if(options.plugin.empty() || options.plugin == plugins[i]->pluginIdentifier || options.plugin == std::to_string(i))
+      plugin = plugins[i];
+  }
+  if(!plugin) {
+    fprintf(stderr, "no effect %s in %s\n", options.plugin.c_str(), options.binary.c_str());
+    return 1;
+  }
+
+  // the frame the effect is given, and the one it renders into
+  FloatFrame full, scaled;
+  if(options.input.empty()) {
+    SyntheticFrame(options.width, options.height, full);
+  }
+  else if(!ReadFrame(options.input.c_str(), full)) {
+    fprintf(stderr, "could not read %s, only binary PPM and PFM are understood\n", options.input.c_str());
+    return 1;
+  }
+  ScaleFrame(full, options.renderScale, scaled);
+
+  Frame source, output, mask;
+  PackFrame(scaled, gFormat, source);
+  output.width = source.width;
+  output.height = source.height;
+  output.rowBytes = source.rowBytes;
+  output.format = gFormat;
+  output.data.assign(source.data.size(), 0);
+  if(options.mask) {
+    FloatFrame ramp;
+    MaskFrame(scaled.width, scaled.height, ramp);
+    PixelFormat alpha = gFormat;
+    alpha.components = kOfxImageComponentAlpha;
+    alpha.nComponents = 1;
+    PackFrame(ramp, alpha, mask);
+  }
+
+  // boot the plugin
+  DescribeHost();
+  gPool.resize(options.threads.back());
+  plugin->setHost(&gHost);
+  OfxStatus status = CallAction(plugin, kOfxActionLoad, NULL, NULL, NULL);
+  if(status != kOfxStatOK && status != kOfxStatReplyDefault)
+    return 1;
+
+  Effect descriptor;
+  descriptor.props.setString(kOfxPropType, kOfxTypeImageEffect);
+  descriptor.props.setString(kOfxPluginPropFilePath, BundlePath(options.binary));
+  status = CallAction(plugin, kOfxActionDescribe, &descriptor, NULL, NULL);
+  if(status != kOfxStatOK && status != kOfxStatReplyDefault)
+    return 1;
+
+  Effect contextDescriptor;
+  CopyEffect(descriptor, contextDescriptor, kOfxTypeImageEffect);
+  {
+    PropertySet inArgs;
+    inArgs.setString(kOfxImageEffectPropContext, options.context);
+    status = CallAction(plugin, kOfxImageEffectActionDescribeInContext, &contextDescriptor, &inArgs, NULL);
+    if(status != kOfxStatOK && status != kOfxStatReplyDefault)
+      return 1;
+  }
+
+  Effect instance;
+  CopyEffect(contextDescriptor, instance, kOfxTypeImageEffectInstance);
+  SetUpInstance(instance, options, full.width, full.height);
+  for(const std::string &name : instance.clipOrder) {
+    Clip &clip = *instance.clips[name];
+    clip.renderScale = options.renderScale;
+    if(name == kOfxImageEffectSimpleSourceClipName)
+      clip.frame = &source;
+    else if(name == kOfxImageEffectOutputClipName)
+      clip.frame = &output;
+    else if(options.mask && clip.props.getDouble(kOfxImageClipPropIsMask) != 0.)
+      clip.frame = &mask;
+  }
+  if(options.mask && !std::any_of(instance.clipOrder.begin(), instance.clipOrder.end(),
+                                  [&](const std::string &name) {return instance.clips[name]->frame == &mask;})) {
+    fprintf(stderr, "the effect has no mask clip in the %s context\n", options.context.c_str());
+    return 1;
+  }
+
+  status = CallAction(plugin, kOfxActionCreateInstance, &instance, NULL, NULL);
+  if(status != kOfxStatOK && status != kOfxStatReplyDefault)
+    return 1;
+
+  // the parameters asked for, told to the instance as a user edit
+  if(!options.params.empty()) {
+    PropertySet changeArgs;
+    changeArgs.setString(kOfxPropChangeReason, kOfxChangeUserEdited);
+    CallAction(plugin, kOfxActionBeginInstanceChanged, &instance, &changeArgs, NULL);
+    for(const std::pair<std::string, std::string> &param : options.params) {
+      if(!SetParam(instance, param.first, param.second))
+        return 1;
+      PropertySet inArgs;
+      inArgs.setString(kOfxPropType, kOfxTypeParameter);
+      inArgs.setString(kOfxPropName, param.first);
+      inArgs.setString(kOfxPropChangeReason, kOfxChangeUserEdited);
+      inArgs.setDoubles(kOfxPropTime, {0.});
+      SetRenderScale(inArgs, options.renderScale);
+      CallAction(plugin, kOfxActionInstanceChanged, &instance, &inArgs, NULL);
+    }
+    CallAction(plugin, kOfxActionEndInstanceChanged, &instance, &changeArgs, NULL);
+  }
+
+  // the actions a host sends before it renders
+  const int renderWindow[4] = {0, 0, output.width, output.height};
+  {
+    PropertySet outArgs;
+    for(const std::string &name : instance.clipOrder) {
+      bool isMask = instance.clips[name]->props.getDouble(kOfxImageClipPropIsMask) != 0.;
+      outArgs.setString(("OfxImageClipPropComponents_" + name).c_str(), isMask ? kOfxImageComponentAlpha : gFormat.components);
+      outArgs.setString(("OfxImageClipPropDepth_" + name).c_str(), gFormat.depth);
+      outArgs.setDoubles(("OfxImageClipPropPAR_" + name).c_str(), {1.});
+    }
+    outArgs.setDoubles(kOfxImageEffectPropFrameRate, {24.});
+    outArgs.setString(kOfxImageClipPropFieldOrder, kOfxImageFieldNone);
+    outArgs.setString(kOfxImageEffectPropPreMultiplication, instance.clips.begin()->second->props.getString(kOfxImageEffectPropPreMultiplication));
+    outArgs.setInts(kOfxImageClipPropContinuousSamples, {0});
+    outArgs.setInts(kOfxImageEffectFrameVarying, {0});
+    CallAction(plugin, kOfxImageEffectActionGetClipPreferences, &instance, NULL, &outArgs);
+  }
+  {
+    PropertySet inArgs, outArgs;
+    inArgs.setDoubles(kOfxPropTime, {0.});
+    SetRenderScale(inArgs, options.renderScale);
+    outArgs.setDoubles(kOfxImageEffectPropRegionOfDefinition, {0., 0., double(full.width), double(full.height)});
+    CallAction(plugin, kOfxImageEffectActionGetRegionOfDefinition, &instance, &inArgs, &outArgs);
+
+    inArgs.setDoubles(kOfxImageEffectPropRegionOfInterest, {0., 0., double(full.width), double(full.height)});
+    for(const std::string &name : instance.clipOrder) {
+      if(name != kOfxImageEffectOutputClipName)
+        outArgs.setDoubles((kOfxImageClipPropRoI + name).c_str(), {0., 0., double(full.width), double(full.height)});
+    }
+    CallAction(plugin, kOfxImageEffectActionGetRegionsOfInterest, &instance, &inArgs, &outArgs);
+  }
+  {
+    PropertySet inArgs, outArgs;
+    inArgs.setDoubles(kOfxPropTime, {0.});
+    inArgs.setString(kOfxImageEffectPropFieldToRender, kOfxImageFieldNone);
+    inArgs.setInts(kOfxImageEffectPropRenderWindow, {renderWindow[0], renderWindow[1], renderWindow[2], renderWindow[3]});
+    SetRenderScale(inArgs, options.renderScale);
+    outArgs.setString(kOfxPropName, "");
+    outArgs.setDoubles(kOfxPropTime, {0.});
+    if(CallAction(plugin, kOfxImageEffectActionIsIdentity, &instance, &inArgs, &outArgs) == kOfxStatReplyYes)
+      fprintf(stderr, "the effect is an identity with these parameters, a host would not render it\n");
+  }
+
+  // render at every thread count
+  PropertySet sequenceArgs;
+  sequenceArgs.setDoubles(kOfxImageEffectPropFrameRange, {0., 0.});
+  sequenceArgs.setDoubles(kOfxImageEffectPropFrameStep, {1.});
+  sequenceArgs.setInts(kOfxPropIsInteractive, {0});
+  sequenceArgs.setInts(kOfxImageEffectPropSequentialRenderStatus, {0});
+  sequenceArgs.setInts(kOfxImageEffectPropInteractiveRenderStatus, {0});
+  sequenceArgs.setInts(kOfxImageEffectPropRenderQualityDraft, {0});
+  SetRenderScale(sequenceArgs, options.renderScale);
+  CallAction(plugin, kOfxImageEffectActionBeginSequenceRender, &instance, &sequenceArgs, NULL);
+
+  PropertySet renderArgs;
+  renderArgs.setDoubles(kOfxPropTime, {0.});
+  renderArgs.setString(kOfxImageEffectPropFieldToRender, kOfxImageFieldNone);
+  renderArgs.setInts(kOfxImageEffectPropRenderWindow, {renderWindow[0], renderWindow[1], renderWindow[2], renderWindow[3]});
+  renderArgs.setInts(kOfxImageEffectPropSequentialRenderStatus, {0});
+  renderArgs.setInts(kOfxImageEffectPropInteractiveRenderStatus, {0});
+  renderArgs.setInts(kOfxImageEffectPropRenderQualityDraft, {0});
+  SetRenderScale(renderArgs, options.renderScale);
+
+  struct ScalingRow {
+    unsigned int threads;
+    double mean;
+    double best;
+  };
+  std::vector<ScalingRow> scaling;
+  // of the timed renders at the last thread count, by thread, the caller first
+  std::vector<Zokzir::PerfCounts> threadCounts;
+  const double megapixels = double(output.width) * output.height * 1e-6;
+
+  for(unsigned int threads : options.threads) {
+    gPool.resize(threads);
+    for(int i = 0; i < options.warmup; i++)
+      CallAction(plugin, kOfxImageEffectActionRender, &instance, &renderArgs, NULL);
+
+    gPool.resetPerf();
+    Zokzir::PerfCounts callerCounts;
+    double total = 0., best = 1e30;
+    for(int i = 0; i < options.frames; i++) {
+      Zokzir::PerfScope perf;
+      Clock::time_point start = Clock::now();
+      status = CallAction(plugin, kOfxImageEffectActionRender, &instance, &renderArgs, NULL);
+      double seconds = Seconds(start);
+      callerCounts += perf.counts();
+      total += seconds;
+      best = std::min(best, seconds);
+      if(status != kOfxStatOK && status != kOfxStatReplyDefault)
+        return 1;
+    }
+    scaling.push_back(ScalingRow{threads, total / options.frames, best});
+    threadCounts = gPool.threadCounts();
+    threadCounts[0] = callerCounts;
+  }
+
+  CallAction(plugin, kOfxImageEffectActionEndSequenceRender, &instance, &sequenceArgs, NULL);
+  // as a host does before saving, which is when the effect updates its readout
+  CallAction(plugin, kOfxActionSyncPrivateData, &instance, NULL, NULL);
+
+  if(!options.output.empty()) {
+    FloatFrame rendered;
+    UnpackFrame(output, rendered);
+    if(!WriteFrame(options.output.c_str(), rendered))
+      fprintf(stderr, "could not write %s\n", options.output.c_str());
+  }
+
+  // what the effect predicted, if it says, see zokzircost.h
+  Param *costEstimate = instance.params.find("costEstimate");
+  std::string estimated = costEstimate ? costEstimate->string : std::string();
+
+  // and the statistics it shows of its last render, see zokzirrenderstats.h
+  std::vector<std::pair<std::string, std::string>> statistics;
+  for(const std::string &name : instance.params.order) {
+    Param *param = instance.params.find(name.c_str());
+    if(name.compare(0, 5, "stats") == 0 && param->isString())
+      statistics.push_back(std::make_pair(param->props.getString(kOfxPropLabel), param->string));
+  }
+
+  CallAction(plugin, kOfxActionDestroyInstance, &instance, NULL, NULL);
+  CallAction(plugin, kOfxActionUnload, NULL, NULL, NULL);
+  gPool.resize(1);
+
+  // the report
+  printf("%s %u.%u, %s, %dx%d %s %s, render scale %g\n",
+         plugin->pluginIdentifier, plugin->pluginVersionMajor, plugin->pluginVersionMinor,
+         options.context.c_str(), output.width, output.height,
+         gFormat.depth.c_str(), gFormat.components.c_str(), options.renderScale);
+  if(gImagesOut != 0)
+    printf("warning: %d images were not released\n", (int) gImagesOut);
+
+  printf("\n%-44s %6s %10s %10s %10s\n", "action", "calls", "mean ms", "min ms", "max ms");
+  for(const std::string &action : gActionOrder) {
+    const ActionStats &stats = gActionStats[action];
+    printf("%-44s %6d %10.3f %10.3f %10.3f\n", action.c_str(), stats.calls,
+           1e3 * stats.total / stats.calls, 1e3 * stats.min, 1e3 * stats.max);
+  }
+
+  if(options.counters) {
+    bool available = false;
+    for(const std::string &action : gActionOrder)
+      available = available || gActionStats[action].counts.available;
+    if(!available) {
+      printf("\nhardware counters unavailable, this system or its perf_event_paranoid setting won't give them\n");
+    }
+    else {
+      PrintCountsHeader("action, per call over every thread");
+      for(const std::string &action : gActionOrder) {
+        const ActionStats &stats = gActionStats[action];
+        PrintCounts(action, stats.counts, stats.calls);
+      }
+
+      char title[64];
+      snprintf(title, sizeof(title), "thread, per render at %u threads", options.threads.back());
+      PrintCountsHeader(title);
+      for(size_t i = 0; i < threadCounts.size(); i++)
+        PrintCounts(i == 0 ? std::string("0, the caller") : std::to_string(i), threadCounts[i], options.frames);
+    }
+  }
+
+  // speedup and efficiency are relative to the first thread count timed
+  printf("\n%8s %10s %10s %10s %9s %11s\n", "threads", "Mpix/s", "best", "ms/frame", "speedup", "efficiency");
+  for(const ScalingRow &row : scaling) {
+    double speedup = scaling.front().mean / row.mean;
+    printf("%8u %10.1f %10.1f %10.3f %8.2fx %10.0f%%\n", row.threads,
+           megapixels / row.mean, megapixels / row.best, 1e3 * row.mean,
+           speedup, 100. * speedup * scaling.front().threads / row.threads);
+  }
+
+  // the prediction is for a full size frame, so compare it at render scale 1
+  if(!estimated.empty()) {
+    printf("\nestimated cost %s, took %.3g CPU s on %u thread%s\n", estimated.c_str(),
+           scaling.front().best * scaling.front().threads, scaling.front().threads,
+           scaling.front().threads == 1 ? "" : "s");
+  }
+  if(!statistics.empty()) {
+    printf("\nthe effect's statistics, of the last render\n");
+    for(const std::pair<std::string, std::string> &stat : statistics)
+      printf("  %-16s %s\n", stat.first.c_str(), stat.second.c_str());
+  }
+
+  // the regression checks, a case with no reference yet is skipped rather
+  // than failed, a checkout has none for effects that couldn't be built
+  bool passed = true, skipped = false;
+  if(!options.reference.empty()) {
+    Frame reference;
+    FrameError error;
+    if(options.update) {
+      const std::string &path = options.updateReference.empty() ? options.reference : options.updateReference;
+      if(!WriteReference(path.c_str(), output)) {
+        fprintf(stderr, "could not write %s\n", path.c_str());
+        return 1;
+      }
+      printf("\nreference %s written\n", path.c_str());
+    }
+    else if(!ReadReference(options.reference.c_str(), reference)) {
+      printf("\nSKIP no reference %s, run with --update to make it\n", options.reference.c_str());
+      skipped = true;
+    }
+    else if(!CompareFrames(output, reference, error)) {
+      printf("\nFAIL the reference is %dx%d %s %s, the render %dx%d %s %s\n",
+             reference.width, reference.height, reference.format.depth.c_str(), reference.format.components.c_str(),
+             output.width, output.height, output.format.depth.c_str(), output.format.components.c_str());
+      passed = false;
+    }
+    else {
+      bool ok = error.max <= options.maxError && error.mean <= options.meanError;
+      printf("\n%s reference: max error %g (allowed %g), mean error %g (allowed %g), %zu components differ\n",
+             ok ? "ok" : "FAIL", error.max, options.maxError, error.mean, options.meanError, error.differing);
+      passed = passed && ok;
+    }
+  }
+
+  if(!options.baseline.empty()) {
+    double best = 1e3 * scaling.back().best;
+    double stored = 0.;
+    FILE *f = options.update ? NULL : fopen(options.baseline.c_str(), "r");
+    if(f) {
+      char line[512];
+      while(fgets(line, sizeof(line), f) && (line[0] == '#' || sscanf(line, "%lf", &stored) != 1)) {}
+      fclose(f);
+    }
+    if(stored > 0.) {
+      double limit = stored * (1. + options.slack / 100.);
+      bool ok = best <= limit;
+      printf("%s timing: best %.3f ms/frame at %u threads, baseline %.3f, allowed %.3f\n",
+             ok ? "ok" : "FAIL", best, scaling.back().threads, stored, limit);
+      passed = passed && ok;
+    }
+    else {
+      // the first run on a machine sets its baseline
+      f = fopen(options.baseline.c_str(), "w");
+      if(!f) {
+        fprintf(stderr, "could not write %s\n", options.baseline.c_str());
+        return 1;
+      }
+      fprintf(f, "# best ms/frame of %s %dx%d %s %s at %u threads\n%.6f\n", plugin->pluginIdentifier,
+              output.width, output.height, gFormat.depth.c_str(), gFormat.components.c_str(), scaling.back().threads, best);
+      fclose(f);
+      printf("baseline %s written, %.3f ms/frame\n", options.baseline.c_str(), best);
+    }
+  }
+  return !passed ? 2 : skipped ? 77 : 0;
+}
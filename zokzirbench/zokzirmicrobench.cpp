@@ -0,0 +1,278 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Microbenchmark of the innermost helpers of the Zokzir effects.
+
+It times the Droste complex arithmetic and compositing, and the Saturation
+per pixel kernels, on their own with no host and no images. The Saturation
+row kernel is timed at every CPU level up to this machine's. Each one runs
+over an array of inputs drawn the way a render would draw them, small
+enough to stay in cache, until the time per test is used up. The best of a
+few repeats is reported as ns per operation and millions of operations a
+second, an operation being one call or one pixel.
+
+  zokzirmicrobench [--time SECONDS] [NAME...]
+
+Only the tests whose names contain one of the NAMEs run, all of them if
+none are given.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "zokzircpu.h"
+#include "zokzirhalf.h"
+#include "zokzirdrostemath.h"
+#include "zokzirsaturationkernels.h"
+
+namespace {
+
+  // number of inputs each test runs over, a few hundred KB at most
+  const int kCount = 4096;
+
+  double gSecondsPerTest = 0.2;
+  std::vector<std::string> gFilters;
+
+  // results are folded in here so the compiler can't drop the work
+  volatile double gSink = 0;
+
+  typedef std::chrono::steady_clock Clock;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run pass, which does ops operations, until the time is up and print the best
+  // of five repeats
+  void Bench(const char *name, int ops, const std::function<double()> &pass)
+  {
+    bool wanted = gFilters.empty();
+    for(const std::string &filter : gFilters)
+      wanted = wanted || strstr(name, filter.c_str()) != NULL;
+    if(!wanted)
+      return;
+
+    // find how many passes fill a fifth of the time
+    long passes = 1;
+    for(;;) {
+      Clock::time_point start = Clock::now();
+      for(long i = 0; i < passes; i++) gSink = gSink + pass();
+      double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+      if(seconds > gSecondsPerTest / 50 || passes > (1L << 30)) {
+        passes = std::max(1L, long(passes * (gSecondsPerTest / 5) / std::max(seconds, 1e-9)));
+        break;
+      }
+      passes *= 2;
+    }
+
+    double best = 1e30;
+    for(int repeat = 0; repeat < 5; repeat++) {
+      Clock::time_point start = Clock::now();
+      for(long i = 0; i < passes; i++) gSink = gSink + pass();
+      best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+
+    double ns = 1e9 * best / (double(passes) * ops);
+    printf("%-40s %10.3f %12.1f\n", name, ns, 1e3 / ns);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the Droste helpers
+
+  void BenchDroste(std::mt19937 &random)
+  {
+    std::uniform_real_distribution<double> unit(-1., 1.);
+    std::uniform_real_distribution<double> logRadius(-4., 1.);
+    std::uniform_real_distribution<double> angle(-M_PI, M_PI);
+
+    // points of the frame around the centre, kept off the pole at zero
+    std::vector<OfxPointD> points(kCount), others(kCount), logPolar(kCount), out(kCount);
+    for(int i = 0; i < kCount; i++) {
+      do {
+        points[i] = OfxPointD{unit(random), unit(random)};
+        others[i] = OfxPointD{unit(random), unit(random)};
+      } while(points[i].x * points[i].x + points[i].y * points[i].y < 1e-6 ||
+              others[i].x * others[i].x + others[i].y * others[i].y < 1e-6);
+      // what cExp sees, the log of a radius and an angle
+      logPolar[i] = OfxPointD{logRadius(random), angle(random)};
+    }
+
+    // pass over the results so every output is used
+    auto consume = [&]() {
+      double sum = 0;
+      for(int i = 0; i < kCount; i++) sum += out[i].x + out[i].y;
+      return sum;
+    };
+
+    Bench("droste cExp", kCount, [&]() {
+      for(int i = 0; i < kCount; i++) out[i] = cExp(logPolar[i]);
+      return consume();
+    });
+    Bench("droste cLog", kCount, [&]() {
+      for(int i = 0; i < kCount; i++) out[i] = cLog(points[i]);
+      return consume();
+    });
+    Bench("droste cRec", kCount, [&]() {
+      for(int i = 0; i < kCount; i++) out[i] = cRec(points[i]);
+      return consume();
+    });
+    Bench("droste cMul", kCount, [&]() {
+      for(int i = 0; i < kCount; i++) out[i] = cMul(points[i], others[i]);
+      return consume();
+    });
+    Bench("droste cDiv", kCount, [&]() {
+      for(int i = 0; i < kCount; i++) out[i] = cDiv(points[i], others[i]);
+      return consume();
+    });
+    // the whole warp of a sample, log, rotate and scale, exp
+    Bench("droste log-mul-exp", kCount, [&]() {
+      for(int i = 0; i < kCount; i++) out[i] = cExp(cMul(cLog(points[i]), others[i]));
+      return consume();
+    });
+
+    // compositing, with the source opaque, clear, and a mix of the two as at
+    // the edges of each generation
+    std::uniform_real_distribution<float> colour(0.f, 1.f);
+    std::vector<float> dst(kCount * 4), src(kCount * 4), comp(kCount * 4);
+    for(float &v : dst) v = colour(random);
+    for(float &v : src) v = colour(random);
+
+    const char *names[] = {"droste over, opaque", "droste over, clear", "droste over, mixed"};
+    for(int kind = 0; kind < 3; kind++) {
+      for(int i = 0; i < kCount; i++) {
+        float a = colour(random);
+        src[i * 4 + 3] = kind == 0 ? 1.f : kind == 1 ? 0.f : (a < 0.3f ? 0.f : a > 0.7f ? 1.f : a);
+      }
+      Bench(names[kind], kCount, [&]() {
+        for(int i = 0; i < kCount; i++) over(&dst[i * 4], &src[i * 4], &comp[i * 4]);
+        double sum = 0;
+        for(int i = 0; i < kCount * 4; i += 4) sum += comp[i] + comp[i + 3];
+        return sum;
+      });
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the Saturation kernels
+
+  // the row kernel compiled for each CPU level, as the effect dispatches it
+  template <class T, int MAX>
+  void ColourMatrixSSE2(const Zokzir::ColourMatrix &m, const T *src, T *dst, int n, int nComps)
+  {
+    Zokzir::ColourMatrixRow<T, MAX>(m, src, dst, n, nComps);
+  }
+
+  template <class T, int MAX>
+  ZOKZIR_TARGET_SSE42 void ColourMatrixSSE42(const Zokzir::ColourMatrix &m, const T *src, T *dst, int n, int nComps)
+  {
+    Zokzir::ColourMatrixRow<T, MAX>(m, src, dst, n, nComps);
+  }
+
+  template <class T, int MAX>
+  ZOKZIR_TARGET_AVX2 void ColourMatrixAVX2(const Zokzir::ColourMatrix &m, const T *src, T *dst, int n, int nComps)
+  {
+    Zokzir::ColourMatrixRow<T, MAX>(m, src, dst, n, nComps);
+  }
+
+  template <class T, int MAX>
+  ZOKZIR_TARGET_AVX512 void ColourMatrixAVX512(const Zokzir::ColourMatrix &m, const T *src, T *dst, int n, int nComps)
+  {
+    Zokzir::ColourMatrixRow<T, MAX>(m, src, dst, n, nComps);
+  }
+
+  // WIDE is the pixel type the AVX2 and AVX-512 kernels use, HalfF16C for half
+  template <class T, class WIDE, int MAX>
+  void BenchColourMatrix(const char *name, std::mt19937 &random, int nComps)
+  {
+    std::uniform_real_distribution<float> colour(0.f, 1.f);
+    std::vector<T> src(kCount * nComps), dst(kCount * nComps);
+    for(T &v : src) v = T(colour(random) * MAX);
+
+    Zokzir::ColourMatrix matrix = Zokzir::BuildColourMatrix(1.5, Zokzir::eLumaWeightsRec709, 1.1, 0.02, float(MAX));
+    const WIDE *wideSrc = (const WIDE *) src.data();
+    WIDE *wideDst = (WIDE *) dst.data();
+    for(int level = Zokzir::eCpuLevelSSE2; level <= Zokzir::CpuLevel(); level++) {
+      std::string title = std::string(name) + ", " + Zokzir::CpuLevelName(Zokzir::CpuLevelEnum(level));
+      Bench(title.c_str(), kCount, [&]() {
+        switch(level) {
+          case Zokzir::eCpuLevelAVX512 : ColourMatrixAVX512<WIDE, MAX>(matrix, wideSrc, wideDst, kCount, nComps); break;
+          case Zokzir::eCpuLevelAVX2 : ColourMatrixAVX2<WIDE, MAX>(matrix, wideSrc, wideDst, kCount, nComps); break;
+          case Zokzir::eCpuLevelSSE42 : ColourMatrixSSE42<T, MAX>(matrix, src.data(), dst.data(), kCount, nComps); break;
+          default : ColourMatrixSSE2<T, MAX>(matrix, src.data(), dst.data(), kCount, nComps); break;
+        }
+        return double(float(dst[0])) + float(dst[kCount * nComps - 1]);
+      });
+    }
+  }
+
+  void BenchSaturation(std::mt19937 &random)
+  {
+    BenchColourMatrix<unsigned char, unsigned char, 255>("saturation matrix, byte rgba", random, 4);
+    BenchColourMatrix<unsigned short, unsigned short, 65535>("saturation matrix, short rgba", random, 4);
+    BenchColourMatrix<Zokzir::Half, Zokzir::HalfF16C, 1>("saturation matrix, half rgba", random, 4);
+    BenchColourMatrix<float, float, 1>("saturation matrix, float rgba", random, 4);
+    BenchColourMatrix<float, float, 1>("saturation matrix, float rgb", random, 3);
+
+    std::uniform_real_distribution<float> colour(0.f, 1.f);
+    std::vector<float> planes(kCount * 3);
+    for(float &v : planes) v = colour(random);
+    const float *r = planes.data(), *g = r + kCount, *b = g + kCount;
+
+    Bench("saturation chroma sum, scalar", kCount, [&]() {
+      return Zokzir::SumChromaScalar(r, g, b, kCount);
+    });
+    Bench("saturation chroma sum, vector", kCount, [&]() {
+      return Zokzir::SumChroma(r, g, b, kCount);
+    });
+#ifdef ZOKZIR_X86
+    if(Zokzir::CpuLevel() >= Zokzir::eCpuLevelAVX2) {
+      Bench("saturation chroma sum, avx2", kCount, [&]() {
+        return Zokzir::SumChromaAVX2(r, g, b, kCount);
+      });
+    }
+#endif
+  }
+
+} // end of anonymous namespace
+
+int main(int argc, char **argv)
+{
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+      gSecondsPerTest = std::max(0.01, atof(argv[++i]));
+    }
+    else if(argv[i][0] == '-') {
+      fprintf(stderr, "usage: zokzirmicrobench [--time SECONDS] [NAME...]\n");
+      return 1;
+    }
+    else {
+      gFilters.push_back(argv[i]);
+    }
+  }
+
+#ifdef ZOKZIR_HAS_SSE2
+  const char *vector = "SSE2";
+#else
+  const char *vector = "none";
+#endif
+#ifdef ZOKZIR_HAS_F16C
+  const char *half = "F16C";
+#else
+  const char *half = "software";
+#endif
+  printf("vector instructions %s, half conversion %s, cpu level %s, %d inputs a pass\n\n",
+         vector, half, Zokzir::CpuLevelName(Zokzir::CpuLevel()), kCount);
+  printf("%-40s %10s %12s\n", "test", "ns/op", "Mop/s");
+
+  // the same inputs every run
+  std::mt19937 random(2024);
+  BenchDroste(random);
+  BenchSaturation(random);
+  return 0;
+}
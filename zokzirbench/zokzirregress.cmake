@@ -0,0 +1,140 @@
+# Golden image and timing regression tests, run through zokzirbench.
+#
+# Every case renders a small frame and compares it with its reference in
+# ZOKZIR_GOLDEN_DIR, within the error budget of its path (label golden), and
+# renders a large one and compares the best time with this machine's baseline
+# in ZOKZIR_BASELINE_DIR (label perf). A machine's first perf run records its
+# baselines. A case with no reference is skipped.
+#
+# The references are checked in under golden and only read. To accept new
+# pixels or timings on purpose, build the zokzir-regress-update target, or run
+# ctest with ZOKZIR_REGRESS_UPDATE=1, which writes the references to
+# ZOKZIR_GOLDEN_UPDATE_DIR in the build tree, and copy the ones to keep into
+# golden.
+#
+# The effects are found through ZOKZIR_SATURATION_OFX and ZOKZIR_DROSTE_OFX,
+# the cases of an effect that isn't set are left out.
+
+set(ZOKZIR_SATURATION_OFX "" CACHE FILEPATH "ZokzirSaturation.ofx binary to test")
+set(ZOKZIR_DROSTE_OFX "" CACHE FILEPATH "ZokzirDroste.ofx binary to test")
+set(ZOKZIR_GOLDEN_DIR ${CMAKE_CURRENT_SOURCE_DIR}/golden CACHE PATH "Where the reference renders are read from")
+set(ZOKZIR_GOLDEN_UPDATE_DIR ${CMAKE_BINARY_DIR}/golden CACHE PATH "Where an update writes the reference renders")
+cmake_host_system_information(RESULT ZOKZIR_HOST_NAME QUERY HOSTNAME)
+cmake_host_system_information(RESULT ZOKZIR_HOST_CORES QUERY NUMBER_OF_LOGICAL_CORES)
+set(ZOKZIR_BASELINE_DIR ${CMAKE_BINARY_DIR}/baselines/${ZOKZIR_HOST_NAME} CACHE PATH "Where this machine's timings are kept")
+set(ZOKZIR_PERF_SIZE 1920x1080 CACHE STRING "Frame size of the timing tests")
+set(ZOKZIR_PERF_SLACK 10 CACHE STRING "Percent slower than the baseline a timing test allows")
+
+# Error budgets, in the normalised units of the depth. The integer depths
+# allow one code value for rounding, half a couple of its steps near one and
+# float a few ulps, so a change of operation order passes and a wrong pixel
+# doesn't.
+set(ZOKZIR_TOLERANCE_byte 0.0040,0.0005)
+set(ZOKZIR_TOLERANCE_short 0.000016,0.000002)
+set(ZOKZIR_TOLERANCE_half 0.002,0.0002)
+set(ZOKZIR_TOLERANCE_float 0.00001,0.000001)
+
+# Paths that need more than their depth's budget, as ZOKZIR_TOLERANCE_PATH_DEPTH.
+# A mask blends most pixels part way and rounds each of them, so more of
+# them are a code value off. Droste's warp goes through log, exp and atan2,
+# whose last bits differ between maths libraries and CPU levels, and moves
+# a float sample by that much.
+set(ZOKZIR_TOLERANCE_saturation.mask_byte 0.0040,0.0010)
+set(ZOKZIR_TOLERANCE_droste_float 0.0001,0.000005)
+
+file(MAKE_DIRECTORY ${ZOKZIR_GOLDEN_UPDATE_DIR} ${ZOKZIR_BASELINE_DIR})
+
+# zokzir_regress(NAME BINARY DEPTH [PATH PATH] [TOLERANCE MAX[,MEAN]] [zokzirbench options...])
+#
+# The error budget is TOLERANCE if given, or else that of PATH at DEPTH, PATH
+# being the effect the name starts with unless given, or else that of DEPTH.
+function(zokzir_regress NAME BINARY DEPTH)
+  if(NOT BINARY)
+    return()
+  endif()
+  cmake_parse_arguments(CASE "" "PATH;TOLERANCE" "" ${ARGN})
+  if(NOT CASE_PATH)
+    string(REGEX REPLACE "\\..*" "" CASE_PATH ${NAME})
+  endif()
+  if(NOT CASE_TOLERANCE)
+    if(DEFINED ZOKZIR_TOLERANCE_${CASE_PATH}_${DEPTH})
+      set(CASE_TOLERANCE ${ZOKZIR_TOLERANCE_${CASE_PATH}_${DEPTH}})
+    else()
+      set(CASE_TOLERANCE ${ZOKZIR_TOLERANCE_${DEPTH}})
+    endif()
+  endif()
+
+  add_test(NAME golden.${NAME}
+           COMMAND zokzirbench ${BINARY} --depth ${DEPTH} ${CASE_UNPARSED_ARGUMENTS}
+                   --size 160x90 --frames 1 --warmup 0 --threads 1
+                   --reference ${ZOKZIR_GOLDEN_DIR}/${NAME}.zr --tolerance ${CASE_TOLERANCE}
+                   --update-reference ${ZOKZIR_GOLDEN_UPDATE_DIR}/${NAME}.zr)
+  # zokzirbench's status for a missing reference
+  set_tests_properties(golden.${NAME} PROPERTIES LABELS golden SKIP_RETURN_CODE 77)
+
+  # alone on the machine, so the other tests don't skew the timing
+  add_test(NAME perf.${NAME}
+           COMMAND zokzirbench ${BINARY} --depth ${DEPTH} ${CASE_UNPARSED_ARGUMENTS}
+                   --size ${ZOKZIR_PERF_SIZE} --frames 5 --warmup 1 --threads ${ZOKZIR_HOST_CORES}
+                   --baseline ${ZOKZIR_BASELINE_DIR}/${NAME}.txt --slack ${ZOKZIR_PERF_SLACK})
+  set_tests_properties(perf.${NAME} PROPERTIES LABELS perf RUN_SERIAL TRUE)
+endfunction()
+
+# Saturation, every depth and layout, with and without the mask, at full and
+# half render scale, and the automatic mode
+foreach(DEPTH byte short half float)
+  foreach(COMPONENTS rgba rgb)
+    zokzir_regress(saturation.${DEPTH}.${COMPONENTS} "${ZOKZIR_SATURATION_OFX}" ${DEPTH}
+                   --components ${COMPONENTS} --param saturation=1.6 --param gain=1.1 --param offset=0.02)
+  endforeach()
+  zokzir_regress(saturation.${DEPTH}.rgba.mask "${ZOKZIR_SATURATION_OFX}" ${DEPTH} PATH saturation.mask
+                 --context general --mask --param saturation=0.4 --param lumaWeights=1)
+  zokzir_regress(saturation.${DEPTH}.rgba.scale50 "${ZOKZIR_SATURATION_OFX}" ${DEPTH}
+                 --scale 0.5 --param saturation=1.6)
+endforeach()
+zokzir_regress(saturation.float.rgba.auto "${ZOKZIR_SATURATION_OFX}" float
+               --param auto=true --param targetChroma=0.3)
+
+# Droste, every depth and layout, both layerings, spin either way, a deep
+# and a shallow depth range, half render scale, the colour stage, adaptive
+# antialiasing, and values the work budget guard has to step in for
+foreach(DEPTH byte short float)
+  foreach(COMPONENTS rgba rgb alpha)
+    zokzir_regress(droste.${DEPTH}.${COMPONENTS} "${ZOKZIR_DROSTE_OFX}" ${DEPTH}
+                   --components ${COMPONENTS})
+  endforeach()
+endforeach()
+foreach(LAYERING 0 1)
+  foreach(SPIN 0 1 -2)
+    zokzir_regress(droste.float.rgba.layering${LAYERING}.spin${SPIN} "${ZOKZIR_DROSTE_OFX}" float
+                   --param layering=${LAYERING} --param spin=${SPIN})
+  endforeach()
+endforeach()
+zokzir_regress(droste.float.rgba.depth0to1 "${ZOKZIR_DROSTE_OFX}" float
+               --param minDepth=0 --param maxDepth=1)
+zokzir_regress(droste.float.rgba.depthm3to6 "${ZOKZIR_DROSTE_OFX}" float
+               --param minDepth=-3 --param maxDepth=6 --param rotation=0.1)
+zokzir_regress(droste.byte.rgba.scale50 "${ZOKZIR_DROSTE_OFX}" byte --scale 0.5)
+zokzir_regress(droste.float.rgba.scale25 "${ZOKZIR_DROSTE_OFX}" float --scale 0.25 --param spin=1)
+foreach(DEPTH byte float)
+  zokzir_regress(droste.${DEPTH}.rgba.colourPerSample "${ZOKZIR_DROSTE_OFX}" ${DEPTH}
+                 --param colourStage=1 --param colourSaturation=1.5 --param colourOffset=0.05 --param colourInvert=true)
+  zokzir_regress(droste.${DEPTH}.rgb.colourOnResult "${ZOKZIR_DROSTE_OFX}" ${DEPTH}
+                 --components rgb --param colourStage=2 --param colourSaturation=0.4 --param colourGain=1.2)
+endforeach()
+zokzir_regress(droste.float.rgba.adaptive "${ZOKZIR_DROSTE_OFX}" float
+               --param antialiasing=1 --param maxSamples=9 --param minDepth=-3 --param maxDepth=6)
+zokzir_regress(droste.byte.rgb.adaptive "${ZOKZIR_DROSTE_OFX}" byte
+               --components rgb --param antialiasing=1 --param maxSamples=25)
+zokzir_regress(droste.float.alpha.ratioNearOne "${ZOKZIR_DROSTE_OFX}" float
+               --components alpha --param ratio=0.995 --param minDepth=-200 --param maxDepth=200 --param workBudget=16)
+zokzir_regress(droste.float.rgba.budgetSamples "${ZOKZIR_DROSTE_OFX}" float
+               --param antialiasing=1 --param maxSamples=49 --param workBudget=20)
+zokzir_regress(droste.float.rgba.radius0 "${ZOKZIR_DROSTE_OFX}" float --param radius=0)
+
+add_custom_target(zokzir-regress-update
+                  COMMAND ${CMAKE_COMMAND} -E env ZOKZIR_REGRESS_UPDATE=1 ${CMAKE_CTEST_COMMAND} -L "golden|perf"
+                  WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
+                  DEPENDS zokzirbench
+                  COMMENT "Rewriting the reference renders and this machine's timing baselines"
+                  VERBATIM)
@@ -0,0 +1,138 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The combined Zokzir bundle, every Zokzir effect from one binary.
+
+A host scanning plugins pays a dlopen and a describe round trip for each
+binary it finds, so the farm build ships this one instead of a bundle per
+effect. The support library effects register their factories as usual, the
+raw API Saturation effect is wrapped in a small factory of its own so the
+support library's OfxGetPlugin hands it out alongside them.
+
+Suites are fetched once for the whole binary. The support library already
+shares its suites between its effects, and the raw effects are given a host
+whose fetchSuite goes through the same cache. A raw effect is only handed
+that host on its first action, so an effect the host never touches never
+fetches anything.
+*/
+
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <windows.h>
+#endif
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "ofxsImageEffect.h"
+#include "ofxsSupportPrivate.h"
+#include "zokzirtrace.h"
+
+// the effects in the bundle, each source is built with ZOKZIR_BUNDLE defined
+namespace Zokzir {
+  OfxPlugin *getSaturationPlugin();
+  void getNegativePluginID(OFX::PluginFactoryArray &ids);
+  void getDrostePluginID(OFX::PluginFactoryArray &ids);
+}
+
+namespace {
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // suites the raw effects asked for, fetched from the host once per binary
+  std::mutex gSuiteMutex;
+  std::map<std::pair<std::string, int>, const void *> gSuites;
+
+  const void *SharedFetchSuite(OfxPropertySetHandle /*host*/, const char *suiteName, int suiteVersion)
+  {
+    std::lock_guard<std::mutex> lock(gSuiteMutex);
+    std::pair<std::string, int> key(suiteName, suiteVersion);
+    std::map<std::pair<std::string, int>, const void *>::iterator found = gSuites.find(key);
+    if(found != gSuites.end())
+      return found->second;
+
+    // optional, the raw effects check for NULL themselves
+    const void *suite = OFX::fetchSuite(suiteName, suiteVersion, true);
+    gSuites[key] = suite;
+    return suite;
+  }
+
+  // the host the raw effects see, its property set is filled in on first use
+  OfxHost gSharedHost = {NULL, SharedFetchSuite};
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Factory that puts a raw API effect in the support library's list of
+  // plugins. The support library never describes or instantiates it, every
+  // action goes straight to the effect's own main entry.
+  template <OfxPlugin *(*GETPLUGIN)()>
+  class RawPluginFactory : public OFX::PluginFactory {
+  public :
+    RawPluginFactory()
+      : _plugin(GETPLUGIN())
+      , _id(_plugin->pluginIdentifier)
+      , _uid(_id + "_" + std::to_string(_plugin->pluginVersionMajor) + "." + std::to_string(_plugin->pluginVersionMinor))
+    {
+    }
+
+    virtual void describe(OFX::ImageEffectDescriptor & /*desc*/)
+    {
+      OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+
+    virtual void describeInContext(OFX::ImageEffectDescriptor & /*desc*/, OFX::ContextEnum /*context*/)
+    {
+      OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+
+    virtual OFX::ImageEffect *createInstance(OfxImageEffectHandle /*handle*/, OFX::ContextEnum /*context*/)
+    {
+      OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+      return NULL;
+    }
+
+    virtual const std::string &getID() const {return _id;}
+    virtual const std::string &getUID() const {return _uid;}
+    virtual unsigned int getMajorVersion() const {return _plugin->pluginVersionMajor;}
+    virtual unsigned int getMinorVersion() const {return _plugin->pluginVersionMinor;}
+    virtual OfxPluginEntryPoint *getMainEntry() {return mainEntry;}
+
+  private :
+    // hand the effect the shared host on its first action, then forward everything
+    static OfxStatus mainEntry(const char *action, const void *handle, OfxPropertySetHandle inArgs, OfxPropertySetHandle outArgs)
+    {
+      static std::once_flag hostGiven;
+      OfxPlugin *plugin = GETPLUGIN();
+      std::call_once(hostGiven, [plugin] {
+        {
+          std::lock_guard<std::mutex> lock(gSuiteMutex);
+          if(!gSharedHost.host && OFX::Private::gHost)
+            gSharedHost.host = OFX::Private::gHost->host;
+        }
+        plugin->setHost(&gSharedHost);
+      });
+      return plugin->mainEntry(action, handle, inArgs, outArgs);
+    }
+
+    OfxPlugin *_plugin;
+    std::string _id;
+    std::string _uid;
+  };
+
+} // end of anonymous namespace
+
+namespace OFX {
+  namespace Plugin {
+    // every Zokzir effect, in the order the host lists them
+    void getPluginIDs(OFX::PluginFactoryArray &ids)
+    {
+      // one trace for the lot, rather than one named after whichever effect loads first
+      Zokzir::TraceSetModule("bundle");
+
+      static RawPluginFactory<Zokzir::getSaturationPlugin> saturation;
+      ids.push_back(&saturation);
+      Zokzir::getNegativePluginID(ids);
+      Zokzir::getDrostePluginID(ids);
+    }
+  }
+}
@@ -0,0 +1,345 @@
+// Copyright OpenFX and contributors to the OpenFX project.
+// Copyright Hashory.
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Ofx plugin that inverts an image, as you would to print a film negative.
+
+Every component, alpha included, is flipped around the maximum of its
+depth, the same as the legacy Negative effect did. Rows are inverted
+16 bytes at a time with SSE2, and the render window is spread over
+threads by the support library's image processor.
+*/
+
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <windows.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+
+#include "ofxsProcessing.H"
+
+#include "zokzircpu.h"
+#include "zokzirhalf.h"
+
+// and SSE2 for the row kernels, which every x86-64 compiler targets
+#if defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define ZOKZIR_HAS_SSE2 1
+#endif
+
+#define kPluginName "Zokzir Negative"
+#define kPluginGrouping "SalkocsisFX"
+#define kPluginDescription "Inverts film negatives."
+
+#define kPluginIdentifier "com.salkocsisfx.zokzir.negative"
+#define kPluginVersionMajor 1
+#define kPluginVersionMinor 0
+
+#define kSupportsTiles 1
+#define kSupportsMultiResolution 1
+#define kSupportsRenderScale 1
+#define kSupportsMultipleClipPARs false
+#define kSupportsMultipleClipDepths false
+#define kRenderThreadSafety eRenderFullySafe
+
+using Zokzir::Half;
+using Zokzir::HalfToFloat;
+using Zokzir::FloatToHalf;
+
+// invert count components from src into dst, for integer types max - v is
+// just the bitwise not, so bytes and shorts share a kernel
+template <class PIX>
+inline void invertRow(const PIX *src, PIX *dst, int count)
+{
+  int i = 0;
+#ifdef ZOKZIR_HAS_SSE2
+  const int perVector = 16 / sizeof(PIX);
+  const __m128i ones = _mm_set1_epi32(-1);
+  for (; i + perVector <= count; i += perVector) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(v, ones));
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = PIX(~src[i]);
+  }
+}
+
+template <>
+inline void invertRow<float>(const float *src, float *dst, int count)
+{
+  int i = 0;
+#ifdef ZOKZIR_HAS_SSE2
+  const __m128 one = _mm_set1_ps(1.f);
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_sub_ps(one, _mm_loadu_ps(src + i)));
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = 1.f - src[i];
+  }
+}
+
+#ifdef ZOKZIR_X86
+// widen to float, invert and narrow back, four at a time, on CPUs with F16C
+ZOKZIR_INTRINSICS_F16C inline int invertRowF16C(const Half *src, Half *dst, int count)
+{
+  int i = 0;
+  const __m128 one = _mm_set1_ps(1.f);
+  for (; i + 4 <= count; i += 4) {
+    __m128 v = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) (src + i)));
+    _mm_storel_epi64((__m128i *) (dst + i), _mm_cvtps_ph(_mm_sub_ps(one, v), 0));
+  }
+  return i;
+}
+#endif
+
+template <>
+inline void invertRow<Half>(const Half *src, Half *dst, int count)
+{
+  int i = 0;
+#ifdef ZOKZIR_X86
+  if (Zokzir::CpuLevel() >= Zokzir::eCpuLevelAVX2) {
+    i = invertRowF16C(src, dst, count);
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = 1.f - float(src[i]);
+  }
+}
+
+// Base class for the processors of each depth
+class NegativeBase : public OFX::ImageProcessor {
+protected :
+  OFX::Image *_srcImg;
+
+public :
+  /** @brief no arg ctor */
+  NegativeBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(NULL)
+  {
+  }
+
+  /** @brief set the src image */
+  void setSrcImg(OFX::Image *v) {_srcImg = v;}
+};
+
+// template to do the processing of a depth, the components don't matter to an invert
+template <class PIX>
+class Negative : public NegativeBase {
+public :
+  // ctor
+  Negative(OFX::ImageEffect &instance)
+    : NegativeBase(instance)
+  {}
+
+  // and do some processing
+  void multiThreadProcessImages(OfxRectI procWindow)
+  {
+    const int nComponents = _dstImg->getPixelComponentCount();
+    const OfxRectI srcBounds = _srcImg ? _srcImg->getBounds() : OfxRectI{0, 0, 0, 0};
+
+    for(int y = procWindow.y1; y < procWindow.y2; y++) {
+      if(_effect.abort()) break;
+
+      PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+      // the part of the row the source has pixels for, zero everything else
+      int x1 = procWindow.x1, x2 = procWindow.x1;
+      if(y >= srcBounds.y1 && y < srcBounds.y2) {
+        x1 = std::min(std::max(procWindow.x1, srcBounds.x1), procWindow.x2);
+        x2 = std::max(std::min(procWindow.x2, srcBounds.x2), x1);
+      }
+
+      memset((void *) dstPix, 0, sizeof(PIX) * nComponents * (x1 - procWindow.x1));
+      if(x2 > x1) {
+        const PIX *srcPix = (const PIX *) _srcImg->getPixelAddress(x1, y);
+        invertRow<PIX>(srcPix, dstPix + nComponents * (x1 - procWindow.x1), nComponents * (x2 - x1));
+      }
+      memset((void *) (dstPix + nComponents * (x2 - procWindow.x1)), 0, sizeof(PIX) * nComponents * (procWindow.x2 - x2));
+    }
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** @brief The plugin that does our work */
+class NegativePlugin : public OFX::ImageEffect {
+protected :
+  // do not need to delete these, the ImageEffect is managing them for us
+  OFX::Clip *_dstClip;
+  OFX::Clip *_srcClip;
+
+public :
+  /** @brief ctor */
+  NegativePlugin(OfxImageEffectHandle handle)
+    : ImageEffect(handle)
+    , _dstClip(NULL)
+    , _srcClip(NULL)
+  {
+    _dstClip = fetchClip(kOfxImageEffectOutputClipName);
+    _srcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
+  }
+
+  /* Override the render */
+  virtual void render(const OFX::RenderArguments &args);
+
+  /* set up and run a processor */
+  void setupAndProcess(NegativeBase &, const OFX::RenderArguments &args);
+};
+
+/* set up and run a processor */
+void
+NegativePlugin::setupAndProcess(NegativeBase &processor, const OFX::RenderArguments &args)
+{
+  // get a dst image
+  std::unique_ptr<OFX::Image> dst(_dstClip->fetchImage(args.time));
+  if(!dst.get())
+    OFX::throwSuiteStatusException(kOfxStatFailed);
+  OFX::BitDepthEnum dstBitDepth       = dst->getPixelDepth();
+  OFX::PixelComponentEnum dstComponents  = dst->getPixelComponents();
+
+  // fetch main input image
+  std::unique_ptr<OFX::Image> src(_srcClip->fetchImage(args.time));
+
+  // make sure bit depths are sane
+  if(src.get()) {
+    OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
+    OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
+
+    // see if they have the same depths and bytes and all
+    if(srcBitDepth != dstBitDepth || srcComponents != dstComponents)
+      OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+  }
+
+  // set the images
+  processor.setDstImg(dst.get());
+  processor.setSrcImg(src.get());
+
+  // set the render window
+  processor.setRenderWindow(args.renderWindow);
+
+  // Call the base class process member, this will call the derived templated process code
+  processor.process();
+}
+
+// the overridden render function
+void
+NegativePlugin::render(const OFX::RenderArguments &args)
+{
+  // instantiate the render code based on the pixel depth of the dst clip
+  OFX::BitDepthEnum dstBitDepth = _dstClip->getPixelDepth();
+
+  switch(dstBitDepth) {
+    case OFX::eBitDepthUByte : {
+      Negative<unsigned char> fred(*this);
+      setupAndProcess(fred, args);
+    }
+    break;
+
+    case OFX::eBitDepthUShort : {
+      Negative<unsigned short> fred(*this);
+      setupAndProcess(fred, args);
+    }
+    break;
+
+    case OFX::eBitDepthHalf : {
+      Negative<Half> fred(*this);
+      setupAndProcess(fred, args);
+    }
+    break;
+
+    case OFX::eBitDepthFloat : {
+      Negative<float> fred(*this);
+      setupAndProcess(fred, args);
+    }
+    break;
+
+    default :
+      OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+  }
+}
+
+mDeclarePluginFactory(NegativePluginFactory, {Zokzir::CpuLevel();}, {});
+
+using namespace OFX;
+void NegativePluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+{
+  // basic labels
+  desc.setLabels(kPluginName, kPluginName, kPluginName);
+  desc.setPluginGrouping(kPluginGrouping);
+  desc.setPluginDescription(kPluginDescription);
+
+  // add the supported contexts
+  desc.addSupportedContext(eContextFilter);
+  desc.addSupportedContext(eContextGeneral);
+
+  // add supported pixel depths
+  desc.addSupportedBitDepth(eBitDepthUByte);
+  desc.addSupportedBitDepth(eBitDepthUShort);
+  desc.addSupportedBitDepth(eBitDepthHalf);
+  desc.addSupportedBitDepth(eBitDepthFloat);
+
+  // set a few flags
+  desc.setSingleInstance(false);
+  desc.setHostFrameThreading(false);
+  desc.setSupportsMultiResolution(kSupportsMultiResolution);
+  desc.setSupportsTiles(kSupportsTiles);
+  desc.setTemporalClipAccess(false);
+  desc.setRenderTwiceAlways(false);
+  desc.setSupportsMultipleClipPARs(kSupportsMultipleClipPARs);
+  desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
+  desc.setRenderThreadSafety(kRenderThreadSafety);
+}
+
+void NegativePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum /*context*/)
+{
+  // create the mandated source clip
+  ClipDescriptor *srcClip = desc.defineClip(kOfxImageEffectSimpleSourceClipName);
+  srcClip->addSupportedComponent(ePixelComponentRGBA);
+  srcClip->addSupportedComponent(ePixelComponentRGB);
+  srcClip->addSupportedComponent(ePixelComponentAlpha);
+  srcClip->setTemporalClipAccess(false);
+  srcClip->setSupportsTiles(kSupportsTiles);
+  srcClip->setIsMask(false);
+
+  // create the mandated output clip
+  ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
+  dstClip->addSupportedComponent(ePixelComponentRGBA);
+  dstClip->addSupportedComponent(ePixelComponentRGB);
+  dstClip->addSupportedComponent(ePixelComponentAlpha);
+  dstClip->setSupportsTiles(kSupportsTiles);
+}
+
+OFX::ImageEffect* NegativePluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
+{
+  return new NegativePlugin(handle);
+}
+
+namespace Zokzir {
+  // add our factory to the list, the factory is only made the first time we are asked
+  void getNegativePluginID(OFX::PluginFactoryArray &ids)
+  {
+    static NegativePluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+    ids.push_back(&p);
+  }
+}
+
+// the combined Zokzir bundle registers every effect itself
+#ifndef ZOKZIR_BUNDLE
+namespace OFX {
+  namespace Plugin {
+    void getPluginIDs(OFX::PluginFactoryArray &ids)
+    {
+      Zokzir::getNegativePluginID(ids);
+    }
+  }
+}
+#endif
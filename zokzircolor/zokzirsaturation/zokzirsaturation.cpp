@@ -16,12 +16,21 @@ The main features are
 
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
-#else
-#  error Zokzir OFX is for Windows only, bro.
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 
@@ -30,6 +39,16 @@ The main features are
 #include "ofxsProcessing.H"
 #include "ofxsMatrix2D.h"
 
+#include "zokzirarena.h"
+#include "zokzircache.h"
+#include "zokzircost.h"
+#include "zokzircpu.h"
+#include "zokzirperf.h"
+#include "zokzirpixeltraits.h"
+#include "zokzirrenderstats.h"
+#include "zokzirsaturationprocess.h"
+#include "zokzirtrace.h"
+
 #define kPluginName "Zokzir Saturation"
 #define kPluginGrouping "SalkocsisFX"
 #define kPluginDescription "Saturates old film."
@@ -45,31 +64,26 @@ The main features are
 #define kSupportsMultipleClipDepths false
 #define kRenderThreadSafety eRenderFullySafe
 
-////////////////////////////////////////////////////////////////////////////////
-// macro to write a labelled message to stderr with
-#ifdef _WIN32
-  #define DUMP(LABEL, MSG, ...)                                           \
-  {                                                                       \
-    fprintf(stderr, "%s%s:%d in %s ", LABEL, __FILE__, __LINE__, __FUNCTION__); \
-    fprintf(stderr, MSG, ##__VA_ARGS__);                                  \
-    fprintf(stderr, "\n");                                                \
-  }
-#else
-  #define DUMP(LABEL, MSG, ...)                                           \
-  {                                                                       \
-    fprintf(stderr, "%s%s:%d in %s ", LABEL, __FILE__, __LINE__, __PRETTY_FUNCTION__); \
-    fprintf(stderr, MSG, ##__VA_ARGS__);                                  \
-    fprintf(stderr, "\n");                                                \
-  }
+// the boot strapper functions are exported the same way on every platform
+#ifndef EXPORT
+#  define EXPORT OfxExport
 #endif
 
-// macro to write a simple message, only works if 'VERBOSE' is #defined
-//#define VERBOSE
-#ifdef VERBOSE
-#  define MESSAGE(MSG, ...) DUMP("", MSG, ##__VA_ARGS__)
+////////////////////////////////////////////////////////////////////////////////
+// macro to write a labelled message to stderr with, and to the trace if
+// ZOKZIR_TRACE is set, which is also where the timings of actions go
+#ifdef _WIN32
+#  define DUMP_FUNCTION __FUNCTION__
 #else
-#  define MESSAGE(MSG, ...)
+#  define DUMP_FUNCTION __PRETTY_FUNCTION__
 #endif
+#define DUMP(LABEL, MSG, ...)                                             \
+{                                                                         \
+  char dumpText[1024];                                                    \
+  snprintf(dumpText, sizeof(dumpText), MSG, ##__VA_ARGS__);               \
+  fprintf(stderr, "%s%s:%d in %s %s\n", LABEL, __FILE__, __LINE__, DUMP_FUNCTION, dumpText); \
+  Zokzir::TraceInstant(LABEL, "diagnostic", dumpText);                    \
+}
 
 // macro to dump errors to stderr if the given condition is true
 #define ERROR_IF(CONDITION, MSG, ...) if(CONDITION) { DUMP("ERROR : ", MSG, ##__VA_ARGS__);}
@@ -83,8 +97,19 @@ The main features are
   }                                             \
 }
 
-// name of our two params
+// names of our params
 #define SATURATION_PARAM_NAME "saturation"
+#define LUMA_WEIGHTS_PARAM_NAME "lumaWeights"
+#define GAIN_PARAM_NAME "gain"
+#define OFFSET_PARAM_NAME "offset"
+#define AUTO_PARAM_NAME "auto"
+#define TARGET_CHROMA_PARAM_NAME "targetChroma"
+#define COST_ESTIMATE_PARAM_NAME "costEstimate"
+#define STATS_GROUP_NAME "statistics"
+#define STATS_LAST_RENDER_PARAM_NAME "statsLastRender"
+#define STATS_THREADS_PARAM_NAME "statsThreads"
+#define STATS_CACHE_PARAM_NAME "statsCache"
+#define STATS_SCRATCH_PARAM_NAME "statsScratch"
 
 // anonymous namespace to hide our symbols in
 namespace {
@@ -94,6 +119,19 @@ namespace {
   OfxPropertySuiteV1    *gPropertySuite    = 0;
   OfxImageEffectSuiteV1 *gImageEffectSuite = 0;
   OfxParameterSuiteV1   *gParameterSuite   = 0;
+  OfxMultiThreadSuiteV1 *gMultiThreadSuite = 0;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // render windows whose source is bigger than this many bytes are processed
+  // in strips, each fetching just its own part of the source and mask
+  size_t gStripBytes = size_t(256) << 20;
+
+  // the colour matrix from the kernel library
+  using Zokzir::ColourMatrix;
+  using Zokzir::BuildColourMatrix;
+  using Zokzir::eLumaWeightsEqual;
+  using Zokzir::eLumaWeightsRec709;
+  using Zokzir::eLumaWeightsRec2020;
 
   ////////////////////////////////////////////////////////////////////////////////
   // class to manage OFX images
@@ -102,8 +140,9 @@ namespace {
     // construct from a property set that represents the image
     Image(OfxPropertySetHandle propSet);
 
-    // construct from a clip by fetching an image at the given frame
-    Image(OfxImageClipHandle clip, double frame);
+    // construct from a clip by fetching an image at the given frame, optionally
+    // asking for just the given region in canonical coordinates
+    Image(OfxImageClipHandle clip, double frame, const OfxRectD *region = NULL);
 
     // destructor
     ~Image();
@@ -118,12 +157,28 @@ namespace {
     // Is this image empty?
     operator bool();
 
-    // bytes per component, 1, 2 or 4 for byte, short and float images
+    // bytes per component, 1, 2 or 4 for byte, short/half and float images
     int bytesPerComponent() const { return bytesPerComponent_; }
 
+    // are the 2 byte components half floats rather than shorts
+    bool isHalf() const { return isHalf_; }
+
     // number of components
     int nComponents() const { return nComponents_; }
 
+    // bytes per pixel
+    int bytesPerPixel() const { return bytesPerPixel_; }
+
+    // the pixel rectangle the image holds data for
+    const OfxRectI &bounds() const { return bounds_; }
+
+    // the pixels, as the kernels take them
+    Zokzir::ImageView view() const;
+
+    // a hash of the host's unique identifier of the image, which changes with
+    // the pixels, 0 if the host gave none
+    uint64_t identity() const;
+
   protected :
     void construct();
 
@@ -138,6 +193,7 @@ namespace {
     int nComponents_;
     int bytesPerComponent_;
     int bytesPerPixel_;
+    bool isHalf_;
   };
 
   // construct from a property set
@@ -148,10 +204,11 @@ namespace {
   }
 
   // construct by fetching from a clip
-  Image::Image(OfxImageClipHandle clip, double time)
+  Image::Image(OfxImageClipHandle clip, double time, const OfxRectD *region)
     : propSet_(NULL)
   {
-    if (clip && (gImageEffectSuite->clipGetImage(clip, time, NULL, &propSet_) == kOfxStatOK)) {
+    Zokzir::TraceSpan span("fetch image", "host");
+    if (clip && (gImageEffectSuite->clipGetImage(clip, time, region, &propSet_) == kOfxStatOK)) {
       construct();
     }
     else {
@@ -186,12 +243,17 @@ namespace {
 
       // what is the data type
       gPropertySuite->propGetString(propSet_, kOfxImageEffectPropPixelDepth, 0, &cstr);
+      isHalf_ = false;
       if(strcmp(cstr, kOfxBitDepthByte) == 0) {
         bytesPerComponent_ = 1;
       }
       else if(strcmp(cstr, kOfxBitDepthShort) == 0) {
         bytesPerComponent_ = 2;
       }
+      else if(strcmp(cstr, kOfxBitDepthHalf) == 0) {
+        bytesPerComponent_ = 2;
+        isHalf_ = true;
+      }
       else if(strcmp(cstr, kOfxBitDepthFloat) == 0) {
         bytesPerComponent_ = 4;
       }
@@ -207,9 +269,42 @@ namespace {
       dataPtr_ = NULL;
       nComponents_ = 0;
       bytesPerComponent_ = 0;
+      bytesPerPixel_ = 0;
+      isHalf_ = false;
     }
   }
 
+  // a view of the pixels, empty if we have none
+  Zokzir::ImageView Image::view() const
+  {
+    Zokzir::ImageView view;
+    if(!propSet_ || !dataPtr_)
+      return view;
+    view.data = dataPtr_;
+    view.rowBytes = rowBytes_;
+    view.bounds = bounds_;
+    view.nComponents = nComponents_;
+    view.depth = bytesPerComponent_ == 1 ? Zokzir::ePixelDepthByte :
+                 bytesPerComponent_ == 4 ? Zokzir::ePixelDepthFloat :
+                 isHalf_ ? Zokzir::ePixelDepthHalf : Zokzir::ePixelDepthShort;
+    return view;
+  }
+
+  // FNV-1a over the identifier
+  uint64_t Image::identity() const
+  {
+    char *identifier = NULL;
+    if(!propSet_ || gPropertySuite->propGetString(propSet_, kOfxImagePropUniqueIdentifier, 0, &identifier) != kOfxStatOK ||
+       !identifier || !*identifier)
+      return 0;
+    uint64_t hash = 14695981039346656037ull;
+    for(const char *c = identifier; *c; c++) {
+      hash ^= (unsigned char) *c;
+      hash *= 1099511628211ull;
+    }
+    return hash ? hash : 1;
+  }
+
   // destructor
   Image::~Image()
   {
@@ -224,9 +319,10 @@ namespace {
     if(x < bounds_.x1 || x >= bounds_.x2 || y < bounds_.y1 || y >= bounds_.y2)
       return NULL;
 
-    // turn image plane coordinates into offsets from the bottom left
-    int yOffset = y - bounds_.y1;
-    int xOffset = x - bounds_.x1;
+    // turn image plane coordinates into offsets from the bottom left, in 64 bits
+    // as images over 2GB overflow an int
+    ptrdiff_t yOffset = y - bounds_.y1;
+    ptrdiff_t xOffset = x - bounds_.x1;
 
     // Find the start of our row, using byte arithmetic
     char *rowStart = (dataPtr_) + yOffset * rowBytes_;
@@ -241,6 +337,15 @@ namespace {
     return propSet_ != NULL && dataPtr_ != NULL;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  // what a mean chroma measurement is cached under, source is the identity of
+  // the source image it was measured from
+  struct MeanChromaKey {
+    double time;
+    double renderScale;
+    uint64_t source;
+  };
+
   ////////////////////////////////////////////////////////////////////////////////
   // our instance data, where we are caching away clip and param handles
   struct MyInstanceData {
@@ -254,6 +359,30 @@ namespace {
 
     // handles to a our parameters
     OfxParamHandle saturationParam;
+    OfxParamHandle lumaWeightsParam;
+    OfxParamHandle gainParam;
+    OfxParamHandle offsetParam;
+    OfxParamHandle autoParam;
+    OfxParamHandle targetChromaParam;
+    OfxParamHandle costEstimateParam;
+
+    // and to the read only statistics
+    OfxParamHandle statsLastRenderParam;
+    OfxParamHandle statsThreadsParam;
+    OfxParamHandle statsCacheParam;
+    OfxParamHandle statsScratchParam;
+
+    // what the renders did, shown in the statistics params
+    Zokzir::RenderStats stats;
+
+    // the mean source chroma for auto saturation is kept in the shared cache
+    // under MeanChromaKey. The mutex guards the keys being measured, renders
+    // wanting one of those wait on measured, and whether a source without an
+    // identifier was measured, which only a new sequence render forgets.
+    std::mutex meanChromaMutex;
+    std::condition_variable meanChromaMeasured;
+    std::vector<MeanChromaKey> meanChromaMeasuring;
+    bool meanChromaUnidentified;
 
     MyInstanceData()
       : isGeneralContext(false)
@@ -261,6 +390,17 @@ namespace {
       , maskClip(NULL)
       , outputClip(NULL)
       , saturationParam(NULL)
+      , lumaWeightsParam(NULL)
+      , gainParam(NULL)
+      , offsetParam(NULL)
+      , autoParam(NULL)
+      , targetChromaParam(NULL)
+      , costEstimateParam(NULL)
+      , statsLastRenderParam(NULL)
+      , statsThreadsParam(NULL)
+      , statsCacheParam(NULL)
+      , statsScratchParam(NULL)
+      , meanChromaUnidentified(false)
     {}
   };
 
@@ -306,10 +446,21 @@ namespace {
   // The first _action_ called after the binary is loaded (three boot strapper functions will be howeever)
   OfxStatus LoadAction(void)
   {
-    // fetch our three suites
+    // fetch our four suites
     FetchSuite(gPropertySuite,    kOfxPropertySuite,    1);
     FetchSuite(gImageEffectSuite, kOfxImageEffectSuite, 1);
     FetchSuite(gParameterSuite,   kOfxParameterSuite,   1);
+    FetchSuite(gMultiThreadSuite, kOfxMultiThreadSuite, 1);
+    Zokzir::TraceSetModule("saturation");
+
+    // pick the kernels for this CPU
+    Zokzir::TraceInstant("cpu level", "load", Zokzir::CpuLevelName(Zokzir::CpuLevel()));
+
+    // let the strip size be overridden, in megabytes
+    const char *stripMB = getenv("ZOKZIR_STRIP_MB");
+    if(stripMB && atoi(stripMB) > 0) {
+      gStripBytes = size_t(atoi(stripMB)) << 20;
+    }
 
     return kOfxStatOK;
   }
@@ -352,10 +503,14 @@ namespace {
     gPropertySuite->propSetString(effectProps,
                                   kOfxImageEffectPropSupportedPixelDepths,
                                   1,
-                                  kOfxBitDepthShort);
+                                  kOfxBitDepthHalf);
     gPropertySuite->propSetString(effectProps,
                                   kOfxImageEffectPropSupportedPixelDepths,
                                   2,
+                                  kOfxBitDepthShort);
+    gPropertySuite->propSetString(effectProps,
+                                  kOfxImageEffectPropSupportedPixelDepths,
+                                  3,
                                   kOfxBitDepthByte);
 
     // say that a single instance of this plugin can be rendered in multiple threads
@@ -372,6 +527,45 @@ namespace {
     return kOfxStatOK;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  // define one of the read only statistics, in their group
+  void DefineStatistic(OfxParamSetHandle paramSet, const char *name, const char *label, const char *hint)
+  {
+    OfxPropertySetHandle paramProps;
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeString,
+                                 name,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropStringMode,
+                                  0,
+                                  kOfxParamStringIsLabel);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropEvaluateOnChange,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropPersistant,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropParent,
+                                  0,
+                                  STATS_GROUP_NAME);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  label);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  hint);
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   //  describe the plugin in context
   OfxStatus
@@ -465,9 +659,257 @@ namespace {
                                   0,
                                   "How saturated the image should be.");
 
+    // the weights used to find the luma that saturation scales around
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeChoice,
+                                 LUMA_WEIGHTS_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  eLumaWeightsEqual,
+                                  "Equal");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  eLumaWeightsRec709,
+                                  "Rec. 709");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropChoiceOption,
+                                  eLumaWeightsRec2020,
+                                  "Rec. 2020");
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               eLumaWeightsEqual);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Luma Weights");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "How R, G and B are weighted to find the luma that saturation scales around.");
+
+    // a gain applied after the saturation
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 GAIN_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropDoubleType,
+                                  0,
+                                  kOfxParamDoubleTypeScale);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  4.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Gain");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Multiplies the saturated colour.");
+
+    // and an offset added after the gain
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 OFFSET_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  -1.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  1.0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Offset");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Added to the colour after the gain, 1 is white.");
+
+    // auto mode, where we measure the source and pick the saturation for the user
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeBoolean,
+                                 AUTO_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropDefault,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Auto");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "Measure the source's chroma and pick the saturation that reaches the Target Chroma.");
+
+    // and the chroma auto mode aims for
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeDouble,
+                                 TARGET_CHROMA_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDefault,
+                                  0,
+                                  0.1);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMin,
+                                  0,
+                                  0.0);
+    gPropertySuite->propSetDouble(paramProps,
+                                  kOfxParamPropDisplayMax,
+                                  0,
+                                  0.5);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Target Chroma");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "The mean chroma, max(R,G,B) - min(R,G,B), Auto saturates the image to.");
+
+    // read only, what a frame is predicted to cost, for render schedulers
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeString,
+                                 COST_ESTIMATE_PARAM_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropStringMode,
+                                  0,
+                                  kOfxParamStringIsLabel);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropAnimates,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropEvaluateOnChange,
+                               0,
+                               0);
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropPersistant,
+                               0,
+                               0);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Estimated Cost");
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxParamPropHint,
+                                  0,
+                                  "The CPU seconds, over every thread, and memory a full size frame at the current time is predicted to take, for scheduling renders.");
+
+    // read only, what the renders did, in a group of their own
+    gParameterSuite->paramDefine(paramSet,
+                                 kOfxParamTypeGroup,
+                                 STATS_GROUP_NAME,
+                                 &paramProps);
+    gPropertySuite->propSetString(paramProps,
+                                  kOfxPropLabel,
+                                  0,
+                                  "Render Statistics");
+    gPropertySuite->propSetInt(paramProps,
+                               kOfxParamPropGroupOpen,
+                               0,
+                               0);
+
+    DefineStatistic(paramSet, STATS_LAST_RENDER_PARAM_NAME, "Last Render",
+                    "How long the last render took, the pixels it made and how fast.");
+    DefineStatistic(paramSet, STATS_THREADS_PARAM_NAME, "Threads",
+                    "The threads the last render ran on, and the most renders the host has run at once. Each render runs on the host's thread, Auto spreads its measure over more.");
+    DefineStatistic(paramSet, STATS_CACHE_PARAM_NAME, "Chroma Cache",
+                    "How often Auto found the frame's chroma already measured, since the effect was made.");
+    DefineStatistic(paramSet, STATS_SCRATCH_PARAM_NAME, "Scratch Peak",
+                    "The most scratch memory the last render held.");
+
     return kOfxStatOK;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  // show what the renders did, hosts only let us set params outside render
+  void UpdateStatistics(MyInstanceData *myData)
+  {
+    Zokzir::RenderStatsText text = Zokzir::FormatRenderStats(myData->stats.snapshot());
+    gParameterSuite->paramSetValue(myData->statsLastRenderParam, text.lastRender.c_str());
+    gParameterSuite->paramSetValue(myData->statsThreadsParam, text.threads.c_str());
+    gParameterSuite->paramSetValue(myData->statsCacheParam, text.cache.c_str());
+    gParameterSuite->paramSetValue(myData->statsScratchParam, text.scratch.c_str());
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // predict what a full size frame at time costs and show it, see zokzircost.h
+  void UpdateCostEstimate(MyInstanceData *myData, double time)
+  {
+    Zokzir::RenderShape shape;
+    OfxPropertySetHandle clipProps;
+    gImageEffectSuite->clipGetPropertySet(myData->sourceClip, &clipProps);
+
+    shape.par = 1.0;
+    gPropertySuite->propGetDouble(clipProps, kOfxImagePropPixelAspectRatio, 0, &shape.par);
+    OfxRectD rod;
+    gImageEffectSuite->clipGetRegionOfDefinition(myData->sourceClip, time, &rod);
+    shape.width = int(std::max(0.0, ceil((rod.x2 - rod.x1) / shape.par)));
+    shape.height = int(std::max(0.0, ceil(rod.y2 - rod.y1)));
+    shape.renderScale.x = shape.renderScale.y = 1.0;
+
+    // unconnected clips may have no components or depth yet, price them as RGBA float
+    char *cstr = 0;
+    shape.nComponents = 4;
+    gPropertySuite->propGetString(clipProps, kOfxImageEffectPropComponents, 0, &cstr);
+    if(cstr && strcmp(cstr, kOfxImageComponentRGB) == 0)
+      shape.nComponents = 3;
+    else if(cstr && strcmp(cstr, kOfxImageComponentAlpha) == 0)
+      shape.nComponents = 1;
+
+    cstr = 0;
+    shape.depth = Zokzir::ePixelDepthFloat;
+    gPropertySuite->propGetString(clipProps, kOfxImageEffectPropPixelDepth, 0, &cstr);
+    if(cstr && strcmp(cstr, kOfxBitDepthByte) == 0)
+      shape.depth = Zokzir::ePixelDepthByte;
+    else if(cstr && strcmp(cstr, kOfxBitDepthShort) == 0)
+      shape.depth = Zokzir::ePixelDepthShort;
+    else if(cstr && strcmp(cstr, kOfxBitDepthHalf) == 0)
+      shape.depth = Zokzir::ePixelDepthHalf;
+
+    // a connected mask may be mixed anywhere, so price every pixel as mixed
+    int masked = 0;
+    if(myData->maskClip) {
+      OfxPropertySetHandle maskProps;
+      gImageEffectSuite->clipGetPropertySet(myData->maskClip, &maskProps);
+      gPropertySuite->propGetInt(maskProps, kOfxImageClipPropConnected, 0, &masked);
+    }
+
+    int autoSaturation = 0;
+    gParameterSuite->paramGetValueAtTime(myData->autoParam, time, &autoSaturation);
+
+    Zokzir::CostEstimate estimate = Zokzir::EstimateSaturationCost(shape, masked != 0, autoSaturation != 0);
+    gParameterSuite->paramSetValue(myData->costEstimateParam, Zokzir::FormatCostEstimate(estimate).c_str());
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   /// instance construction
   OfxStatus CreateInstanceAction( OfxImageEffectHandle instance)
@@ -503,6 +945,49 @@ namespace {
                                     SATURATION_PARAM_NAME,
                                     &myData->saturationParam,
                                     0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    LUMA_WEIGHTS_PARAM_NAME,
+                                    &myData->lumaWeightsParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    GAIN_PARAM_NAME,
+                                    &myData->gainParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    OFFSET_PARAM_NAME,
+                                    &myData->offsetParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    AUTO_PARAM_NAME,
+                                    &myData->autoParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    TARGET_CHROMA_PARAM_NAME,
+                                    &myData->targetChromaParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    COST_ESTIMATE_PARAM_NAME,
+                                    &myData->costEstimateParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    STATS_LAST_RENDER_PARAM_NAME,
+                                    &myData->statsLastRenderParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    STATS_THREADS_PARAM_NAME,
+                                    &myData->statsThreadsParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    STATS_CACHE_PARAM_NAME,
+                                    &myData->statsCacheParam,
+                                    0);
+    gParameterSuite->paramGetHandle(paramSet,
+                                    STATS_SCRATCH_PARAM_NAME,
+                                    &myData->statsScratchParam,
+                                    0);
+
+    UpdateCostEstimate(myData, 0.0);
+    UpdateStatistics(myData);
 
     return kOfxStatOK;
   }
@@ -513,105 +998,255 @@ namespace {
   {
     // get my instance data
     MyInstanceData *myData = FetchInstanceData(instance);
+    Zokzir::Cache::Instance().purge(myData);
     delete myData;
 
     return kOfxStatOK;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // clamp to 0 and MAX inclusive
-  template <class T, int MAX>
-  static inline T Clamp(float value)
-  {
-    if(MAX == 1)
-      return value; // don't clamp floating point values
-    else
-      return value < 0 ? T(0) : (value > MAX ? T(MAX) : T(value));
-  }
+  // a per thread share of the chroma sum, padded so threads don't share cache lines
+  struct alignas(64) ChromaSum {
+    double sum;
+    double count;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // what the chroma measuring threads work from
+  struct ChromaMeasure {
+    Zokzir::ImageView src;
+    OfxRectI window;
+    ChromaSum *sums;
+    Zokzir::RenderStats::Render *stats;
+  };
 
   ////////////////////////////////////////////////////////////////////////////////
-  // clamp to 0 and MAX inclusive
-  template <class T1, class T2>
-  static inline T1 Blend(T1 v1, T2 v2, float blend)
+  // the multithread suite callback, each thread sums its band of rows of the window
+  void MeasureChromaThread(unsigned int threadIndex, unsigned int threadMax, void *customArg)
   {
-    return v1 + (v2-v1) * blend;
+    ChromaMeasure *measure = (ChromaMeasure *) customArg;
+    OfxRectI window = measure->window;
+    int width = window.x2 - window.x1;
+    int rows = window.y2 - window.y1;
+    int y1 = window.y1 + int((long long) rows * threadIndex / threadMax);
+    int y2 = window.y1 + int((long long) rows * (threadIndex + 1) / threadMax);
+
+    Zokzir::TraceSpan span("measure chroma rows", "kernel");
+    span.arg("pixels", double(width) * (y2 - y1));
+    Zokzir::PerfScope perf;
+
+    measure->sums[threadIndex].sum = Zokzir::SaturationSumChroma(measure->src, window.x1, window.x2, y1, y2);
+    measure->sums[threadIndex].count = double(width) * (y2 - y1);
+    // the sum's planes came from this thread's arena and are handed back by now
+    measure->stats->addScratch(Zokzir::ThreadArena().recentPeak());
+    Zokzir::TracePerfCounts(span, perf.counts());
   }
 
   ////////////////////////////////////////////////////////////////////////////////
-  // iterate over our pixels and process them
-  template <class T, int MAX>
-  void PixelProcessing(double saturation,
-                       OfxImageEffectHandle instance,
-                       Image &src,
-                       Image &mask,
-                       Image &output,
-                       OfxRectI renderWindow)
+  // add the chroma of the rows y1 to y2 of the source to the running sums, spread
+  // over as many threads as the host gives us
+  void MeasureChroma(Image &src, int y1, int y2, double &sum, double &count, Zokzir::RenderStats::Render &stats)
   {
-    int nComps = output.nComponents();
+    ChromaMeasure measure;
+    measure.src = src.view();
+    measure.window = src.bounds();
+    measure.stats = &stats;
+    measure.window.y1 = std::max(measure.window.y1, y1);
+    measure.window.y2 = std::min(measure.window.y2, y2);
+    if(measure.window.y1 >= measure.window.y2 || measure.window.x1 >= measure.window.x2)
+      return;
+
+    unsigned int nThreads = 1;
+    gMultiThreadSuite->multiThreadNumCPUs(&nThreads);
+    nThreads = std::max(1u, std::min<unsigned int>(nThreads, measure.window.y2 - measure.window.y1));
+    Zokzir::ArenaScope arena;
+    measure.sums = arena.allocate<ChromaSum>(nThreads);
+    std::fill(measure.sums, measure.sums + nThreads, ChromaSum());
+
+    gMultiThreadSuite->multiThread(MeasureChromaThread, nThreads, &measure);
+    stats.spreadOver(nThreads);
+
+    for(unsigned int i = 0; i < nThreads; ++i) {
+      sum += measure.sums[i].sum;
+      count += measure.sums[i].count;
+    }
+  }
 
-    // and do some processing
-    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
-      if(y % 20 == 0 && gImageEffectSuite->abort(instance)) break;
+  ////////////////////////////////////////////////////////////////////////////////
+  // takes a key off the ones being measured when it goes, measured or not,
+  // and wakes the renders waiting on it
+  class MeanChromaMeasuring {
+  public :
+    MeanChromaMeasuring(MyInstanceData *myData, const MeanChromaKey &key) : _myData(myData), _key(key) {}
 
-      // get the row start for the output image
-      T *dstPix = output.pixelAddress<T>(renderWindow.x1, y);
+    ~MeanChromaMeasuring()
+    {
+      std::lock_guard<std::mutex> lock(_myData->meanChromaMutex);
+      std::vector<MeanChromaKey> &measuring = _myData->meanChromaMeasuring;
+      for(size_t i = 0; i < measuring.size(); ++i) {
+        if(memcmp(&measuring[i], &_key, sizeof(_key)) == 0) {
+          measuring.erase(measuring.begin() + i);
+          break;
+        }
+      }
+      _myData->meanChromaMeasured.notify_all();
+    }
 
-      for(int x = renderWindow.x1; x < renderWindow.x2; x++) {
+  private :
+    MyInstanceData *_myData;
+    MeanChromaKey _key;
+  };
 
-        // get the source pixel
-        T *srcPix = src.pixelAddress<T>(x, y);
+  ////////////////////////////////////////////////////////////////////////////////
+  // the mean chroma of the whole source frame at the given time, measured once
+  // per source image and render scale and cached for the instance after that
+  double FetchMeanChroma(MyInstanceData *myData, double time, OfxPointD renderScale, Zokzir::RenderStats::Render &stats)
+  {
+    Zokzir::TraceSpan span("measure chroma", "kernel");
+    double par = 1.0;
+    OfxPropertySetHandle clipProps;
+    gImageEffectSuite->clipGetPropertySet(myData->sourceClip, &clipProps);
+    gPropertySuite->propGetDouble(clipProps, kOfxImagePropPixelAspectRatio, 0, &par);
+
+    // the whole frame, in canonical coordinates and pixels
+    OfxRectD rod;
+    gImageEffectSuite->clipGetRegionOfDefinition(myData->sourceClip, time, &rod);
+    int pixelY1 = int(floor(rod.y1 * renderScale.y));
+    int pixelY2 = int(ceil(rod.y2 * renderScale.y));
+    // we haven't seen the image yet, so size the strips for the widest pixel, RGBA float
+    size_t rowBytes = size_t(std::max(0.0, ceil((rod.x2 - rod.x1) * renderScale.x / par))) * 4 * sizeof(float);
+    int stripRows = int(std::max<size_t>(1, gStripBytes / std::max<size_t>(rowBytes, 1)));
+
+    // the first strip, which also tells us which source image this is, so a
+    // change upstream, which the host gives a new identifier, is measured again
+    OfxRectD region = rod;
+    region.y1 = pixelY1 / renderScale.y;
+    region.y2 = std::min(pixelY1 + stripRows, pixelY2) / renderScale.y;
+    std::unique_ptr<Image> firstImg(new Image(myData->sourceClip, time, &region));
+    if(!*firstImg) {
+      throw " no source image!";
+    }
+    MeanChromaKey key = {time, renderScale.x, firstImg->identity()};
 
-        // get the amount to mask by, no mask image means we do the full effect everywhere
-        float maskAmount = 1.0f;
-        if (mask) {
-          // get our mask pixel address
-          T *maskPix = mask.pixelAddress<T>(x, y);
-          if(maskPix) {
-            maskAmount = float(*maskPix)/float(MAX);
-          }
-          else {
-            maskAmount = 0;
-          }
+    // other renders of this image need the answer too and wait for the one
+    // measuring it, renders of other frames go on
+    {
+      std::unique_lock<std::mutex> lock(myData->meanChromaMutex);
+      for(;;) {
+        std::shared_ptr<const double> found = Zokzir::Cache::Instance().find<double>(myData, key);
+        if(found) {
+          myData->stats.cacheHit();
+          return *found;
         }
+        bool measuring = false;
+        for(const MeanChromaKey &other : myData->meanChromaMeasuring)
+          measuring = measuring || memcmp(&other, &key, sizeof(key)) == 0;
+        if(!measuring)
+          break;
+        myData->meanChromaMeasured.wait(lock);
+      }
+      myData->meanChromaMeasuring.push_back(key);
+      if(!key.source)
+        myData->meanChromaUnidentified = true;
+    }
+    MeanChromaMeasuring measuring(myData, key);
+    myData->stats.cacheMiss();
 
-        if(srcPix) {
-          if(maskAmount == 0) {
-            // we have a mask input, but the mask is zero here,
-            // so no effect happens, copy source to output
-            for(int i = 0; i < nComps; ++i) {
-              *dstPix = *srcPix;
-              ++dstPix; ++srcPix;
-            }
-          }
-          else {
-            // we have a non zero mask or no mask at all
-
-            // find the average of the R, G and B
-            float average = (srcPix[0] + srcPix[1] + srcPix[2])/3.0f;
-
-            // scale each component around that average
-            for(int c = 0; c < 3; ++c) {
-              float value = (srcPix[c] - average) * saturation + average;
-              value = Clamp<T, MAX>(value);
-              // use the mask to control how much original we should have
-              dstPix[c] = Blend(srcPix[c], value, maskAmount);
-            }
+    // big frames are measured in strips, just like they are rendered
+    double sum = 0, count = 0;
+    for(int stripY = pixelY1; stripY < pixelY2; stripY += stripRows) {
+      int stripY2 = std::min(stripY + stripRows, pixelY2);
 
-            if(nComps == 4) { // if we have an alpha, just copy it
-              dstPix[3] = srcPix[3];
-            }
-            dstPix += nComps;
-          }
-        }
-        else {
-          // we don't have a pixel in the source image, set output to zero
-          for(int i = 0; i < nComps; ++i) {
-            *dstPix = 0;
-            ++dstPix;
-          }
+      std::unique_ptr<Image> sourceImg = std::move(firstImg);
+      if(!sourceImg) {
+        region.y1 = stripY / renderScale.y;
+        region.y2 = stripY2 / renderScale.y;
+        sourceImg.reset(new Image(myData->sourceClip, time, &region));
+        if(!*sourceImg) {
+          throw " no source image!";
         }
       }
+
+      // hosts that ignore the region give us the lot, so measure it all in one go
+      if(sourceImg->bounds().y1 <= pixelY1 && sourceImg->bounds().y2 >= pixelY2) {
+        sum = count = 0;
+        MeasureChroma(*sourceImg, pixelY1, pixelY2, sum, count, stats);
+        break;
+      }
+      MeasureChroma(*sourceImg, stripY, stripY2, sum, count, stats);
     }
+
+    double meanChroma = count > 0 ? sum / count : 0.0;
+    Zokzir::Cache::Instance().insert(myData, key, std::make_shared<const double>(meanChroma), sizeof(double));
+    return meanChroma;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // hint to the OS that we are about to touch rows y1 to y2 of an image
+  void PrefetchRows(Image &image, int y1, int y2)
+  {
+    const OfxRectI &bounds = image.bounds();
+    y1 = std::max(y1, bounds.y1);
+    y2 = std::min(y2, bounds.y2);
+    if(!image || y1 >= y2)
+      return;
+
+    // rows may run either way in memory
+    char *first = image.pixelAddress<char>(bounds.x1, y1);
+    char *last  = image.pixelAddress<char>(bounds.x1, y2 - 1);
+    char *start = std::min(first, last);
+    size_t rowSize = size_t(bounds.x2 - bounds.x1) * image.bytesPerPixel();
+    size_t length = size_t(std::max(first, last) - start) + rowSize;
+
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = start;
+    range.NumberOfBytes = length;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    // madvise wants a page aligned start
+    uintptr_t pageMask = uintptr_t(sysconf(_SC_PAGESIZE)) - 1;
+    char *pageStart = (char *) (uintptr_t(start) & ~pageMask);
+    posix_madvise(pageStart, length + size_t(start - pageStart), POSIX_MADV_WILLNEED);
+#endif
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the kernels' cancel check, which asks the host
+  bool AbortCallback(void *instance)
+  {
+    return gImageEffectSuite->abort((OfxImageEffectHandle) instance) != 0;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // process a window of the output, the kernel library sorts out the data type
+  void ProcessImages(const ColourMatrix &matrix,
+                     OfxImageEffectHandle instance,
+                     Image &sourceImg,
+                     Image &maskImg,
+                     Image &outputImg,
+                     OfxRectI window)
+  {
+    Zokzir::TraceSpan span("process", "kernel");
+    span.arg("pixels", double(window.x2 - window.x1) * (window.y2 - window.y1));
+    span.arg("masked", maskImg ? 1 : 0);
+
+    Zokzir::SaturationProcess(matrix,
+                              sourceImg.view(),
+                              maskImg.view(),
+                              outputImg.view(),
+                              window,
+                              Zokzir::CancelCheck(AbortCallback, instance));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // does the image hold every pixel of the window
+  bool ImageCovers(Image &image, OfxRectI window)
+  {
+    const OfxRectI &bounds = image.bounds();
+    return image &&
+           bounds.x1 <= window.x1 && bounds.x2 >= window.x2 &&
+           bounds.y1 <= window.y1 && bounds.y2 >= window.y2;
   }
 
   ////////////////////////////////////////////////////////////////////////////////
@@ -623,6 +1258,7 @@ namespace {
     // get the render window and the time from the inArgs
     OfxTime time;
     OfxRectI renderWindow;
+    OfxPointD renderScale;
     OfxStatus status = kOfxStatOK;
 
     gPropertySuite->propGetDouble(inArgs,
@@ -633,64 +1269,136 @@ namespace {
                                 kOfxImageEffectPropRenderWindow,
                                 4,
                                 &renderWindow.x1);
+    gPropertySuite->propGetDoubleN(inArgs,
+                                   kOfxImageEffectPropRenderScale,
+                                   2,
+                                   &renderScale.x);
 
     // get our instance data which has out clip and param handles
     MyInstanceData *myData = FetchInstanceData(instance);
 
+    Zokzir::TraceSpan renderSpan("render", "render");
+    renderSpan.arg("pixels", double(renderWindow.x2 - renderWindow.x1) * (renderWindow.y2 - renderWindow.y1));
+    renderSpan.arg("renderScale", renderScale.x);
+    // this thread's counts, the chroma measure's threads put theirs on their own spans
+    Zokzir::PerfScope perf;
+
+    // this thread's scratch, all handed back when the render returns
+    Zokzir::ArenaScope scratch;
+    Zokzir::RenderStats::Render stats(myData->stats, double(renderWindow.x2 - renderWindow.x1) * (renderWindow.y2 - renderWindow.y1));
+
     // get our param values
-    double saturation = 1.0;
-    gParameterSuite->paramGetValueAtTime(myData->saturationParam, time, &saturation);
+    double saturation = 1.0, gain = 1.0, offset = 0.0;
+    int lumaWeights = eLumaWeightsEqual;
+    int autoSaturation = 0;
+    double targetChroma = 0.1;
+    {
+      Zokzir::TraceSpan span("fetch params", "host");
+      gParameterSuite->paramGetValueAtTime(myData->saturationParam, time, &saturation);
+      gParameterSuite->paramGetValueAtTime(myData->lumaWeightsParam, time, &lumaWeights);
+      gParameterSuite->paramGetValueAtTime(myData->gainParam, time, &gain);
+      gParameterSuite->paramGetValueAtTime(myData->offsetParam, time, &offset);
+      gParameterSuite->paramGetValueAtTime(myData->autoParam, time, &autoSaturation);
+      gParameterSuite->paramGetValueAtTime(myData->targetChromaParam, time, &targetChroma);
+    }
 
-    // the property sets holding our images
-    OfxPropertySetHandle outputImg = NULL, sourceImg = NULL, maskImg = NULL;
     try {
+      // in auto mode, saturation scales chroma linearly, so pick the saturation
+      // that takes the measured mean chroma (after the gain) to the target
+      if(autoSaturation) {
+        double meanChroma = FetchMeanChroma(myData, time, renderScale, stats) * fabs(gain);
+        saturation = meanChroma > 0.000001 ? targetChroma / meanChroma : 1.0;
+      }
+
       // fetch image to render into from that clip
       Image outputImg(myData->outputClip, time);
       if(!outputImg) {
         throw " no output image!";
       }
 
-      // fetch image to render into from that clip
-      Image sourceImg(myData->sourceClip, time);
-      if(!sourceImg) {
-        throw " no source image!";
-      }
+      // fold the colour params into a single matrix, scaled to the pixel's value range
+      float maxValue = float(Zokzir::MaxValue(outputImg.view().depth));
+      ColourMatrix matrix = BuildColourMatrix(saturation, lumaWeights, gain, offset, maxValue);
+
+      // how many rows of source fit in a strip, the source is the same depth
+      // and components as the output
+      size_t rowBytes = size_t(renderWindow.x2 - renderWindow.x1) * outputImg.bytesPerPixel();
+      int windowRows = renderWindow.y2 - renderWindow.y1;
+      int stripRows = int(std::min<size_t>(windowRows, std::max<size_t>(1, gStripBytes / std::max<size_t>(rowBytes, 1))));
+
+      if(stripRows >= windowRows) {
+        // fetch image to render into from that clip
+        Image sourceImg(myData->sourceClip, time);
+        if(!sourceImg) {
+          throw " no source image!";
+        }
 
-      // fetch mask image at render time from that clip, it may not be there
-      // as we might in the filter context or it might not be attached as it
-      // is optional, so don't worry if we don't have one.
-      Image maskImg(myData->maskClip, time);
-
-      // now do our render depending on the data type
-      if(outputImg.bytesPerComponent() == 1) {
-        PixelProcessing<unsigned char, 255>(saturation,
-                                            instance,
-                                            sourceImg,
-                                            maskImg,
-                                            outputImg,
-                                            renderWindow);
-      }
-      else if(outputImg.bytesPerComponent() == 2) {
-        PixelProcessing<unsigned short, 65535>(saturation,
-                                               instance,
-                                               sourceImg,
-                                               maskImg,
-                                               outputImg,
-                                               renderWindow);
-      }
-      else if(outputImg.bytesPerComponent() == 4) {
-        PixelProcessing<float, 1>(saturation,
-                                  instance,
-                                  sourceImg,
-                                  maskImg,
-                                  outputImg,
-                                  renderWindow);
+        // fetch mask image at render time from that clip, it may not be there
+        // as we might in the filter context or it might not be attached as it
+        // is optional, so don't worry if we don't have one.
+        Image maskImg(myData->maskClip, time);
+
+        ProcessImages(matrix, instance, sourceImg, maskImg, outputImg, renderWindow);
       }
       else {
-        throw " bad data type!";
-        throw 1;
-      }
+        // too big to hold the whole source at once, so walk the window in
+        // strips lined up with the mask tiles, asking the host for just the
+        // source and mask each strip needs and releasing them after
+        stripRows = std::max(Zokzir::kSaturationTileSize, stripRows / Zokzir::kSaturationTileSize * Zokzir::kSaturationTileSize);
+
+        double par = 1.0;
+        OfxPropertySetHandle clipProps;
+        gImageEffectSuite->clipGetPropertySet(myData->sourceClip, &clipProps);
+        gPropertySuite->propGetDouble(clipProps, kOfxImagePropPixelAspectRatio, 0, &par);
+
+        // hosts that ignore the region give us the lot, which we then keep
+        std::unique_ptr<Image> wholeSource, wholeMask;
+
+        for(int stripY = renderWindow.y1; stripY < renderWindow.y2; stripY += stripRows) {
+          if(gImageEffectSuite->abort(instance)) break;
+
+          OfxRectI strip = renderWindow;
+          strip.y1 = stripY;
+          strip.y2 = std::min(stripY + stripRows, renderWindow.y2);
+
+          // the strip in canonical coordinates
+          OfxRectD region;
+          region.x1 = strip.x1 * par / renderScale.x;
+          region.x2 = strip.x2 * par / renderScale.x;
+          region.y1 = strip.y1 / renderScale.y;
+          region.y2 = strip.y2 / renderScale.y;
+
+          std::unique_ptr<Image> sourceImg, maskImg;
+          if(!wholeSource) {
+            sourceImg.reset(new Image(myData->sourceClip, time, &region));
+            if(!*sourceImg) {
+              throw " no source image!";
+            }
+            if(ImageCovers(*sourceImg, renderWindow)) {
+              wholeSource = std::move(sourceImg);
+            }
+          }
+          if(!wholeMask) {
+            maskImg.reset(new Image(myData->maskClip, time, &region));
+            if(ImageCovers(*maskImg, renderWindow)) {
+              wholeMask = std::move(maskImg);
+            }
+          }
 
+          // a source the host handed over whole may be paged out, have the
+          // OS bring in the next strip's rows while we work on this one. The
+          // output is the host's and already in memory.
+          if(wholeSource)
+            PrefetchRows(*wholeSource, strip.y2, strip.y2 + stripRows);
+
+          ProcessImages(matrix,
+                        instance,
+                        wholeSource ? *wholeSource : *sourceImg,
+                        wholeMask ? *wholeMask : *maskImg,
+                        outputImg,
+                        strip);
+        }
+      }
     }
     catch(const char *errStr ) {
       bool isAborting = gImageEffectSuite->abort(instance);
@@ -703,6 +1411,10 @@ namespace {
       ERROR_IF(!isAborting, " Rendering failed because %s", errStr);
     }
 
+    // the render ran on this thread
+    stats.addThread(0, scratch.arena().recentPeak());
+    Zokzir::TracePerfCounts(renderSpan, perf.counts());
+
     // all was well
     return status;
   }
@@ -717,11 +1429,19 @@ namespace {
     double time;
     gPropertySuite->propGetDouble(inArgs, kOfxPropTime, 0, &time);
 
-    double saturation = 1.0;
+    double saturation = 1.0, gain = 1.0, offset = 0.0;
+    int autoSaturation = 0;
     gParameterSuite->paramGetValueAtTime(myData->saturationParam, time, &saturation);
-
-    // if the saturation value is 1.0 (or nearly so) say we aren't doing anything
-    if(fabs(saturation - 1.0) < 0.000000001) {
+    gParameterSuite->paramGetValueAtTime(myData->gainParam, time, &gain);
+    gParameterSuite->paramGetValueAtTime(myData->offsetParam, time, &offset);
+    gParameterSuite->paramGetValueAtTime(myData->autoParam, time, &autoSaturation);
+
+    // if the colour matrix is the identity (or nearly so) say we aren't doing anything,
+    // the luma weights don't matter when the saturation is 1.0
+    if(!autoSaturation &&
+       fabs(saturation - 1.0) < 0.000000001 &&
+       fabs(gain - 1.0) < 0.000000001 &&
+       fabs(offset) < 0.000000001) {
       // we set the name of the input clip to pull default images from
       gPropertySuite->propSetString(outArgs, kOfxPropName, 0, "Source");
       // and say we trapped the action and we are at the identity
@@ -732,11 +1452,86 @@ namespace {
     return kOfxStatReplyDefault;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+  // in auto mode we need to see the whole source frame to measure it
+  OfxStatus GetRegionsOfInterestAction( OfxImageEffectHandle instance,
+                                        OfxPropertySetHandle inArgs,
+                                        OfxPropertySetHandle outArgs)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+
+    double time;
+    gPropertySuite->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+
+    int autoSaturation = 0;
+    gParameterSuite->paramGetValueAtTime(myData->autoParam, time, &autoSaturation);
+    if(!autoSaturation)
+      return kOfxStatReplyDefault;
+
+    OfxRectD rod;
+    gImageEffectSuite->clipGetRegionOfDefinition(myData->sourceClip, time, &rod);
+    gPropertySuite->propSetDoubleN(outArgs, kOfxImageClipPropRoI "Source", 4, &rod.x1);
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // forget the measured chroma, the host is short of memory or the source changed
+  OfxStatus PurgeCachesAction( OfxImageEffectHandle instance)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+
+    std::lock_guard<std::mutex> lock(myData->meanChromaMutex);
+    Zokzir::Cache::Instance().purge(myData);
+    return kOfxStatOK;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a sequence render is starting, sources the host gave no identifier may have
+  // changed since they were measured without us hearing of it, so measure
+  // them again
+  OfxStatus BeginSequenceRenderAction( OfxImageEffectHandle instance)
+  {
+    MyInstanceData *myData = FetchInstanceData(instance);
+
+    bool unidentified;
+    {
+      std::lock_guard<std::mutex> lock(myData->meanChromaMutex);
+      unidentified = myData->meanChromaUnidentified;
+      myData->meanChromaUnidentified = false;
+    }
+    if(unidentified)
+      PurgeCachesAction(instance);
+    return kOfxStatReplyDefault;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // something changed on the instance, only a new source invalidates what we
+  // measured, but anything bar the estimate itself may change the estimate
+  OfxStatus InstanceChangedAction( OfxImageEffectHandle instance,
+                                   OfxPropertySetHandle inArgs)
+  {
+    char *type = 0, *name = 0;
+    double time = 0.0;
+    gPropertySuite->propGetString(inArgs, kOfxPropType, 0, &type);
+    gPropertySuite->propGetString(inArgs, kOfxPropName, 0, &name);
+    gPropertySuite->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+    if(type && strcmp(type, kOfxTypeClip) == 0) {
+      PurgeCachesAction(instance);
+    }
+    // setting the readouts tells us they changed too
+    if(!name || (strcmp(name, COST_ESTIMATE_PARAM_NAME) != 0 && strncmp(name, "stats", 5) != 0)) {
+      UpdateCostEstimate(FetchInstanceData(instance), time);
+      UpdateStatistics(FetchInstanceData(instance));
+    }
+    return kOfxStatReplyDefault;
+  }
+
   ////////////////////////////////////////////////////////////////////////////////
   // The main entry point function, the host calls this to get the plugin to do things.
   OfxStatus MainEntryPoint(const char *action, const void *handle, OfxPropertySetHandle inArgs,  OfxPropertySetHandle outArgs)
   {
-    MESSAGE(": START action is : %s \n", action );
+    Zokzir::TraceSpan span(action, "action");
+
     // cast to appropriate type
     OfxImageEffectHandle effect = (OfxImageEffectHandle) handle;
 
@@ -770,8 +1565,31 @@ namespace {
       // action called to render a frame
       returnStatus = RenderAction(effect, inArgs, outArgs);
     }
+    else if(strcmp(action, kOfxImageEffectActionGetRegionsOfInterest) == 0) {
+      // what parts of the source we need to render
+      returnStatus = GetRegionsOfInterestAction(effect, inArgs, outArgs);
+    }
+    else if(strcmp(action, kOfxActionPurgeCaches) == 0) {
+      // drop anything we've cached
+      returnStatus = PurgeCachesAction(effect);
+    }
+    else if(strcmp(action, kOfxImageEffectActionBeginSequenceRender) == 0) {
+      // a sequence render is starting
+      returnStatus = BeginSequenceRenderAction(effect);
+    }
+    else if(strcmp(action, kOfxActionInstanceChanged) == 0) {
+      // a param or clip changed
+      returnStatus = InstanceChangedAction(effect, inArgs);
+    }
+    else if(strcmp(action, kOfxActionSyncPrivateData) == 0) {
+      // the host is about to save, so show what the renders did
+      UpdateStatistics(FetchInstanceData(effect));
+    }
+    else if(strcmp(action, kOfxActionUnload) == 0) {
+      // the last action, so write out what we traced
+      Zokzir::TraceFlush();
+    }
 
-    MESSAGE(": END action is : %s \n", action );
     /// other actions to take the default value
     return returnStatus;
   }
@@ -803,6 +1621,17 @@ static OfxPlugin effectPluginStruct =
   MainEntryPoint                             // The main entry point to the plugin where all actions are passed to.
 };
 
+#ifdef ZOKZIR_BUNDLE
+////////////////////////////////////////////////////////////////////////////////
+// In the combined Zokzir bundle the bundle exports the two boot strapper
+// functions, and asks us for our plugin struct through this.
+namespace Zokzir {
+  OfxPlugin *getSaturationPlugin()
+  {
+    return &effectPluginStruct;
+  }
+}
+#else
 ////////////////////////////////////////////////////////////////////////////////
 // The first of the two functions that a host application will look for
 // after loading the binary, this function returns the number of plugins within
@@ -826,3 +1655,4 @@ EXPORT OfxPlugin * OfxGetPlugin(int nth)
     return &effectPluginStruct;
   return 0;
 }
+#endif
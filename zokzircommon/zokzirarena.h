@@ -0,0 +1,301 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Per thread scratch memory for the Zokzir render paths.
+
+Each thread has an arena it takes scratch buffers from with a pointer bump,
+64 byte aligned so rows start on a cache line. An ArenaScope hands back
+everything taken since it was made when it goes, a render opens one on each
+of its threads so the arena is empty again when the render ends. The memory
+itself is kept, so once the arena has grown to what a render needs, later
+renders make no heap calls and take no allocator locks.
+
+Blocks of 2MB or more are asked to be backed by huge pages on Linux. If a
+render outgrows its arena, the blocks are merged into one the next time the
+arena is empty.
+
+ArenaPeak gives the most any one thread has held, and ArenaReserved the
+memory every arena holds, both are also traced as counters. An arena's
+recentPeak is the most it has held since a scope was opened on it empty,
+which is what the render running on it has needed so far, and it is kept
+when nested scopes end so it can still be read after them.
+*/
+
+#ifndef ZOKZIR_ARENA_H
+#define ZOKZIR_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#endif
+
+#include "zokzirtrace.h"
+
+namespace Zokzir {
+
+namespace ArenaDetail {
+
+  const size_t kAlignment = 64;
+  const size_t kMinBlock = size_t(1) << 20;
+  const size_t kHugePage = size_t(2) << 20;
+
+  inline std::atomic<int64_t> &Reserved()
+  {
+    static std::atomic<int64_t> reserved{0};
+    return reserved;
+  }
+
+  inline std::atomic<int64_t> &Peak()
+  {
+    static std::atomic<int64_t> peak{0};
+    return peak;
+  }
+
+  // page aligned memory straight from the OS, so it never touches the heap
+  inline void *MapBlock(size_t bytes)
+  {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(block == MAP_FAILED)
+      return NULL;
+#  ifdef MADV_HUGEPAGE
+    if(bytes >= kHugePage)
+      madvise(block, bytes, MADV_HUGEPAGE);
+#  endif
+    return block;
+#endif
+  }
+
+  inline void UnmapBlock(void *block, size_t bytes)
+  {
+#ifdef _WIN32
+    (void) bytes;
+    VirtualFree(block, 0, MEM_RELEASE);
+#else
+    munmap(block, bytes);
+#endif
+  }
+
+} // namespace ArenaDetail
+
+////////////////////////////////////////////////////////////////////////////////
+// a bump allocator owned by one thread
+class ScratchArena {
+public :
+  ScratchArena()
+    : _current(0)
+    , _used(0)
+    , _held(0)
+    , _highWater(0)
+    , _recentPeak(0)
+  {}
+
+  ~ScratchArena()
+  {
+    release();
+  }
+
+  // bytes of scratch, 64 byte aligned and not initialised, throws
+  // std::bad_alloc if the OS has no more
+  void *allocate(size_t bytes)
+  {
+    bytes = (std::max<size_t>(bytes, 1) + ArenaDetail::kAlignment - 1) & ~(ArenaDetail::kAlignment - 1);
+    while(_current < _blocks.size() && _used + bytes > _blocks[_current].size) {
+      _current++;
+      _used = 0;
+    }
+    if(_current == _blocks.size())
+      grow(bytes);
+
+    void *memory = _blocks[_current].memory + _used;
+    _used += bytes;
+    _held += bytes;
+    _recentPeak = std::max(_recentPeak, _held);
+    if(_held > _highWater) {
+      _highWater = _held;
+      int64_t peak = ArenaDetail::Peak().load();
+      while(int64_t(_highWater) > peak && !ArenaDetail::Peak().compare_exchange_weak(peak, int64_t(_highWater))) {}
+    }
+    return memory;
+  }
+
+  template <class T>
+  T *allocate(size_t count)
+  {
+    return (T *) allocate(count * sizeof(T));
+  }
+
+  // where the arena is up to, to hand back to rewind
+  struct Mark {
+    size_t block;
+    size_t used;
+    size_t held;
+  };
+
+  Mark mark() const
+  {
+    Mark m = {_current, _used, _held};
+    return m;
+  }
+
+  // hand back everything allocated since the mark was taken
+  void rewind(const Mark &m)
+  {
+    _current = m.block;
+    _used = m.used;
+    _held = m.held;
+    if(_held == 0) {
+      _current = 0;
+      _used = 0;
+      if(_blocks.size() > 1)
+        merge();
+      TraceCounter("scratch arenas", "peak bytes", double(ArenaDetail::Peak().load()));
+    }
+  }
+
+  // the most this arena has held at once
+  size_t highWater() const {return _highWater;}
+
+  // the most it has held since a scope was opened on it empty
+  size_t recentPeak() const {return _recentPeak;}
+
+  // start recentPeak over if nothing is held, as a scope opening does
+  void restartRecentPeak()
+  {
+    if(_held == 0)
+      _recentPeak = 0;
+  }
+
+  // bytes in its blocks
+  size_t reserved() const
+  {
+    size_t total = 0;
+    for(const Block &block : _blocks) total += block.size;
+    return total;
+  }
+
+private :
+  ScratchArena(const ScratchArena &);
+  ScratchArena &operator=(const ScratchArena &);
+
+  struct Block {
+    char *memory;
+    size_t size;
+  };
+
+  void grow(size_t bytes)
+  {
+    size_t last = _blocks.empty() ? 0 : _blocks.back().size;
+    size_t size = std::max(std::max(bytes, 2 * last), ArenaDetail::kMinBlock);
+    size_t page = size >= ArenaDetail::kHugePage ? ArenaDetail::kHugePage : size_t(4096);
+    size = (size + page - 1) & ~(page - 1);
+
+    Block block;
+    block.memory = (char *) ArenaDetail::MapBlock(size);
+    if(!block.memory)
+      throw std::bad_alloc();
+    block.size = size;
+    _blocks.push_back(block);
+    _current = _blocks.size() - 1;
+    _used = 0;
+
+    TraceCounter("scratch arenas", "reserved bytes", double(ArenaDetail::Reserved() += int64_t(size)));
+  }
+
+  // replace the blocks with one that holds the lot, so the next render of the
+  // same size fits in a single block
+  void merge()
+  {
+    size_t total = reserved();
+    release();
+    grow(total);
+  }
+
+  void release()
+  {
+    for(const Block &block : _blocks) {
+      ArenaDetail::UnmapBlock(block.memory, block.size);
+      ArenaDetail::Reserved() -= int64_t(block.size);
+    }
+    _blocks.clear();
+    _current = 0;
+    _used = 0;
+  }
+
+  std::vector<Block> _blocks;
+  size_t _current;     // the block being allocated from
+  size_t _used;        // bytes used of it
+  size_t _held;        // bytes allocated and not yet rewound, over every block
+  size_t _highWater;
+  size_t _recentPeak;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the calling thread's arena
+inline ScratchArena &ThreadArena()
+{
+  thread_local ScratchArena arena;
+  return arena;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// everything taken from the thread's arena while this is alive is handed back
+// when it goes
+class ArenaScope {
+public :
+  ArenaScope()
+    : _arena(ThreadArena())
+    , _mark(_arena.mark())
+  {
+    _arena.restartRecentPeak();
+  }
+
+  ~ArenaScope()
+  {
+    _arena.rewind(_mark);
+  }
+
+  ScratchArena &arena() {return _arena;}
+
+  template <class T>
+  T *allocate(size_t count)
+  {
+    return _arena.allocate<T>(count);
+  }
+
+private :
+  ArenaScope(const ArenaScope &);
+  ArenaScope &operator=(const ArenaScope &);
+
+  ScratchArena &_arena;
+  ScratchArena::Mark _mark;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the most scratch any one thread has held at once
+inline size_t ArenaPeak()
+{
+  return size_t(ArenaDetail::Peak().load());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the memory all the arenas hold between them
+inline size_t ArenaReserved()
+{
+  return size_t(ArenaDetail::Reserved().load());
+}
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,248 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+A cache shared by every Zokzir effect instance in the process, for data an
+instance derives once and reuses across renders, such as warp tables or
+measurements of the source.
+
+Entries belong to an owner, normally the instance, and are found by the type
+of their key and value and the bytes of the key, so keys should be plain
+structs with no padding. Values are handed out as shared pointers, an entry
+evicted while a render uses it lives until that render lets go.
+
+The cache holds at most ZOKZIR_CACHE_MB megabytes, 1024 if that isn't set and
+nothing if it is 0, and evicts the least recently used entries to stay under
+it. It is split into shards with a lock each, so lookups from many threads
+rarely wait on each other. Eviction starts with the shard being inserted
+into, so the order is only roughly LRU across the whole cache.
+
+Hits, misses, insertions and evictions are counted, and the bytes held are
+traced as a counter.
+*/
+
+#ifndef ZOKZIR_CACHE_H
+#define ZOKZIR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+
+#include "zokzirtrace.h"
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// what the cache has done so far
+struct CacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  size_t bytes;
+  size_t entries;
+  size_t budget;
+};
+
+class Cache {
+public :
+  // the cache of the process
+  static Cache &Instance()
+  {
+    static Cache cache;
+    return cache;
+  }
+
+  // the value stored under owner and key, or null
+  template <class V, class K>
+  std::shared_ptr<const V> find(const void *owner, const K &key)
+  {
+    Key internal = makeKey<V, K>(owner, key);
+    Shard &shard = _shards[shardOf(internal)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    typename Map::iterator found = shard.map.find(internal);
+    if(found == shard.map.end()) {
+      _misses++;
+      return std::shared_ptr<const V>();
+    }
+    // most recently used to the front
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    _hits++;
+    return std::static_pointer_cast<const V>(found->second->value);
+  }
+
+  // store value under owner and key, replacing what was there, bytes being
+  // what it holds in memory, values bigger than the whole budget aren't kept
+  template <class V, class K>
+  void insert(const void *owner, const K &key, const std::shared_ptr<const V> &value, size_t bytes)
+  {
+    if(!value || bytes > _budget)
+      return;
+
+    Key internal = makeKey<V, K>(owner, key);
+    size_t home = shardOf(internal);
+    {
+      Shard &shard = _shards[home];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      typename Map::iterator found = shard.map.find(internal);
+      if(found != shard.map.end())
+        erase(shard, found->second);
+      Entry entry = {internal, std::static_pointer_cast<const void>(value), bytes};
+      shard.lru.push_front(entry);
+      shard.map[internal] = shard.lru.begin();
+      _bytes += bytes;
+      _entries++;
+      _insertions++;
+    }
+
+    // evict from the least recently used end, this shard first
+    for(size_t i = 0; i < kShards && _bytes > _budget; i++) {
+      Shard &shard = _shards[(home + i) % kShards];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      while(_bytes > _budget && !shard.lru.empty()) {
+        erase(shard, std::prev(shard.lru.end()));
+        _evictions++;
+      }
+    }
+    TraceCounter("cache", "bytes", double(_bytes.load()));
+  }
+
+  // drop everything owner has stored, when it is destroyed or the host asks
+  // for memory back
+  void purge(const void *owner)
+  {
+    for(size_t i = 0; i < kShards; i++) {
+      Shard &shard = _shards[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for(List::iterator entry = shard.lru.begin(); entry != shard.lru.end();) {
+        List::iterator next = std::next(entry);
+        if(entry->key.owner == owner)
+          erase(shard, entry);
+        entry = next;
+      }
+    }
+    TraceCounter("cache", "bytes", double(_bytes.load()));
+  }
+
+  // the most it holds, so callers can skip building what it won't keep
+  size_t budget() const {return _budget;}
+
+  CacheStats stats() const
+  {
+    CacheStats s;
+    s.hits = _hits.load();
+    s.misses = _misses.load();
+    s.insertions = _insertions.load();
+    s.evictions = _evictions.load();
+    s.bytes = _bytes.load();
+    s.entries = _entries.load();
+    s.budget = _budget;
+    return s;
+  }
+
+private :
+  Cache()
+    : _budget(size_t(1024) << 20)
+  {
+    const char *megabytes = getenv("ZOKZIR_CACHE_MB");
+    if(megabytes && *megabytes)
+      _budget = size_t(std::max(0., atof(megabytes)) * 1048576.);
+  }
+
+  Cache(const Cache &);
+  Cache &operator=(const Cache &);
+
+  static const size_t kShards = 16;
+
+  struct Key {
+    const void *owner;
+    std::type_index keyType;
+    std::type_index valueType;
+    std::string bytes;
+    size_t hash;
+
+    bool operator==(const Key &other) const
+    {
+      return hash == other.hash && owner == other.owner && keyType == other.keyType &&
+             valueType == other.valueType && bytes == other.bytes;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {return key.hash;}
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const void> value;
+    size_t bytes;
+  };
+
+  typedef std::list<Entry> List;
+  typedef std::unordered_map<Key, List::iterator, KeyHash> Map;
+
+  struct Shard {
+    std::mutex mutex;
+    List lru;
+    Map map;
+  };
+
+  template <class V, class K>
+  static Key makeKey(const void *owner, const K &key)
+  {
+    static_assert(std::is_trivially_copyable<K>::value, "cache keys are compared as bytes");
+    Key internal = {owner, std::type_index(typeid(K)), std::type_index(typeid(V)),
+                    std::string((const char *) &key, sizeof(K)), 0};
+    // FNV-1a over the key bytes, mixed with the owner and the types
+    uint64_t hash = 14695981039346656037ull;
+    for(char c : internal.bytes) {
+      hash ^= (unsigned char) c;
+      hash *= 1099511628211ull;
+    }
+    hash ^= uint64_t(uintptr_t(owner)) * 0x9e3779b97f4a7c15ull;
+    hash ^= internal.keyType.hash_code() + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= internal.valueType.hash_code() + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    internal.hash = size_t(hash ^ (hash >> 32));
+    return internal;
+  }
+
+  // the shard from the top bits of the hash, the map buckets use the bottom ones
+  static size_t shardOf(const Key &key)
+  {
+    return (key.hash >> 28) % kShards;
+  }
+
+  // shard's lock must be held
+  void erase(Shard &shard, List::iterator entry)
+  {
+    _bytes -= entry->bytes;
+    _entries--;
+    shard.map.erase(entry->key);
+    shard.lru.erase(entry);
+  }
+
+  Shard _shards[kShards];
+  size_t _budget;
+
+  std::atomic<size_t> _bytes{0};
+  std::atomic<size_t> _entries{0};
+  std::atomic<uint64_t> _hits{0};
+  std::atomic<uint64_t> _misses{0};
+  std::atomic<uint64_t> _insertions{0};
+  std::atomic<uint64_t> _evictions{0};
+};
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,150 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Runtime choice of instruction set for the Zokzir pixel kernels.
+
+The binaries are built for plain x86-64 so they load on every machine of a
+farm. The hot kernels are compiled again for each level below, with the
+ZOKZIR_TARGET_ macros, and the effect calls the one for the level the CPU
+has, detected once when the effect is loaded.
+
+Setting ZOKZIR_CPU_LEVEL to sse2, sse4.2, avx2 or avx512 forces a level, to
+test the kernels of a lower one. A level above what the CPU has is refused.
+
+Only GCC and Clang can compile a function for another level, elsewhere
+every level runs the baseline code. The explicit intrinsics kernels, which
+MSVC allows anywhere, are the exception.
+*/
+
+#ifndef ZOKZIR_CPU_H
+#define ZOKZIR_CPU_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#  define ZOKZIR_X86 1
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  else
+#    include <cpuid.h>
+#  endif
+#endif
+
+// compile a function for a level, and pull everything it calls into it so the
+// whole kernel gets that level's code
+#if defined(ZOKZIR_X86) && (defined(__GNUC__) || defined(__clang__))
+#  define ZOKZIR_TARGET_SSE42  __attribute__((target("sse4.2,popcnt"), flatten))
+#  define ZOKZIR_TARGET_AVX2   __attribute__((target("avx2,fma,f16c,bmi,bmi2,popcnt"), flatten))
+#  define ZOKZIR_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,fma,f16c,bmi,bmi2,popcnt"), flatten))
+// just the instructions, for functions written with their intrinsics
+#  define ZOKZIR_INTRINSICS_F16C __attribute__((target("avx,f16c")))
+#  define ZOKZIR_INTRINSICS_AVX2 __attribute__((target("avx2,fma")))
+#else
+#  define ZOKZIR_TARGET_SSE42
+#  define ZOKZIR_TARGET_AVX2
+#  define ZOKZIR_TARGET_AVX512
+#  define ZOKZIR_INTRINSICS_F16C
+#  define ZOKZIR_INTRINSICS_AVX2
+#endif
+
+namespace Zokzir {
+
+// the levels we compile kernels for, each includes the ones before it
+enum CpuLevelEnum
+{
+  eCpuLevelSSE2,    // every x86-64
+  eCpuLevelSSE42,
+  eCpuLevelAVX2,    // with FMA, F16C and BMI2
+  eCpuLevelAVX512,  // F, BW, DQ and VL
+};
+
+inline const char *CpuLevelName(CpuLevelEnum level)
+{
+  switch(level) {
+    case eCpuLevelSSE42 : return "sse4.2";
+    case eCpuLevelAVX2 : return "avx2";
+    case eCpuLevelAVX512 : return "avx512";
+    default : return "sse2";
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the highest level this CPU and OS support
+inline CpuLevelEnum DetectCpuLevel()
+{
+#ifdef ZOKZIR_X86
+  unsigned int leaf1[4] = {0, 0, 0, 0}, leaf7[4] = {0, 0, 0, 0};
+  unsigned long long xcr0 = 0;
+#  if defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 0);
+  int maxLeaf = regs[0];
+  __cpuidex(regs, 1, 0);
+  for(int i = 0; i < 4; i++) leaf1[i] = (unsigned int) regs[i];
+  if(maxLeaf >= 7) {
+    __cpuidex(regs, 7, 0);
+    for(int i = 0; i < 4; i++) leaf7[i] = (unsigned int) regs[i];
+  }
+  if(leaf1[2] & (1u << 27))
+    xcr0 = _xgetbv(0);
+#  else
+  unsigned int maxLeaf = __get_cpuid_max(0, NULL);
+  __get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3]);
+  if(maxLeaf >= 7)
+    __cpuid_count(7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3]);
+  if(leaf1[2] & (1u << 27)) {
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    xcr0 = (unsigned long long) edx << 32 | eax;
+  }
+#  endif
+
+  const unsigned int ecx1 = leaf1[2], ebx7 = leaf7[1];
+  bool sse42 = (ecx1 & (1u << 20)) && (ecx1 & (1u << 23));                    // SSE4.2, POPCNT
+  // the OS must save the YMM state, and the ZMM state for AVX-512
+  bool ymm = (ecx1 & (1u << 27)) && (xcr0 & 0x6) == 0x6;
+  bool zmm = ymm && (xcr0 & 0xe0) == 0xe0;
+  bool avx2 = ymm && (ecx1 & (1u << 28)) && (ecx1 & (1u << 12)) && (ecx1 & (1u << 29)) && // AVX, FMA, F16C
+              (ebx7 & (1u << 5)) && (ebx7 & (1u << 3)) && (ebx7 & (1u << 8));            // AVX2, BMI1, BMI2
+  bool avx512 = zmm && (ebx7 & (1u << 16)) && (ebx7 & (1u << 17)) &&                     // F, DQ
+                (ebx7 & (1u << 30)) && (ebx7 & (1u << 31));                                // BW, VL
+
+  if(avx2 && avx512) return eCpuLevelAVX512;
+  if(avx2 && sse42) return eCpuLevelAVX2;
+  if(sse42) return eCpuLevelSSE42;
+#endif
+  return eCpuLevelSSE2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the level the kernels run at, detected on first use and lowered by
+// ZOKZIR_CPU_LEVEL if that is set
+inline CpuLevelEnum CpuLevel()
+{
+  static const CpuLevelEnum level = [] {
+    CpuLevelEnum detected = DetectCpuLevel();
+    const char *forced = getenv("ZOKZIR_CPU_LEVEL");
+    if(!forced || !*forced)
+      return detected;
+
+    for(int i = eCpuLevelSSE2; i <= eCpuLevelAVX512; i++) {
+      CpuLevelEnum wanted = CpuLevelEnum(i);
+      if(strcmp(forced, CpuLevelName(wanted)) == 0 || (wanted == eCpuLevelSSE42 && strcmp(forced, "sse42") == 0)) {
+        if(wanted <= detected)
+          return wanted;
+        fprintf(stderr, "Zokzir: ZOKZIR_CPU_LEVEL=%s is above this CPU's %s, ignoring it\n", forced, CpuLevelName(detected));
+        return detected;
+      }
+    }
+    fprintf(stderr, "Zokzir: unknown ZOKZIR_CPU_LEVEL=%s, want sse2, sse4.2, avx2 or avx512\n", forced);
+    return detected;
+  }();
+  return level;
+}
+
+} // namespace Zokzir
+
+#endif
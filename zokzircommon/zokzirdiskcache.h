@@ -0,0 +1,539 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+A cache on disk for data an effect derives from its parameters alone, such as
+warp tables, shared by every process on the machine. Several hosts rendering
+frame ranges of the same shot compute such a table once between them, and the
+page cache holds one copy that they all map.
+
+It is off unless ZOKZIR_DISK_CACHE_DIR names a directory to keep it in, and
+holds at most ZOKZIR_DISK_CACHE_MB megabytes there, 4096 if that isn't set.
+
+An entry is a file of a kind, named by a hash of its key:
+
+  header    magic, format version, byte order, kind, key and payload sizes
+  key       the bytes of the key, compared in full, so a hash collision
+            reads as a miss
+  payload   from a 64 byte boundary, so it can be used where it is mapped
+
+An entry is written to a temporary file and renamed into place, so a reader
+sees a whole file or none. Entries are read only, mapped for as long as the
+DiskCacheEntry lives, and the file time is bumped on every hit so the cleanup
+after a publish that goes over the budget removes the least recently used.
+Removing a file another process has mapped is safe, its mapping stays valid.
+One process at a time cleans up, holding a lock on a file in the directory.
+
+publishLater hands the writing to a thread of the cache, so a render that
+made an entry of many megabytes doesn't wait on the disk for it. One entry
+waits at a time and a publish while one does is dropped, as a later render
+that misses will publish it again.
+
+Anything that goes wrong, a full disk or a file that doesn't check out, is a
+miss and not an error.
+*/
+
+#ifndef ZOKZIR_DISK_CACHE_H
+#define ZOKZIR_DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#  include <windows.h>
+#  include <process.h>
+#else
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <sys/file.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  include <utime.h>
+#endif
+
+#include "zokzirtrace.h"
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// what the disk cache has done so far in this process
+struct DiskCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t published;
+  uint64_t removed;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// a mapped entry, the payload is valid while this lives
+class DiskCacheEntry {
+public :
+  ~DiskCacheEntry()
+  {
+#ifdef _WIN32
+    if(_base) UnmapViewOfFile(_base);
+    if(_mapping) CloseHandle(_mapping);
+#else
+    if(_base) munmap(_base, _size);
+#endif
+  }
+
+  const void *data() const {return (const char *) _base + _offset;}
+  size_t size() const {return _size - _offset;}
+
+private :
+  friend class DiskCache;
+
+  DiskCacheEntry()
+    : _base(NULL)
+    , _size(0)
+    , _offset(0)
+#ifdef _WIN32
+    , _mapping(NULL)
+#endif
+  {}
+
+  DiskCacheEntry(const DiskCacheEntry &);
+  DiskCacheEntry &operator=(const DiskCacheEntry &);
+
+  void *_base;
+  size_t _size;
+  size_t _offset;
+#ifdef _WIN32
+  HANDLE _mapping;
+#endif
+};
+
+class DiskCache {
+public :
+  // the disk cache of the process
+  static DiskCache &Instance()
+  {
+    static DiskCache cache;
+    return cache;
+  }
+
+  bool enabled() const {return !_dir.empty();}
+
+  // the entry of kind stored under key, or null. kind names the layout of the
+  // payload and should change when that does.
+  template <class K>
+  std::shared_ptr<const DiskCacheEntry> find(const char *kind, const K &key)
+  {
+    static_assert(std::is_trivially_copyable<K>::value, "disk cache keys are compared as bytes");
+    if(!enabled())
+      return std::shared_ptr<const DiskCacheEntry>();
+
+    TraceSpan span("disk cache find", "cache");
+    std::string path = pathOf(kind, &key, sizeof(K));
+    std::shared_ptr<DiskCacheEntry> entry(new DiskCacheEntry);
+    if(!map(path, *entry) || !matches(*entry, kind, &key, sizeof(K))) {
+      _misses++;
+      span.arg("hit", 0.);
+      return std::shared_ptr<const DiskCacheEntry>();
+    }
+
+    // most recently used for the cleanup
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    if(file != INVALID_HANDLE_VALUE) {
+      FILETIME now;
+      GetSystemTimeAsFileTime(&now);
+      SetFileTime(file, NULL, NULL, &now);
+      CloseHandle(file);
+    }
+#else
+    utime(path.c_str(), NULL);
+#endif
+    _hits++;
+    span.arg("hit", 1.);
+    span.arg("bytes", double(entry->size()));
+    return entry;
+  }
+
+  // store bytes of data as the entry of kind under key, for this and every
+  // other process, and clean up if that takes the cache over its budget
+  template <class K>
+  void publish(const char *kind, const K &key, const void *data, size_t bytes)
+  {
+    static_assert(std::is_trivially_copyable<K>::value, "disk cache keys are compared as bytes");
+    if(!enabled() || bytes > _budget)
+      return;
+
+    TraceSpan span("disk cache publish", "cache");
+    span.arg("bytes", double(bytes));
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.version = kVersion;
+    header.byteOrder = kByteOrder;
+    strncpy(header.kind, kind, sizeof(header.kind) - 1);
+    header.keyBytes = sizeof(K);
+    header.payloadOffset = PayloadOffset(sizeof(K));
+    header.payloadBytes = bytes;
+
+    // a name no other writer uses, in the same directory so the rename is atomic
+    std::string path = pathOf(kind, &key, sizeof(K));
+    std::string temporary = path + "." + std::to_string(ProcessId()) + "-" + std::to_string(_nextTemporary++) + kTemporarySuffix;
+
+    FILE *f = fopen(temporary.c_str(), "wb");
+    if(!f)
+      return;
+    static const char zeros[64] = {0};
+    size_t padding = size_t(header.payloadOffset) - sizeof(Header) - sizeof(K);
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                   fwrite(&key, sizeof(K), 1, f) == 1 &&
+                   (padding == 0 || fwrite(zeros, padding, 1, f) == 1) &&
+                   fwrite(data, 1, bytes, f) == bytes;
+    written = fclose(f) == 0 && written;
+    if(!written || !Rename(temporary, path)) {
+      remove(temporary.c_str());
+      return;
+    }
+    _published++;
+    cleanup();
+  }
+
+  // publish from the cache's writer thread, which holds on to owner until it
+  // has written data, so the caller can go on rendering
+  template <class K>
+  void publishLater(const char *kind, const K &key, std::shared_ptr<const void> owner, const void *data, size_t bytes)
+  {
+    static_assert(std::is_trivially_copyable<K>::value, "disk cache keys are compared as bytes");
+    if(!enabled() || bytes > _budget)
+      return;
+
+    std::lock_guard<std::mutex> lock(_writing);
+    if(_pending || _stopping)
+      return;
+    _pending = [this, kind, key, owner, data, bytes]() {publish(kind, key, data, bytes);};
+    if(!_writer.joinable())
+      _writer = std::thread(&DiskCache::write, this);
+    _wake.notify_one();
+  }
+
+  DiskCacheStats stats() const
+  {
+    DiskCacheStats s;
+    s.hits = _hits.load();
+    s.misses = _misses.load();
+    s.published = _published.load();
+    s.removed = _removed.load();
+    return s;
+  }
+
+private :
+  DiskCache()
+    : _budget(size_t(4096) << 20)
+  {
+    const char *dir = getenv("ZOKZIR_DISK_CACHE_DIR");
+    if(dir && *dir) {
+      _dir = dir;
+      char last = _dir[_dir.size() - 1];
+      if(last != '/' && last != '\\')
+        _dir += '/';
+    }
+    const char *megabytes = getenv("ZOKZIR_DISK_CACHE_MB");
+    if(megabytes && *megabytes)
+      _budget = size_t(std::max(0., atof(megabytes)) * 1048576.);
+  }
+
+  ~DiskCache()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_writing);
+      _stopping = true;
+    }
+    _wake.notify_one();
+    if(_writer.joinable())
+      _writer.join();
+  }
+
+  DiskCache(const DiskCache &);
+  DiskCache &operator=(const DiskCache &);
+
+  // the writer thread, publishing what publishLater left until the cache goes
+  void write()
+  {
+    std::unique_lock<std::mutex> lock(_writing);
+    for(;;) {
+      _wake.wait(lock, [this] {return bool(_pending) || _stopping;});
+      if(!_pending)
+        return;
+      std::function<void()> pending;
+      pending.swap(_pending);
+      lock.unlock();
+      pending();
+      pending = nullptr;
+      lock.lock();
+    }
+  }
+
+  // bump the version when the header changes
+  static const uint32_t kVersion = 1;
+  static const uint32_t kByteOrder = 0x01020304;
+  static constexpr const char *kMagic = "ZOKZIRDC";
+  static constexpr const char *kSuffix = ".zdc";
+  static constexpr const char *kTemporarySuffix = ".tmp";
+  static constexpr const char *kLockName = "cleanup.lock";
+
+  // temporary files a writer left this long ago died with it
+  static const int kStaleSeconds = 3600;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    char kind[32];
+    uint64_t keyBytes;
+    uint64_t payloadOffset;
+    uint64_t payloadBytes;
+  };
+
+  static uint64_t PayloadOffset(size_t keyBytes)
+  {
+    return (uint64_t(sizeof(Header) + keyBytes) + 63) & ~uint64_t(63);
+  }
+
+  static int ProcessId()
+  {
+#ifdef _WIN32
+    return _getpid();
+#else
+    return getpid();
+#endif
+  }
+
+  // FNV-1a over the kind and the key
+  std::string pathOf(const char *kind, const void *key, size_t keyBytes) const
+  {
+    uint64_t hash = 14695981039346656037ull;
+    for(const char *c = kind; *c; c++) {
+      hash ^= (unsigned char) *c;
+      hash *= 1099511628211ull;
+    }
+    for(size_t i = 0; i < keyBytes; i++) {
+      hash ^= ((const unsigned char *) key)[i];
+      hash *= 1099511628211ull;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "-%016llx", (unsigned long long) hash);
+    return _dir + kind + name + kSuffix;
+  }
+
+  static bool map(const std::string &path, DiskCacheEntry &entry)
+  {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER size;
+    if(GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+      entry._mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if(entry._mapping)
+        entry._base = MapViewOfFile(entry._mapping, FILE_MAP_READ, 0, 0, 0);
+      entry._size = entry._base ? size_t(size.QuadPart) : 0;
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      return false;
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+      void *base = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+      if(base != MAP_FAILED) {
+        entry._base = base;
+        entry._size = size_t(info.st_size);
+      }
+    }
+    close(fd);
+#endif
+    return entry._base != NULL;
+  }
+
+  // whether a mapped file is an entry of kind under key, and where its payload is
+  static bool matches(DiskCacheEntry &entry, const char *kind, const void *key, size_t keyBytes)
+  {
+    if(entry._size < sizeof(Header) + keyBytes)
+      return false;
+    Header header;
+    memcpy(&header, entry._base, sizeof(header));
+    if(memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 || header.version != kVersion ||
+       header.byteOrder != kByteOrder || strncmp(header.kind, kind, sizeof(header.kind)) != 0 ||
+       header.keyBytes != keyBytes || header.payloadOffset != PayloadOffset(keyBytes) ||
+       header.payloadOffset + header.payloadBytes != entry._size ||
+       memcmp((const char *) entry._base + sizeof(Header), key, keyBytes) != 0)
+      return false;
+    entry._offset = size_t(header.payloadOffset);
+    return true;
+  }
+
+  static bool Rename(const std::string &from, const std::string &to)
+  {
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+  }
+
+  struct File {
+    std::string path;
+    uint64_t bytes;
+    int64_t time;
+  };
+
+  static bool EndsWith(const std::string &name, const char *suffix)
+  {
+    size_t length = strlen(suffix);
+    return name.size() > length && name.compare(name.size() - length, length, suffix) == 0;
+  }
+
+  // the entries in the cache directory, removing temporary files gone stale
+  std::vector<File> list()
+  {
+    std::vector<File> files;
+    int64_t now = int64_t(time(NULL));
+    auto consider = [&](const std::string &name, uint64_t bytes, int64_t modified) {
+      File file = {_dir + name, bytes, modified};
+      if(EndsWith(name, kSuffix))
+        files.push_back(file);
+      else if(EndsWith(name, kTemporarySuffix) && now - modified > kStaleSeconds)
+        remove(file.path.c_str());
+    };
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((_dir + "*").c_str(), &found);
+    if(search == INVALID_HANDLE_VALUE)
+      return files;
+    do {
+      if(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        continue;
+      // 100ns ticks since 1601 to seconds since 1970
+      ULARGE_INTEGER written;
+      written.LowPart = found.ftLastWriteTime.dwLowDateTime;
+      written.HighPart = found.ftLastWriteTime.dwHighDateTime;
+      consider(found.cFileName, (uint64_t(found.nFileSizeHigh) << 32) | found.nFileSizeLow,
+               int64_t(written.QuadPart / 10000000ull) - 11644473600ll);
+    } while(FindNextFileA(search, &found));
+    FindClose(search);
+#else
+    DIR *dir = opendir(_dir.c_str());
+    if(!dir)
+      return files;
+    while(struct dirent *found = readdir(dir)) {
+      struct stat info;
+      if(stat((_dir + found->d_name).c_str(), &info) == 0 && S_ISREG(info.st_mode))
+        consider(found->d_name, uint64_t(info.st_size), int64_t(info.st_mtime));
+    }
+    closedir(dir);
+#endif
+    return files;
+  }
+
+  // a lock on the cleanup of the directory held by the returned file, which
+  // no other thread or process can take until it is closed. Returns false if
+  // one already has it.
+#ifdef _WIN32
+  bool lockCleanup(HANDLE &file) const
+  {
+    file = CreateFileA((_dir + kLockName).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+    return file != INVALID_HANDLE_VALUE;
+  }
+
+  static void UnlockCleanup(HANDLE file) {CloseHandle(file);}
+#else
+  bool lockCleanup(int &fd) const
+  {
+    fd = open((_dir + kLockName).c_str(), O_RDWR | O_CREAT, 0666);
+    if(fd < 0)
+      return false;
+    if(flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      close(fd);
+      return false;
+    }
+    return true;
+  }
+
+  static void UnlockCleanup(int fd) {close(fd);}
+#endif
+
+  // remove the least recently used entries until the cache is in its budget.
+  // Another process may publish or hit an entry while this runs, so one of
+  // those can be removed soon after, which is only a miss later.
+  void cleanup()
+  {
+    // one thread of one process cleaning at a time is plenty
+#ifdef _WIN32
+    HANDLE lockFile;
+#else
+    int lockFile;
+#endif
+    if(!lockCleanup(lockFile))
+      return;
+    struct Unlock {
+      decltype(lockFile) file;
+      ~Unlock() {UnlockCleanup(file);}
+    } unlock = {lockFile};
+
+    std::vector<File> files = list();
+    uint64_t total = 0;
+    for(const File &file : files)
+      total += file.bytes;
+    TraceCounter("disk cache", "bytes", double(total));
+    if(total <= _budget)
+      return;
+
+    TraceSpan span("disk cache cleanup", "cache");
+    std::sort(files.begin(), files.end(), [](const File &a, const File &b) {return a.time < b.time;});
+    for(const File &file : files) {
+      if(total <= _budget)
+        break;
+      // another process may have removed it first
+      if(remove(file.path.c_str()) == 0)
+        _removed++;
+      total -= file.bytes;
+    }
+    span.arg("bytes", double(total));
+    TraceCounter("disk cache", "bytes", double(total));
+  }
+
+  std::string _dir;
+  size_t _budget;
+
+  std::mutex _writing;
+  std::condition_variable _wake;
+  std::function<void()> _pending;
+  bool _stopping = false;
+  std::thread _writer;
+
+  std::atomic<uint64_t> _nextTemporary{0};
+  std::atomic<uint64_t> _hits{0};
+  std::atomic<uint64_t> _misses{0};
+  std::atomic<uint64_t> _published{0};
+  std::atomic<uint64_t> _removed{0};
+};
+
+} // namespace Zokzir
+
+#endif
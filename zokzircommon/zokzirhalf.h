@@ -0,0 +1,149 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Half float (IEEE 754 binary16) pixel support shared by the Zokzir plugins.
+
+Conversions use the F16C instructions when the compiler targets them,
+otherwise a bit exact software version. Kernels compiled for a CPU level
+with F16C, see zokzircpu.h, use HalfF16C to get them either way.
+*/
+
+#ifndef ZOKZIR_HALF_H
+#define ZOKZIR_HALF_H
+
+#include <string.h>
+
+#include "zokzircpu.h"
+
+// use the F16C instructions to convert half floats if the compiler targets them
+#if defined(__F16C__) || defined(__AVX2__)
+#  define ZOKZIR_HAS_F16C 1
+#endif
+#ifdef ZOKZIR_X86
+#  include <immintrin.h>
+#endif
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// convert the bits of an IEEE 754 half float to a float
+inline float HalfToFloat(unsigned short half)
+{
+#ifdef ZOKZIR_HAS_F16C
+  return _cvtsh_ss(half);
+#else
+  unsigned int sign     = (unsigned int)(half & 0x8000) << 16;
+  unsigned int exponent = (half >> 10) & 0x1f;
+  unsigned int mantissa = half & 0x3ff;
+  unsigned int bits;
+
+  if(exponent == 0) {
+    if(mantissa == 0) {
+      // signed zero
+      bits = sign;
+    }
+    else {
+      // denormal, renormalise it as a float
+      exponent = 113;
+      while((mantissa & 0x400) == 0) {
+        mantissa <<= 1;
+        --exponent;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  }
+  else if(exponent == 31) {
+    // infinity or nan
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  }
+  else {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// convert a float to the bits of an IEEE 754 half float, rounding to nearest even
+inline unsigned short FloatToHalf(float value)
+{
+#ifdef ZOKZIR_HAS_F16C
+  return _cvtss_sh(value, 0);
+#else
+  unsigned int bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  unsigned int sign    = (bits >> 16) & 0x8000;
+  unsigned int absBits = bits & 0x7fffffff;
+
+  if(absBits >= 0x7f800000) {
+    // infinity or nan, nans keep their top payload bits and are made quiet
+    unsigned int nan = absBits > 0x7f800000 ? (0x200 | ((absBits & 0x7fffff) >> 13)) : 0;
+    return (unsigned short)(sign | 0x7c00 | nan);
+  }
+  if(absBits >= 0x477ff000) {
+    // rounds past the largest half, 65504
+    return (unsigned short)(sign | 0x7c00);
+  }
+  if(absBits < 0x33000000) {
+    // rounds to zero
+    return (unsigned short)sign;
+  }
+
+  unsigned int result, remainder, halfway;
+  if(absBits < 0x38800000) {
+    // below the smallest normal half, so make a denormal
+    unsigned int mantissa = (absBits & 0x7fffff) | 0x800000;
+    unsigned int shift    = 126 - (absBits >> 23);
+    result    = mantissa >> shift;
+    remainder = mantissa & ((1u << shift) - 1);
+    halfway   = 1u << (shift - 1);
+  }
+  else {
+    result    = (((absBits >> 23) - 112) << 10) | ((absBits & 0x7fffff) >> 13);
+    remainder = absBits & 0x1fff;
+    halfway   = 0x1000;
+  }
+
+  // round to nearest even, a carry correctly bumps the exponent
+  if(remainder > halfway || (remainder == halfway && (result & 1))) {
+    ++result;
+  }
+  return (unsigned short)(sign | result);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// storage type for half float pixels, reads and writes convert through float
+struct Half {
+  unsigned short bits;
+
+  Half() : bits(0) {}
+  Half(float value) : bits(FloatToHalf(value)) {}
+
+  operator float() const { return HalfToFloat(bits); }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the same storage, always converting with the F16C instructions, only for
+// kernels compiled for eCpuLevelAVX2 and up
+#ifdef ZOKZIR_X86
+struct HalfF16C {
+  unsigned short bits;
+
+  HalfF16C() : bits(0) {}
+  ZOKZIR_INTRINSICS_F16C HalfF16C(float value) : bits(_cvtss_sh(value, 0)) {}
+
+  ZOKZIR_INTRINSICS_F16C operator float() const { return _cvtsh_ss(bits); }
+};
+#else
+typedef Half HalfF16C;
+#endif
+
+} // end of namespace Zokzir
+
+#endif
@@ -0,0 +1,225 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Hardware performance counters for the Zokzir render paths, from Linux
+perf_event, to tell whether a kernel is bound by arithmetic, memory or
+branches.
+
+Each thread counts the cycles, instructions, last level cache misses, dTLB
+misses and branch misses it runs in user space, opening its counters the
+first time it reads them. They are off unless ZOKZIR_PERF_COUNTERS is set
+when the effect is loaded, or a host such as zokzirbench turns them on, and
+then cost a read of each counter per PerfScope, so scopes are for actions
+and the share of a render each thread does. A counter the CPU, the kernel or
+perf_event_paranoid won't give reads as unavailable rather than failing, as
+they all do on other systems. Counters the kernel time-shares are scaled up
+to the whole time.
+
+The effects add the counts of their render and worker thread spans to the
+trace as arguments, see zokzirtrace.h.
+*/
+
+#ifndef ZOKZIR_PERF_H
+#define ZOKZIR_PERF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+#include "zokzirtrace.h"
+
+namespace Zokzir {
+
+enum PerfCounterEnum
+{
+  ePerfCycles,
+  ePerfInstructions,
+  ePerfCacheMisses,     // last level cache read misses
+  ePerfTLBMisses,       // dTLB read misses
+  ePerfBranchMisses,
+  ePerfCounterCount,
+};
+
+// short names, also the trace's argument names
+inline const char *PerfCounterName(int counter)
+{
+  static const char *const names[ePerfCounterCount] = {
+    "cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"
+  };
+  return names[counter];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// counts of one thread or summed over several
+struct PerfCounts {
+  uint64_t value[ePerfCounterCount];
+  unsigned int available;   // a bit for each counter that was read
+
+  PerfCounts() : available(0) {memset(value, 0, sizeof(value));}
+
+  bool has(int counter) const {return (available >> counter) & 1;}
+
+  PerfCounts &operator+=(const PerfCounts &other)
+  {
+    for(int i = 0; i < ePerfCounterCount; i++) value[i] += other.value[i];
+    available |= other.available;
+    return *this;
+  }
+};
+
+namespace PerfDetail {
+
+  inline std::atomic<bool> &Enabled()
+  {
+    static std::atomic<bool> enabled{getenv("ZOKZIR_PERF_COUNTERS") && *getenv("ZOKZIR_PERF_COUNTERS") &&
+                                     strcmp(getenv("ZOKZIR_PERF_COUNTERS"), "0") != 0};
+    return enabled;
+  }
+
+#ifdef __linux__
+  // a thread's counters, -1 for one that couldn't be opened
+  struct ThreadCounters {
+    int fd[ePerfCounterCount];
+
+    ThreadCounters()
+    {
+      const uint32_t types[ePerfCounterCount] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+      };
+      const uint64_t configs[ePerfCounterCount] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES,
+      };
+      for(int i = 0; i < ePerfCounterCount; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // this thread on whichever CPU it runs
+        fd[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+      }
+    }
+
+    ~ThreadCounters()
+    {
+      for(int i = 0; i < ePerfCounterCount; i++)
+        if(fd[i] >= 0) close(fd[i]);
+    }
+
+    PerfCounts read() const
+    {
+      PerfCounts counts;
+      for(int i = 0; i < ePerfCounterCount; i++) {
+        uint64_t data[3];
+        if(fd[i] < 0 || ::read(fd[i], data, sizeof(data)) != ssize_t(sizeof(data)) || data[2] == 0)
+          continue;
+        counts.value[i] = data[2] < data[1] ? uint64_t(double(data[0]) * double(data[1]) / double(data[2])) : data[0];
+        counts.available |= 1u << i;
+      }
+      return counts;
+    }
+  };
+#endif
+
+} // namespace PerfDetail
+
+////////////////////////////////////////////////////////////////////////////////
+// are the counters being read
+inline bool PerfCountersEnabled()
+{
+  return PerfDetail::Enabled().load(std::memory_order_relaxed);
+}
+
+// turn them on or off for the whole process
+inline void PerfCountersEnable(bool enable)
+{
+  PerfDetail::Enabled() = enable;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the calling thread's counts so far, with none available if they are off or
+// can't be had
+inline PerfCounts PerfRead()
+{
+#ifdef __linux__
+  if(PerfCountersEnabled()) {
+    thread_local PerfDetail::ThreadCounters counters;
+    return counters.read();
+  }
+#endif
+  return PerfCounts();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// what the calling thread counts from construction to counts()
+class PerfScope {
+public :
+  PerfScope() : _start(PerfRead()) {}
+
+  PerfCounts counts() const
+  {
+    PerfCounts now = PerfRead();
+    PerfCounts counts;
+    counts.available = now.available & _start.available;
+    for(int i = 0; i < ePerfCounterCount; i++)
+      counts.value[i] = counts.has(i) ? now.value[i] - _start.value[i] : 0;
+    return counts;
+  }
+
+private :
+  PerfCounts _start;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// counts summed over threads as they finish, safe to add to from any thread
+class PerfTotal {
+public :
+  void add(const PerfCounts &counts)
+  {
+    for(int i = 0; i < ePerfCounterCount; i++)
+      _value[i].fetch_add(counts.value[i], std::memory_order_relaxed);
+    _available.fetch_or(counts.available, std::memory_order_relaxed);
+  }
+
+  PerfCounts counts() const
+  {
+    PerfCounts counts;
+    for(int i = 0; i < ePerfCounterCount; i++)
+      counts.value[i] = _value[i].load(std::memory_order_relaxed);
+    counts.available = _available.load(std::memory_order_relaxed);
+    return counts;
+  }
+
+private :
+  std::atomic<uint64_t> _value[ePerfCounterCount] = {};
+  std::atomic<unsigned int> _available{0};
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// put the counts that were read on a span
+inline void TracePerfCounts(TraceSpan &span, const PerfCounts &counts)
+{
+  for(int i = 0; i < ePerfCounterCount; i++)
+    if(counts.has(i))
+      span.arg(PerfCounterName(i), double(counts.value[i]));
+}
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,212 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+What an effect instance's renders did, for the read-only statistics it shows
+so artists can see why it is slow.
+
+Each render opens a RenderStats::Render, and the threads working on it add
+the threads, depth samples and scratch they used to it with relaxed atomics,
+so recording never takes a lock or waits on another thread. When the render
+goes it leaves its figures as the instance's last render. Renders of tiles
+running at once each leave theirs, so the last render is whichever finished
+last, and the renders running at once are counted too.
+
+Cache hits and misses are counted over the instance's life. The effects show
+a snapshot of it all in parameters, which hosts only let them set outside
+render, and some not during a sequence render either, so the readout is only
+brought up to date when the instance is created or changed and when the host
+syncs private data before saving.
+*/
+
+#ifndef ZOKZIR_RENDER_STATS_H
+#define ZOKZIR_RENDER_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// the statistics at a moment
+struct RenderStatsSnapshot {
+  uint64_t renders;           // finished renders
+  double lastSeconds;         // wall time of the last render
+  double lastPixels;          // pixels it rendered
+  unsigned int lastThreads;   // threads that ran its kernels
+  unsigned int concurrent;    // the most renders that have run at once
+  uint64_t lastSamples;       // source samples it took, 0 for effects that don't count them
+  uint64_t cacheHits;
+  uint64_t cacheMisses;
+  uint64_t diskHits;          // hits that came from the disk cache, also counted in cacheHits
+  size_t scratchPeak;         // the most scratch one of its threads held
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// an instance's statistics, safe to record into from any thread
+class RenderStats {
+public :
+  ////////////////////////////////////////////////////////////////////////////////
+  // a render in flight
+  class Render {
+  public :
+    Render(RenderStats &stats, double pixels)
+      : _stats(stats)
+      , _pixels(pixels)
+      , _start(std::chrono::steady_clock::now())
+    {
+      unsigned int running = ++_stats._running;
+      unsigned int concurrent = _stats._concurrent.load(std::memory_order_relaxed);
+      while(running > concurrent && !_stats._concurrent.compare_exchange_weak(concurrent, running, std::memory_order_relaxed)) {}
+    }
+
+    ~Render()
+    {
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+      _stats._lastSeconds.store(seconds, std::memory_order_relaxed);
+      _stats._lastPixels.store(_pixels, std::memory_order_relaxed);
+      unsigned int threads = std::max(_threads.load(std::memory_order_relaxed), _spread.load(std::memory_order_relaxed));
+      _stats._lastThreads.store(std::max(1u, threads), std::memory_order_relaxed);
+      _stats._lastSamples.store(_samples.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      _stats._lastScratch.store(_scratch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      _stats._renders.fetch_add(1, std::memory_order_relaxed);
+      --_stats._running;
+    }
+
+    // a thread working on the render, which took samples and held scratch bytes at most
+    void addThread(uint64_t samples, size_t scratch)
+    {
+      _threads.fetch_add(1, std::memory_order_relaxed);
+      _samples.fetch_add(samples, std::memory_order_relaxed);
+      size_t peak = _scratch.load(std::memory_order_relaxed);
+      while(scratch > peak && !_scratch.compare_exchange_weak(peak, scratch, std::memory_order_relaxed)) {}
+    }
+
+    // a thread of a step spread over threads, counted by spreadOver, held
+    // scratch bytes at most
+    void addScratch(size_t scratch)
+    {
+      size_t peak = _scratch.load(std::memory_order_relaxed);
+      while(scratch > peak && !_scratch.compare_exchange_weak(peak, scratch, std::memory_order_relaxed)) {}
+    }
+
+    // the render also had a step spread over threads at once
+    void spreadOver(unsigned int threads)
+    {
+      unsigned int spread = _spread.load(std::memory_order_relaxed);
+      while(threads > spread && !_spread.compare_exchange_weak(spread, threads, std::memory_order_relaxed)) {}
+    }
+
+  private :
+    Render(const Render &);
+    Render &operator=(const Render &);
+
+    RenderStats &_stats;
+    double _pixels;
+    std::chrono::steady_clock::time_point _start;
+    std::atomic<unsigned int> _threads{0};
+    std::atomic<unsigned int> _spread{0};
+    std::atomic<uint64_t> _samples{0};
+    std::atomic<size_t> _scratch{0};
+  };
+
+  void cacheHit(bool fromDisk = false)
+  {
+    _cacheHits.fetch_add(1, std::memory_order_relaxed);
+    if(fromDisk)
+      _diskHits.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void cacheMiss()
+  {
+    _cacheMisses.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  RenderStatsSnapshot snapshot() const
+  {
+    RenderStatsSnapshot s;
+    s.renders = _renders.load(std::memory_order_relaxed);
+    s.lastSeconds = _lastSeconds.load(std::memory_order_relaxed);
+    s.lastPixels = _lastPixels.load(std::memory_order_relaxed);
+    s.lastThreads = _lastThreads.load(std::memory_order_relaxed);
+    s.concurrent = _concurrent.load(std::memory_order_relaxed);
+    s.lastSamples = _lastSamples.load(std::memory_order_relaxed);
+    s.cacheHits = _cacheHits.load(std::memory_order_relaxed);
+    s.cacheMisses = _cacheMisses.load(std::memory_order_relaxed);
+    s.diskHits = _diskHits.load(std::memory_order_relaxed);
+    s.scratchPeak = _lastScratch.load(std::memory_order_relaxed);
+    return s;
+  }
+
+private :
+  std::atomic<uint64_t> _renders{0};
+  std::atomic<double> _lastSeconds{0.};
+  std::atomic<double> _lastPixels{0.};
+  std::atomic<unsigned int> _lastThreads{0};
+  std::atomic<unsigned int> _running{0};
+  std::atomic<unsigned int> _concurrent{0};
+  std::atomic<uint64_t> _lastSamples{0};
+  std::atomic<size_t> _lastScratch{0};
+  std::atomic<uint64_t> _cacheHits{0};
+  std::atomic<uint64_t> _cacheMisses{0};
+  std::atomic<uint64_t> _diskHits{0};
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// a snapshot as the lines of the readout
+struct RenderStatsText {
+  std::string lastRender;   // "12.5 ms, 2.07 Mpix at 166 Mpix/s"
+  std::string threads;      // "16, 2 renders at once"
+  std::string samples;      // "2.41 a pixel"
+  std::string cache;        // "75% of 8 lookups, 2 from disk"
+  std::string scratch;      // "1.5 MB" or "96 KB"
+};
+
+inline RenderStatsText FormatRenderStats(const RenderStatsSnapshot &s)
+{
+  RenderStatsText text;
+  if(s.renders == 0) {
+    text.lastRender = text.threads = text.samples = text.scratch = "not rendered yet";
+  }
+  else {
+    char buffer[128];
+    double megapixels = s.lastPixels * 1e-6;
+    snprintf(buffer, sizeof(buffer), "%.3g ms, %.3g Mpix at %.3g Mpix/s",
+             s.lastSeconds * 1e3, megapixels, s.lastSeconds > 0. ? megapixels / s.lastSeconds : 0.);
+    text.lastRender = buffer;
+    if(s.concurrent > 1)
+      snprintf(buffer, sizeof(buffer), "%u, %u renders at once", s.lastThreads, s.concurrent);
+    else
+      snprintf(buffer, sizeof(buffer), "%u", s.lastThreads);
+    text.threads = buffer;
+    snprintf(buffer, sizeof(buffer), "%.3g a pixel", s.lastPixels > 0. ? double(s.lastSamples) / s.lastPixels : 0.);
+    text.samples = buffer;
+    if(s.scratchPeak < (1 << 20))
+      snprintf(buffer, sizeof(buffer), "%.3g KB", double(s.scratchPeak) / (1 << 10));
+    else
+      snprintf(buffer, sizeof(buffer), "%.3g MB", double(s.scratchPeak) / (1 << 20));
+    text.scratch = buffer;
+  }
+
+  uint64_t lookups = s.cacheHits + s.cacheMisses;
+  if(lookups == 0) {
+    text.cache = "not used yet";
+  }
+  else {
+    char buffer[128];
+    int n = snprintf(buffer, sizeof(buffer), "%.0f%% of %llu lookups", 100. * double(s.cacheHits) / double(lookups),
+                     (unsigned long long) lookups);
+    if(s.diskHits)
+      snprintf(buffer + n, sizeof(buffer) - n, ", %llu from disk", (unsigned long long) s.diskHits);
+    text.cache = buffer;
+  }
+  return text;
+}
+
+} // namespace Zokzir
+
+#endif
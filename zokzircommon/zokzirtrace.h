@@ -0,0 +1,335 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Tracing for the Zokzir effects, written as Chrome trace event JSON that
+chrome://tracing or Perfetto can open.
+
+It is off unless the ZOKZIR_TRACE environment variable is set when the
+effect is loaded, and then costs a test of a flag per span. Set it to a file
+name, in which %p becomes the process id and %m the module, or to 1 for
+zokzir-%m-%p.json in the working directory. The file is written when the
+effect is unloaded and again when the process exits.
+
+Spans are meant for actions, phases of a render and the share of a render
+each thread does, not for single pixels. Every event takes a lock.
+*/
+
+#ifndef ZOKZIR_TRACE_H
+#define ZOKZIR_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#  include <process.h>
+#else
+#  include <unistd.h>
+#endif
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// one event, as the trace event format has it
+struct TraceEvent {
+  char name[64];
+  const char *category;   // always a literal
+  char phase;             // 'X' span, 'C' counter, 'i' instant
+  uint32_t thread;
+  double start;           // microseconds since the trace started
+  double duration;
+  int nArgs;
+  const char *argNames[10];
+  double argValues[10];
+  std::string message;    // the text of an instant, if any
+};
+
+namespace TraceDetail {
+
+  // the most events kept, so a long session can't eat the machine
+  const size_t kMaxEvents = size_t(1) << 20;
+
+  struct State {
+    bool enabled = false;
+    std::string path;
+    std::string module = "zokzir";
+    bool moduleNamed = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    size_t dropped = 0;
+
+    std::atomic<uint32_t> nextThread{0};
+    std::atomic<int64_t> scratch{0};
+    std::atomic<int64_t> scratchPeak{0};
+
+    State()
+    {
+      const char *trace = getenv("ZOKZIR_TRACE");
+      if(trace && *trace && strcmp(trace, "0") != 0) {
+        enabled = true;
+        path = strcmp(trace, "1") == 0 ? "zokzir-%m-%p.json" : trace;
+      }
+    }
+
+    ~State();
+  };
+
+  inline State &GetState()
+  {
+    static State state;
+    return state;
+  }
+
+  // small numbers for the threads, in the order they first trace something
+  inline uint32_t ThreadNumber()
+  {
+    thread_local uint32_t number = GetState().nextThread++;
+    return number;
+  }
+
+  inline double Now()
+  {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - GetState().start).count();
+  }
+
+  inline void Add(const TraceEvent &event)
+  {
+    State &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if(state.events.size() < kMaxEvents)
+      state.events.push_back(event);
+    else
+      state.dropped++;
+  }
+
+  inline void WriteString(FILE *f, const char *s)
+  {
+    fputc('"', f);
+    for(; *s; s++) {
+      unsigned char c = (unsigned char) *s;
+      if(c == '"' || c == '\\')
+        fprintf(f, "\\%c", c);
+      else if(c < 0x20)
+        fprintf(f, "\\u%04x", c);
+      else
+        fputc(c, f);
+    }
+    fputc('"', f);
+  }
+
+  // write every event so far, replacing what an earlier flush wrote
+  inline void Write(State &state)
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if(!state.enabled || state.events.empty())
+      return;
+
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    std::string path;
+    for(size_t i = 0; i < state.path.size(); i++) {
+      if(state.path[i] == '%' && i + 1 < state.path.size() && state.path[i + 1] == 'p') {
+        path += std::to_string(pid);
+        i++;
+      }
+      else if(state.path[i] == '%' && i + 1 < state.path.size() && state.path[i + 1] == 'm') {
+        path += state.module;
+        i++;
+      }
+      else {
+        path += state.path[i];
+      }
+    }
+
+    FILE *f = fopen(path.c_str(), "w");
+    if(!f) {
+      fprintf(stderr, "Zokzir: could not write the trace to %s\n", path.c_str());
+      return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"scratchPeakBytes\":%lld,\"droppedEvents\":%zu},\"traceEvents\":[\n",
+            (long long) state.scratchPeak.load(), state.dropped);
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":", pid);
+    WriteString(f, state.module.c_str());
+    fprintf(f, "}}");
+
+    for(const TraceEvent &event : state.events) {
+      fprintf(f, ",\n{\"name\":");
+      WriteString(f, event.name);
+      fprintf(f, ",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+              event.category, event.phase, pid, event.thread, event.start);
+      if(event.phase == 'X')
+        fprintf(f, ",\"dur\":%.3f", event.duration);
+      if(event.phase == 'i')
+        fprintf(f, ",\"s\":\"t\"");
+      fprintf(f, ",\"args\":{");
+      for(int i = 0; i < event.nArgs; i++)
+        fprintf(f, "%s\"%s\":%.17g", i ? "," : "", event.argNames[i], event.argValues[i]);
+      if(!event.message.empty()) {
+        fprintf(f, "%s\"message\":", event.nArgs ? "," : "");
+        WriteString(f, event.message.c_str());
+      }
+      fprintf(f, "}}");
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+  }
+
+  inline State::~State()
+  {
+    Write(*this);
+  }
+
+  inline void Start(TraceEvent &event, const char *name, const char *category, char phase)
+  {
+    size_t length = std::min(strlen(name), sizeof(event.name) - 1);
+    memcpy(event.name, name, length);
+    event.name[length] = 0;
+    event.category = category;
+    event.phase = phase;
+    event.thread = ThreadNumber();
+    event.start = Now();
+    event.duration = 0;
+    event.nArgs = 0;
+  }
+
+} // namespace TraceDetail
+
+////////////////////////////////////////////////////////////////////////////////
+// is anything being traced
+inline bool TraceEnabled()
+{
+  return TraceDetail::GetState().enabled;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// name the module in the file name and the trace, the first name given wins
+inline void TraceSetModule(const char *module)
+{
+  TraceDetail::State &state = TraceDetail::GetState();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if(!state.moduleNamed) {
+    state.module = module;
+    state.moduleNamed = true;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// write the trace now rather than at exit
+inline void TraceFlush()
+{
+  TraceDetail::Write(TraceDetail::GetState());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// a span from construction to destruction, with a few numbers to go with it
+class TraceSpan {
+public :
+  TraceSpan(const char *name, const char *category)
+    : _enabled(TraceEnabled())
+  {
+    if(_enabled)
+      TraceDetail::Start(_event, name, category, 'X');
+  }
+
+  ~TraceSpan()
+  {
+    if(_enabled) {
+      _event.duration = TraceDetail::Now() - _event.start;
+      TraceDetail::Add(_event);
+    }
+  }
+
+  // name must be a literal, or live as long as the trace
+  void arg(const char *name, double value)
+  {
+    if(_enabled && _event.nArgs < int(sizeof(_event.argNames) / sizeof(_event.argNames[0]))) {
+      _event.argNames[_event.nArgs] = name;
+      _event.argValues[_event.nArgs++] = value;
+    }
+  }
+
+private :
+  TraceSpan(const TraceSpan &);
+  TraceSpan &operator=(const TraceSpan &);
+
+  bool _enabled;
+  TraceEvent _event;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// a value over time, drawn as a graph
+inline void TraceCounter(const char *name, const char *series, double value)
+{
+  if(!TraceEnabled())
+    return;
+  TraceEvent event;
+  TraceDetail::Start(event, name, "counter", 'C');
+  event.nArgs = 1;
+  event.argNames[0] = series;
+  event.argValues[0] = value;
+  TraceDetail::Add(event);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// a moment with a message, such as an error
+inline void TraceInstant(const char *name, const char *category, const std::string &message)
+{
+  if(!TraceEnabled())
+    return;
+  TraceEvent event;
+  TraceDetail::Start(event, name, category, 'i');
+  event.message = message;
+  TraceDetail::Add(event);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// scratch memory held from construction to destruction, traced as the total
+// held by every thread and its peak
+class TraceScratch {
+public :
+  explicit TraceScratch(size_t bytes)
+    : _bytes(TraceEnabled() ? int64_t(bytes) : 0)
+  {
+    if(_bytes)
+      update(_bytes);
+  }
+
+  ~TraceScratch()
+  {
+    if(_bytes)
+      update(-_bytes);
+  }
+
+private :
+  TraceScratch(const TraceScratch &);
+  TraceScratch &operator=(const TraceScratch &);
+
+  static void update(int64_t change)
+  {
+    TraceDetail::State &state = TraceDetail::GetState();
+    int64_t now = state.scratch += change;
+    int64_t peak = state.scratchPeak.load();
+    while(now > peak && !state.scratchPeak.compare_exchange_weak(peak, now)) {}
+    TraceCounter("scratch memory", "bytes", double(now));
+  }
+
+  int64_t _bytes;
+};
+
+} // namespace Zokzir
+
+#endif
@@ -16,20 +16,29 @@ The main features are
 
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
-#else
-#  error Zokzir OFX is for Windows only, bro.
 #endif
 
 #include <stdio.h>
 #include <math.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 
-#include "ofxsCoords.h"
-#include "ofxsFilter.h"
 #include "ofxsProcessing.H"
 #include "ofxsMatrix2D.h"
 
+#include "zokzircache.h"
+#include "zokzircost.h"
+#include "zokzircpu.h"
+#include "zokzirdiskcache.h"
+#include "zokzirdrosteprocess.h"
+#include "zokzirperf.h"
+#include "zokzirrenderstats.h"
+#include "zokzirtrace.h"
+
 #define kPluginName "Zokzir Droste"
 #define kPluginGrouping "SalkocsisFX"
 #define kPluginDescription "Makes a droste effect"
@@ -98,84 +107,109 @@ enum LayeringEnum
 #define kParamMaxDepthLabel "Max Depth"
 #define kParamMaxDepthHint "If the image seems to be clipped, try to change this, will impact performance if the difference between Max Depth and Min Depth is large"
 
-inline OfxPointD cExp(OfxPointD c) {
-  double s = exp(c.x);
-  return (OfxPointD){
-    s * cos(c.y),
-    s * sin(c.y)
-  };
-}
+#define kParamAntialiasing "antialiasing"
+#define kParamAntialiasingLabel "Antialiasing"
+#define kParamAntialiasingHint "Off takes one sample a pixel. Adaptive takes more where the spiral shrinks the image, towards the vanishing point, and along the seams between strips, and one everywhere else, smoothing those pixels as rendering bigger and scaling down would"
+#define kParamAntialiasingOptionOff "Off", "One sample a pixel", "off"
+#define kParamAntialiasingOptionAdaptive "Adaptive", "More samples only where the pixel needs them", "adaptive"
 
-inline OfxPointD cLog(OfxPointD c) {
-  return (OfxPointD){
-    log(sqrt(c.x * c.x + c.y * c.y)),
-    atan2(c.y, c.x)
-  };
-}
+enum AntialiasingEnum
+{
+  eAntialiasingOff,
+  eAntialiasingAdaptive,
+};
 
-inline OfxPointD cRec(OfxPointD c) {
-  double s = c.x * c.x + c.y * c.y;
-  return (OfxPointD){
-    c.x / s,
-    -c.y / s
-  };
-}
+#define kParamMaxSamples "maxSamples"
+#define kParamMaxSamplesLabel "Max Samples"
+#define kParamMaxSamplesHint "The most samples an antialiased pixel takes, on a square grid of an odd side around the pixel centre, so 9 is 3 by 3 and 16 is also 3 by 3"
 
-inline OfxPointD cMul(OfxPointD a, OfxPointD b) {
-  return (OfxPointD){
-    a.x * b.x - a.y * b.y,
-    a.x * b.y + a.y * b.x
-  };
-}
+#define kParamWorkBudget "workBudget"
+#define kParamWorkBudgetLabel "Work Budget"
+#define kParamWorkBudgetHint "The most depth samples a pixel may take, counting every depth from Min Depth to Max Depth and every antialiasing sample. A render that would take more cuts back Max Samples, then renders only the depths nearest 0 and says so, so a ratio near 1 or a wide depth range can't stall a render"
 
-inline OfxPointD cDiv(OfxPointD a, OfxPointD b) {
-  double s = b.x * b.x + b.y * b.y;
-  return (OfxPointD){
-    (a.x * b.x + a.y * b.y) / s,
-    (a.y * b.x - a.x * b.y) / s
-  };
-}
+#define kParamColourGroup "colour"
+#define kParamColourGroupLabel "Colour"
 
-inline OfxPointD cAdd(OfxPointD a, OfxPointD b) {
-  return (OfxPointD) {
-    a.x + b.x,
-    a.y + b.y
-  };
-}
+#define kParamColourStage "colourStage"
+#define kParamColourStageLabel "Colour Stage"
+#define kParamColourStageHint "Run the saturation and invert below as part of the effect, in the same pass. Per Sample colours each source pixel the warp reads before it is filtered, On Result colours the output as if Saturation and Negative came after Droste"
+#define kParamColourStageOptionOff "Off", "No colour stage", "off"
+#define kParamColourStageOptionPerSample "Per Sample", "Colour every sample of the source", "perSample"
+#define kParamColourStageOptionOnResult "On Result", "Colour the composited pixel", "onResult"
 
-inline OfxPointD cSub(OfxPointD a, OfxPointD b) {
-  return (OfxPointD) {
-    a.x - b.x,
-    a.y - b.y
-  };
-}
+#define kParamColourSaturation "colourSaturation"
+#define kParamColourSaturationLabel "Saturation"
+#define kParamColourSaturationHint "As the Saturation effect's saturation"
 
-inline OfxPointD cMulS(OfxPointD c, double s) {
-  return (OfxPointD) {
-    c.x * s,
-    c.y * s
-  };
-}
+#define kParamColourLumaWeights "colourLumaWeights"
+#define kParamColourLumaWeightsLabel "Luma Weights"
+#define kParamColourLumaWeightsHint "As the Saturation effect's luma weights"
 
-inline OfxPointD cDivS(OfxPointD c, double s) {
-  return (OfxPointD) {
-    c.x / s,
-    c.y / s
-  };
-}
+#define kParamColourGain "colourGain"
+#define kParamColourGainLabel "Gain"
+#define kParamColourGainHint "As the Saturation effect's gain"
 
-inline void over(float *dst, float *src, float *out) {
-  out[3] = src[3] + dst[3] * (1. - src[3]); // alpha
-  if (out[3] != 0.) {
-    for (int i=0; i<3; i++) {
-      out[i] = (src[i] * src[3] + dst[i] * dst[3] * (1. - src[3])) / out[3];
-    }
-  } else {
-    out[0] = out[1] = out[2] = 0.;
+#define kParamColourOffset "colourOffset"
+#define kParamColourOffsetLabel "Offset"
+#define kParamColourOffsetHint "As the Saturation effect's offset"
+
+#define kParamColourInvert "colourInvert"
+#define kParamColourInvertLabel "Invert"
+#define kParamColourInvertHint "Invert every component, alpha included, after the saturation, as the Negative effect does"
+
+#define kParamCostEstimate "costEstimate"
+#define kParamCostEstimateLabel "Estimated Cost"
+#define kParamCostEstimateHint "The CPU seconds, over every thread, and memory a full size frame at the current time is predicted to take, for scheduling renders. An upper bound for alpha and RGBA"
+
+#define kParamStatsGroup "statistics"
+#define kParamStatsGroupLabel "Render Statistics"
+
+#define kParamStatsLastRender "statsLastRender"
+#define kParamStatsLastRenderLabel "Last Render"
+#define kParamStatsLastRenderHint "How long the last render took, the pixels it made and how fast"
+
+#define kParamStatsThreads "statsThreads"
+#define kParamStatsThreadsLabel "Threads"
+#define kParamStatsThreadsHint "The threads the last render ran on, and the most renders the host has run at once"
+
+#define kParamStatsSamples "statsSamples"
+#define kParamStatsSamplesLabel "Depth Samples"
+#define kParamStatsSamplesHint "The depths the last render sampled for each pixel. A pixel stops at the first depth that makes it opaque, so a Min Depth to Max Depth range wider than this only costs where the image is transparent"
+
+#define kParamStatsCache "statsCache"
+#define kParamStatsCacheLabel "Warp Cache"
+#define kParamStatsCacheHint "How often a render found its warp table already made, in memory or on disk, since the effect was made. Animating the position, zoom, spin, ratio, rotation or evolution makes a table for every frame"
+
+// an OFX depth as the kernels know it
+static Zokzir::PixelDepthEnum PixelDepthOf(OFX::BitDepthEnum depth)
+{
+  switch(depth) {
+    case OFX::eBitDepthUByte : return Zokzir::ePixelDepthByte;
+    case OFX::eBitDepthUShort : return Zokzir::ePixelDepthShort;
+    case OFX::eBitDepthHalf : return Zokzir::ePixelDepthHalf;
+    case OFX::eBitDepthFloat : return Zokzir::ePixelDepthFloat;
+    default : return Zokzir::ePixelDepthNone;
   }
 }
 
-// Base class for the RGBA and the Alpha processor
+// an OFX image as the kernels take it
+static Zokzir::ImageView ImageViewOf(const OFX::Image *image)
+{
+  Zokzir::ImageView view;
+  if(!image)
+    return view;
+  view.data = (char *) image->getPixelData();
+  view.rowBytes = image->getRowBytes();
+  view.bounds = image->getBounds();
+  view.nComponents = image->getPixelComponentCount();
+  view.premultiplied = image->getPreMultiplication() == OFX::eImagePreMultiplied;
+  view.depth = PixelDepthOf(image->getPixelDepth());
+  if(view.depth == Zokzir::ePixelDepthNone)
+    view.data = NULL;
+  return view;
+}
+
+// Base class for the processor
 class DrosteBase : public OFX::ImageProcessor {
 protected :
   OFX::Image *_srcImg;
@@ -192,6 +226,21 @@ protected :
   int           _minDepth;
   int           _maxDepth;
 
+  Zokzir::DrosteColour _colour;
+  int _maxSamples;
+
+  // the tiled log polar point of every pixel of the render window, which
+  // doesn't change with the depth, read from a cached table or written to a
+  // new one, or neither
+  const OfxPointD *_warpIn;
+  OfxPointD       *_warpOut;
+
+  // where the threads record what they did, if anywhere
+  Zokzir::RenderStats::Render *_stats;
+
+  // the hardware counts of the threads, summed as they finish
+  Zokzir::PerfTotal _perf;
+
   OFX::RenderArguments _args;
 public :
   /** @brief no arg ctor */
@@ -209,12 +258,36 @@ public :
     , _evolution(0.)
     , _minDepth(-2)
     , _maxDepth(2)
+    , _colour()
+    , _maxSamples(1)
+    , _warpIn(NULL)
+    , _warpOut(NULL)
+    , _stats(NULL)
   {        
   }
 
   /** @brief set the src image */
   void setSrcImg(OFX::Image *v) {_srcImg = v;}
 
+  /** @brief set the colour stage */
+  void setColour(const Zokzir::DrosteColour &colour) {_colour = colour;}
+
+  /** @brief set the most samples a pixel takes, 1 for no antialiasing */
+  void setMaxSamples(int maxSamples) {_maxSamples = maxSamples;}
+
+  /** @brief set the warp table to read, or to fill in */
+  void setWarpTable(const OfxPointD *in, OfxPointD *out)
+  {
+    _warpIn = in;
+    _warpOut = out;
+  }
+
+  /** @brief set the render the threads record their statistics in */
+  void setStats(Zokzir::RenderStats::Render *stats) {_stats = stats;}
+
+  /** @brief the hardware counts of every thread that processed, see zokzirperf.h */
+  Zokzir::PerfCounts perfCounts() const {return _perf.counts();}
+
   void setRenderArguments(const OFX::RenderArguments &args) {
     _args = args;
   }
@@ -246,8 +319,7 @@ public :
   }
 };
 
-// template to do the RGBA processing
-template <class PIX, int nComponents, int max>
+// the processor, which hands each thread's share to the kernel library
 class Droste : public DrosteBase {
 public :
   // ctor
@@ -258,100 +330,83 @@ public :
   // and do some processing
   void multiThreadProcessImages(OfxRectI procWindow)
   {
-    OfxPointD renderScale = _dstImg->getRenderScale();
-    double par = _dstImg->getPixelAspectRatio();
-
-    OfxRectD bounds;
-    OFX::Coords::toCanonical(_dstImg->getBounds(), renderScale, par, &bounds);
-
-    const double two_pi = 2.0 * OFX::ofxsPi();
-    const double r2 = _radius;
-    const double r1 = r2 * _ratio;
-    const double scale = log(r2 / r1);
-    const double angle = atan2(_spin * scale, two_pi);
-
-    double cos_angle = cos(angle);
-    OfxPointD complex_angle = cExp((OfxPointD) {0, angle});
-
-    for(int y = procWindow.y1; y < procWindow.y2; y++) {
-      if(_effect.abort()) break;
-
-      PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-      for(int x = procWindow.x1; x < procWindow.x2; x++) {
-
-        OfxPointD t_canonical;
-        OFX::Coords::toCanonicalSub((OfxPointD){x, y}, renderScale, par, &t_canonical);
-
-        float dst[4] = {0., 0., 0., 0.};
-        for (int i=_minDepth; i<=_maxDepth; i++) {
-          int depth;
-          if (_layering == eLayeringOnFront) {
-            depth = i;
-          } else if (_layering == eLayeringOnBack) {
-            depth = _maxDepth + _minDepth - i;
-          } else {
-            depth = i;
-          }
-
-          OfxPointD c = t_canonical;
-
-          // 10. Translate to position
-          c = cSub(c, _position);
-
-          // 9. Take the tiled strips back to ordinary space
-          c = cLog(c);
-
-          // 8. To zoom
-          c.x -= scale * _zoom;
-
-          // 7. Make spiral
-          c = cDiv(cDivS(c, cos_angle), complex_angle);
-
-          // 6. To rotate
-          c.y -= two_pi * fmod(_rotation, 1.);
-
-          // 5. Evolution (zoom with looping)
-          c.x -= scale * fmod(_evolution, 1.);
-
-          // 4. Tile the strips
-          c.x = fmod(c.x, scale);
-
-          // 3. Offset the depth
-          c.x += scale * (double) depth;
-
-          // 2. Convert to strip
-          c = cMulS(cExp(c), r1);
-
-          // 1. Take from center
-          c = cAdd(c, _center);
-
-          OfxPointD t_pixel;
-          OFX::Coords::toPixelSub(c, renderScale, par, &t_pixel);
-
-          float src[4];
-          OFX::ofxsFilterInterpolate2D<PIX, nComponents, OFX::eFilterCubic, false>(t_pixel.x, t_pixel.y, _srcImg, true, src);
+    Zokzir::TraceSpan span("process rows", "kernel");
+    span.arg("pixels", double(procWindow.x2 - procWindow.x1) * (procWindow.y2 - procWindow.y1));
+    span.arg("depths", _maxDepth - _minDepth + 1);
+    Zokzir::PerfScope perf;
+
+    Zokzir::DrosteValues values;
+    values.layering = _layering == eLayeringOnBack ? Zokzir::eDrosteLayeringOnBack : Zokzir::eDrosteLayeringOnFront;
+    values.spin = _spin;
+    values.radius = _radius;
+    values.ratio = _ratio;
+    values.center = _center;
+    values.position = _position;
+    values.zoom = _zoom;
+    values.rotation = _rotation;
+    values.evolution = _evolution;
+    values.minDepth = _minDepth;
+    values.maxDepth = _maxDepth;
+    values.colour = _colour;
+    values.maxSamples = _maxSamples;
+
+    uint64_t samples = Zokzir::DrosteProcess(values,
+                                             ImageViewOf(_srcImg),
+                                             ImageViewOf(_dstImg),
+                                             _dstImg->getRenderScale(),
+                                             _dstImg->getPixelAspectRatio(),
+                                             _renderWindow,
+                                             procWindow,
+                                             _warpIn,
+                                             _warpOut,
+                                             Zokzir::CancelCheck(AbortCallback, &_effect));
+    if(_stats)
+      _stats->addThread(samples, 0);   // the rows take no scratch
+
+    Zokzir::PerfCounts counts = perf.counts();
+    Zokzir::TracePerfCounts(span, counts);
+    _perf.add(counts);
+  }
 
-          float out[4];
-          over(dst, src, out);
+private :
+  static bool AbortCallback(void *effect)
+  {
+    return ((OFX::ImageEffect *) effect)->abort();
+  }
+};
 
-          // copy out to src
-          for (int i=0; i<4; i++) {
-            dst[i] = out[i];
-          }
-        }
+////////////////////////////////////////////////////////////////////////////////
+// what a warp table depends on, everything up to tiling the strips, all
+// doubles so the key has no padding
+struct WarpKey {
+  double renderWindow[4];
+  double renderScale[2];
+  double par;
+  double position[2];
+  double zoom;
+  double spin;
+  double radius;
+  double ratio;
+  double rotation;
+  double evolution;
+};
 
-        for (int c = 0; c < nComponents; c++) {
-          dstPix[c] = dst[c] * max;
-        }
+// the tiled log polar point of every pixel of a render window, row by row,
+// computed here or mapped from the disk cache
+struct WarpTable {
+  std::vector<OfxPointD> points;
+  std::shared_ptr<const Zokzir::DiskCacheEntry> mapped;
 
-        // increment the dst pixel
-        dstPix += nComponents;
-      }
-    }
+  const OfxPointD *data() const
+  {
+    return mapped ? (const OfxPointD *) mapped->data() : points.data();
   }
 };
 
+// the kind of the warp tables in the disk cache, change it with WarpKey or the
+// layout of the table
+static const char *const kWarpTableKind = "droste-warp-1";
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class DrostePlugin : public OFX::ImageEffect {
@@ -371,6 +426,30 @@ protected :
   OFX::DoubleParam   *_evolution;
   OFX::IntParam      *_minDepth;
   OFX::IntParam      *_maxDepth;
+  OFX::ChoiceParam   *_antialiasing;
+  OFX::IntParam      *_maxSamples;
+  OFX::IntParam      *_workBudget;
+
+  OFX::ChoiceParam   *_colourStage;
+  OFX::DoubleParam   *_colourSaturation;
+  OFX::ChoiceParam   *_colourLumaWeights;
+  OFX::DoubleParam   *_colourGain;
+  OFX::DoubleParam   *_colourOffset;
+  OFX::BooleanParam  *_colourInvert;
+
+  OFX::StringParam   *_costEstimate;
+
+  OFX::StringParam   *_statsLastRender;
+  OFX::StringParam   *_statsThreads;
+  OFX::StringParam   *_statsSamples;
+  OFX::StringParam   *_statsCache;
+
+  // what the renders did, shown in the params above
+  Zokzir::RenderStats _stats;
+
+  // what the work budget guard last told the host, see reportGuard
+  std::mutex  _guardMutex;
+  std::string _guardMessage;
 
 public :
   /** @brief ctor */
@@ -389,6 +468,20 @@ public :
     , _evolution(NULL)
     , _minDepth(NULL)
     , _maxDepth(NULL)
+    , _antialiasing(NULL)
+    , _maxSamples(NULL)
+    , _workBudget(NULL)
+    , _colourStage(NULL)
+    , _colourSaturation(NULL)
+    , _colourLumaWeights(NULL)
+    , _colourGain(NULL)
+    , _colourOffset(NULL)
+    , _colourInvert(NULL)
+    , _costEstimate(NULL)
+    , _statsLastRender(NULL)
+    , _statsThreads(NULL)
+    , _statsSamples(NULL)
+    , _statsCache(NULL)
   {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     _srcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
@@ -403,13 +496,65 @@ public :
     _evolution  = fetchDoubleParam(kParamEvolution);
     _minDepth   = fetchIntParam(kParamMinDepth);
     _maxDepth   = fetchIntParam(kParamMaxDepth);
+    _antialiasing = fetchChoiceParam(kParamAntialiasing);
+    _maxSamples   = fetchIntParam(kParamMaxSamples);
+    _workBudget   = fetchIntParam(kParamWorkBudget);
+    _colourStage       = fetchChoiceParam(kParamColourStage);
+    _colourSaturation  = fetchDoubleParam(kParamColourSaturation);
+    _colourLumaWeights = fetchChoiceParam(kParamColourLumaWeights);
+    _colourGain        = fetchDoubleParam(kParamColourGain);
+    _colourOffset      = fetchDoubleParam(kParamColourOffset);
+    _colourInvert      = fetchBooleanParam(kParamColourInvert);
+    _costEstimate      = fetchStringParam(kParamCostEstimate);
+    _statsLastRender   = fetchStringParam(kParamStatsLastRender);
+    _statsThreads      = fetchStringParam(kParamStatsThreads);
+    _statsSamples      = fetchStringParam(kParamStatsSamples);
+    _statsCache        = fetchStringParam(kParamStatsCache);
+    updateCostEstimate(0.);
+    updateStatistics();
+  }
+
+  /** @brief dtor, drops what we left in the cache */
+  virtual ~DrostePlugin()
+  {
+    Zokzir::Cache::Instance().purge(this);
   }
 
   /* Override the render */
   virtual void render(const OFX::RenderArguments &args);
 
+  /* the host wants memory back */
+  virtual void purgeCaches(void)
+  {
+    Zokzir::Cache::Instance().purge(this);
+  }
+
+  /* never an identity, but the check is traced like the other actions */
+  virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip *&identityClip, double &identityTime);
+
+  /* keep the cost estimate and statistics up to date */
+  virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName);
+  virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName);
+  virtual void syncPrivateData(void);
+
   /* set up and run a processor */
   void setupAndProcess(DrosteBase &, const OFX::RenderArguments &args);
+
+private :
+  /* the source frame at time as the cost model sees it */
+  Zokzir::RenderShape renderShape(double time, const OfxPointD &renderScale);
+
+  /* predict what a full size frame at time costs, see zokzircost.h */
+  void updateCostEstimate(double time);
+
+  /* whether a warp table made now could serve other frames */
+  bool warpIsStatic();
+
+  /* show what the work budget guard did as a persistent message, or clear it */
+  void reportGuard(const std::string &text);
+
+  /* show what the renders did, hosts only let us set params outside render */
+  void updateStatistics();
 };
 
 
@@ -425,12 +570,20 @@ void
 DrostePlugin::setupAndProcess(DrosteBase &processor, const OFX::RenderArguments &args)
 {
   // get a dst image
-  std::auto_ptr<OFX::Image> dst(_dstClip->fetchImage(args.time));
+  std::unique_ptr<OFX::Image> dst;
+  {
+    Zokzir::TraceSpan span("fetch image", "host");
+    dst.reset(_dstClip->fetchImage(args.time));
+  }
   OFX::BitDepthEnum dstBitDepth       = dst->getPixelDepth();
   OFX::PixelComponentEnum dstComponents  = dst->getPixelComponents();
 
   // fetch main input image
-  std::auto_ptr<OFX::Image> src(_srcClip->fetchImage(args.time));
+  std::unique_ptr<OFX::Image> src;
+  {
+    Zokzir::TraceSpan span("fetch image", "host");
+    src.reset(_srcClip->fetchImage(args.time));
+  }
 
   // make sure bit depths are sane
   if(src.get()) {
@@ -443,17 +596,54 @@ DrostePlugin::setupAndProcess(DrosteBase &processor, const OFX::RenderArguments
   }
 
   // get parameters
-  LayeringEnum layering = (LayeringEnum) _layering->getValueAtTime(args.time);
-  int spin              = _spin->getValueAtTime(args.time);
-  double radius         = _radius->getValueAtTime(args.time);
-  double ratio          = _ratio->getValueAtTime(args.time);
-  OfxPointD center      = _center->getValueAtTime(args.time);
-  OfxPointD position    = _position->getValueAtTime(args.time);
-  double zoom           = _zoom->getValueAtTime(args.time);
-  double rotation       = _rotation->getValueAtTime(args.time);
-  double evolution      = _evolution->getValueAtTime(args.time);
-  int minDepth          = _minDepth->getValueAtTime(args.time);
-  int maxDepth          = _maxDepth->getValueAtTime(args.time);
+  LayeringEnum layering;
+  int spin, minDepth, maxDepth, maxSamples, workBudget;
+  double radius, ratio, zoom, rotation, evolution;
+  OfxPointD center, position;
+  Zokzir::DrosteColour colour;
+  {
+    Zokzir::TraceSpan span("fetch params", "host");
+    layering  = (LayeringEnum) _layering->getValueAtTime(args.time);
+    spin      = _spin->getValueAtTime(args.time);
+    radius    = _radius->getValueAtTime(args.time);
+    ratio     = _ratio->getValueAtTime(args.time);
+    center    = _center->getValueAtTime(args.time);
+    position  = _position->getValueAtTime(args.time);
+    zoom      = _zoom->getValueAtTime(args.time);
+    rotation  = _rotation->getValueAtTime(args.time);
+    evolution = _evolution->getValueAtTime(args.time);
+    minDepth  = _minDepth->getValueAtTime(args.time);
+    maxDepth  = _maxDepth->getValueAtTime(args.time);
+    maxSamples = _antialiasing->getValueAtTime(args.time) == eAntialiasingAdaptive ? _maxSamples->getValueAtTime(args.time) : 1;
+    workBudget = _workBudget->getValueAtTime(args.time);
+
+    // the kernel works on samples of 0 to 1, whatever the depth
+    colour.stage  = (Zokzir::DrosteColourStageEnum) _colourStage->getValueAtTime(args.time);
+    colour.matrix = Zokzir::BuildColourMatrix(_colourSaturation->getValueAtTime(args.time),
+                                              _colourLumaWeights->getValueAtTime(args.time),
+                                              _colourGain->getValueAtTime(args.time),
+                                              _colourOffset->getValueAtTime(args.time),
+                                              1.0f);
+    colour.invert = _colourInvert->getValueAtTime(args.time);
+  }
+
+  // a ratio near 1, a tiny radius or a wide depth range can take far more
+  // work than it shows, keep the render within its budget and say what we did
+  Zokzir::DrosteValues guarded = Zokzir::DrosteValues();
+  guarded.layering   = layering == eLayeringOnBack ? Zokzir::eDrosteLayeringOnBack : Zokzir::eDrosteLayeringOnFront;
+  guarded.radius     = radius;
+  guarded.ratio      = ratio;
+  guarded.center     = center;
+  guarded.minDepth   = minDepth;
+  guarded.maxDepth   = maxDepth;
+  guarded.maxSamples = maxSamples;
+  Zokzir::DrosteGuard guard = Zokzir::GuardDrosteValues(renderShape(args.time, args.renderScale), workBudget, guarded);
+  radius     = guarded.radius;
+  ratio      = guarded.ratio;
+  minDepth   = guarded.minDepth;
+  maxDepth   = guarded.maxDepth;
+  maxSamples = guarded.maxSamples;
+  reportGuard(Zokzir::FormatDrosteGuard(guard, guarded));
 
   // set the images
   processor.setDstImg(dst.get());
@@ -479,73 +669,211 @@ DrostePlugin::setupAndProcess(DrosteBase &processor, const OFX::RenderArguments
     minDepth,
     maxDepth
   );
+  processor.setColour(colour);
+  processor.setMaxSamples(maxSamples);
+
+  // the warp up to the depth is the same for every frame that shares these
+  // values, use a table from an earlier render or fill one in for later ones
+  WarpKey warpKey = {
+    {double(args.renderWindow.x1), double(args.renderWindow.y1), double(args.renderWindow.x2), double(args.renderWindow.y2)},
+    {args.renderScale.x, args.renderScale.y},
+    dst->getPixelAspectRatio(),
+    {position.x, position.y},
+    zoom,
+    double(spin),
+    radius,
+    ratio,
+    rotation,
+    evolution
+  };
+  size_t warpPoints = size_t(args.renderWindow.x2 - args.renderWindow.x1) * (args.renderWindow.y2 - args.renderWindow.y1);
+  // a table of an animated warp serves no other frame, so isn't looked for,
+  // kept or published
+  bool warpStatic = warpIsStatic();
+  std::shared_ptr<const WarpTable> warp = Zokzir::Cache::Instance().find<WarpTable>(this, warpKey);
+  bool fromMemory = bool(warp);
+  if(!warp && warpStatic) {
+    // another process on the machine may have made it already
+    std::shared_ptr<const Zokzir::DiskCacheEntry> mapped = Zokzir::DiskCache::Instance().find(kWarpTableKind, warpKey);
+    if(mapped && mapped->size() == warpPoints * sizeof(OfxPointD)) {
+      std::shared_ptr<WarpTable> fromDisk = std::make_shared<WarpTable>();
+      fromDisk->mapped = mapped;
+      Zokzir::Cache::Instance().insert<WarpTable>(this, warpKey, fromDisk, mapped->size());
+      warp = fromDisk;
+    }
+  }
+  if(warp)
+    _stats.cacheHit(!fromMemory);
+  else
+    _stats.cacheMiss();
+
+  // only fill in a table another frame could use, one the cache would keep,
+  // as it costs sixteen bytes a pixel over the whole window
+  std::shared_ptr<WarpTable> newWarp;
+  if(warp) {
+    processor.setWarpTable(warp->data(), NULL);
+  }
+  else if(!warpStatic || warpPoints * sizeof(OfxPointD) > Zokzir::Cache::Instance().budget()) {
+    processor.setWarpTable(NULL, NULL);
+  }
+  else {
+    newWarp = std::make_shared<WarpTable>();
+    newWarp->points.resize(warpPoints);
+    processor.setWarpTable(NULL, newWarp->points.data());
+  }
 
   // Call the base class process member, this will call the derived templated process code
+  Zokzir::TraceSpan span("process", "kernel");
+  span.arg("pixels", double(args.renderWindow.x2 - args.renderWindow.x1) * (args.renderWindow.y2 - args.renderWindow.y1));
+  span.arg("warpCached", warp ? 1. : 0.);
+  span.arg("guard", guard.flags);
   processor.process();
+  Zokzir::TracePerfCounts(span, processor.perfCounts());
+
+  // a render that stopped part way leaves holes in the table
+  if(newWarp && !abort()) {
+    size_t bytes = newWarp->points.size() * sizeof(OfxPointD);
+    Zokzir::Cache::Instance().insert<WarpTable>(this, warpKey, newWarp, bytes);
+    // tables run to many megabytes, let the cache's thread write them out
+    if(warpStatic)
+      Zokzir::DiskCache::Instance().publishLater(kWarpTableKind, warpKey, newWarp, newWarp->points.data(), bytes);
+  }
 }
 
 // the overridden render function
 void
 DrostePlugin::render(const OFX::RenderArguments &args)
 {
-  // instantiate the render code based on the pixel depth of the dst clip
+  Zokzir::TraceSpan span("render", "render");
+  span.arg("pixels", double(args.renderWindow.x2 - args.renderWindow.x1) * (args.renderWindow.y2 - args.renderWindow.y1));
+  span.arg("renderScale", args.renderScale.x);
+
+  // the kernel does byte, short and float, alpha, RGB and RGBA
   OFX::BitDepthEnum       dstBitDepth    = _dstClip->getPixelDepth();
   OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+  if((dstBitDepth != OFX::eBitDepthUByte && dstBitDepth != OFX::eBitDepthUShort && dstBitDepth != OFX::eBitDepthFloat) ||
+     (dstComponents != OFX::ePixelComponentRGBA && dstComponents != OFX::ePixelComponentRGB &&
+      dstComponents != OFX::ePixelComponentAlpha)) {
+    OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+  }
 
   // do the rendering
-  if(dstComponents == OFX::ePixelComponentRGBA) {
-    switch(dstBitDepth) {
-case OFX::eBitDepthUByte : {      
-  Droste<unsigned char, 4, 255> fred(*this);
+  Zokzir::RenderStats::Render stats(_stats, double(args.renderWindow.x2 - args.renderWindow.x1) * (args.renderWindow.y2 - args.renderWindow.y1));
+  Droste fred(*this);
+  fred.setStats(&stats);
   setupAndProcess(fred, args);
-                           }
-                           break;
+}
 
-case OFX::eBitDepthUShort : {
-  Droste<unsigned short, 4, 65535> fred(*this);
-  setupAndProcess(fred, args);
-                            }                          
-                            break;
+// the overridden is identity
+bool
+DrostePlugin::isIdentity(const OFX::IsIdentityArguments & /*args*/, OFX::Clip *& /*identityClip*/, double & /*identityTime*/)
+{
+  Zokzir::TraceSpan span("isIdentity", "action");
+  return false;
+}
 
-case OFX::eBitDepthFloat : {
-  Droste<float, 4, 1> fred(*this);
-  setupAndProcess(fred, args);
-                           }
-                           break;
-default :
-  OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
-    }
-  }
-  else {
-    switch(dstBitDepth) {
-case OFX::eBitDepthUByte : {
-  Droste<unsigned char, 1, 255> fred(*this);
-  setupAndProcess(fred, args);
-                           }
-                           break;
+void
+DrostePlugin::changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName)
+{
+  // setting the readouts tells us they changed too
+  if(paramName == kParamCostEstimate || paramName.compare(0, 5, "stats") == 0)
+    return;
+  updateCostEstimate(args.time);
+  updateStatistics();
+}
 
-case OFX::eBitDepthUShort : {
-  Droste<unsigned short, 1, 65535> fred(*this);
-  setupAndProcess(fred, args);
-                            }                          
-                            break;
+void
+DrostePlugin::changedClip(const OFX::InstanceChangedArgs &args, const std::string & /*clipName*/)
+{
+  updateCostEstimate(args.time);
+  updateStatistics();
+}
 
-case OFX::eBitDepthFloat : {
-  Droste<float, 1, 1> fred(*this);
-  setupAndProcess(fred, args);
-                           }                          
-                           break;
-default :
-  OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
-    }
-  } 
+void
+DrostePlugin::syncPrivateData(void)
+{
+  updateStatistics();
+}
+
+bool
+DrostePlugin::warpIsStatic()
+{
+  return _spin->getNumKeys() == 0 && _radius->getNumKeys() == 0 &&
+         _ratio->getNumKeys() == 0 && _position->getNumKeys() == 0 &&
+         _zoom->getNumKeys() == 0 && _rotation->getNumKeys() == 0 &&
+         _evolution->getNumKeys() == 0;
+}
+
+void
+DrostePlugin::updateStatistics()
+{
+  Zokzir::RenderStatsText text = Zokzir::FormatRenderStats(_stats.snapshot());
+  _statsLastRender->setValue(text.lastRender);
+  _statsThreads->setValue(text.threads);
+  _statsSamples->setValue(text.samples);
+  _statsCache->setValue(text.cache);
+}
+
+Zokzir::RenderShape
+DrostePlugin::renderShape(double time, const OfxPointD &renderScale)
+{
+  Zokzir::RenderShape shape;
+  OfxRectD rod = _srcClip->getRegionOfDefinition(time);
+  shape.par = _srcClip->getPixelAspectRatio();
+  shape.renderScale = renderScale;
+  shape.width = int(ceil((rod.x2 - rod.x1) * renderScale.x / shape.par));
+  shape.height = int(ceil((rod.y2 - rod.y1) * renderScale.y));
+  shape.nComponents = _srcClip->getPixelComponents() == OFX::ePixelComponentAlpha ? 1 :
+                      _srcClip->getPixelComponents() == OFX::ePixelComponentRGB ? 3 : 4;
+  shape.depth = PixelDepthOf(_srcClip->getPixelDepth());
+  return shape;
+}
+
+void
+DrostePlugin::updateCostEstimate(double time)
+{
+  OfxPointD fullSize = {1., 1.};
+  Zokzir::RenderShape shape = renderShape(time, fullSize);
+
+  // only these change the count of depths sampled
+  Zokzir::DrosteValues values = Zokzir::DrosteValues();
+  values.layering = _layering->getValueAtTime(time) == eLayeringOnBack ? Zokzir::eDrosteLayeringOnBack : Zokzir::eDrosteLayeringOnFront;
+  values.radius = _radius->getValueAtTime(time);
+  values.ratio = _ratio->getValueAtTime(time);
+  values.center = _center->getValueAtTime(time);
+  values.minDepth = _minDepth->getValueAtTime(time);
+  values.maxDepth = _maxDepth->getValueAtTime(time);
+
+  // as the work budget will leave them, antialiasing isn't counted
+  values.maxSamples = 1;
+  Zokzir::GuardDrosteValues(shape, _workBudget->getValueAtTime(time), values);
+
+  Zokzir::CostEstimate estimate = Zokzir::EstimateDrosteCost(shape, values, false);
+  _costEstimate->setValue(Zokzir::FormatCostEstimate(estimate));
+}
+
+void
+DrostePlugin::reportGuard(const std::string &text)
+{
+  // renders of tiles at once all report, only tell the host when it changes
+  std::lock_guard<std::mutex> lock(_guardMutex);
+  if(text == _guardMessage)
+    return;
+  _guardMessage = text;
+  if(text.empty())
+    clearPersistentMessage();
+  else
+    setPersistentMessage(OFX::Message::eMessageWarning, "", text);
 }
 
-mDeclarePluginFactory(DrostePluginFactory, {}, {});
+// name the trace on load and write it out on unload
+mDeclarePluginFactory(DrostePluginFactory, {Zokzir::TraceSetModule("droste"); Zokzir::CpuLevel();}, {Zokzir::TraceFlush();});
 
 using namespace OFX;
 void DrostePluginFactory::describe(OFX::ImageEffectDescriptor &desc)
 {
+  Zokzir::TraceSpan span("describe", "action");
+
   // basic labels
   desc.setLabels("Droste", "Droste", "Droste");
   desc.setPluginGrouping("alijaya");
@@ -571,10 +899,13 @@ void DrostePluginFactory::describe(OFX::ImageEffectDescriptor &desc)
 
 void DrostePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum /*context*/)
 {
+  Zokzir::TraceSpan span("describeInContext", "action");
+
   // Source clip only in the filter context
   // create the mandated source clip
   ClipDescriptor *srcClip = desc.defineClip(kOfxImageEffectSimpleSourceClipName);
   srcClip->addSupportedComponent(ePixelComponentRGBA);
+  srcClip->addSupportedComponent(ePixelComponentRGB);
   srcClip->addSupportedComponent(ePixelComponentAlpha);
   srcClip->setTemporalClipAccess(false);
   srcClip->setSupportsTiles(true);
@@ -583,6 +914,7 @@ void DrostePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OF
   // create the mandated output clip
   ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
   dstClip->addSupportedComponent(ePixelComponentRGBA);
+  dstClip->addSupportedComponent(ePixelComponentRGB);
   dstClip->addSupportedComponent(ePixelComponentAlpha);
   dstClip->setSupportsTiles(true);
 
@@ -680,12 +1012,163 @@ void DrostePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OF
     param->setDisplayRange(-10, 10);
   }
 
+  {
+    ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamAntialiasing);
+    param->setLabel(kParamAntialiasingLabel);
+    param->setHint(kParamAntialiasingHint);
+    assert(param->getNOptions() == eAntialiasingOff);
+    param->appendOption(kParamAntialiasingOptionOff);
+    assert(param->getNOptions() == eAntialiasingAdaptive);
+    param->appendOption(kParamAntialiasingOptionAdaptive);
+    param->setDefault(eAntialiasingOff);
+  }
+
+  {
+    IntParamDescriptor *param = desc.defineIntParam(kParamMaxSamples);
+    param->setLabel(kParamMaxSamplesLabel);
+    param->setHint(kParamMaxSamplesHint);
+    param->setDefault(9);
+    param->setRange(1, 49);
+    param->setDisplayRange(1, 49);
+  }
+
+  {
+    IntParamDescriptor *param = desc.defineIntParam(kParamWorkBudget);
+    param->setLabel(kParamWorkBudgetLabel);
+    param->setHint(kParamWorkBudgetHint);
+    param->setDefault(400);
+    param->setRange(1, 10000000);
+    param->setDisplayRange(10, 2000);
+  }
+
+  // the colour stage, in its own group as it is off by default
+  GroupParamDescriptor *colourGroup = desc.defineGroupParam(kParamColourGroup);
+  colourGroup->setLabel(kParamColourGroupLabel);
+  colourGroup->setOpen(false);
+
+  {
+    ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamColourStage);
+    param->setLabel(kParamColourStageLabel);
+    param->setHint(kParamColourStageHint);
+    assert(param->getNOptions() == Zokzir::eDrosteColourOff);
+    param->appendOption(kParamColourStageOptionOff);
+    assert(param->getNOptions() == Zokzir::eDrosteColourPerSample);
+    param->appendOption(kParamColourStageOptionPerSample);
+    assert(param->getNOptions() == Zokzir::eDrosteColourOnResult);
+    param->appendOption(kParamColourStageOptionOnResult);
+    param->setDefault(Zokzir::eDrosteColourOff);
+    param->setParent(*colourGroup);
+  }
+
+  {
+    DoubleParamDescriptor *param = desc.defineDoubleParam(kParamColourSaturation);
+    param->setLabel(kParamColourSaturationLabel);
+    param->setHint(kParamColourSaturationHint);
+    param->setDefault(1.);
+    param->setDisplayRange(-2., 2.);
+    param->setDoubleType(eDoubleTypeScale);
+    param->setParent(*colourGroup);
+  }
+
+  {
+    ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamColourLumaWeights);
+    param->setLabel(kParamColourLumaWeightsLabel);
+    param->setHint(kParamColourLumaWeightsHint);
+    assert(param->getNOptions() == Zokzir::eLumaWeightsEqual);
+    param->appendOption("Equal");
+    assert(param->getNOptions() == Zokzir::eLumaWeightsRec709);
+    param->appendOption("Rec. 709");
+    assert(param->getNOptions() == Zokzir::eLumaWeightsRec2020);
+    param->appendOption("Rec. 2020");
+    param->setDefault(Zokzir::eLumaWeightsEqual);
+    param->setParent(*colourGroup);
+  }
+
+  {
+    DoubleParamDescriptor *param = desc.defineDoubleParam(kParamColourGain);
+    param->setLabel(kParamColourGainLabel);
+    param->setHint(kParamColourGainHint);
+    param->setDefault(1.);
+    param->setDisplayRange(0., 4.);
+    param->setDoubleType(eDoubleTypeScale);
+    param->setParent(*colourGroup);
+  }
+
+  {
+    DoubleParamDescriptor *param = desc.defineDoubleParam(kParamColourOffset);
+    param->setLabel(kParamColourOffsetLabel);
+    param->setHint(kParamColourOffsetHint);
+    param->setDefault(0.);
+    param->setDisplayRange(-1., 1.);
+    param->setDoubleType(eDoubleTypeScale);
+    param->setParent(*colourGroup);
+  }
+
+  {
+    BooleanParamDescriptor *param = desc.defineBooleanParam(kParamColourInvert);
+    param->setLabel(kParamColourInvertLabel);
+    param->setHint(kParamColourInvertHint);
+    param->setDefault(false);
+    param->setParent(*colourGroup);
+  }
+
+  {
+    StringParamDescriptor *param = desc.defineStringParam(kParamCostEstimate);
+    param->setLabel(kParamCostEstimateLabel);
+    param->setHint(kParamCostEstimateHint);
+    param->setStringType(eStringTypeLabel);
+    param->setAnimates(false);
+    param->setEvaluateOnChange(false);
+    param->setIsPersistant(false);
+  }
+
+  // read only, what the renders did
+  GroupParamDescriptor *statsGroup = desc.defineGroupParam(kParamStatsGroup);
+  statsGroup->setLabel(kParamStatsGroupLabel);
+  statsGroup->setOpen(false);
+
+  static const char *const statsParams[][3] = {
+    {kParamStatsLastRender, kParamStatsLastRenderLabel, kParamStatsLastRenderHint},
+    {kParamStatsThreads, kParamStatsThreadsLabel, kParamStatsThreadsHint},
+    {kParamStatsSamples, kParamStatsSamplesLabel, kParamStatsSamplesHint},
+    {kParamStatsCache, kParamStatsCacheLabel, kParamStatsCacheHint},
+  };
+  for(const auto &stat : statsParams) {
+    StringParamDescriptor *param = desc.defineStringParam(stat[0]);
+    param->setLabel(stat[1]);
+    param->setHint(stat[2]);
+    param->setStringType(eStringTypeLabel);
+    param->setAnimates(false);
+    param->setEvaluateOnChange(false);
+    param->setIsPersistant(false);
+    param->setParent(*statsGroup);
+  }
+
 }
 
 OFX::ImageEffect* DrostePluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
 {
+  Zokzir::TraceSpan span("createInstance", "action");
   return new DrostePlugin(handle);
 }
 
-static DrostePluginFactory p("com.alijaya.droste", 1, 0);
-mRegisterPluginFactoryInstance(p)
+namespace Zokzir {
+  // add our factory to the list, the factory is only made the first time we are asked
+  void getDrostePluginID(OFX::PluginFactoryArray &ids)
+  {
+    static DrostePluginFactory p("com.alijaya.droste", 1, 0);
+    ids.push_back(&p);
+  }
+}
+
+// the combined Zokzir bundle registers every effect itself
+#ifndef ZOKZIR_BUNDLE
+namespace OFX {
+  namespace Plugin {
+    void getPluginIDs(OFX::PluginFactoryArray &ids)
+    {
+      Zokzir::getDrostePluginID(ids);
+    }
+  }
+}
+#endif
@@ -0,0 +1,421 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The render cost model, see zokzircost.h.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "zokzircost.h"
+#include "zokzirhalf.h"
+#include "zokzirsaturationprocess.h"
+
+namespace Zokzir {
+
+// anonymous namespace to hide our symbols in
+namespace {
+
+  // names of the depths in the calibration file, by PixelDepthEnum
+  const char *const kDepthNames[ePixelDepthFloat + 1] = {NULL, "byte", "short", "half", "float"};
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // measured with zokzir-render --calibrate on an AVX-512 Xeon
+  CostModel BuiltInCostModel()
+  {
+    CostModel model;
+    const double saturation[] = {0., 8.5, 8., 5.5, 3.};
+    const double saturationMask[] = {0., 14.5, 15.5, 13., 12.5};
+    const double drosteSample[] = {0., 55., 57., 56., 53.};
+    for(int d = 0; d <= ePixelDepthFloat; d++) {
+      model.saturationNs[d] = saturation[d];
+      model.saturationMaskNs[d] = saturationMask[d];
+      model.drosteSampleNs[d] = drosteSample[d];
+    }
+    model.saturationAutoNs = 1.4;
+    model.drostePixelNs = 37.;
+    model.drosteWarpNs = 52.;
+    return model;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // every value of a model with its key, for reading and writing the file
+  void ForEachCostKey(CostModel &model, const std::function<void(const std::string &, double &)> &f)
+  {
+    for(int d = ePixelDepthByte; d <= ePixelDepthFloat; d++) {
+      f(std::string("saturation.") + kDepthNames[d], model.saturationNs[d]);
+      f(std::string("saturation.mask.") + kDepthNames[d], model.saturationMaskNs[d]);
+      f(std::string("droste.sample.") + kDepthNames[d], model.drosteSampleNs[d]);
+    }
+    f("saturation.auto", model.saturationAutoNs);
+    f("droste.pixel", model.drostePixelNs);
+    f("droste.warp", model.drosteWarpNs);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the bytes of a frame of shape's pixels
+  double FrameBytes(const RenderShape &shape, int nComponents)
+  {
+    return double(shape.width) * shape.height * nComponents * BytesPerComponent(shape.depth);
+  }
+
+  int DepthIndex(PixelDepthEnum depth)
+  {
+    return depth >= ePixelDepthByte && depth <= ePixelDepthFloat ? int(depth) : int(ePixelDepthFloat);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the best time of a few runs of f, in seconds
+  double BestTime(double seconds, const std::function<void()> &f)
+  {
+    typedef std::chrono::steady_clock Clock;
+    double best = 1e30;
+    Clock::time_point end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    for(int run = 0; run < 3 || (run < 100 && Clock::now() < end); run++) {
+      Clock::time_point start = Clock::now();
+      f();
+      best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    return best;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a frame of size by size RGBA pixels for the calibration, with an alpha of a
+  // quarter so Droste composites every depth
+  struct CalibrationFrame {
+    std::vector<char> pixels;
+    ImageView view;
+
+    CalibrationFrame(int size, int nComponents, PixelDepthEnum depth)
+    {
+      view.bounds.x1 = view.bounds.y1 = 0;
+      view.bounds.x2 = view.bounds.y2 = size;
+      view.nComponents = nComponents;
+      view.depth = depth;
+      view.rowBytes = ptrdiff_t(size) * view.bytesPerPixel();
+      pixels.resize(size_t(view.rowBytes) * size);
+      view.data = pixels.data();
+    }
+
+    // fill with the value made by f from x, y and the component
+    void fill(const std::function<float(int, int, int)> &f)
+    {
+      for(int y = view.bounds.y1; y < view.bounds.y2; y++) {
+        for(int x = view.bounds.x1; x < view.bounds.x2; x++) {
+          for(int c = 0; c < view.nComponents; c++) {
+            float value = f(x, y, c);
+            switch(view.depth) {
+              case ePixelDepthByte : view.pixelAddress<unsigned char>(x, y)[c] = (unsigned char) (value * 255.f); break;
+              case ePixelDepthShort : view.pixelAddress<unsigned short>(x, y)[c] = (unsigned short) (value * 65535.f); break;
+              case ePixelDepthHalf : view.pixelAddress<Half>(x, y)[c] = Half(value); break;
+              default : view.pixelAddress<float>(x, y)[c] = value; break;
+            }
+          }
+        }
+      }
+    }
+  };
+
+} // end of anonymous namespace
+
+////////////////////////////////////////////////////////////////////////////////
+const CostModel &CurrentCostModel()
+{
+  static const CostModel model = [] {
+    CostModel m = BuiltInCostModel();
+    const char *path = getenv("ZOKZIR_COST_CALIBRATION");
+    if(path && *path && !ReadCostModel(path, m)) {
+      fprintf(stderr, "Zokzir: could not read the cost calibration %s, using the built in one\n", path);
+      m = BuiltInCostModel();
+    }
+    return m;
+  }();
+  return model;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ReadCostModel(const char *path, CostModel &model)
+{
+  FILE *f = fopen(path, "r");
+  if(!f)
+    return false;
+  bool ok = true;
+  char line[512];
+  while(ok && fgets(line, sizeof(line), f)) {
+    char key[128];
+    double value;
+    if(line[0] == '#' || sscanf(line, " %127s", key) != 1)
+      continue;
+    bool known = false;
+    if(sscanf(line, " %127[^ =] = %lf", key, &value) == 2) {
+      ForEachCostKey(model, [&](const std::string &name, double &v) {
+        if(name == key) {
+          v = value;
+          known = true;
+        }
+      });
+    }
+    ok = known;
+  }
+  fclose(f);
+  return ok;
+}
+
+bool WriteCostModel(const char *path, const CostModel &model)
+{
+  FILE *f = fopen(path, "w");
+  if(!f)
+    return false;
+  fprintf(f, "# Zokzir render cost calibration, ns per pixel on one thread\n");
+  CostModel copy = model;
+  ForEachCostKey(copy, [&](const std::string &name, double &value) {
+    fprintf(f, "%s = %.4g\n", name.c_str(), value);
+  });
+  return fclose(f) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CostModel CalibrateCostModel(double seconds)
+{
+  CostModel model = BuiltInCostModel();
+  const int size = 256;
+  const double pixels = double(size) * size;
+  OfxRectI window = {0, 0, size, size};
+  CancelCheck cancel;
+
+  // a share of the time for each of the timings below
+  const double share = seconds / (4 * 6);
+
+  ColourMatrix matrix = BuildColourMatrix(1.5, eLumaWeightsRec709, 1., 0., 1.f);
+
+  DrosteValues values;
+  values.layering = eDrosteLayeringOnFront;
+  values.spin = 1;
+  values.radius = size * 0.4;
+  values.ratio = 0.5;
+  values.center = values.position = (OfxPointD) {size * 0.5, size * 0.5};
+  values.zoom = values.rotation = values.evolution = 0.;
+  values.colour.stage = eDrosteColourOff;
+  values.colour.matrix = matrix;
+  values.colour.invert = false;
+  values.maxSamples = 1;
+  OfxPointD renderScale = {1., 1.};
+  std::vector<OfxPointD> warp(size_t(size) * size);
+
+  for(int d = ePixelDepthByte; d <= ePixelDepthFloat; d++) {
+    PixelDepthEnum depth = PixelDepthEnum(d);
+    CalibrationFrame src(size, 4, depth), dst(size, 4, depth), mask(size, 1, depth);
+    src.fill([&](int x, int y, int c) {return c == 3 ? 0.25f : float((x * 7 + y * 13 + c * 29) % 256) / 255.f;});
+    // a mask that is mixed in every tile
+    mask.fill([&](int x, int y, int) {return float((x + y) % 64) / 64.f;});
+
+    double plain = BestTime(share, [&] {SaturationProcess(matrix, src.view, ImageView(), dst.view, window, cancel);});
+    double masked = BestTime(share, [&] {SaturationProcess(matrix, src.view, mask.view, dst.view, window, cancel);});
+    model.saturationNs[d] = plain / pixels * 1e9;
+    model.saturationMaskNs[d] = std::max(0., masked - plain) / pixels * 1e9;
+
+    // the sample cost from the difference between one and five depths, both
+    // from a filled in warp table. The depths below zero are smaller copies,
+    // so every sample lands on the source.
+    values.minDepth = values.maxDepth = 0;
+    DrosteProcess(values, src.view, dst.view, renderScale, 1., window, window, NULL, warp.data(), cancel);
+    double one = BestTime(share, [&] {DrosteProcess(values, src.view, dst.view, renderScale, 1., window, window, warp.data(), NULL, cancel);});
+    values.minDepth = -4;
+    double five = BestTime(share, [&] {DrosteProcess(values, src.view, dst.view, renderScale, 1., window, window, warp.data(), NULL, cancel);});
+    model.drosteSampleNs[d] = std::max(0., five - one) / 4. / pixels * 1e9;
+    if(depth == ePixelDepthFloat)
+      model.drostePixelNs = std::max(0., one / pixels * 1e9 - model.drosteSampleNs[d]);
+
+    if(depth == ePixelDepthFloat) {
+      values.minDepth = 0;
+      double warped = BestTime(share, [&] {DrosteProcess(values, src.view, dst.view, renderScale, 1., window, window, NULL, NULL, cancel);});
+      model.drosteWarpNs = std::max(0., warped - one) / pixels * 1e9;
+      double chroma = BestTime(share, [&] {SaturationSumChroma(src.view, 0, size, 0, size);});
+      model.saturationAutoNs = chroma / pixels * 1e9;
+    }
+  }
+  return model;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CostEstimate EstimateSaturationCost(const RenderShape &shape, bool masked, bool autoSaturation, const CostModel &model)
+{
+  int d = DepthIndex(shape.depth);
+  double pixels = double(shape.width) * shape.height;
+  double ns = model.saturationNs[d] + (masked ? model.saturationMaskNs[d] : 0.) +
+              (autoSaturation ? model.saturationAutoNs : 0.);
+
+  CostEstimate estimate;
+  estimate.cpuSeconds = pixels * ns * 1e-9;
+  estimate.peakBytes = 2. * FrameBytes(shape, shape.nComponents) + (masked ? FrameBytes(shape, 1) : 0.);
+  return estimate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double DrosteSamplesPerPixel(const RenderShape &shape, const DrosteValues &values)
+{
+  int depths = std::max(0, values.maxDepth - values.minDepth + 1);
+  if(shape.nComponents != 3 || values.ratio <= 0. || values.ratio >= 1. || values.radius <= 0.)
+    return depths;
+
+  // the canonical distance from the centre to the furthest corner of the frame
+  double width = shape.width * shape.par / shape.renderScale.x;
+  double height = shape.height / shape.renderScale.y;
+  double dx = std::max(fabs(values.center.x), fabs(width - values.center.x));
+  double dy = std::max(fabs(values.center.y), fabs(height - values.center.y));
+  double reach = sqrt(dx * dx + dy * dy);
+
+  // a depth's copy starts at radius * ratio / ratio^depth, so the deepest one
+  // that starts on the frame is
+  double r1 = values.radius * values.ratio;
+  double onFrame = floor(log(reach / r1) / -log(values.ratio));
+
+  // the depths in the order the kernel takes them, up to the first on the frame
+  int samples = 0;
+  for(int i = values.maxDepth; i >= values.minDepth; i--) {
+    int depth = values.layering == eDrosteLayeringOnBack ? values.maxDepth + values.minDepth - i : i;
+    samples++;
+    if(depth <= onFrame)
+      break;
+  }
+  return samples;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+DrosteGuard GuardDrosteValues(const RenderShape &shape, int budget, DrosteValues &values)
+{
+  DrosteGuard guard;
+  guard.flags = 0;
+  guard.budget = budget = std::max(1, budget);
+  guard.asked = values;
+
+  // a ratio of 0 or 1 or a radius of 0 has no strip to tile, the kernel would
+  // divide by a zero strip width. A radius that isn't one becomes a canonical
+  // unit, so the same values render the same at every render scale.
+  const double kRatioMin = 1e-6, kStripMin = 1e-6, kRadiusClamped = 1.;
+  if(!(values.radius > 0.) || values.radius >= HUGE_VAL) {
+    values.radius = kRadiusClamped;
+    guard.flags |= eDrosteGuardClamped;
+  }
+  if(!(values.ratio > kRatioMin) || values.ratio >= HUGE_VAL) {
+    values.ratio = kRatioMin;
+    guard.flags |= eDrosteGuardClamped;
+  }
+  else if(fabs(log(values.ratio)) < kStripMin) {
+    values.ratio = values.ratio < 1. ? exp(-kStripMin) : exp(kStripMin);
+    guard.flags |= eDrosteGuardClamped;
+  }
+
+  // within 2% of 1 a copy is hardly smaller than the next and it takes
+  // hundreds of depths to reach the edge of the frame
+  if(fabs(log(values.ratio)) < 0.02)
+    guard.flags |= eDrosteGuardRatioNearOne;
+  if(values.radius * std::min(values.ratio, 1.) * shape.renderScale.y < 1.)
+    guard.flags |= eDrosteGuardRadiusTiny;
+
+  // an antialiased pixel takes at most an n by n grid, its centre among them
+  int side = DrosteAntialiasSide(values.maxSamples);
+  double depthSamples = DrosteSamplesPerPixel(shape, values);
+  guard.samplesPerPixel = depthSamples * side * side;
+
+  if(guard.samplesPerPixel > budget) {
+    if(depthSamples <= budget) {
+      while(side > 1 && depthSamples * side * side > budget) side -= 2;
+      values.maxSamples = side * side;
+      guard.flags |= eDrosteGuardSamplesReduced;
+    }
+    else {
+      if(values.maxSamples > 1)
+        guard.flags |= eDrosteGuardSamplesReduced;
+      values.maxSamples = 1;
+
+      // as many depths as the budget has, centred on 0 and kept inside the range
+      long long keep = budget;
+      long long first = std::max((long long) values.minDepth, std::min(-keep / 2, (long long) values.maxDepth - keep + 1));
+      values.minDepth = int(first);
+      values.maxDepth = int(std::min((long long) values.maxDepth, first + keep - 1));
+      guard.flags |= eDrosteGuardDepthsCapped;
+    }
+    side = DrosteAntialiasSide(values.maxSamples);
+    guard.guardedPerPixel = DrosteSamplesPerPixel(shape, values) * side * side;
+  }
+  else {
+    guard.guardedPerPixel = guard.samplesPerPixel;
+  }
+  return guard;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::string FormatDrosteGuard(const DrosteGuard &guard, const DrosteValues &values)
+{
+  std::string text;
+  char buffer[256];
+  if(guard.flags & eDrosteGuardClamped) {
+    snprintf(buffer, sizeof(buffer), "Radius %g and Ratio %g make no spiral, rendered at %g and %g. ",
+             guard.asked.radius, guard.asked.ratio, values.radius, values.ratio);
+    text += buffer;
+  }
+  if(guard.flags & eDrosteGuardRatioNearOne) {
+    snprintf(buffer, sizeof(buffer), "Ratio %g is so near 1 that filling the frame takes many depths. ", values.ratio);
+    text += buffer;
+  }
+  if(guard.flags & eDrosteGuardRadiusTiny) {
+    snprintf(buffer, sizeof(buffer), "Radius %g makes the innermost copy smaller than a pixel. ", values.radius);
+    text += buffer;
+  }
+  if(guard.flags & (eDrosteGuardSamplesReduced | eDrosteGuardDepthsCapped)) {
+    snprintf(buffer, sizeof(buffer), "Up to %.0f depth samples a pixel is over the work budget of %d, so ",
+             guard.samplesPerPixel, guard.budget);
+    text += buffer;
+    if(guard.flags & eDrosteGuardSamplesReduced) {
+      if(values.maxSamples <= 1)
+        snprintf(buffer, sizeof(buffer), "antialiasing is off");
+      else
+        snprintf(buffer, sizeof(buffer), "Max Samples is %d", values.maxSamples);
+      text += buffer;
+      if(guard.flags & eDrosteGuardDepthsCapped)
+        text += " and ";
+    }
+    if(guard.flags & eDrosteGuardDepthsCapped) {
+      snprintf(buffer, sizeof(buffer), "only depths %d to %d of %d to %d are rendered",
+               values.minDepth, values.maxDepth, guard.asked.minDepth, guard.asked.maxDepth);
+      text += buffer;
+    }
+    text += ". ";
+  }
+  if(!text.empty())
+    text.erase(text.size() - 1);
+  return text;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CostEstimate EstimateDrosteCost(const RenderShape &shape, const DrosteValues &values, bool warpCached, const CostModel &model)
+{
+  int d = DepthIndex(shape.depth);
+  double pixels = double(shape.width) * shape.height;
+  double ns = model.drostePixelNs + (warpCached ? 0. : model.drosteWarpNs) +
+              DrosteSamplesPerPixel(shape, values) * model.drosteSampleNs[d];
+
+  CostEstimate estimate;
+  estimate.cpuSeconds = pixels * ns * 1e-9;
+  // the source, output and the warp table
+  estimate.peakBytes = 2. * FrameBytes(shape, shape.nComponents) + pixels * sizeof(OfxPointD);
+  return estimate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::string FormatCostEstimate(const CostEstimate &estimate)
+{
+  char text[64];
+  snprintf(text, sizeof(text), "%.3g CPU s, %.0f MB", estimate.cpuSeconds, estimate.peakBytes / 1048576.);
+  return text;
+}
+
+} // namespace Zokzir
@@ -0,0 +1,131 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Predicted cost of a render, for schedulers that pack jobs onto a farm.
+
+A CostEstimate is the CPU seconds a frame takes, summed over threads, and the
+most memory it holds at once: the source, output and mask images and the
+tables the effect keeps. It comes from a CostModel of per pixel times,
+measured by CalibrateCostModel on the machine that runs the kernels and kept
+in a calibration file of KEY = VALUE lines, which zokzir-render --calibrate
+writes. ZOKZIR_COST_CALIBRATION names the file the effects and tools read,
+without one they use times measured on an AVX-512 Xeon.
+
+Saturation costs the same per pixel at a depth, more where its mask is
+neither zero nor one and more again for Auto's measure of the source.
+
+Droste costs something for every pixel, the warp of each pixel unless the
+warp table is cached, and a sample per depth it composites. Compositing
+stops at the first depth that makes a pixel opaque, and RGB is opaque
+wherever the source is, so for RGB DrosteSamplesPerPixel estimates the
+depths before the first whose copy starts inside the frame corner furthest
+from the centre, from the radius and ratio alone. That is one figure for
+the whole frame that leaves out the spiral, zoom and the edges of the
+source, a heuristic rather than a count. Alpha and RGBA may be transparent
+anywhere, so every depth is counted, which makes theirs an upper bound.
+The extra samples of adaptive antialiasing depend on the picture and are not
+counted.
+
+The same estimate keeps a Droste render within a work budget of depth samples a
+pixel, see GuardDrosteValues, as a ratio near 1 or a wide Min to Max Depth can
+otherwise make a frame take hours.
+*/
+
+#ifndef ZOKZIR_COST_H
+#define ZOKZIR_COST_H
+
+#include <string>
+
+#include "zokzirdrosteprocess.h"
+#include "zokzirimageview.h"
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// what a frame costs
+struct CostEstimate {
+  double cpuSeconds;
+  double peakBytes;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the per pixel times in ns, the ones per depth are indexed by PixelDepthEnum
+struct CostModel {
+  double saturationNs[ePixelDepthFloat + 1];       // the matrix, every pixel
+  double saturationMaskNs[ePixelDepthFloat + 1];   // added by a mixed mask
+  double saturationAutoNs;                         // Auto's measure, every pixel
+  double drostePixelNs;                            // every pixel, whatever its depths
+  double drosteWarpNs;                             // the warp up to the depth
+  double drosteSampleNs[ePixelDepthFloat + 1];     // a sample at one depth
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the frame a render makes, in pixels at its render scale
+struct RenderShape {
+  int width;
+  int height;
+  int nComponents;
+  PixelDepthEnum depth;
+  OfxPointD renderScale;
+  double par;
+};
+
+// the built in model, or the one in ZOKZIR_COST_CALIBRATION if that is set
+const CostModel &CurrentCostModel();
+
+// read model from a calibration file, keys it doesn't have keep their value,
+// returns false if the file can't be read or has a line it doesn't know
+bool ReadCostModel(const char *path, CostModel &model);
+bool WriteCostModel(const char *path, const CostModel &model);
+
+// time the kernels on this machine on one thread, for about seconds
+CostModel CalibrateCostModel(double seconds);
+
+CostEstimate EstimateSaturationCost(const RenderShape &shape, bool masked, bool autoSaturation,
+                                    const CostModel &model = CurrentCostModel());
+
+// values in canonical coordinates as the kernel takes them
+CostEstimate EstimateDrosteCost(const RenderShape &shape, const DrosteValues &values, bool warpCached,
+                                const CostModel &model = CurrentCostModel());
+
+// an estimate of the depths a Droste pixel samples, see above
+double DrosteSamplesPerPixel(const RenderShape &shape, const DrosteValues &values);
+
+////////////////////////////////////////////////////////////////////////////////
+// what GuardDrosteValues found and did, bits of DrosteGuard::flags
+enum DrosteGuardEnum
+{
+  eDrosteGuardClamped         = 1 << 0,   // the ratio or radius made no spiral and was moved to the nearest that does
+  eDrosteGuardRatioNearOne    = 1 << 1,   // copies barely shrink, so filling the frame takes many depths
+  eDrosteGuardRadiusTiny      = 1 << 2,   // the innermost copy is under a pixel, only reported
+  eDrosteGuardSamplesReduced  = 1 << 3,   // antialiasing was cut back
+  eDrosteGuardDepthsCapped    = 1 << 4,   // Min to Max Depth was narrowed
+};
+
+struct DrosteGuard {
+  unsigned int flags;
+  int budget;               // depth samples a pixel
+  double samplesPerPixel;   // the most a pixel could take as asked
+  double guardedPerPixel;   // and as it will be rendered
+  DrosteValues asked;       // the values before
+};
+
+// check values, in canonical coordinates, for the regimes where the Droste
+// kernel does far more work than it shows, and bring them within budget
+// depth samples a pixel. The most a pixel takes is estimated as
+// DrosteSamplesPerPixel times the samples antialiasing could take, and over budget antialiasing
+// is cut back first, then turned off and Min to Max Depth narrowed to the
+// depths nearest 0, which are the copies nearest the original size.
+DrosteGuard GuardDrosteValues(const RenderShape &shape, int budget, DrosteValues &values);
+
+// what the guard found and did as a sentence or two for the artist, empty if
+// it found nothing
+std::string FormatDrosteGuard(const DrosteGuard &guard, const DrosteValues &values);
+
+// an estimate as text, such as "1.25 CPU s, 96 MB"
+std::string FormatCostEstimate(const CostEstimate &estimate);
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,95 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Complex arithmetic and compositing helpers of the Droste effect.
+
+A point of the plane is a complex number x + iy, the warp is a log, a
+multiply and an exp of it. These sit in the innermost loop of the render,
+they are in a header of their own so the microbenchmark can time them.
+*/
+
+#ifndef ZOKZIR_DROSTE_MATH_H
+#define ZOKZIR_DROSTE_MATH_H
+
+#include <math.h>
+#include "ofxCore.h"
+
+inline OfxPointD cExp(OfxPointD c) {
+  double s = exp(c.x);
+  return (OfxPointD){
+    s * cos(c.y),
+    s * sin(c.y)
+  };
+}
+
+inline OfxPointD cLog(OfxPointD c) {
+  return (OfxPointD){
+    log(sqrt(c.x * c.x + c.y * c.y)),
+    atan2(c.y, c.x)
+  };
+}
+
+inline OfxPointD cRec(OfxPointD c) {
+  double s = c.x * c.x + c.y * c.y;
+  return (OfxPointD){
+    c.x / s,
+    -c.y / s
+  };
+}
+
+inline OfxPointD cMul(OfxPointD a, OfxPointD b) {
+  return (OfxPointD){
+    a.x * b.x - a.y * b.y,
+    a.x * b.y + a.y * b.x
+  };
+}
+
+inline OfxPointD cDiv(OfxPointD a, OfxPointD b) {
+  double s = b.x * b.x + b.y * b.y;
+  return (OfxPointD){
+    (a.x * b.x + a.y * b.y) / s,
+    (a.y * b.x - a.x * b.y) / s
+  };
+}
+
+inline OfxPointD cAdd(OfxPointD a, OfxPointD b) {
+  return (OfxPointD) {
+    a.x + b.x,
+    a.y + b.y
+  };
+}
+
+inline OfxPointD cSub(OfxPointD a, OfxPointD b) {
+  return (OfxPointD) {
+    a.x - b.x,
+    a.y - b.y
+  };
+}
+
+inline OfxPointD cMulS(OfxPointD c, double s) {
+  return (OfxPointD) {
+    c.x * s,
+    c.y * s
+  };
+}
+
+inline OfxPointD cDivS(OfxPointD c, double s) {
+  return (OfxPointD) {
+    c.x / s,
+    c.y / s
+  };
+}
+
+inline void over(float *dst, float *src, float *out) {
+  out[3] = src[3] + dst[3] * (1. - src[3]); // alpha
+  if (out[3] != 0.) {
+    for (int i=0; i<3; i++) {
+      out[i] = (src[i] * src[3] + dst[i] * dst[3] * (1. - src[3])) / out[3];
+    }
+  } else {
+    out[0] = out[1] = out[2] = 0.;
+  }
+}
+
+#endif
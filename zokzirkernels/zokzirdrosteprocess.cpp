@@ -0,0 +1,419 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The Droste kernel over whole images, see zokzirdrosteprocess.h.
+
+Each pixel is warped back through the spiral once, then sampled and
+composited at every depth from Min Depth to Max Depth, front to back so it
+stops at the first depth that makes it opaque. Antialiased pixels that need
+it are sampled again on a finer grid, see ProcessRows. The kernel is
+compiled for every pixel layout, alpha, RGB and straight or premultiplied
+RGBA, and for every CPU level, and both are picked per call.
+*/
+
+#include <math.h>
+#include <algorithm>
+
+#include "zokzircpu.h"
+#include "zokzirdrostemath.h"
+#include "zokzirdrosteprocess.h"
+#include "zokzirpixeltraits.h"
+#include "zokzirsample.h"
+
+#ifndef M_PI
+#  define M_PI 3.14159265358979323846
+#endif
+
+namespace Zokzir {
+
+// anonymous namespace to hide our symbols in
+namespace {
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // between pixels, whose centres are whole numbers, and canonical coordinates,
+  // as OFX::Coords does it
+  inline void PixelToCanonical(OfxPointD p, OfxPointD renderScale, double par, OfxPointD *canonical)
+  {
+    canonical->x = (p.x + 0.5) * par / renderScale.x;
+    canonical->y = (p.y + 0.5) / renderScale.y;
+  }
+
+  inline void CanonicalToPixel(OfxPointD c, OfxPointD renderScale, double par, OfxPointD *pixel)
+  {
+    pixel->x = c.x * renderScale.x / par - 0.5;
+    pixel->y = c.y * renderScale.y - 0.5;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run a pixel through the colour stage, the matrix needs RGB and is clamped to
+  // 0 to 1 for integer depths as the Saturation effect does
+  template <class P>
+  inline void ApplyColour(const DrosteColour &colour, float *pix)
+  {
+    if(P::kHasColour) {
+      const float (*m)[4] = colour.matrix.m;
+      float r = pix[0], g = pix[1], b = pix[2];
+      for(int c = 0; c < 3; c++) {
+        float value = m[c][0] * r + m[c][1] * g + m[c][2] * b + m[c][3];
+        pix[c] = P::kMax == 1 ? value : std::min(std::max(value, 0.f), 1.f);
+      }
+    }
+    if(colour.invert) {
+      for(int c = 0; c < P::kComponents; c++)
+        pix[c] = 1.f - pix[c];
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the colour stage as a tap of SampleCubic, so it colours the source pixels
+  // before they are filtered
+  template <class P>
+  struct ColourTap {
+    const DrosteColour &colour;
+    void operator()(float *pix) const {ApplyColour<P>(colour, pix);}
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // put a sample under what we have so far. acc is premultiplied colour and
+  // alpha, an alpha image is all alpha, an RGB one is opaque where the source
+  // covers it and straight RGBA is premultiplied on the way in
+  template <class P>
+  inline void CompositeUnder(float *acc, const float *sample, float coverage)
+  {
+    float alpha = P::kHasAlpha ? sample[P::kAlpha] : coverage;
+    float under = 1.f - acc[3];
+    if(P::kHasColour) {
+      float weight = P::kHasAlpha && !P::kPremultiplied ? alpha : 1.f;
+      for(int c = 0; c < 3; c++)
+        acc[c] += under * weight * sample[c];
+    }
+    acc[3] += under * alpha;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the composited pixel in the layout of P from acc
+  template <class P>
+  inline void Resolve(const float *acc, float *pix)
+  {
+    if(!P::kHasColour) {
+      pix[0] = acc[3];
+    }
+    else if(!P::kHasAlpha || P::kPremultiplied) {
+      for(int c = 0; c < P::kComponents; c++) pix[c] = acc[c];
+    }
+    else {
+      float alpha = acc[3];
+      for(int c = 0; c < 3; c++) pix[c] = alpha > 0.f ? acc[c] / alpha : 0.f;
+      pix[3] = alpha;
+    }
+  }
+
+  // the alpha past which anything under a pixel can't be seen
+  const float kOpaque = 1.f - 1e-6f;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the spiral's constants, the same for every pixel
+  struct Spiral {
+    double r1;              // the inner radius of the strip
+    double scale;           // log(r2 / r1), the width of a strip in log space
+    double cosAngle;
+    OfxPointD complexAngle;
+  };
+
+  inline Spiral SpiralOf(const DrosteValues &v)
+  {
+    const double two_pi = 2.0 * M_PI;
+    Spiral s;
+    s.r1 = v.radius * v.ratio;
+    s.scale = log(v.radius / s.r1);
+    double angle = atan2(v.spin * s.scale, two_pi);
+    s.cosAngle = cos(angle);
+    s.complexAngle = cExp((OfxPointD) {0, angle});
+    return s;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the warp of a point in canonical coordinates up to its depth, the tiled log
+  // polar point
+  inline OfxPointD TiledPoint(const DrosteValues &v, const Spiral &s, OfxPointD t_canonical)
+  {
+    const double two_pi = 2.0 * M_PI;
+    OfxPointD c = t_canonical;
+
+    // 10. Translate to position
+    c = cSub(c, v.position);
+
+    // 9. Take the tiled strips back to ordinary space
+    c = cLog(c);
+
+    // 8. To zoom
+    c.x -= s.scale * v.zoom;
+
+    // 7. Make spiral
+    c = cDiv(cDivS(c, s.cosAngle), s.complexAngle);
+
+    // 6. To rotate
+    c.y -= two_pi * fmod(v.rotation, 1.);
+
+    // 5. Evolution (zoom with looping)
+    c.x -= s.scale * fmod(v.evolution, 1.);
+
+    // 4. Tile the strips
+    c.x = fmod(c.x, s.scale);
+
+    return c;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // composite the depths of a tiled point under acc front to back. Returns the
+  // samples taken, and sets radius to the distance from the center of the
+  // last one, which is what the warp scales the point's neighbourhood by.
+  //
+  // Step i of Min Depth to Max Depth goes over all the steps before it, so the
+  // steps are composited front to back from the last one, stopping once the
+  // pixel is opaque rather than sampling copies that can't be seen.
+  template <class P, class T>
+  inline int CompositeDepths(const DrosteValues &v,
+                             const Spiral &s,
+                             const ImageView &srcView,
+                             OfxPointD renderScale,
+                             double par,
+                             OfxPointD tiled,
+                             float *acc,
+                             double *radius)
+  {
+    int samples = 0;
+    for (int i=v.maxDepth; i>=v.minDepth; i--) {
+      samples++;
+      int depth;
+      if (v.layering == eDrosteLayeringOnBack) {
+        depth = v.maxDepth + v.minDepth - i;
+      } else {
+        depth = i;
+      }
+
+      OfxPointD c = tiled;
+
+      // 3. Offset the depth
+      c.x += s.scale * (double) depth;
+
+      // 2. Convert to strip
+      *radius = s.r1 * exp(c.x);
+      c = cMulS(cExp(c), s.r1);
+
+      // 1. Take from center
+      c = cAdd(c, v.center);
+
+      OfxPointD t_pixel;
+      CanonicalToPixel(c, renderScale, par, &t_pixel);
+
+      float src[4] = {0., 0., 0., 0.};
+      float coverage = v.colour.stage == eDrosteColourPerSample ?
+                       SampleCubic<T, P::kComponents, P::kMax>(srcView, t_pixel.x, t_pixel.y, src, ColourTap<P>{v.colour}) :
+                       SampleCubic<T, P::kComponents, P::kMax>(srcView, t_pixel.x, t_pixel.y, src);
+
+      CompositeUnder<P>(acc, src, coverage);
+      if(acc[3] >= kOpaque)
+        break;
+    }
+    return samples;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // how many samples a side the pixel centred on the canonical point t needs,
+  // at most maxSide. The warp is conformal, so about a point it only scales
+  // and turns, by |dw/dz| = |w| / (|z| cos angle) where z is the point from
+  // the position and w the sample from the center. Where that shrinks the
+  // source the pixel covers more than one source pixel and is supersampled
+  // to match. The log polar point wraps by a strip at the tiling seams,
+  // where neighbouring pixels come from different depths, so pixels that
+  // close to a seam get every sample.
+  inline int AntialiasSide(const DrosteValues &v, const Spiral &s, OfxPointD t, OfxPointD tiled, double radius,
+                           OfxPointD renderScale, double par, int maxSide)
+  {
+    double z = hypot(t.x - v.position.x, t.y - v.position.y);
+    if(z <= 0.)
+      return maxSide;
+
+    // the change of the log polar point for a canonical unit, and the
+    // canonical units an output pixel spans and the source pixels one does
+    double dc = 1. / (z * s.cosAngle);
+    double outScale = std::max(par / renderScale.x, 1. / renderScale.y);
+    double inScale = std::max(renderScale.x / par, renderScale.y);
+
+    double seam = std::min(fabs(tiled.x), s.scale - fabs(tiled.x)) / (dc * outScale);
+    if(seam < 1.)
+      return maxSide;
+
+    // the cubic filter already smooths a little shrinking
+    double footprint = radius * dc * outScale * inScale;
+    return std::max(1, std::min(maxSide, int(ceil(footprint - 0.25))));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the rows of procWindow, for pixels described by the PixelTraits P with their
+  // components read as T. Returns the samples taken.
+  //
+  // Each pixel is sampled at its centre. When antialiasing, the centre
+  // sample decides how many a side the pixel needs, see AntialiasSide, and a
+  // pixel that needs more than one is sampled on an n by n grid, n odd so
+  // the centre sample is the middle of it, and the composited samples
+  // averaged, as a render at n times the size would be when scaled down.
+  template <class P, class T>
+  uint64_t ProcessRows(const DrosteValues &v,
+                       const ImageView &srcView,
+                       const ImageView &dstView,
+                       OfxPointD renderScale,
+                       double par,
+                       OfxRectI renderWindow,
+                       OfxRectI procWindow,
+                       const OfxPointD *warpIn,
+                       OfxPointD *warpOut,
+                       const CancelCheck &cancel)
+  {
+    const Spiral s = SpiralOf(v);
+    const int maxSide = DrosteAntialiasSide(v.maxSamples);
+    uint64_t samples = 0;
+
+    for(int y = procWindow.y1; y < procWindow.y2; y++) {
+      if(cancel()) break;
+
+      T *dstPix = dstView.pixelAddress<T>(procWindow.x1, y);
+
+      // where this row starts in the warp table
+      size_t warpIndex = size_t(y - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1) + (procWindow.x1 - renderWindow.x1);
+
+      for(int x = procWindow.x1; x < procWindow.x2; x++, warpIndex++) {
+
+        OfxPointD t_canonical;
+        PixelToCanonical((OfxPointD){double(x), double(y)}, renderScale, par, &t_canonical);
+
+        OfxPointD tiled;
+        if(warpIn) {
+          tiled = warpIn[warpIndex];
+        }
+        else {
+          tiled = TiledPoint(v, s, t_canonical);
+          if(warpOut) warpOut[warpIndex] = tiled;
+        }
+
+        float acc[4] = {0., 0., 0., 0.};
+        double radius = 0.;
+        samples += CompositeDepths<P, T>(v, s, srcView, renderScale, par, tiled, acc, &radius);
+
+        // maxSide is odd, so rounding up to odd stays within it
+        int side = maxSide > 1 ? AntialiasSide(v, s, t_canonical, tiled, radius, renderScale, par, maxSide) | 1 : 1;
+        if(side > 1) {
+          float sum[4] = {acc[0], acc[1], acc[2], acc[3]};
+          for(int j = 0; j < side; j++) {
+            for(int i = 0; i < side; i++) {
+              if(i == side / 2 && j == side / 2) continue;
+              OfxPointD sub;
+              PixelToCanonical((OfxPointD){x + (i + 0.5) / side - 0.5, y + (j + 0.5) / side - 0.5}, renderScale, par, &sub);
+              float subAcc[4] = {0., 0., 0., 0.};
+              samples += CompositeDepths<P, T>(v, s, srcView, renderScale, par, TiledPoint(v, s, sub), subAcc, &radius);
+              for(int c = 0; c < 4; c++) sum[c] += subAcc[c];
+            }
+          }
+          for(int c = 0; c < 4; c++) acc[c] = sum[c] / float(side * side);
+        }
+
+        float dst[4];
+        Resolve<P>(acc, dst);
+        if(v.colour.stage == eDrosteColourOnResult)
+          ApplyColour<P>(v.colour, dst);
+
+        // samples are 0 to 1 at every depth, so this is the one scale to the
+        // pixel range. The host's filter gave byte and short samples already
+        // in their range and they used to be scaled again here, which is wrong.
+        for (int c = 0; c < P::kComponents; c++) {
+          dstPix[c] = T(dst[c] * P::kMax);
+        }
+
+        // increment the dst pixel
+        dstPix += P::kComponents;
+      }
+    }
+    return samples;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // ProcessRows compiled for each CPU level above the baseline
+  template <class P, class T>
+  ZOKZIR_TARGET_SSE42 uint64_t ProcessRowsSSE42(const DrosteValues &v, const ImageView &srcView, const ImageView &dstView,
+                                                OfxPointD renderScale, double par, OfxRectI renderWindow, OfxRectI procWindow,
+                                                const OfxPointD *warpIn, OfxPointD *warpOut, const CancelCheck &cancel)
+  {
+    return ProcessRows<P, T>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+  }
+
+  template <class P, class T>
+  ZOKZIR_TARGET_AVX2 uint64_t ProcessRowsAVX2(const DrosteValues &v, const ImageView &srcView, const ImageView &dstView,
+                                              OfxPointD renderScale, double par, OfxRectI renderWindow, OfxRectI procWindow,
+                                              const OfxPointD *warpIn, OfxPointD *warpOut, const CancelCheck &cancel)
+  {
+    return ProcessRows<P, T>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+  }
+
+  template <class P, class T>
+  ZOKZIR_TARGET_AVX512 uint64_t ProcessRowsAVX512(const DrosteValues &v, const ImageView &srcView, const ImageView &dstView,
+                                                  OfxPointD renderScale, double par, OfxRectI renderWindow, OfxRectI procWindow,
+                                                  const OfxPointD *warpIn, OfxPointD *warpOut, const CancelCheck &cancel)
+  {
+    return ProcessRows<P, T>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run the ProcessRows for the CPU we are on, from AVX2 up the components are
+  // read as the depth's Wide type
+  template <class P>
+  uint64_t DispatchProcessRows(const DrosteValues &v, const ImageView &srcView, const ImageView &dstView,
+                               OfxPointD renderScale, double par, OfxRectI renderWindow, OfxRectI procWindow,
+                               const OfxPointD *warpIn, OfxPointD *warpOut, const CancelCheck &cancel)
+  {
+    typedef typename P::Storage T;
+    typedef typename P::Wide WIDE;
+    switch(CpuLevel()) {
+      case eCpuLevelAVX512 :
+        return ProcessRowsAVX512<P, WIDE>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+      case eCpuLevelAVX2 :
+        return ProcessRowsAVX2<P, WIDE>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+      case eCpuLevelSSE42 :
+        return ProcessRowsSSE42<P, T>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+      default :
+        return ProcessRows<P, T>(v, srcView, dstView, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+    }
+  }
+
+} // end of anonymous namespace
+
+////////////////////////////////////////////////////////////////////////////////
+int DrosteAntialiasSide(int maxSamples)
+{
+  int side = std::max(1, int(sqrt(double(std::max(maxSamples, 1)))));
+  return side % 2 ? side : side - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t DrosteProcess(const DrosteValues &values,
+                       const ImageView &src,
+                       const ImageView &dst,
+                       OfxPointD renderScale,
+                       double par,
+                       OfxRectI renderWindow,
+                       OfxRectI procWindow,
+                       const OfxPointD *warpIn,
+                       OfxPointD *warpOut,
+                       const CancelCheck &cancel)
+{
+  uint64_t samples = 0;
+  bool known = DispatchPixel(dst, [&](auto traits) {
+    samples = DispatchProcessRows<decltype(traits)>(values, src, dst, renderScale, par, renderWindow, procWindow, warpIn, warpOut, cancel);
+  });
+  if(!known)
+    throw " bad pixel type!";
+  return samples;
+}
+
+} // namespace Zokzir
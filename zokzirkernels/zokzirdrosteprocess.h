@@ -0,0 +1,96 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The Droste effect's kernel over whole images, for the effect and for tools
+that run it without a host.
+*/
+
+#ifndef ZOKZIR_DROSTE_PROCESS_H
+#define ZOKZIR_DROSTE_PROCESS_H
+
+#include <stdint.h>
+
+#include "zokzirimageview.h"
+#include "zokzirsaturationkernels.h"
+
+namespace Zokzir {
+
+// where the scaled copies go, the options of the layering choice param
+enum DrosteLayeringEnum
+{
+  eDrosteLayeringOnFront,
+  eDrosteLayeringOnBack,
+};
+
+// where the colour stage runs, the options of the colour stage choice param
+enum DrosteColourStageEnum
+{
+  eDrosteColourOff,
+  eDrosteColourPerSample,   // on each source pixel read, before the filter
+  eDrosteColourOnResult,    // once on the composited pixel, as if after it
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the colour operations folded into the warp, so a Saturation and Negative
+// chain around Droste is one pass. The matrix is the Saturation effect's, on
+// values of 0 to 1, then every component is inverted as Negative does.
+struct DrosteColour {
+  DrosteColourStageEnum stage;
+  ColourMatrix matrix;
+  bool invert;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the effect's parameters at the frame being rendered, in canonical coordinates
+struct DrosteValues {
+  DrosteLayeringEnum layering;
+  int spin;
+  double radius;
+  double ratio;
+  OfxPointD center;
+  OfxPointD position;
+  double zoom;
+  double rotation;
+  double evolution;
+  int minDepth;
+  int maxDepth;
+  DrosteColour colour;
+  int maxSamples;     // the most samples an antialiased pixel takes, 1 or less for none
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// render procWindow, a part of renderWindow, of dst from src, which have the
+// same depth and components, any depth and alpha, RGB or RGBA. RGBA is
+// composited premultiplied if dst says it is, straight otherwise, and RGB as
+// opaque wherever the source is.
+//
+// With maxSamples above 1, pixels where the warp shrinks the source, near
+// the vanishing point, or that straddle a tiling seam are supersampled, on a
+// grid of at most DrosteAntialiasSide(maxSamples) a side, and the rest take
+// one sample.
+//
+// The warp of each pixel up to its depth, the tiled log polar point, is read
+// from warpIn if that is given, and written to warpOut if that is given, both
+// hold renderWindow row by row. Returns the source samples it took, a pixel
+// takes one for each depth it composites. Throws a const char * for pixels it
+// doesn't know.
+uint64_t DrosteProcess(const DrosteValues &values,
+                       const ImageView &src,
+                       const ImageView &dst,
+                       OfxPointD renderScale,
+                       double par,
+                       OfxRectI renderWindow,
+                       OfxRectI procWindow,
+                       const OfxPointD *warpIn,
+                       OfxPointD *warpOut,
+                       const CancelCheck &cancel);
+
+// the side of the largest grid an antialiased pixel takes for maxSamples. It
+// is odd so the grid's middle sample is the pixel centre, which every pixel
+// takes first, and side * side is at most maxSamples.
+int DrosteAntialiasSide(int maxSamples);
+
+} // namespace Zokzir
+
+#endif
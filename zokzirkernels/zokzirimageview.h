@@ -0,0 +1,102 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The image type the Zokzir kernels work on.
+
+An ImageView is a pointer to pixels, the bounds they cover and the bytes
+from one row to the next, it neither owns nor frees them. The effects wrap
+the images the host gives them in one, the tools wrap their own buffers, so
+both run the same kernels.
+
+Kernels check a CancelCheck every so often and stop when it says so, which
+is how the effects pass on the host's abort.
+*/
+
+#ifndef ZOKZIR_IMAGE_VIEW_H
+#define ZOKZIR_IMAGE_VIEW_H
+
+#include <stddef.h>
+#include "ofxCore.h"
+
+namespace Zokzir {
+
+// the pixel depths the kernels know
+enum PixelDepthEnum
+{
+  ePixelDepthNone,
+  ePixelDepthByte,
+  ePixelDepthShort,
+  ePixelDepthHalf,
+  ePixelDepthFloat,
+};
+
+inline int BytesPerComponent(PixelDepthEnum depth)
+{
+  switch(depth) {
+    case ePixelDepthByte : return 1;
+    case ePixelDepthShort : return 2;
+    case ePixelDepthHalf : return 2;
+    case ePixelDepthFloat : return 4;
+    default : return 0;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// pixels somebody else owns
+struct ImageView {
+  char *data;              // the pixel at bounds.x1, bounds.y1
+  ptrdiff_t rowBytes;      // from a row to the one above, may be negative
+  OfxRectI bounds;         // the pixel rectangle there is data for
+  int nComponents;         // 1 for alpha, 3 for RGB, 4 for RGBA
+  PixelDepthEnum depth;
+  bool premultiplied;      // RGBA colour is premultiplied by the alpha
+
+  ImageView()
+    : data(NULL)
+    , rowBytes(0)
+    , nComponents(0)
+    , depth(ePixelDepthNone)
+    , premultiplied(false)
+  {
+    bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+  }
+
+  // is there anything to look at
+  explicit operator bool() const { return data != NULL; }
+
+  int bytesPerComponent() const { return BytesPerComponent(depth); }
+  int bytesPerPixel() const { return BytesPerComponent(depth) * nComponents; }
+
+  // the address of a pixel, null off the bounds
+  template <class T>
+  T *pixelAddress(int x, int y) const
+  {
+    if(x < bounds.x1 || x >= bounds.x2 || y < bounds.y1 || y >= bounds.y2)
+      return NULL;
+    return reinterpret_cast<T *>(data + ptrdiff_t(y - bounds.y1) * rowBytes + ptrdiff_t(x - bounds.x1) * bytesPerPixel());
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// asks whoever started a kernel whether it should stop
+struct CancelCheck {
+  bool (*callback)(void *data);
+  void *data;
+
+  CancelCheck()
+    : callback(NULL)
+    , data(NULL)
+  {}
+
+  CancelCheck(bool (*c)(void *), void *d)
+    : callback(c)
+    , data(d)
+  {}
+
+  bool operator()() const { return callback && callback(data); }
+};
+
+} // namespace Zokzir
+
+#endif
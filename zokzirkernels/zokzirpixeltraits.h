@@ -0,0 +1,161 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Compile time descriptions of the pixels the Zokzir kernels work on.
+
+A PixelTraits gives the type a component is stored as, the value of full
+intensity, whether it is a half float, how many components a pixel has,
+whether they carry colour and alpha, and whether the colour is premultiplied
+by the alpha. Kernels are templates on one and branch on its constants, so
+each layout gets code of its own with the branches folded away.
+
+DispatchPixel turns the depth, components and premultiplication of an
+ImageView into the PixelTraits for them and calls a generic lambda with it,
+so a new depth is added here and every kernel is instantiated for it.
+*/
+
+#ifndef ZOKZIR_PIXEL_TRAITS_H
+#define ZOKZIR_PIXEL_TRAITS_H
+
+#include "zokzirhalf.h"
+#include "zokzirimageview.h"
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// the depths
+template <PixelDepthEnum DEPTH>
+struct DepthTraits;
+
+template <>
+struct DepthTraits<ePixelDepthByte> {
+  typedef unsigned char Storage;
+  typedef unsigned char Wide;      // the storage from AVX2 up
+  static const int kMax = 255;
+  static const bool kIsHalf = false;
+};
+
+template <>
+struct DepthTraits<ePixelDepthShort> {
+  typedef unsigned short Storage;
+  typedef unsigned short Wide;
+  static const int kMax = 65535;
+  static const bool kIsHalf = false;
+};
+
+template <>
+struct DepthTraits<ePixelDepthHalf> {
+  typedef Half Storage;
+  typedef HalfF16C Wide;           // converts with F16C
+  static const int kMax = 1;
+  static const bool kIsHalf = true;
+};
+
+template <>
+struct DepthTraits<ePixelDepthFloat> {
+  typedef float Storage;
+  typedef float Wide;
+  static const int kMax = 1;
+  static const bool kIsHalf = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the component layouts, alpha alone, opaque RGB and RGBA
+template <int N>
+struct LayoutTraits;
+
+template <>
+struct LayoutTraits<1> {
+  static const int kComponents = 1;
+  static const bool kHasColour = false;
+  static const bool kHasAlpha = true;
+  static const int kAlpha = 0;     // the index of alpha
+};
+
+template <>
+struct LayoutTraits<3> {
+  static const int kComponents = 3;
+  static const bool kHasColour = true;
+  static const bool kHasAlpha = false;
+  static const int kAlpha = -1;
+};
+
+template <>
+struct LayoutTraits<4> {
+  static const int kComponents = 4;
+  static const bool kHasColour = true;
+  static const bool kHasAlpha = true;
+  static const int kAlpha = 3;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// a pixel layout at a depth
+template <PixelDepthEnum DEPTH, int N, bool PREMULTIPLIED = false>
+struct PixelTraits : DepthTraits<DEPTH>, LayoutTraits<N> {
+  static const PixelDepthEnum kDepth = DEPTH;
+  // only RGBA can be premultiplied, for alpha and RGB it makes no difference
+  static const bool kPremultiplied = PREMULTIPLIED && N == 4;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// call f(DepthTraits<depth>()) for depth, or return false for a depth we don't know
+template <class F>
+bool DispatchDepth(PixelDepthEnum depth, F &&f)
+{
+  switch(depth) {
+    case ePixelDepthByte : f(DepthTraits<ePixelDepthByte>()); return true;
+    case ePixelDepthShort : f(DepthTraits<ePixelDepthShort>()); return true;
+    case ePixelDepthHalf : f(DepthTraits<ePixelDepthHalf>()); return true;
+    case ePixelDepthFloat : f(DepthTraits<ePixelDepthFloat>()); return true;
+    default : return false;
+  }
+}
+
+namespace PixelTraitsDetail {
+
+  template <PixelDepthEnum DEPTH, class F>
+  bool DispatchLayout(int nComponents, bool premultiplied, F &&f)
+  {
+    switch(nComponents) {
+      case 1 : f(PixelTraits<DEPTH, 1>()); return true;
+      case 3 : f(PixelTraits<DEPTH, 3>()); return true;
+      case 4 :
+        if(premultiplied)
+          f(PixelTraits<DEPTH, 4, true>());
+        else
+          f(PixelTraits<DEPTH, 4, false>());
+        return true;
+      default : return false;
+    }
+  }
+
+} // namespace PixelTraitsDetail
+
+////////////////////////////////////////////////////////////////////////////////
+// call f(PixelTraits<...>()) for the pixels of view, or return false for
+// pixels we don't know
+template <class F>
+bool DispatchPixel(const ImageView &view, F &&f)
+{
+  switch(view.depth) {
+    case ePixelDepthByte : return PixelTraitsDetail::DispatchLayout<ePixelDepthByte>(view.nComponents, view.premultiplied, f);
+    case ePixelDepthShort : return PixelTraitsDetail::DispatchLayout<ePixelDepthShort>(view.nComponents, view.premultiplied, f);
+    case ePixelDepthHalf : return PixelTraitsDetail::DispatchLayout<ePixelDepthHalf>(view.nComponents, view.premultiplied, f);
+    case ePixelDepthFloat : return PixelTraitsDetail::DispatchLayout<ePixelDepthFloat>(view.nComponents, view.premultiplied, f);
+    default : return false;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// full intensity at a depth, 0 for one we don't know
+inline int MaxValue(PixelDepthEnum depth)
+{
+  int max = 0;
+  DispatchDepth(depth, [&](auto traits) {max = decltype(traits)::kMax;});
+  return max;
+}
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,115 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+Filtered lookups into an ImageView, for the warping kernels.
+
+Coordinates are in pixels with the centre of pixel (x, y) at (x, y), as
+OFX::Coords::toPixelSub gives them. The cubic filter blends the four pixels
+around the point with a cubic of zero slope at each pixel centre, so it
+never overshoots. Pixels off the image count as transparent black.
+
+Results are normalised to 0 to 1, whatever the depth.
+*/
+
+#ifndef ZOKZIR_SAMPLE_H
+#define ZOKZIR_SAMPLE_H
+
+#include <math.h>
+
+#include "zokzirimageview.h"
+
+namespace Zokzir {
+
+////////////////////////////////////////////////////////////////////////////////
+// the component c of a pixel, or zero for a pixel off the image
+template <class PIX>
+inline float SampleComponent(const PIX *pix, int c)
+{
+  return pix ? float(pix[c]) : 0.f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the nComponents components of src at x, y into out, returns how much of the
+// filter fell on the image, 1 inside it and 0 off it
+template <class PIX, int nComponents, int MAX>
+inline float SampleCubic(const ImageView &src, double x, double y, float *out)
+{
+  double fx = floor(x), fy = floor(y);
+  int cx = int(fx), cy = int(fy);
+
+  // the smoothstep weight of the pixel to the right and the one above
+  double dx = x - fx, dy = y - fy;
+  float wx = float(dx * dx * (3. - 2. * dx));
+  float wy = float(dy * dy * (3. - 2. * dy));
+
+  const PIX *Pcc = src.pixelAddress<PIX>(cx, cy);
+  const PIX *Pnc = src.pixelAddress<PIX>(cx + 1, cy);
+  const PIX *Pcn = src.pixelAddress<PIX>(cx, cy + 1);
+  const PIX *Pnn = src.pixelAddress<PIX>(cx + 1, cy + 1);
+
+  if(!Pcc && !Pnc && !Pcn && !Pnn) {
+    for(int c = 0; c < nComponents; c++) out[c] = 0.f;
+    return 0.f;
+  }
+
+  const float scale = 1.f / float(MAX);
+  for(int c = 0; c < nComponents; c++) {
+    float Icc = SampleComponent(Pcc, c), Inc = SampleComponent(Pnc, c);
+    float Icn = SampleComponent(Pcn, c), Inn = SampleComponent(Pnn, c);
+    float Ic = Icc + (Inc - Icc) * wx;
+    float In = Icn + (Inn - Icn) * wx;
+    out[c] = (Ic + (In - Ic) * wy) * scale;
+  }
+
+  // the weights of the pixels on the image
+  return (Pcc ? (1.f - wx) * (1.f - wy) : 0.f) + (Pnc ? wx * (1.f - wy) : 0.f) +
+         (Pcn ? (1.f - wx) * wy : 0.f) + (Pnn ? wx * wy : 0.f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the same with each pixel on the image run through tap before the filter,
+// as components of 0 to 1 in place, which is what an effect run on src before
+// the lookup would have done to it. Pixels off the image stay transparent
+// black, as they would be past the edge of that effect's output.
+template <class PIX, int nComponents, int MAX, class TAP>
+inline float SampleCubic(const ImageView &src, double x, double y, float *out, const TAP &tap)
+{
+  double fx = floor(x), fy = floor(y);
+  int cx = int(fx), cy = int(fy);
+
+  double dx = x - fx, dy = y - fy;
+  float wx = float(dx * dx * (3. - 2. * dx));
+  float wy = float(dy * dy * (3. - 2. * dy));
+
+  const PIX *P[4] = {
+    src.pixelAddress<PIX>(cx, cy), src.pixelAddress<PIX>(cx + 1, cy),
+    src.pixelAddress<PIX>(cx, cy + 1), src.pixelAddress<PIX>(cx + 1, cy + 1)
+  };
+
+  if(!P[0] && !P[1] && !P[2] && !P[3]) {
+    for(int c = 0; c < nComponents; c++) out[c] = 0.f;
+    return 0.f;
+  }
+
+  const float scale = 1.f / float(MAX);
+  float I[4][nComponents];
+  for(int i = 0; i < 4; i++) {
+    for(int c = 0; c < nComponents; c++)
+      I[i][c] = SampleComponent(P[i], c) * scale;
+    if(P[i])
+      tap(I[i]);
+  }
+  for(int c = 0; c < nComponents; c++) {
+    float Ic = I[0][c] + (I[1][c] - I[0][c]) * wx;
+    float In = I[2][c] + (I[3][c] - I[2][c]) * wx;
+    out[c] = Ic + (In - Ic) * wy;
+  }
+
+  return (P[0] ? (1.f - wx) * (1.f - wy) : 0.f) + (P[1] ? wx * (1.f - wy) : 0.f) +
+         (P[2] ? (1.f - wx) * wy : 0.f) + (P[3] ? wx * wy : 0.f);
+}
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,172 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The per pixel kernels of the Saturation effect.
+
+They work on plain pixel pointers so the microbenchmark can time them
+without a host, the effect itself does the image and mask bookkeeping.
+*/
+
+#ifndef ZOKZIR_SATURATION_KERNELS_H
+#define ZOKZIR_SATURATION_KERNELS_H
+
+#include <algorithm>
+
+#include "zokzirhalf.h"
+
+// and SSE2 for the image statistics, which every x86-64 compiler targets
+#if defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define ZOKZIR_HAS_SSE2 1
+#endif
+
+namespace Zokzir {
+
+// the options of the luma weights choice param, in order
+enum LumaWeightsEnum
+{
+  eLumaWeightsEqual,
+  eLumaWeightsRec709,
+  eLumaWeightsRec2020,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// a 3x4 colour matrix, out[c] = m[c][0]*r + m[c][1]*g + m[c][2]*b + m[c][3]
+struct ColourMatrix {
+  float m[3][4];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// the R, G and B weights of each luma weights option
+static const double kLumaWeights[][3] = {
+  {1.0/3.0, 1.0/3.0, 1.0/3.0},   // eLumaWeightsEqual
+  {0.2126,  0.7152,  0.0722},    // eLumaWeightsRec709
+  {0.2627,  0.6780,  0.0593},    // eLumaWeightsRec2020
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// fold the saturation around the weighted luma, the gain and the offset into
+// a single matrix, built once per render. MAX scales the offset into the
+// pixel's value range.
+inline ColourMatrix BuildColourMatrix(double saturation,
+                                      int lumaWeights,
+                                      double gain,
+                                      double offset,
+                                      float max)
+{
+  if(lumaWeights < eLumaWeightsEqual || lumaWeights > eLumaWeightsRec2020)
+    lumaWeights = eLumaWeightsEqual;
+  const double *weights = kLumaWeights[lumaWeights];
+
+  ColourMatrix matrix;
+  for(int row = 0; row < 3; ++row) {
+    for(int col = 0; col < 3; ++col) {
+      // luma + (value - luma) * saturation, then the gain
+      double value = (1.0 - saturation) * weights[col] + (row == col ? saturation : 0.0);
+      matrix.m[row][col] = float(value * gain);
+    }
+    matrix.m[row][3] = float(offset * max);
+  }
+  return matrix;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// clamp to 0 and MAX inclusive
+template <class T, int MAX>
+inline T Clamp(float value)
+{
+  if(MAX == 1)
+    return value; // don't clamp floating point values
+  else
+    return value < 0 ? T(0) : (value > MAX ? T(MAX) : T(value));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// lerp from v1 to v2
+template <class T1, class T2>
+inline T1 Blend(T1 v1, T2 v2, float blend)
+{
+  return v1 + (v2-v1) * blend;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// run count pixels of nComps components through the matrix, alpha is copied
+template <class T, int MAX>
+inline void ColourMatrixRow(const ColourMatrix &matrix, const T *srcPix, T *dstPix, int count, int nComps)
+{
+  const float (*m)[4] = matrix.m;
+  for(int x = 0; x < count; x++) {
+    float r = srcPix[0], g = srcPix[1], b = srcPix[2];
+    for(int c = 0; c < 3; ++c) {
+      dstPix[c] = Clamp<T, MAX>(m[c][0] * r + m[c][1] * g + m[c][2] * b + m[c][3]);
+    }
+    if(nComps == 4) {
+      dstPix[3] = srcPix[3];
+    }
+    srcPix += nComps;
+    dstPix += nComps;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// sum of the chroma, max(R,G,B) - min(R,G,B), of n pixels held in planar rows,
+// a pixel at a time
+inline double SumChromaScalar(const float *r, const float *g, const float *b, int n)
+{
+  double sum = 0;
+  for(int x = 0; x < n; x++) {
+    sum += std::max(std::max(r[x], g[x]), b[x]) - std::min(std::min(r[x], g[x]), b[x]);
+  }
+  return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the same, four pixels at a time where SSE2 is there
+inline double SumChroma(const float *r, const float *g, const float *b, int n)
+{
+  double sum = 0;
+  int x = 0;
+#ifdef ZOKZIR_HAS_SSE2
+  __m128 acc = _mm_setzero_ps();
+  for(; x + 4 <= n; x += 4) {
+    __m128 vr = _mm_loadu_ps(r + x);
+    __m128 vg = _mm_loadu_ps(g + x);
+    __m128 vb = _mm_loadu_ps(b + x);
+    __m128 hi = _mm_max_ps(_mm_max_ps(vr, vg), vb);
+    __m128 lo = _mm_min_ps(_mm_min_ps(vr, vg), vb);
+    acc = _mm_add_ps(acc, _mm_sub_ps(hi, lo));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  sum = double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#endif
+  return sum + SumChromaScalar(r + x, g + x, b + x, n - x);
+}
+
+#ifdef ZOKZIR_X86
+////////////////////////////////////////////////////////////////////////////////
+// and eight at a time, only for eCpuLevelAVX2 and up
+ZOKZIR_INTRINSICS_AVX2 inline double SumChromaAVX2(const float *r, const float *g, const float *b, int n)
+{
+  __m256 acc = _mm256_setzero_ps();
+  int x = 0;
+  for(; x + 8 <= n; x += 8) {
+    __m256 vr = _mm256_loadu_ps(r + x);
+    __m256 vg = _mm256_loadu_ps(g + x);
+    __m256 vb = _mm256_loadu_ps(b + x);
+    __m256 hi = _mm256_max_ps(_mm256_max_ps(vr, vg), vb);
+    __m256 lo = _mm256_min_ps(_mm256_min_ps(vr, vg), vb);
+    acc = _mm256_add_ps(acc, _mm256_sub_ps(hi, lo));
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  double sum = 0;
+  for(int i = 0; i < 8; i++) sum += lanes[i];
+  return sum + SumChromaScalar(r + x, g + x, b + x, n - x);
+}
+#endif
+
+} // namespace Zokzir
+
+#endif
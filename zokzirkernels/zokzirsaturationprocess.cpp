@@ -0,0 +1,370 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The Saturation kernels over whole images, see zokzirsaturationprocess.h.
+
+Each is compiled for every CPU level and the level is picked per call.
+*/
+
+#include <string.h>
+#include <algorithm>
+
+#include "zokzirarena.h"
+#include "zokzircpu.h"
+#include "zokzirhalf.h"
+#include "zokzirpixeltraits.h"
+#include "zokzirsaturationprocess.h"
+
+namespace Zokzir {
+
+// anonymous namespace to hide our symbols in
+namespace {
+  ////////////////////////////////////////////////////////////////////////////////
+  // the part of the span x1 to x2 on row y that the source has pixels for
+  void SourceSpan(const ImageView &src, int x1, int x2, int y, int &spanX1, int &spanX2)
+  {
+    const OfxRectI &srcBounds = src.bounds;
+    spanX1 = spanX2 = x1;
+    if(y >= srcBounds.y1 && y < srcBounds.y2) {
+      spanX1 = std::min(std::max(x1, srcBounds.x1), x2);
+      spanX2 = std::max(std::min(x2, srcBounds.x2), spanX1);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // process the pixels from x1 to x2 on row y, MASKED says whether to read the
+  // mask per pixel or to do the full effect everywhere. P is the PixelTraits of
+  // the images and T the type their components are read as.
+  template <class P, class T, bool MASKED>
+  void ProcessRow(const ColourMatrix &matrix,
+                  const ImageView &src,
+                  const ImageView &mask,
+                  const ImageView &output,
+                  int x1, int x2, int y)
+  {
+    const int nComps = P::kComponents;
+    const int MAX = P::kMax;
+
+    if(!MASKED) {
+      // the full effect wherever there is source, zero elsewhere
+      size_t bytesPerPixel = size_t(nComps) * sizeof(T);
+      char *dstRow = output.pixelAddress<char>(x1, y);
+      int spanX1, spanX2;
+      SourceSpan(src, x1, x2, y, spanX1, spanX2);
+
+      memset(dstRow, 0, (spanX1 - x1) * bytesPerPixel);
+      if(spanX2 > spanX1) {
+        ColourMatrixRow<T, MAX>(matrix,
+                                src.pixelAddress<T>(spanX1, y),
+                                (T *) (dstRow + (spanX1 - x1) * bytesPerPixel),
+                                spanX2 - spanX1,
+                                nComps);
+      }
+      memset(dstRow + (spanX2 - x1) * bytesPerPixel, 0, (x2 - spanX2) * bytesPerPixel);
+      return;
+    }
+
+    // get the row start for the output image
+    T *dstPix = output.pixelAddress<T>(x1, y);
+
+    for(int x = x1; x < x2; x++) {
+
+      // get the source pixel
+      T *srcPix = src.pixelAddress<T>(x, y);
+
+      // get the amount to mask by, pixels off the mask image get no effect
+      T *maskPix = mask.pixelAddress<T>(x, y);
+      float maskAmount = maskPix ? float(*maskPix)/float(MAX) : 0.0f;
+
+      if(srcPix) {
+        if(maskAmount == 0) {
+          // the mask is zero here, so no effect happens, copy source to output
+          for(int i = 0; i < nComps; ++i) {
+            dstPix[i] = srcPix[i];
+          }
+        }
+        else {
+          // run the pixel through the colour matrix, then use the mask to lerp
+          // between the identity and that, in float so the integer depths are
+          // only truncated once
+          const float (*m)[4] = matrix.m;
+          float r = srcPix[0], g = srcPix[1], b = srcPix[2];
+          for(int c = 0; c < 3; ++c) {
+            float value = m[c][0] * r + m[c][1] * g + m[c][2] * b + m[c][3];
+            if(MAX != 1)
+              value = std::min(std::max(value, 0.0f), float(MAX));
+            dstPix[c] = Clamp<T, MAX>(Blend(float(srcPix[c]), value, maskAmount));
+          }
+
+          if(P::kHasAlpha) { // if we have an alpha, just copy it
+            dstPix[3] = srcPix[3];
+          }
+        }
+      }
+      else {
+        // we don't have a pixel in the source image, set output to zero
+        for(int i = 0; i < nComps; ++i) {
+          dstPix[i] = 0;
+        }
+      }
+      dstPix += nComps;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // copy the pixels from x1 to x2 on row y straight from the source, zeroing
+  // anything the source doesn't cover
+  template <class T>
+  void CopyRow(const ImageView &src, const ImageView &output, int x1, int x2, int y)
+  {
+    size_t bytesPerPixel = size_t(output.nComponents) * sizeof(T);
+    char *dstRow = output.pixelAddress<char>(x1, y);
+    int copyX1, copyX2;
+    SourceSpan(src, x1, x2, y, copyX1, copyX2);
+
+    memset(dstRow, 0, (copyX1 - x1) * bytesPerPixel);
+    if(copyX2 > copyX1) {
+      memcpy(dstRow + (copyX1 - x1) * bytesPerPixel,
+             src.pixelAddress<char>(copyX1, y),
+             (copyX2 - copyX1) * bytesPerPixel);
+    }
+    memset(dstRow + (copyX2 - x1) * bytesPerPixel, 0, (x2 - copyX2) * bytesPerPixel);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // what a tile of the render window needs doing, from the summary of its mask
+  enum MaskTileEnum {
+    eMaskTileEmpty,  // the mask is zero everywhere, copy the source
+    eMaskTileFull,   // the mask is one everywhere, do the full effect
+    eMaskTileMixed,  // blend per pixel
+  };
+
+  
+  ////////////////////////////////////////////////////////////////////////////////
+  // find whether the mask is exactly zero or exactly one over the whole tile,
+  // stopping as soon as we know it is neither. Pixels off the mask image count
+  // as zero. A float mask outside 0 to 1 is mixed, so it is blended per pixel,
+  // which goes past the effect or back past the source as the blend always has.
+  template <class T, int MAX>
+  MaskTileEnum SummariseMaskTile(const ImageView &mask, OfxRectI tile)
+  {
+    const OfxRectI &maskBounds = mask.bounds;
+    bool coversTile = tile.x1 >= maskBounds.x1 && tile.x2 <= maskBounds.x2 &&
+                      tile.y1 >= maskBounds.y1 && tile.y2 <= maskBounds.y2;
+
+    bool empty = true, full = coversTile;
+    for(int y = tile.y1; y < tile.y2; y++) {
+      for(int x = tile.x1; x < tile.x2; x++) {
+        T *maskPix = mask.pixelAddress<T>(x, y);
+        float value = maskPix ? float(*maskPix) : 0.0f;
+        empty = empty && value == 0.0f;
+        full = full && value == float(MAX);
+      }
+      if(!empty && !full)
+        return eMaskTileMixed;
+    }
+
+    return empty ? eMaskTileEmpty : full ? eMaskTileFull : eMaskTileMixed;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // iterate over our pixels and process them
+  template <class P, class T>
+  void PixelProcessing(const ColourMatrix &matrix,
+                       const CancelCheck &cancel,
+                       const ImageView &src,
+                       const ImageView &mask,
+                       const ImageView &output,
+                       OfxRectI renderWindow)
+  {
+    if(!mask) {
+      // no mask image means we do the full effect everywhere
+      for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
+        if(y % 20 == 0 && cancel()) break;
+        ProcessRow<P, T, false>(matrix, src, mask, output, renderWindow.x1, renderWindow.x2, y);
+      }
+      return;
+    }
+
+    // otherwise summarise the mask a tile at a time, so we only pay for the
+    // per pixel blend where the mask is neither zero nor one
+    for(int tileY = renderWindow.y1; tileY < renderWindow.y2; tileY += kSaturationTileSize) {
+      if(cancel()) break;
+
+      for(int tileX = renderWindow.x1; tileX < renderWindow.x2; tileX += kSaturationTileSize) {
+        OfxRectI tile;
+        tile.x1 = tileX;
+        tile.y1 = tileY;
+        tile.x2 = std::min(tileX + kSaturationTileSize, renderWindow.x2);
+        tile.y2 = std::min(tileY + kSaturationTileSize, renderWindow.y2);
+
+        switch(SummariseMaskTile<T, P::kMax>(mask, tile)) {
+          case eMaskTileEmpty :
+            for(int y = tile.y1; y < tile.y2; y++)
+              CopyRow<T>(src, output, tile.x1, tile.x2, y);
+            break;
+          case eMaskTileFull :
+            for(int y = tile.y1; y < tile.y2; y++)
+              ProcessRow<P, T, false>(matrix, src, mask, output, tile.x1, tile.x2, y);
+            break;
+          case eMaskTileMixed :
+            for(int y = tile.y1; y < tile.y2; y++)
+              ProcessRow<P, T, true>(matrix, src, mask, output, tile.x1, tile.x2, y);
+            break;
+        }
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // PixelProcessing compiled for each CPU level above the baseline
+  template <class P, class T>
+  ZOKZIR_TARGET_SSE42 void PixelProcessingSSE42(const ColourMatrix &matrix, const CancelCheck &cancel,
+                                                const ImageView &src, const ImageView &mask, const ImageView &output, OfxRectI renderWindow)
+  {
+    PixelProcessing<P, T>(matrix, cancel, src, mask, output, renderWindow);
+  }
+
+  template <class P, class T>
+  ZOKZIR_TARGET_AVX2 void PixelProcessingAVX2(const ColourMatrix &matrix, const CancelCheck &cancel,
+                                              const ImageView &src, const ImageView &mask, const ImageView &output, OfxRectI renderWindow)
+  {
+    PixelProcessing<P, T>(matrix, cancel, src, mask, output, renderWindow);
+  }
+
+  template <class P, class T>
+  ZOKZIR_TARGET_AVX512 void PixelProcessingAVX512(const ColourMatrix &matrix, const CancelCheck &cancel,
+                                                  const ImageView &src, const ImageView &mask, const ImageView &output, OfxRectI renderWindow)
+  {
+    PixelProcessing<P, T>(matrix, cancel, src, mask, output, renderWindow);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // run the PixelProcessing for the CPU we are on, from AVX2 up the components
+  // are read as the depth's Wide type, so half floats convert with F16C
+  template <class P>
+  void DispatchPixelProcessing(const ColourMatrix &matrix, const CancelCheck &cancel,
+                               const ImageView &src, const ImageView &mask, const ImageView &output, OfxRectI renderWindow)
+  {
+    typedef typename P::Storage T;
+    typedef typename P::Wide WIDE;
+    switch(CpuLevel()) {
+      case eCpuLevelAVX512 :
+        PixelProcessingAVX512<P, WIDE>(matrix, cancel, src, mask, output, renderWindow);
+        break;
+      case eCpuLevelAVX2 :
+        PixelProcessingAVX2<P, WIDE>(matrix, cancel, src, mask, output, renderWindow);
+        break;
+      case eCpuLevelSSE42 :
+        PixelProcessingSSE42<P, T>(matrix, cancel, src, mask, output, renderWindow);
+        break;
+      default :
+        PixelProcessing<P, T>(matrix, cancel, src, mask, output, renderWindow);
+        break;
+    }
+  }
+
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the chroma of the rows y1 to y2 from x1 to x2, with the components read
+  // as T, a row at a time through planar scratch rows so the sum can run
+  // several pixels at a time, eight with AVX2 if wide
+  template <class P, class T>
+  double SumChromaRows(const ImageView &src, int x1, int x2, int y1, int y2, bool wide)
+  {
+    const int nComps = P::kComponents;
+    int width = x2 - x1;
+
+    // a plane each, rounded to a cache line
+    ArenaScope arena;
+    size_t plane = (size_t(width) + 15) & ~size_t(15);
+    TraceScratch scratch(plane * 3 * sizeof(float));
+    float *r = arena.allocate<float>(plane * 3), *g = r + plane, *b = g + plane;
+    const float scale = 1.0f / float(P::kMax);
+
+    double sum = 0;
+    for(int y = y1; y < y2; y++) {
+      const T *srcPix = src.pixelAddress<T>(x1, y);
+      for(int x = 0; x < width; x++) {
+        r[x] = float(srcPix[0]) * scale;
+        g[x] = float(srcPix[1]) * scale;
+        b[x] = float(srcPix[2]) * scale;
+        srcPix += nComps;
+      }
+#ifdef ZOKZIR_X86
+      if(wide) {
+        sum += SumChromaAVX2(r, g, b, width);
+        continue;
+      }
+#endif
+      sum += SumChroma(r, g, b, width);
+    }
+#ifndef ZOKZIR_X86
+    (void) wide;
+#endif
+    return sum;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // SumChromaRows compiled for AVX2, where the components are read as the
+  // depth's Wide type, so half floats convert with F16C as they do in
+  // DispatchPixelProcessing
+  template <class P>
+  ZOKZIR_TARGET_AVX2 double SumChromaRowsAVX2(const ImageView &src, int x1, int x2, int y1, int y2)
+  {
+    return SumChromaRows<P, typename P::Wide>(src, x1, x2, y1, y2, true);
+  }
+
+  // run the SumChromaRows for the CPU we are on
+  template <class P>
+  double DispatchSumChromaRows(const ImageView &src, int x1, int x2, int y1, int y2)
+  {
+#ifdef ZOKZIR_X86
+    if(CpuLevel() >= eCpuLevelAVX2)
+      return SumChromaRowsAVX2<P>(src, x1, x2, y1, y2);
+#endif
+    return SumChromaRows<P, typename P::Storage>(src, x1, x2, y1, y2, false);
+  }
+
+} // end of anonymous namespace
+
+////////////////////////////////////////////////////////////////////////////////
+void SaturationProcess(const ColourMatrix &matrix,
+                       const ImageView &src,
+                       const ImageView &mask,
+                       const ImageView &output,
+                       OfxRectI window,
+                       const CancelCheck &cancel)
+{
+  bool known = DispatchPixel(output, [&](auto traits) {
+    typedef decltype(traits) P;
+    // the matrix needs colour, there's nothing to do to an alpha
+    if constexpr(P::kHasColour)
+      DispatchPixelProcessing<P>(matrix, cancel, src, mask, output, window);
+    else
+      throw " bad data type!";
+  });
+  if(!known)
+    throw " bad data type!";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double SaturationSumChroma(const ImageView &src, int x1, int x2, int y1, int y2)
+{
+  if(x1 >= x2 || y1 >= y2)
+    return 0;
+  double sum = 0;
+  bool known = DispatchPixel(src, [&](auto traits) {
+    typedef decltype(traits) P;
+    if constexpr(P::kHasColour)
+      sum = DispatchSumChromaRows<P>(src, x1, x2, y1, y2);
+    else
+      throw " bad data type!";
+  });
+  if(!known)
+    throw " bad data type!";
+  return sum;
+}
+
+} // namespace Zokzir
@@ -0,0 +1,40 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+The Saturation effect's kernels over whole images, for the effect and for
+tools that run it without a host.
+*/
+
+#ifndef ZOKZIR_SATURATION_PROCESS_H
+#define ZOKZIR_SATURATION_PROCESS_H
+
+#include "zokzirimageview.h"
+#include "zokzirsaturationkernels.h"
+
+namespace Zokzir {
+
+// size in pixels of the square tiles the mask is summarised over, windows
+// split on these lines do the same work as the whole
+const int kSaturationTileSize = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+// run window of src through the matrix into output, which has the same depth
+// and components. Where there is a mask, the effect is blended by it and
+// pixels off it get none. Pixels off src come out as zero. Throws a const
+// char * for a depth it doesn't know.
+void SaturationProcess(const ColourMatrix &matrix,
+                       const ImageView &src,
+                       const ImageView &mask,
+                       const ImageView &output,
+                       OfxRectI window,
+                       const CancelCheck &cancel);
+
+////////////////////////////////////////////////////////////////////////////////
+// the sum of the chroma, max(R,G,B) - min(R,G,B) in 0 to 1, of the pixels
+// x1 to x2 of rows y1 to y2 of src, which must all be on it
+double SaturationSumChroma(const ImageView &src, int x1, int x2, int y1, int y2);
+
+} // namespace Zokzir
+
+#endif
@@ -0,0 +1,1193 @@
+// Copyright SalkocsisFX.
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+zokzir-render, renders image sequences through the Zokzir kernels with no
+host.
+
+    zokzir-render CONFIG [KEY=VALUE ...]
+
+The config file is lines of KEY = VALUE, lines starting with # are
+comments, and the KEY=VALUE arguments after it override it. The keys are
+
+    effect    saturation or droste
+    input     the frames to read, a run of # or a printf %d in the name is
+              the frame number
+    output    the frames to write, the same way
+    frames    FIRST-LAST, or a single frame
+    parallel  frames to render a whole frame per thread, rows to share the
+              rows of each frame between the threads (default frames)
+    threads   render threads (default one per core)
+    queue     frames in flight between reading and writing (default the
+              threads plus four)
+    io        reading threads and writing threads, each (default 2)
+    raw       WIDTHxHEIGHT,COMPONENTS,DEPTH of .raw input, such as
+              1920x1080,rgba,float
+    estimate  only to read the frames and report the predicted cost of
+              rendering them, without rendering
+
+and the parameters of the effect, by the names the plugin gives them. A
+parameter set as NAME@FRAME = VALUE is keyframed, between keys it is
+interpolated linearly and outside them it holds. Choices take the option
+names, such as layering = onBack.
+
+Frames are PFM, binary PPM and PGM of 8 or 16 bits, or raw, which is packed
+rows bottom up as OFX has them. Input is memory mapped, and rendered from in
+place when its layout is one the kernels take, as little endian PFM, 8 bit
+PPM and raw are. The rest is converted to a buffer first. Output is written
+in the format its extension names, .pfm, .ppm, .pgm or .raw.
+
+The report gives the CPU seconds and memory the cost model predicts for the
+frames next to the CPU seconds they took, see zokzirkernels/zokzircost.h.
+Droste frames are kept within the workBudget parameter as the effect keeps
+them, and what that changes is printed when it changes.
+
+    zokzir-render --calibrate FILE
+
+times the kernels on this machine and writes the cost model's calibration
+file, for ZOKZIR_COST_CALIBRATION.
+
+Reading, rendering and writing run on their own threads, passing frames
+through queues. At most `queue` frames are in flight, and their buffers are
+reused, so the disk and the cores are busy at once without frames piling up
+in memory. Frames rather than rows in parallel gives the best throughput, rows
+is for when few frames are wanted soon or memory is short.
+*/
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "zokzirarena.h"
+#include "zokzircost.h"
+#include "zokzircpu.h"
+#include "zokzirdrosteprocess.h"
+#include "zokzirimageview.h"
+#include "zokzirsaturationkernels.h"
+#include "zokzirsaturationprocess.h"
+#include "zokzirtrace.h"
+
+namespace {
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // The effects and their parameters, with the names and defaults the plugins
+  // give them
+
+  enum EffectEnum {
+    eEffectNone,
+    eEffectSaturation,
+    eEffectDroste,
+  };
+
+  struct ParamSpec {
+    const char *name;
+    int dimension;
+    double defaults[2];
+    bool integer;
+    std::vector<const char *> options;  // the names of a choice's options
+  };
+
+  const std::vector<ParamSpec> &ParamSpecs(EffectEnum effect)
+  {
+    static const std::vector<ParamSpec> saturation = {
+      {"saturation", 1, {1.0}, false, {}},
+      {"lumaWeights", 1, {0.}, true, {"equal", "rec709", "rec2020"}},
+      {"gain", 1, {1.0}, false, {}},
+      {"offset", 1, {0.0}, false, {}},
+      {"auto", 1, {0.}, true, {"off", "on"}},
+      {"targetChroma", 1, {0.1}, false, {}},
+    };
+    static const std::vector<ParamSpec> droste = {
+      {"layering", 1, {0.}, true, {"onFront", "onBack"}},
+      {"spin", 1, {1.}, true, {}},
+      {"radius", 1, {500.}, false, {}},
+      {"ratio", 1, {0.5}, false, {}},
+      {"center", 2, {0., 0.}, false, {}},
+      {"position", 2, {0., 0.}, false, {}},
+      {"zoom", 1, {0.}, false, {}},
+      {"rotation", 1, {0.}, false, {}},
+      {"evolution", 1, {0.}, false, {}},
+      {"minDepth", 1, {-2.}, true, {}},
+      {"maxDepth", 1, {2.}, true, {}},
+      {"colourStage", 1, {0.}, true, {"off", "perSample", "onResult"}},
+      {"colourSaturation", 1, {1.}, false, {}},
+      {"colourLumaWeights", 1, {0.}, true, {"equal", "rec709", "rec2020"}},
+      {"colourGain", 1, {1.}, false, {}},
+      {"colourOffset", 1, {0.}, false, {}},
+      {"colourInvert", 1, {0.}, true, {"off", "on"}},
+      {"antialiasing", 1, {0.}, true, {"off", "adaptive"}},
+      {"maxSamples", 1, {9.}, true, {}},
+      {"workBudget", 1, {400.}, true, {}},
+    };
+    static const std::vector<ParamSpec> none;
+    return effect == eEffectSaturation ? saturation : effect == eEffectDroste ? droste : none;
+  }
+
+  const ParamSpec *FindParamSpec(EffectEnum effect, const std::string &name)
+  {
+    for(const ParamSpec &spec : ParamSpecs(effect))
+      if(name == spec.name) return &spec;
+    return NULL;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // the keys of a parameter, by frame
+  struct Track {
+    std::map<double, std::vector<double>> keys;
+
+    // the value at frame, choices hold from one key to the next
+    std::vector<double> valueAt(const ParamSpec &spec, double frame) const
+    {
+      if(keys.empty())
+        return std::vector<double>(spec.defaults, spec.defaults + spec.dimension);
+      std::map<double, std::vector<double>>::const_iterator after = keys.upper_bound(frame);
+      if(after == keys.begin())
+        return after->second;
+      std::map<double, std::vector<double>>::const_iterator before = std::prev(after);
+      if(after == keys.end() || !spec.options.empty())
+        return before->second;
+
+      double t = (frame - before->first) / (after->first - before->first);
+      std::vector<double> value(spec.dimension);
+      for(int i = 0; i < spec.dimension; i++) {
+        value[i] = before->second[i] + (after->second[i] - before->second[i]) * t;
+        if(spec.integer) value[i] = floor(value[i] + 0.5);
+      }
+      return value;
+    }
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Settings, from the config file and the command line
+
+  struct Settings {
+    EffectEnum effect = eEffectNone;
+    std::string input;
+    std::string output;
+    int firstFrame = 1;
+    int lastFrame = 1;
+    bool rowsInParallel = false;
+    bool estimateOnly = false;
+    int threads = 0;
+    int queue = 0;
+    int io = 2;
+    // the layout of .raw input
+    int rawWidth = 0;
+    int rawHeight = 0;
+    int rawComponents = 4;
+    Zokzir::PixelDepthEnum rawDepth = Zokzir::ePixelDepthFloat;
+    // the raw text of each parameter key, checked once the effect is known
+    struct ParamKey {
+      std::string name;
+      bool keyed;
+      double frame;
+      std::string value;
+      std::string where;
+    };
+    std::vector<ParamKey> paramKeys;
+    std::map<std::string, Track> params;
+  };
+
+  void Usage()
+  {
+    fprintf(stderr,
+            "usage: zokzir-render CONFIG [KEY=VALUE ...]\n"
+            "  effect = saturation|droste\n"
+            "  input = FILE           frames to read, #### or %%04d is the frame number\n"
+            "  output = FILE          frames to write, .pfm, .ppm, .pgm or .raw\n"
+            "  frames = FIRST[-LAST]\n"
+            "  parallel = frames|rows a frame per thread, or every thread on each frame (default frames)\n"
+            "  threads = N            render threads (default one per core)\n"
+            "  queue = N              frames in flight (default the threads plus four)\n"
+            "  io = N                 reading and writing threads, each (default 2)\n"
+            "  raw = WxH,rgba|rgb|alpha,byte|short|float  the layout of .raw input\n"
+            "  estimate = only        report the predicted cost without rendering\n"
+            "  NAME = V[,V]           an effect parameter\n"
+            "  NAME@FRAME = V[,V]     a key of an animated effect parameter\n"
+            "or: zokzir-render --calibrate FILE  write the cost calibration of this machine\n");
+  }
+
+  std::string Trim(const std::string &s)
+  {
+    size_t start = 0, end = s.size();
+    while(start < end && isspace((unsigned char) s[start])) start++;
+    while(end > start && isspace((unsigned char) s[end - 1])) end--;
+    return s.substr(start, end - start);
+  }
+
+  bool ParseRaw(const std::string &value, Settings &settings)
+  {
+    char components[16] = "", depth[16] = "";
+    if(sscanf(value.c_str(), "%dx%d,%15[a-z],%15[a-z]", &settings.rawWidth, &settings.rawHeight, components, depth) != 4 ||
+       settings.rawWidth <= 0 || settings.rawHeight <= 0)
+      return false;
+    std::string c = components, d = depth;
+    settings.rawComponents = c == "alpha" ? 1 : c == "rgb" ? 3 : c == "rgba" ? 4 : 0;
+    settings.rawDepth = d == "byte" ? Zokzir::ePixelDepthByte : d == "short" ? Zokzir::ePixelDepthShort
+                      : d == "float" ? Zokzir::ePixelDepthFloat : Zokzir::ePixelDepthNone;
+    return settings.rawComponents != 0 && settings.rawDepth != Zokzir::ePixelDepthNone;
+  }
+
+  // one KEY = VALUE, where says where it came from for the errors
+  bool SetKey(const std::string &line, const std::string &where, Settings &settings)
+  {
+    size_t equals = line.find('=');
+    if(equals == std::string::npos) {
+      fprintf(stderr, "%s: want KEY = VALUE\n", where.c_str());
+      return false;
+    }
+    std::string key = Trim(line.substr(0, equals));
+    std::string value = Trim(line.substr(equals + 1));
+
+    if(key == "effect") {
+      settings.effect = value == "saturation" ? eEffectSaturation : value == "droste" ? eEffectDroste : eEffectNone;
+      if(settings.effect == eEffectNone) {
+        fprintf(stderr, "%s: unknown effect %s\n", where.c_str(), value.c_str());
+        return false;
+      }
+    }
+    else if(key == "input") {
+      settings.input = value;
+    }
+    else if(key == "output") {
+      settings.output = value;
+    }
+    else if(key == "frames") {
+      int n = sscanf(value.c_str(), "%d-%d", &settings.firstFrame, &settings.lastFrame);
+      if(n == 1) settings.lastFrame = settings.firstFrame;
+      if(n < 1 || settings.lastFrame < settings.firstFrame) {
+        fprintf(stderr, "%s: bad frame range %s\n", where.c_str(), value.c_str());
+        return false;
+      }
+    }
+    else if(key == "parallel") {
+      if(value != "frames" && value != "rows") {
+        fprintf(stderr, "%s: parallel is frames or rows\n", where.c_str());
+        return false;
+      }
+      settings.rowsInParallel = value == "rows";
+    }
+    else if(key == "threads") {
+      settings.threads = std::max(0, atoi(value.c_str()));
+    }
+    else if(key == "queue") {
+      settings.queue = std::max(0, atoi(value.c_str()));
+    }
+    else if(key == "io") {
+      settings.io = std::max(1, atoi(value.c_str()));
+    }
+    else if(key == "estimate") {
+      if(value != "only") {
+        fprintf(stderr, "%s: estimate is only\n", where.c_str());
+        return false;
+      }
+      settings.estimateOnly = true;
+    }
+    else if(key == "raw") {
+      if(!ParseRaw(value, settings)) {
+        fprintf(stderr, "%s: bad raw layout %s\n", where.c_str(), value.c_str());
+        return false;
+      }
+    }
+    else {
+      // an effect parameter, checked when we know which effect
+      Settings::ParamKey param;
+      size_t at = key.find('@');
+      param.name = Trim(key.substr(0, at));
+      param.keyed = at != std::string::npos;
+      param.frame = param.keyed ? atof(key.c_str() + at + 1) : 0.;
+      param.value = value;
+      param.where = where;
+      settings.paramKeys.push_back(param);
+    }
+    return true;
+  }
+
+  // the numbers of a parameter value, or the index of a choice's option
+  bool ParseParamValue(const ParamSpec &spec, const std::string &text, std::vector<double> &value)
+  {
+    value.clear();
+    for(size_t i = 0; i < spec.options.size(); i++) {
+      if(text == spec.options[i]) {
+        value.push_back(double(i));
+        return true;
+      }
+    }
+    if(text == "true" || text == "false") {
+      value.push_back(text == "true" ? 1. : 0.);
+      return spec.dimension == 1;
+    }
+    const char *p = text.c_str();
+    while(*p) {
+      char *end;
+      double v = strtod(p, &end);
+      if(end == p) return false;
+      value.push_back(v);
+      p = end;
+      while(isspace((unsigned char) *p)) p++;
+      if(*p == ',') p++;
+    }
+    return int(value.size()) == spec.dimension;
+  }
+
+  bool ParseSettings(int argc, char **argv, Settings &settings)
+  {
+    if(argc < 2)
+      return false;
+
+    FILE *f = fopen(argv[1], "r");
+    if(!f) {
+      fprintf(stderr, "can't read %s\n", argv[1]);
+      return false;
+    }
+    char buffer[4096];
+    bool ok = true;
+    for(int lineNumber = 1; ok && fgets(buffer, sizeof(buffer), f); lineNumber++) {
+      std::string line = buffer;
+      size_t hash = line.find('#');
+      // a # after the = is part of a value, such as a frame number pattern
+      if(hash != std::string::npos && hash < line.find('='))
+        line.erase(hash);
+      line = Trim(line);
+      if(line.empty()) continue;
+      ok = SetKey(line, std::string(argv[1]) + ":" + std::to_string(lineNumber), settings);
+    }
+    fclose(f);
+
+    for(int i = 2; ok && i < argc; i++)
+      ok = SetKey(argv[i], std::string("argument ") + argv[i], settings);
+    if(!ok)
+      return false;
+
+    if(settings.effect == eEffectNone || settings.input.empty() || settings.output.empty()) {
+      fprintf(stderr, "effect, input and output must be set\n");
+      return false;
+    }
+
+    for(const Settings::ParamKey &key : settings.paramKeys) {
+      const ParamSpec *spec = FindParamSpec(settings.effect, key.name);
+      if(!spec) {
+        fprintf(stderr, "%s: the effect has no parameter %s\n", key.where.c_str(), key.name.c_str());
+        return false;
+      }
+      std::vector<double> value;
+      if(!ParseParamValue(*spec, key.value, value)) {
+        fprintf(stderr, "%s: %s wants %d number%s\n", key.where.c_str(), key.name.c_str(), spec->dimension, spec->dimension > 1 ? "s" : "");
+        return false;
+      }
+      // an unkeyed value replaces any keys before it
+      Track &track = settings.params[key.name];
+      if(!key.keyed) track.keys.clear();
+      track.keys[key.frame] = value;
+    }
+
+    if(settings.threads == 0)
+      settings.threads = int(std::max(1u, std::thread::hardware_concurrency()));
+    if(settings.queue == 0)
+      settings.queue = (settings.rowsInParallel ? 1 : settings.threads) + 4;
+    return true;
+  }
+
+  // the value of a parameter at frame
+  std::vector<double> ParamAt(const Settings &settings, const char *name, double frame)
+  {
+    const ParamSpec *spec = FindParamSpec(settings.effect, name);
+    std::map<std::string, Track>::const_iterator found = settings.params.find(name);
+    return found == settings.params.end() ? Track().valueAt(*spec, frame) : found->second.valueAt(*spec, frame);
+  }
+
+  // the name of frame number, from a pattern with a run of # or a printf %d
+  std::string FramePath(const std::string &pattern, int frame)
+  {
+    size_t hashes = pattern.find('#');
+    if(hashes != std::string::npos) {
+      size_t end = pattern.find_first_not_of('#', hashes);
+      if(end == std::string::npos) end = pattern.size();
+      char number[32];
+      snprintf(number, sizeof(number), "%0*d", int(end - hashes), frame);
+      return pattern.substr(0, hashes) + number + pattern.substr(end);
+    }
+    if(pattern.find('%') != std::string::npos) {
+      char path[4096];
+      snprintf(path, sizeof(path), pattern.c_str(), frame);
+      return path;
+    }
+    return pattern;
+  }
+
+  bool HasExtension(const std::string &path, const char *extension)
+  {
+    size_t n = strlen(extension);
+    if(path.size() < n) return false;
+    for(size_t i = 0; i < n; i++)
+      if(tolower((unsigned char) path[path.size() - n + i]) != extension[i]) return false;
+    return true;
+  }
+
+  bool HostIsLittleEndian()
+  {
+    const uint16_t one = 1;
+    return *(const unsigned char *) &one == 1;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // a file mapped read only into memory
+
+  class MappedFile {
+  public :
+    MappedFile()
+      : _data(NULL)
+      , _size(0)
+#ifdef _WIN32
+      , _mapping(NULL)
+#endif
+    {}
+
+    ~MappedFile() {close();}
+
+    bool open(const char *path)
+    {
+      close();
+#ifdef _WIN32
+      HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if(file == INVALID_HANDLE_VALUE)
+        return false;
+      LARGE_INTEGER size;
+      if(GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        _mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(_mapping)
+          _data = (const unsigned char *) MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        _size = _data ? size_t(size.QuadPart) : 0;
+      }
+      CloseHandle(file);
+#else
+      int fd = ::open(path, O_RDONLY);
+      if(fd < 0)
+        return false;
+      struct stat info;
+      if(fstat(fd, &info) == 0 && info.st_size > 0) {
+        void *data = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+          _data = (const unsigned char *) data;
+          _size = size_t(info.st_size);
+          madvise(data, _size, MADV_SEQUENTIAL);
+          madvise(data, _size, MADV_WILLNEED);
+        }
+      }
+      ::close(fd);
+#endif
+      return _data != NULL;
+    }
+
+    // fault every page in, so the render doesn't wait on the disk
+    void touch() const
+    {
+      volatile unsigned char sum = 0;
+      for(size_t i = 0; i < _size; i += 4096)
+        sum += _data[i];
+      (void) sum;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+      if(_data) UnmapViewOfFile(_data);
+      if(_mapping) CloseHandle(_mapping);
+      _mapping = NULL;
+#else
+      if(_data) munmap((void *) _data, _size);
+#endif
+      _data = NULL;
+      _size = 0;
+    }
+
+    const unsigned char *data() const {return _data;}
+    size_t size() const {return _size;}
+
+  private :
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const unsigned char *_data;
+    size_t _size;
+#ifdef _WIN32
+    HANDLE _mapping;
+#endif
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Frames in flight, each is read, rendered and written in turn, then goes
+  // back to be read into again with its buffers kept
+
+  struct Frame {
+    int number = 0;
+    size_t bytesRead = 0;
+    MappedFile file;
+    std::vector<char> converted;   // the source, when the file can't be used in place
+    std::vector<char> rendered;
+    Zokzir::ImageView src;
+    Zokzir::ImageView dst;
+  };
+
+  // how the pixels of a file are laid out
+  struct FileLayout {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    Zokzir::PixelDepthEnum depth = Zokzir::ePixelDepthNone;
+    bool swap = false;      // samples are the other endianness
+    bool topDown = false;   // the first row in the file is the top one
+    size_t offset = 0;      // of the first pixel
+  };
+
+  // read past whitespace and comments to the next token of a PPM or PFM header
+  bool HeaderToken(const unsigned char *data, size_t size, size_t &at, std::string &token)
+  {
+    token.clear();
+    while(at < size && (isspace(data[at]) || data[at] == '#')) {
+      if(data[at] == '#')
+        while(at < size && data[at] != '\n') at++;
+      else
+        at++;
+    }
+    while(at < size && !isspace(data[at]) && token.size() < 32)
+      token += char(data[at++]);
+    // a single whitespace character ends the header
+    at++;
+    return !token.empty();
+  }
+
+  bool ReadLayout(const std::string &path, const MappedFile &file, const Settings &settings, FileLayout &layout)
+  {
+    if(HasExtension(path, ".raw")) {
+      layout.width = settings.rawWidth;
+      layout.height = settings.rawHeight;
+      layout.channels = settings.rawComponents;
+      layout.depth = settings.rawDepth;
+      if(layout.width <= 0) {
+        fprintf(stderr, "%s: set raw = WxH,COMPONENTS,DEPTH to read raw frames\n", path.c_str());
+        return false;
+      }
+    }
+    else {
+      size_t at = 0;
+      std::string magic, w, h, scale;
+      if(!HeaderToken(file.data(), file.size(), at, magic) || !HeaderToken(file.data(), file.size(), at, w) ||
+         !HeaderToken(file.data(), file.size(), at, h) || !HeaderToken(file.data(), file.size(), at, scale)) {
+        fprintf(stderr, "%s: bad header\n", path.c_str());
+        return false;
+      }
+      layout.width = atoi(w.c_str());
+      layout.height = atoi(h.c_str());
+      layout.offset = at;
+      double max = atof(scale.c_str());
+      if(magic == "PF" || magic == "Pf") {
+        // PFM is bottom up, a negative scale means little endian
+        layout.channels = magic == "PF" ? 3 : 1;
+        layout.depth = Zokzir::ePixelDepthFloat;
+        layout.swap = (max < 0) != HostIsLittleEndian();
+      }
+      else if(magic == "P6" || magic == "P5") {
+        // PPM is top down, 16 bit samples are big endian
+        layout.channels = magic == "P6" ? 3 : 1;
+        layout.depth = max > 255 ? Zokzir::ePixelDepthShort : Zokzir::ePixelDepthByte;
+        layout.swap = max > 255 && HostIsLittleEndian();
+        layout.topDown = true;
+      }
+      else {
+        fprintf(stderr, "%s: not a binary PPM, PGM or PFM\n", path.c_str());
+        return false;
+      }
+    }
+
+    size_t bytes = size_t(layout.width) * layout.height * layout.channels * Zokzir::BytesPerComponent(layout.depth);
+    if(layout.width <= 0 || layout.height <= 0 || file.size() < layout.offset + bytes) {
+      fprintf(stderr, "%s: the file is shorter than its pixels\n", path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // the components the effect renders for a file with channels
+  int RenderComponents(EffectEnum effect, int channels)
+  {
+    if(effect == eEffectDroste)
+      return channels == 2 ? 0 : channels;   // alpha, RGB or RGBA
+    return channels == 1 || channels == 2 ? 0 : channels;
+  }
+
+  // copy the samples of a file into packed rows, bottom up, of nComponents,
+  // with an opaque alpha added to RGB
+  template <class T>
+  void ConvertSamples(const unsigned char *data, const FileLayout &layout, int nComponents, T opaque, char *out)
+  {
+    size_t fileRow = size_t(layout.width) * layout.channels;
+    for(int y = 0; y < layout.height; y++) {
+      int line = layout.topDown ? layout.height - 1 - y : y;
+      const unsigned char *in = data + layout.offset + size_t(line) * fileRow * sizeof(T);
+      T *pix = (T *) out + size_t(y) * layout.width * nComponents;
+      for(int x = 0; x < layout.width; x++, pix += nComponents) {
+        for(int c = 0; c < layout.channels; c++, in += sizeof(T)) {
+          unsigned char bytes[sizeof(T)];
+          for(size_t b = 0; b < sizeof(T); b++)
+            bytes[b] = layout.swap ? in[sizeof(T) - 1 - b] : in[b];
+          memcpy(&pix[c], bytes, sizeof(T));
+        }
+        for(int c = layout.channels; c < nComponents; c++)
+          pix[c] = opaque;
+      }
+    }
+  }
+
+  // read a frame into frame.src, in place when the file allows
+  bool ReadFrame(const std::string &path, const Settings &settings, Frame &frame)
+  {
+    Zokzir::TraceSpan span("read frame", "io");
+    if(!frame.file.open(path.c_str())) {
+      fprintf(stderr, "can't read %s\n", path.c_str());
+      return false;
+    }
+    frame.file.touch();
+
+    FileLayout layout;
+    if(!ReadLayout(path, frame.file, settings, layout))
+      return false;
+    int nComponents = RenderComponents(settings.effect, layout.channels);
+    if(nComponents == 0) {
+      fprintf(stderr, "%s: the effect can't render %d channels\n", path.c_str(), layout.channels);
+      return false;
+    }
+
+    Zokzir::ImageView &src = frame.src;
+    src.bounds.x1 = src.bounds.y1 = 0;
+    src.bounds.x2 = layout.width;
+    src.bounds.y2 = layout.height;
+    src.nComponents = nComponents;
+    src.depth = layout.depth;
+    ptrdiff_t rowBytes = ptrdiff_t(layout.width) * src.bytesPerPixel();
+
+    if(!layout.swap && nComponents == layout.channels) {
+      // the kernels can read the file as it is, top down rows go backwards
+      src.data = (char *) frame.file.data() + layout.offset;
+      src.rowBytes = rowBytes;
+      if(layout.topDown) {
+        src.data += (layout.height - 1) * rowBytes;
+        src.rowBytes = -rowBytes;
+      }
+    }
+    else {
+      frame.converted.resize(size_t(rowBytes) * layout.height);
+      switch(layout.depth) {
+        case Zokzir::ePixelDepthByte :
+          ConvertSamples<unsigned char>(frame.file.data(), layout, nComponents, 255, frame.converted.data());
+          break;
+        case Zokzir::ePixelDepthShort :
+          ConvertSamples<unsigned short>(frame.file.data(), layout, nComponents, 65535, frame.converted.data());
+          break;
+        default :
+          ConvertSamples<float>(frame.file.data(), layout, nComponents, 1.f, frame.converted.data());
+          break;
+      }
+      frame.file.close();
+      src.data = frame.converted.data();
+      src.rowBytes = rowBytes;
+    }
+    frame.bytesRead = layout.offset + size_t(layout.width) * layout.height * layout.channels * Zokzir::BytesPerComponent(layout.depth);
+    span.arg("bytes", double(frame.bytesRead));
+
+    // the render goes into a packed buffer of the same layout
+    frame.dst = src;
+    frame.rendered.resize(size_t(rowBytes) * layout.height);
+    frame.dst.data = frame.rendered.data();
+    frame.dst.rowBytes = rowBytes;
+    return true;
+  }
+
+  // component c of pixel x on row y of a view, 0 to 1 for the integer depths
+  inline float ComponentAt(const Zokzir::ImageView &view, int x, int y, int c)
+  {
+    switch(view.depth) {
+      case Zokzir::ePixelDepthByte : return view.pixelAddress<unsigned char>(x, y)[c] / 255.f;
+      case Zokzir::ePixelDepthShort : return view.pixelAddress<unsigned short>(x, y)[c] / 65535.f;
+      default : return view.pixelAddress<float>(x, y)[c];
+    }
+  }
+
+  // write a rendered frame in the format its name asks for
+  bool WriteFrame(const std::string &path, const Zokzir::ImageView &view, size_t &bytesWritten)
+  {
+    Zokzir::TraceSpan span("write frame", "io");
+    FILE *f = fopen(path.c_str(), "wb");
+    if(!f) {
+      fprintf(stderr, "can't write %s\n", path.c_str());
+      return false;
+    }
+    setvbuf(f, NULL, _IOFBF, size_t(1) << 20);
+
+    int width = view.bounds.x2 - view.bounds.x1, height = view.bounds.y2 - view.bounds.y1;
+    int channels = view.nComponents == 1 ? 1 : 3;
+    bool ok = true;
+    bytesWritten = 0;
+
+    if(HasExtension(path, ".raw")) {
+      // the rows as rendered
+      for(int y = 0; ok && y < height; y++)
+        ok = fwrite(view.pixelAddress<char>(view.bounds.x1, view.bounds.y1 + y), view.bytesPerPixel(), width, f) == size_t(width);
+      bytesWritten = size_t(view.bytesPerPixel()) * width * height;
+    }
+    else if(HasExtension(path, ".pfm")) {
+      // bottom up floats, alpha dropped
+      fprintf(f, "%s\n%d %d\n%s\n", channels == 3 ? "PF" : "Pf", width, height, HostIsLittleEndian() ? "-1.0" : "1.0");
+      std::vector<float> row(size_t(width) * channels);
+      for(int y = 0; ok && y < height; y++) {
+        for(int x = 0; x < width; x++)
+          for(int c = 0; c < channels; c++)
+            row[size_t(x) * channels + c] = ComponentAt(view, view.bounds.x1 + x, view.bounds.y1 + y, c);
+        ok = fwrite(row.data(), sizeof(float), row.size(), f) == row.size();
+      }
+      bytesWritten = row.size() * sizeof(float) * height;
+    }
+    else {
+      // top down PPM or PGM, 16 bit for short renders, 8 bit otherwise
+      bool sixteen = view.depth == Zokzir::ePixelDepthShort;
+      int max = sixteen ? 65535 : 255;
+      fprintf(f, "%s\n%d %d\n%d\n", channels == 3 ? "P6" : "P5", width, height, max);
+      std::vector<unsigned char> row(size_t(width) * channels * (sixteen ? 2 : 1));
+      for(int line = 0; ok && line < height; line++) {
+        int y = view.bounds.y2 - 1 - line;
+        unsigned char *out = row.data();
+        for(int x = 0; x < width; x++) {
+          for(int c = 0; c < channels; c++) {
+            float v = std::min(std::max(ComponentAt(view, view.bounds.x1 + x, y, c), 0.f), 1.f);
+            unsigned int sample = (unsigned int) (v * max + 0.5f);
+            if(sixteen) *out++ = (unsigned char) (sample >> 8);
+            *out++ = (unsigned char) sample;
+          }
+        }
+        ok = fwrite(row.data(), 1, row.size(), f) == row.size();
+      }
+      bytesWritten = row.size() * height;
+    }
+
+    ok = fclose(f) == 0 && ok;
+    if(!ok)
+      fprintf(stderr, "can't write %s\n", path.c_str());
+    span.arg("bytes", double(bytesWritten));
+    return ok;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Rendering a frame, through the effect's kernel
+
+  // run band(i, n) for i in 0 to n on n threads, the calling one included
+  void RunBands(int n, const std::function<void(int, int)> &band)
+  {
+    std::vector<std::thread> threads;
+    for(int i = 1; i < n; i++)
+      threads.push_back(std::thread(band, i, n));
+    band(0, n);
+    for(std::thread &thread : threads)
+      thread.join();
+  }
+
+  // band i of n of the rows of window
+  OfxRectI Band(OfxRectI window, int i, int n)
+  {
+    int rows = window.y2 - window.y1;
+    OfxRectI band = window;
+    band.y1 = window.y1 + int((long long) rows * i / n);
+    band.y2 = window.y1 + int((long long) rows * (i + 1) / n);
+    return band;
+  }
+
+  std::atomic<bool> gFailed(false);
+
+  bool Cancelled(void *)
+  {
+    return gFailed.load();
+  }
+
+  // the Droste parameters at time
+  Zokzir::DrosteValues DrosteValuesAt(const Settings &settings, double time)
+  {
+    Zokzir::DrosteValues values;
+    std::vector<double> center = ParamAt(settings, "center", time), position = ParamAt(settings, "position", time);
+    values.layering = ParamAt(settings, "layering", time)[0] != 0. ? Zokzir::eDrosteLayeringOnBack : Zokzir::eDrosteLayeringOnFront;
+    values.spin = int(ParamAt(settings, "spin", time)[0]);
+    values.radius = ParamAt(settings, "radius", time)[0];
+    values.ratio = ParamAt(settings, "ratio", time)[0];
+    values.center.x = center[0];
+    values.center.y = center[1];
+    values.position.x = position[0];
+    values.position.y = position[1];
+    values.zoom = ParamAt(settings, "zoom", time)[0];
+    values.rotation = ParamAt(settings, "rotation", time)[0];
+    values.evolution = ParamAt(settings, "evolution", time)[0];
+    values.minDepth = int(ParamAt(settings, "minDepth", time)[0]);
+    values.maxDepth = int(ParamAt(settings, "maxDepth", time)[0]);
+    values.colour.stage = (Zokzir::DrosteColourStageEnum) int(ParamAt(settings, "colourStage", time)[0]);
+    values.colour.matrix = Zokzir::BuildColourMatrix(ParamAt(settings, "colourSaturation", time)[0],
+                                                     int(ParamAt(settings, "colourLumaWeights", time)[0]),
+                                                     ParamAt(settings, "colourGain", time)[0],
+                                                     ParamAt(settings, "colourOffset", time)[0],
+                                                     1.f);
+    values.colour.invert = ParamAt(settings, "colourInvert", time)[0] != 0.;
+    values.maxSamples = ParamAt(settings, "antialiasing", time)[0] != 0. ? int(ParamAt(settings, "maxSamples", time)[0]) : 1;
+    return values;
+  }
+
+  // a frame as the cost model sees it
+  Zokzir::RenderShape FrameShape(const Frame &frame)
+  {
+    Zokzir::RenderShape shape;
+    shape.width = frame.dst.bounds.x2 - frame.dst.bounds.x1;
+    shape.height = frame.dst.bounds.y2 - frame.dst.bounds.y1;
+    shape.nComponents = frame.dst.nComponents;
+    shape.depth = frame.dst.depth;
+    shape.renderScale.x = shape.renderScale.y = 1.;
+    shape.par = 1.;
+    return shape;
+  }
+
+  // the Droste values of a frame within its work budget, as the effect keeps
+  // them, saying what the guard did whenever that changes from the frame before
+  Zokzir::DrosteValues GuardedDrosteValuesAt(const Settings &settings, const Frame &frame, bool report)
+  {
+    static std::mutex reportMutex;
+    static std::string reported;
+
+    double time = frame.number;
+    Zokzir::DrosteValues values = DrosteValuesAt(settings, time);
+    Zokzir::DrosteGuard guard = Zokzir::GuardDrosteValues(FrameShape(frame), int(ParamAt(settings, "workBudget", time)[0]), values);
+    if(report) {
+      std::string text = Zokzir::FormatDrosteGuard(guard, values);
+      std::lock_guard<std::mutex> lock(reportMutex);
+      if(text != reported) {
+        if(!text.empty())
+          fprintf(stderr, "frame %d: %s\n", frame.number, text.c_str());
+        reported = text;
+      }
+    }
+    return values;
+  }
+
+  // what the cost model predicts frame costs
+  Zokzir::CostEstimate EstimateFrame(const Settings &settings, const Frame &frame)
+  {
+    Zokzir::RenderShape shape = FrameShape(frame);
+    double time = frame.number;
+    if(settings.effect == eEffectSaturation)
+      return Zokzir::EstimateSaturationCost(shape, false, ParamAt(settings, "auto", time)[0] != 0.);
+    return Zokzir::EstimateDrosteCost(shape, GuardedDrosteValuesAt(settings, frame, false), false);
+  }
+
+  // render frame on nThreads threads, the kernels throw on pixels they don't know
+  void RenderFrame(const Settings &settings, Frame &frame, int nThreads)
+  {
+    Zokzir::TraceSpan span("render frame", "kernel");
+    const Zokzir::ImageView &src = frame.src, &dst = frame.dst;
+    const OfxRectI window = dst.bounds;
+    nThreads = std::max(1, std::min(nThreads, window.y2 - window.y1));
+    span.arg("pixels", double(window.x2 - window.x1) * (window.y2 - window.y1));
+    span.arg("frame", frame.number);
+
+    double time = frame.number;
+    Zokzir::CancelCheck cancel(Cancelled, NULL);
+
+    if(settings.effect == eEffectSaturation) {
+      double saturation = ParamAt(settings, "saturation", time)[0];
+      double gain = ParamAt(settings, "gain", time)[0];
+      double offset = ParamAt(settings, "offset", time)[0];
+      int lumaWeights = int(ParamAt(settings, "lumaWeights", time)[0]);
+
+      // in auto mode, pick the saturation that takes the mean chroma to the target
+      if(ParamAt(settings, "auto", time)[0] != 0.) {
+        std::vector<double> sums(nThreads, 0.);
+        RunBands(nThreads, [&](int i, int n) {
+          OfxRectI band = Band(window, i, n);
+          Zokzir::ArenaScope scratch;
+          sums[i] = Zokzir::SaturationSumChroma(src, band.x1, band.x2, band.y1, band.y2);
+        });
+        double count = double(window.x2 - window.x1) * (window.y2 - window.y1);
+        double meanChroma = count > 0 ? std::accumulate(sums.begin(), sums.end(), 0.) / count * fabs(gain) : 0.;
+        saturation = meanChroma > 0.000001 ? ParamAt(settings, "targetChroma", time)[0] / meanChroma : 1.0;
+      }
+
+      float maxValue = dst.depth == Zokzir::ePixelDepthByte ? 255.f : dst.depth == Zokzir::ePixelDepthShort ? 65535.f : 1.f;
+      Zokzir::ColourMatrix matrix = Zokzir::BuildColourMatrix(saturation, lumaWeights, gain, offset, maxValue);
+      RunBands(nThreads, [&](int i, int n) {
+        Zokzir::ArenaScope scratch;
+        Zokzir::SaturationProcess(matrix, src, Zokzir::ImageView(), dst, Band(window, i, n), cancel);
+      });
+    }
+    else {
+      Zokzir::DrosteValues values = GuardedDrosteValuesAt(settings, frame, true);
+
+      OfxPointD renderScale = {1., 1.};
+      RunBands(nThreads, [&](int i, int n) {
+        Zokzir::DrosteProcess(values, src, dst, renderScale, 1., window, Band(window, i, n), NULL, NULL, cancel);
+      });
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // The pipeline
+
+  // frames handed from one stage to the next, pop waits for one and fails
+  // once the queue is closed and empty
+  class FrameQueue {
+  public :
+    void push(Frame *frame)
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _frames.push_back(frame);
+      }
+      _ready.notify_one();
+    }
+
+    bool pop(Frame *&frame)
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _ready.wait(lock, [this] {return !_frames.empty() || _closed;});
+      if(_frames.empty())
+        return false;
+      frame = _frames.front();
+      _frames.pop_front();
+      return true;
+    }
+
+    void close()
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+      }
+      _ready.notify_all();
+    }
+
+  private :
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<Frame *> _frames;
+    bool _closed = false;
+  };
+
+  // the threads of a stage, the last one out closes the next queue
+  struct Stage {
+    std::vector<std::thread> threads;
+    std::atomic<int> running{0};
+    std::atomic<int64_t> busy{0};   // nanoseconds spent working, over every thread
+
+    void start(int n, const std::function<void()> &work, FrameQueue &next)
+    {
+      running = n;
+      for(int i = 0; i < n; i++) {
+        threads.push_back(std::thread([this, work, &next] {
+          work();
+          if(--running == 0)
+            next.close();
+        }));
+      }
+    }
+
+    void join()
+    {
+      for(std::thread &thread : threads)
+        thread.join();
+    }
+  };
+
+  typedef std::chrono::steady_clock Clock;
+
+  int64_t Nanoseconds(Clock::time_point start)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  }
+
+} // end of anonymous namespace
+
+int main(int argc, char **argv)
+{
+  if(argc == 3 && strcmp(argv[1], "--calibrate") == 0) {
+    printf("timing the kernels on one thread...\n");
+    Zokzir::CostModel model = Zokzir::CalibrateCostModel(10.);
+    if(!Zokzir::WriteCostModel(argv[2], model)) {
+      fprintf(stderr, "can't write %s\n", argv[2]);
+      return 1;
+    }
+    printf("wrote %s, set ZOKZIR_COST_CALIBRATION to it to use it\n", argv[2]);
+    return 0;
+  }
+
+  Settings settings;
+  if(!ParseSettings(argc, argv, settings)) {
+    Usage();
+    return 1;
+  }
+  int nFrames = settings.lastFrame - settings.firstFrame + 1;
+  if(nFrames > 1 && FramePath(settings.output, 0) == FramePath(settings.output, 1)) {
+    fprintf(stderr, "output %s has no frame number\n", settings.output.c_str());
+    return 1;
+  }
+
+  Zokzir::TraceSetModule("render");
+  Zokzir::CpuLevel();
+
+  // frames ready to be read into, read, and rendered
+  std::vector<std::unique_ptr<Frame>> frames;
+  FrameQueue empty, toRender, toWrite;
+  for(int i = 0; i < std::min(settings.queue, nFrames); i++) {
+    frames.push_back(std::unique_ptr<Frame>(new Frame));
+    empty.push(frames.back().get());
+  }
+
+  std::atomic<int> nextFrame(settings.firstFrame);
+  std::atomic<int> framesWritten(0);
+  std::atomic<int64_t> bytesRead(0), bytesWritten(0), pixels(0);
+  // the predicted cost, CPU ns summed and the most bytes of a frame
+  std::atomic<int64_t> estimatedNs(0), estimatedPeak(0);
+  std::mutex errorMutex;
+  std::string error;
+
+  // after a failure the frames just go round to be freed, so every stage drains
+  Stage readers, renderers, writers;
+  Clock::time_point start = Clock::now();
+
+  readers.start(settings.io, [&] {
+    Frame *frame;
+    while(!gFailed && empty.pop(frame)) {
+      int number = nextFrame++;
+      if(number > settings.lastFrame) {
+        empty.push(frame);
+        break;
+      }
+      Clock::time_point begin = Clock::now();
+      frame->number = number;
+      if(!ReadFrame(FramePath(settings.input, number), settings, *frame)) {
+        gFailed = true;
+        frame->file.close();
+        empty.push(frame);
+        break;
+      }
+      bytesRead += int64_t(frame->bytesRead);
+      readers.busy += Nanoseconds(begin);
+      toRender.push(frame);
+    }
+  }, toRender);
+
+  // a frame to each render thread, or one render thread spreading each frame
+  // over all of them
+  int renderThreads = settings.rowsInParallel ? 1 : settings.threads;
+  int bandsPerFrame = settings.rowsInParallel ? settings.threads : 1;
+  renderers.start(renderThreads, [&] {
+    Frame *frame;
+    while(toRender.pop(frame)) {
+      if(!gFailed) {
+        Zokzir::CostEstimate estimate = EstimateFrame(settings, *frame);
+        estimatedNs += int64_t(estimate.cpuSeconds * 1e9);
+        int64_t peak = int64_t(estimate.peakBytes), seen = estimatedPeak;
+        while(peak > seen && !estimatedPeak.compare_exchange_weak(seen, peak)) {}
+      }
+      if(!gFailed && !settings.estimateOnly) {
+        Clock::time_point begin = Clock::now();
+        try {
+          RenderFrame(settings, *frame, bandsPerFrame);
+          pixels += int64_t(frame->dst.bounds.x2 - frame->dst.bounds.x1) * (frame->dst.bounds.y2 - frame->dst.bounds.y1);
+        }
+        catch(const char *message) {
+          std::lock_guard<std::mutex> lock(errorMutex);
+          error = std::string("frame ") + std::to_string(frame->number) + ":" + message;
+          gFailed = true;
+        }
+        catch(const std::exception &e) {
+          std::lock_guard<std::mutex> lock(errorMutex);
+          error = std::string("frame ") + std::to_string(frame->number) + ": " + e.what();
+          gFailed = true;
+        }
+        renderers.busy += Nanoseconds(begin) * bandsPerFrame;
+      }
+      toWrite.push(frame);
+    }
+  }, toWrite);
+
+  writers.start(settings.io, [&] {
+    Frame *frame;
+    while(toWrite.pop(frame)) {
+      frame->file.close();
+      if(!gFailed && settings.estimateOnly) {
+        framesWritten++;
+      }
+      else if(!gFailed) {
+        Clock::time_point begin = Clock::now();
+        size_t bytes = 0;
+        if(WriteFrame(FramePath(settings.output, frame->number), frame->dst, bytes)) {
+          bytesWritten += int64_t(bytes);
+          framesWritten++;
+        }
+        else {
+          gFailed = true;
+        }
+        writers.busy += Nanoseconds(begin);
+      }
+      empty.push(frame);
+    }
+  }, empty);
+
+  readers.join();
+  renderers.join();
+  writers.join();
+  double seconds = Nanoseconds(start) * 1e-9;
+  Zokzir::TraceFlush();
+
+  if(!error.empty())
+    fprintf(stderr, "%s\n", error.c_str());
+
+  // the report, a stage busy close to 100% is the one holding the others up
+  int written = framesWritten;
+  if(settings.estimateOnly) {
+    printf("%s, %d of %d frames, estimated %.3g CPU s, %.3g CPU s a frame, %.0f MB a frame at most\n",
+           settings.effect == eEffectSaturation ? "saturation" : "droste", written, nFrames,
+           estimatedNs * 1e-9, written ? estimatedNs * 1e-9 / written : 0., estimatedPeak / 1048576.);
+    return gFailed ? 1 : 0;
+  }
+  printf("%s, %d of %d frames in %.2f s, %.2f frames/s, %.1f Mpix/s, %s x %d threads, %s\n",
+         settings.effect == eEffectSaturation ? "saturation" : "droste",
+         written, nFrames, seconds, written / seconds, pixels * 1e-6 / seconds,
+         settings.rowsInParallel ? "rows" : "frames", settings.threads,
+         Zokzir::CpuLevelName(Zokzir::CpuLevel()));
+  printf("read %.0f MB/s, written %.0f MB/s\n", bytesRead * 1e-6 / seconds, bytesWritten * 1e-6 / seconds);
+  printf("busy: read %.0f%%, render %.0f%%, write %.0f%%\n",
+         100. * readers.busy * 1e-9 / (seconds * settings.io),
+         100. * renderers.busy * 1e-9 / (seconds * settings.threads),
+         100. * writers.busy * 1e-9 / (seconds * settings.io));
+  printf("cost: estimated %.3g CPU s, rendering took %.3g CPU s, %.0f MB a frame at most\n",
+         estimatedNs * 1e-9, renderers.busy * 1e-9, estimatedPeak / 1048576.);
+
+  return gFailed ? 1 : 0;
+}